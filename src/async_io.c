@@ -0,0 +1,370 @@
+/**
+* async_io.c - Write loose objects off the hashing threads
+* Once an object is compressed in memory, the file system work left is
+* creating a temporary file, writing it, closing it, making the fan-out
+* directory and renaming the file into place. Here that work is queued
+* and carried out in the background while the caller goes on hashing.
+* With liburing, one I/O thread drives every queued object through those
+* steps as io_uring operations, keeping many objects in flight and
+* reaping their completions in batches. Without it, or when the kernel
+* refuses io_uring, a few I/O threads make the same calls one object at
+* a time each. async_io_finish waits until everything is on disk.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "async_io.h"
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/* One loose object on its way to disk */
+typedef struct async_write {
+    sha1_t sha;
+    unsigned char *data;  /* compressed object, freed when done */
+    size_t len;
+    size_t written;
+    int fd;
+    int stage;
+    char tmp_path[64];
+    char path[64];        /* final name; paths must outlive submission */
+    char dir[24];         /* fan-out directory */
+    struct async_write *next;
+} async_write;
+
+static struct {
+    async_io_kind kind;
+    int fsync_objects;
+    async_io_done_fn done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;       /* queue changed or bytes were released */
+    async_write *head;
+    async_write *tail;
+    size_t queued_bytes;       /* queued or in flight */
+    int stopping;
+    atomic_int failed;
+    atomic_ulong serial;       /* for unique temporary names */
+    pthread_t threads[ASYNC_IO_WORKERS];
+    int nr_threads;
+} io = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// Report an object as done and give its bytes back to the submitters.
+static void complete_write(async_write *w, int ok) {
+    if (!ok) {
+        unlink(w->tmp_path);
+        atomic_store(&io.failed, 1);
+    }
+    io.done(&w->sha, w->len, ok);
+    pthread_mutex_lock(&io.lock);
+    io.queued_bytes -= w->len;
+    pthread_cond_broadcast(&io.cond);
+    pthread_mutex_unlock(&io.lock);
+    free(w->data);
+    free(w);
+}
+
+// Take up to max queued objects; blocks while the queue is empty unless
+// wait is clear. Returns NULL once stopping and drained.
+static async_write *take_writes(size_t max, int wait) {
+    pthread_mutex_lock(&io.lock);
+    while (wait && !io.head && !io.stopping) {
+        pthread_cond_wait(&io.cond, &io.lock);
+    }
+    async_write *list = io.head, *last = NULL;
+    for (size_t n = 0; io.head && n < max; n++) {
+        last = io.head;
+        io.head = io.head->next;
+    }
+    if (last) {
+        last->next = NULL;
+    } else {
+        list = NULL;
+    }
+    if (!io.head) {
+        io.tail = NULL;
+    }
+    pthread_mutex_unlock(&io.lock);
+    return list;
+}
+
+// The blocking version of every step, for one object.
+static int write_loose_file(async_write *w) {
+    int fd = open(w->tmp_path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0444);
+    if (fd < 0) {
+        perror(w->tmp_path);
+        return -1;
+    }
+    while (w->written < w->len) {
+        ssize_t n = write(fd, w->data + w->written, w->len - w->written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("write object");
+            close(fd);
+            return -1;
+        }
+        w->written += n;
+    }
+    if ((io.fsync_objects && fsync(fd) != 0) | (close(fd) != 0)) {
+        perror("write object");
+        return -1;
+    }
+    if (prepare_loose_subdir(&w->sha) != 0 || rename(w->tmp_path, w->path) != 0) {
+        perror("rename object");
+        return -1;
+    }
+    return 0;
+}
+
+static void *io_thread(void *arg) {
+    (void)arg;
+    async_write *w;
+    while ((w = take_writes(1, 1))) {
+        complete_write(w, write_loose_file(w) == 0);
+    }
+    return NULL;
+}
+
+#ifdef HAVE_LIBURING
+
+static int is_stopping(void) {
+    pthread_mutex_lock(&io.lock);
+    int stopping = io.stopping && !io.head;
+    pthread_mutex_unlock(&io.lock);
+    return stopping;
+}
+
+enum { STAGE_OPEN, STAGE_WRITE, STAGE_FSYNC, STAGE_CLOSE, STAGE_MKDIR, STAGE_RENAME };
+
+static struct io_uring ring;
+static unsigned char subdir_made[256];  /* fan-out directories known to exist */
+
+static void queue_stage(async_write *w, int stage) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    w->stage = stage;
+    switch (stage) {
+    case STAGE_OPEN:
+        io_uring_prep_openat(sqe, AT_FDCWD, w->tmp_path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0444);
+        break;
+    case STAGE_WRITE:
+        io_uring_prep_write(sqe, w->fd, w->data + w->written, w->len - w->written, w->written);
+        break;
+    case STAGE_FSYNC:
+        io_uring_prep_fsync(sqe, w->fd, 0);
+        break;
+    case STAGE_CLOSE:
+        io_uring_prep_close(sqe, w->fd);
+        break;
+    case STAGE_MKDIR:
+        io_uring_prep_mkdirat(sqe, AT_FDCWD, w->dir, 0755);
+        break;
+    case STAGE_RENAME:
+        io_uring_prep_renameat(sqe, AT_FDCWD, w->tmp_path, AT_FDCWD, w->path, 0);
+        break;
+    }
+    io_uring_sqe_set_data(sqe, w);
+}
+
+// Handle the completion of an object's current step and queue the next.
+static void advance_write(async_write *w, int res, size_t *inflight) {
+    int stage = w->stage;
+    if (res < 0 && !(stage == STAGE_MKDIR && res == -EEXIST)) {
+        // Kernels without these operations answer -EINVAL; do them directly.
+        if ((stage == STAGE_MKDIR || stage == STAGE_RENAME) && res == -EINVAL) {
+            int ok = prepare_loose_subdir(&w->sha) == 0 && rename(w->tmp_path, w->path) == 0;
+            (*inflight)--;
+            complete_write(w, ok);
+            return;
+        }
+        fprintf(stderr, "Failed to write object: %s\n", strerror(-res));
+        if (stage == STAGE_WRITE || stage == STAGE_FSYNC) {
+            close(w->fd);
+        }
+        (*inflight)--;
+        complete_write(w, 0);
+        return;
+    }
+    switch (stage) {
+    case STAGE_OPEN:
+        w->fd = res;
+        queue_stage(w, STAGE_WRITE);
+        return;
+    case STAGE_WRITE:
+        w->written += res;
+        if (res == 0) {
+            fprintf(stderr, "Failed to write object: short write\n");
+            close(w->fd);
+            (*inflight)--;
+            complete_write(w, 0);
+            return;
+        }
+        queue_stage(w, w->written < w->len ? STAGE_WRITE : io.fsync_objects ? STAGE_FSYNC : STAGE_CLOSE);
+        return;
+    case STAGE_FSYNC:
+        queue_stage(w, STAGE_CLOSE);
+        return;
+    case STAGE_CLOSE:
+        queue_stage(w, subdir_made[w->sha.hash[0]] ? STAGE_RENAME : STAGE_MKDIR);
+        return;
+    case STAGE_MKDIR:
+        subdir_made[w->sha.hash[0]] = 1;
+        queue_stage(w, STAGE_RENAME);
+        return;
+    case STAGE_RENAME:
+        (*inflight)--;
+        complete_write(w, 1);
+        return;
+    }
+}
+
+// The ring's only user: starts queued objects and reaps completions in
+// batches, each completion queueing the object's next step.
+static void *uring_thread(void *arg) {
+    (void)arg;
+    size_t inflight = 0;
+    for (;;) {
+        async_write *w = take_writes(ASYNC_IO_RING_DEPTH - inflight, inflight == 0);
+        if (!w && inflight == 0 && is_stopping()) {
+            break;
+        }
+        while (w) {
+            async_write *next = w->next;
+            inflight++;
+            queue_stage(w, STAGE_OPEN);
+            w = next;
+        }
+
+        struct io_uring_cqe *cqe;
+        struct __kernel_timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+        int ret = io_uring_submit_and_wait_timeout(&ring, &cqe, inflight ? 1 : 0, &ts, NULL);
+        if (ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EAGAIN) {
+            fprintf(stderr, "io_uring: %s\n", strerror(-ret));
+        }
+        unsigned head, seen = 0;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            advance_write(io_uring_cqe_get_data(cqe), cqe->res, &inflight);
+            seen++;
+        }
+        io_uring_cq_advance(&ring, seen);
+    }
+    io_uring_queue_exit(&ring);
+    return NULL;
+}
+
+static int start_uring(void) {
+    if (io_uring_queue_init(ASYNC_IO_RING_DEPTH, &ring, 0) != 0) {
+        return -1;
+    }
+    memset(subdir_made, 0, sizeof(subdir_made));
+    if (pthread_create(&io.threads[0], NULL, uring_thread, NULL) != 0) {
+        io_uring_queue_exit(&ring);
+        return -1;
+    }
+    io.nr_threads = 1;
+    return 0;
+}
+
+#else
+
+static int start_uring(void) {
+    return -1;
+}
+
+#endif
+
+const char *async_io_name(async_io_kind kind) {
+    switch (kind) {
+    case ASYNC_IO_THREADS: return "threads";
+    case ASYNC_IO_URING: return "io_uring";
+    default: return "sync";
+    }
+}
+
+/* Function to start writing objects in the background
+* ASYNC_IO_URING falls back to ASYNC_IO_THREADS when io_uring is not
+* available. Returns the kind actually started, ASYNC_IO_NONE if none.
+*/
+async_io_kind async_io_start(async_io_kind kind, int fsync_objects, async_io_done_fn done) {
+    if (io.kind != ASYNC_IO_NONE || kind == ASYNC_IO_NONE) {
+        return io.kind;
+    }
+    io.fsync_objects = fsync_objects;
+    io.done = done;
+    io.stopping = 0;
+    atomic_store(&io.failed, 0);
+    if (kind == ASYNC_IO_URING && start_uring() == 0) {
+        io.kind = ASYNC_IO_URING;
+        return io.kind;
+    }
+    for (io.nr_threads = 0; io.nr_threads < ASYNC_IO_WORKERS; io.nr_threads++) {
+        if (pthread_create(&io.threads[io.nr_threads], NULL, io_thread, NULL) != 0) {
+            break;
+        }
+    }
+    io.kind = io.nr_threads ? ASYNC_IO_THREADS : ASYNC_IO_NONE;
+    return io.kind;
+}
+
+async_io_kind async_io_active(void) {
+    return io.kind;
+}
+
+/* Function to queue a compressed object for writing; takes ownership of data
+* Waits while ASYNC_IO_MAX_BYTES are already queued.
+*/
+int async_io_submit(const sha1_t *sha, unsigned char *data, size_t len) {
+    async_write *w = calloc(1, sizeof(*w));
+    if (!w) {
+        perror("calloc");
+        free(data);
+        return -1;
+    }
+    w->sha = *sha;
+    w->data = data;
+    w->len = len;
+    w->fd = -1;
+    snprintf(w->tmp_path, sizeof(w->tmp_path), "%s/tmp_obj_%d_%lu", OBJ_DIR, (int)getpid(),
+             atomic_fetch_add(&io.serial, 1));
+    char hex[41];
+    sha1_to_hex(sha, hex);
+    snprintf(w->dir, sizeof(w->dir), "%s/%.2s", OBJ_DIR, hex);
+    snprintf(w->path, sizeof(w->path), "%s/%s", w->dir, hex + 2);
+
+    pthread_mutex_lock(&io.lock);
+    while (io.queued_bytes && io.queued_bytes + len > ASYNC_IO_MAX_BYTES) {
+        pthread_cond_wait(&io.cond, &io.lock);
+    }
+    io.queued_bytes += len;
+    if (io.tail) {
+        io.tail->next = w;
+    } else {
+        io.head = w;
+    }
+    io.tail = w;
+    pthread_cond_broadcast(&io.cond);
+    pthread_mutex_unlock(&io.lock);
+    return 0;
+}
+
+/* Function to wait for every queued object and stop the I/O threads
+* Returns -1 if any object could not be written.
+*/
+int async_io_finish(void) {
+    if (io.kind == ASYNC_IO_NONE) {
+        return 0;
+    }
+    pthread_mutex_lock(&io.lock);
+    io.stopping = 1;
+    pthread_cond_broadcast(&io.cond);
+    pthread_mutex_unlock(&io.lock);
+    for (int i = 0; i < io.nr_threads; i++) {
+        pthread_join(io.threads[i], NULL);
+    }
+    io.nr_threads = 0;
+    io.kind = ASYNC_IO_NONE;
+    return atomic_load(&io.failed) ? -1 : 0;
+}
@@ -0,0 +1,27 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include "blob.h"
+
+/* Loose object writes allowed in flight; submitters wait beyond this */
+#define ASYNC_IO_MAX_BYTES (64 * 1024 * 1024)
+#define ASYNC_IO_WORKERS 4
+#define ASYNC_IO_RING_DEPTH 256
+
+typedef enum {
+    ASYNC_IO_NONE,     /* objects are written synchronously */
+    ASYNC_IO_THREADS,  /* blocking syscalls on a few I/O threads */
+    ASYNC_IO_URING,    /* io_uring, when built with HAVE_LIBURING */
+} async_io_kind;
+
+/* Called from an I/O thread once an object is on disk (ok) or failed */
+typedef void (*async_io_done_fn)(const sha1_t *sha, size_t compressed, int ok);
+
+/* Function prototypes */
+async_io_kind async_io_start(async_io_kind kind, int fsync_objects, async_io_done_fn done);
+async_io_kind async_io_active(void);
+int async_io_submit(const sha1_t *sha, unsigned char *data, size_t len);
+int async_io_finish(void);
+const char *async_io_name(async_io_kind kind);
+
+#endif
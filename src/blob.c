@@ -9,7 +9,17 @@
 #include <string.h>
 #include <zlib.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
 #include "blob.h"
+#include "object_cache.h"
+#include "pack.h"
+#include "object_writer.h"
+#include "thread_pool.h"
+#include "sha1_engine.h"
+#include "index_file.h"
+#include "tree_builder.h"
+#include "dir_scan.h"
 
 /* Function to get file path from the object hash */
 
@@ -25,124 +35,324 @@ char file[SHA_LEN + 1];
 }
 
 
-/* Function to decompress blob data from a file */
-int decompress_blob(FILE *file, unsigned char **blob_data, size_t *blob_size) {
-  // Decompress the blob data from the file
-  z_stream stream;
-  int ret;
-  unsigned have;
-  unsigned char in[CHUNK];
-  size_t output_capacity = CHUNK;
+/* Function to parse the "<type> <size>" header of a loose object */
+int parse_object_header(const char *header, char *type, size_t type_size, size_t *size) {
+  const char *space = strchr(header, ' ');
+  if (space == NULL || (size_t)(space - header) >= type_size) {
+    return -1;
+  }
+  memcpy(type, header, space - header);
+  type[space - header] = '\0';
 
-  *blob_data = malloc(output_capacity);
-  if (*blob_data == NULL) {
-    fprintf(stderr, "Failed to allocate memory for blob data\n");
-    return Z_MEM_ERROR;
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(space + 1, &end, 10);
+  if (errno != 0 || end == space + 1 || *end != '\0') {
+    return -1;
   }
+  *size = (size_t)value;
+  return 0;
+}
 
-  /* Initialize the zlib stream */
-stream.zalloc = Z_NULL;
-  stream.zfree = Z_NULL;
-  stream.opaque = Z_NULL;
-  stream.avail_in = 0;
-  stream.next_in = Z_NULL;
+/* Function to refill the input side of an object stream from its file */
+static int object_stream_fill(object_stream *os) {
+  if (os->stream.avail_in > 0) {
+    return Z_OK;
+  }
+  os->stream.avail_in = fread(os->in, 1, CHUNK, os->file);
+  if (ferror(os->file)) {
+    fprintf(stderr, "Failed to read compressed data from file\n");
+    return Z_ERRNO;
+  }
+  os->stream.next_in = os->in;
+  return Z_OK;
+}
 
-  /* Initialize the inflate stream */
-  ret = inflateInit(&stream);
+/* Function to inflate the next chunk of an object stream into its out buffer */
+static int object_stream_inflate(object_stream *os) {
+  int ret = object_stream_fill(os);
   if (ret != Z_OK) {
-    fprintf(stderr, "Failed to initialize inflate stream\n");
     return ret;
   }
+  os->stream.avail_out = CHUNK;
+  os->stream.next_out = os->out;
+  ret = inflate(&os->stream, Z_NO_FLUSH);
+  switch (ret) {
+    case Z_BUF_ERROR:
+      // No progress possible: the file ended before the zlib stream did.
+      fprintf(stderr, "Truncated object data\n");
+      return Z_DATA_ERROR;
+    case Z_NEED_DICT:
+    case Z_DATA_ERROR:
+    case Z_MEM_ERROR:
+    case Z_STREAM_ERROR:
+      fprintf(stderr, "Failed to decompress object data\n");
+      return Z_DATA_ERROR;
+  }
+  if (ret == Z_STREAM_END) {
+    os->finished = 1;
+  }
+  os->pending = os->out;
+  os->pending_len = CHUNK - os->stream.avail_out;
+  return Z_OK;
+}
+
+/* Function to allocate an object stream
+* The z_stream and both CHUNK buffers are kept across objects: each new
+* object only costs an inflateReset, which is what makes batch mode cheap.
+*/
+object_stream *object_stream_new(void) {
+  object_stream *os = calloc(1, sizeof(*os));
+  if (os == NULL) {
+    fprintf(stderr, "Failed to allocate object stream\n");
+    return NULL;
+  }
+  if (inflateInit(&os->stream) != Z_OK) {
+    fprintf(stderr, "Failed to initialize inflate stream\n");
+    free(os);
+    return NULL;
+  }
+  return os;
+}
+
+void object_stream_free(object_stream *os) {
+  if (os == NULL) {
+    return;
+  }
+  (void)inflateEnd(&os->stream);
+  free(os);
+}
 
-  /* Read the compressed data from the file and decompress it */
-  *blob_size = 0;
-  do {
-    stream.avail_in = fread(in, 1, CHUNK, file);
-    if (ferror(file)) {
-      (void)inflateEnd(&stream);
-      fprintf(stderr, "Failed to read compressed data from file\n");
-      return Z_ERRNO;
+/* Function to start reading a loose object and parse its "<type> <size>\0" header
+* Content bytes inflated along with the header are kept pending for
+* object_stream_copy.
+*/
+int object_stream_begin(object_stream *os, FILE *in, char *type, size_t type_size, size_t *size) {
+  char header[64];
+  size_t header_len = 0;
+  int ret;
+
+  if (inflateReset(&os->stream) != Z_OK) {
+    fprintf(stderr, "Failed to reset inflate stream\n");
+    return Z_STREAM_ERROR;
+  }
+  os->file = in;
+  os->stream.avail_in = 0;
+  os->finished = 0;
+  os->pending_len = 0;
+  os->written = 0;
+
+  for (;;) {
+    if (os->pending_len == 0) {
+      if (os->finished) {
+        fprintf(stderr, "Invalid object header\n");
+        return Z_DATA_ERROR;
+      }
+      ret = object_stream_inflate(os);
+      if (ret != Z_OK) {
+        return ret;
+      }
+      continue;
     }
-    if (stream.avail_in == 0) {
+    if (header_len == sizeof(header) - 1) {
+      fprintf(stderr, "Invalid object header\n");
+      return Z_DATA_ERROR;
+    }
+    unsigned char c = *os->pending++;
+    os->pending_len--;
+    header[header_len++] = c;
+    if (c == '\0') {
       break;
     }
-    stream.next_in = in;
-
-    do {
-      stream.avail_out = CHUNK;
-      stream.next_out = *blob_data + *blob_size;
-      ret = inflate(&stream, Z_NO_FLUSH);
-      assert(ret != Z_STREAM_ERROR);
-      switch (ret) {
-        case Z_NEED_DICT:
-          ret = Z_DATA_ERROR;
-        case Z_DATA_ERROR:
-        case Z_MEM_ERROR:
-          (void)inflateEnd(&stream);
-          fprintf(stderr, "Failed to decompress blob data\n");
-          return ret;
-      }
-      have = CHUNK - stream.avail_out;
-      blob_size += have;
-      if (*blob_size >= output_capacity) {
-        output_capacity *= 2;
-        *blob_data = realloc(*blob_data, output_capacity);
-        if (*blob_data == NULL) {
-          (void)inflateEnd(&stream);
-          fprintf(stderr, "Failed to reallocate memory for blob data\n");
-          return Z_MEM_ERROR;
-        }
-      }
-    } while (stream.avail_out == 0);
-  } while (ret != Z_STREAM_END);
-
-  /* Clean up the zlib stream */
-  (void)inflateEnd(&stream);
-  
-  if (ret != Z_STREAM_END) {
-    fprintf(stderr, "Failed to decompress blob data\n");
+  }
+
+  if (parse_object_header(header, type, type_size, &os->expected) != 0) {
+    fprintf(stderr, "Invalid object header\n");
     return Z_DATA_ERROR;
   }
-  
-  *blob_data = realloc(*blob_data, *blob_size + 1);
-  (*blob_data)[*blob_size] = '\0';
+  *size = os->expected;
   return Z_OK;
 }
 
-/* Function to extract and display the contents from decompressed data */
-int extract_and_print_content(unsigned char *data, size_t size) {
-  char *content = strchr((char *)data, '\0');
-  if (content == NULL) {
-    fprintf(stderr, "Invalid blob format\n");
+/* Function to write the remaining content of an object stream to out
+* Every inflated chunk goes straight to fwrite, so memory use stays at the
+* two CHUNK buffers whatever the size of the object.
+*/
+int object_stream_copy(object_stream *os, FILE *out) {
+  int ret;
+
+  for (;;) {
+    if (os->pending_len > 0) {
+      if (fwrite(os->pending, 1, os->pending_len, out) != os->pending_len) {
+        perror("fwrite");
+        return Z_ERRNO;
+      }
+      os->written += os->pending_len;
+      os->pending_len = 0;
+    }
+    if (os->finished) {
+      break;
+    }
+    ret = object_stream_inflate(os);
+    if (ret != Z_OK) {
+      return ret;
+    }
+  }
+
+  if (os->written != os->expected) {
+    fprintf(stderr, "Object size mismatch: header says %zu, got %zu\n", os->expected, os->written);
     return Z_DATA_ERROR;
   }
-  content++; // Skip the null terminator to get the actual content
-  printf("%s", content);
   return Z_OK;
 }
 
-/* Function to display the contents of a blob object */
-int cat_file(char *fp, char *path) {
-  FILE *f = fopen(path, "rb");
-  if (f == NULL) {
-    fprintf(stderr, "Failed to open file %s\n", path);
-    return Z_ERRNO;
-  }
-  unsigned char *decompressed_data;
-  size_t decompressed_size;
-  int ret;
-
-  ret = decompress_blob(f, &decompressed_data, &decompressed_size);
+/* Function to inflate a loose object and stream its content to out */
+int stream_object_content(object_stream *os, FILE *in, FILE *out) {
+  char type[16];
+  size_t size;
+  int ret = object_stream_begin(os, in, type, sizeof(type), &size);
   if (ret != Z_OK) {
     return ret;
   }
+  return object_stream_copy(os, out);
+}
+
+/* Function to write a packed object's content to out
+* Packed entries may be deltas, which are rebuilt in memory before writing.
+*/
+static int write_packed_object(const sha1_t *sha, FILE *out, int header_only, const char *name) {
+  int type;
+  unsigned char *data;
+  size_t size;
 
-  ret = extract_and_print_content(decompressed_data, decompressed_size);
-  free(decompressed_data);
+  if (header_only) {
+    if (packed_object_info(sha, &type, &size) != 0) {
+      return -1;
+    }
+    fprintf(out, "%s %s %zu\n", name, type_name(type), size);
+    return 0;
+  }
+  if (read_packed_object(sha, 0, &type, &data, &size) != 0) {
+    return -1;
+  }
+  int ret = 0;
+  if (name) {
+    fprintf(out, "%s %s %zu\n", name, type_name(type), size);
+  }
+  if (fwrite(data, 1, size, out) != size) {
+    perror("fwrite");
+    ret = -1;
+  }
+  free(data);
   return ret;
+}
+
+/* Function to display the contents of an object */
+int cat_file(const char *hash) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%.2s/%s", OBJ_DIR, hash, hash + 2);
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    sha1_t sha;
+    if (strlen(hash) != 40 || hex_to_sha1(hash, &sha) != 0 ||
+        !has_packed_object(&sha)) {
+      fprintf(stderr, "Not a valid object name %s\n", hash);
+      return -1;
+    }
+    return write_packed_object(&sha, stdout, 0, NULL) == 0 ? Z_OK : Z_DATA_ERROR;
+  }
+  object_stream *os = object_stream_new();
+  if (os == NULL) {
+    fclose(f);
+    return Z_MEM_ERROR;
+  }
+
+  int ret = stream_object_content(os, f, stdout);
+  object_stream_free(os);
   fclose(f);
-  return 0;
-  
+  return ret;
+}
+
+/* Function to check that a string is a full 40 character hex object id */
+static int is_hex_sha(const char *s, size_t len) {
+  if (len != SHA_DIGEST_LENGTH * 2) {
+    return 0;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (!isxdigit((unsigned char)s[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Function to implement cat-file --batch and --batch-check
+* Object ids are read from stdin, one per line. For each one a
+* "<sha> <type> <size>" line is written, followed by the content and a
+* newline unless header_only is set. Unknown ids produce "<id> missing".
+* One object_stream is reused for every request.
+*/
+int cat_file_batch(int header_only, int buffer_output) {
+  object_stream *os = object_stream_new();
+  if (os == NULL) {
+    return 1;
+  }
+  char path[256];
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t line_len;
+  int status = 0;
+
+  while ((line_len = getline(&line, &line_cap, stdin)) != -1) {
+    while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
+      line[--line_len] = '\0';
+    }
+
+    FILE *f = NULL;
+    if (is_hex_sha(line, line_len)) {
+      snprintf(path, sizeof(path), "%s/%.2s/%s", OBJ_DIR, line, line + 2);
+      f = fopen(path, "rb");
+    }
+    sha1_t sha;
+    if (f == NULL && is_hex_sha(line, line_len) && hex_to_sha1(line, &sha) == 0 &&
+        has_packed_object(&sha)) {
+      if (write_packed_object(&sha, stdout, header_only, line) != 0) {
+        fprintf(stderr, "Failed to read object %s\n", line);
+        status = 1;
+        break;
+      }
+      if (!header_only) {
+        putchar('\n');
+      }
+    } else if (f == NULL) {
+      printf("%s missing\n", line);
+    } else {
+      char type[16];
+      size_t size;
+      int ret = object_stream_begin(os, f, type, sizeof(type), &size);
+      if (ret == Z_OK) {
+        printf("%s %s %zu\n", line, type, size);
+        if (!header_only) {
+          ret = object_stream_copy(os, stdout);
+          putchar('\n');
+        }
+      }
+      fclose(f);
+      if (ret != Z_OK) {
+        fprintf(stderr, "Failed to read object %s\n", line);
+        status = 1;
+        break;
+      }
+    }
+    if (!buffer_output) {
+      fflush(stdout);
+    }
+  }
+
+  free(line);
+  object_stream_free(os);
+  fflush(stdout);
+  return status;
 }
 
 /* A function to support creating a blob object using git hash-object and write flag */
@@ -152,203 +362,332 @@ int hash_object(char *filename, int write_flag) {
     fprintf(stderr, "Failed to open file %s\n", filename);
     return -1;
   }
-
-  // Read the file contents
-  fseek(f, 0, SEEK_END);
-  size_t file_size = ftell(f);
-  fseek(f, 0, SEEK_SET);
-  unsigned char *file_contents = malloc(file_size);
-  if (!file_contents) {
-    fprintf(stderr, "Failed to allocate memory for file contents\n");
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0) {
+    perror("fstat");
     fclose(f);
     return -1;
   }
-  fread(file_contents, 1, file_size, f);
-  fclose(f);
-
-  // Create blob content: "blob <size>\0<file_contents>"
-  char header[64];
-  int header_len = snprintf(header, sizeof(header), "blob %zu", file_size);
-  header[header_len] = '\0';
-  // int header_len = snprintf(header, sizeof(header), "blob %zu\0", file_size);
-  size_t blob_size = header_len + 1 + file_size;
 
-
-  unsigned char *blob = malloc(blob_size);
-  if (!blob) {
-    fprintf(stderr, "Failed to allocate memory for blob\n");
-    free(file_contents);
+  sha1_t sha;
+  int ret = write_blob_stream(f, st.st_size, write_flag, &sha);
+  fclose(f);
+  if (ret != 0) {
     return -1;
   }
-  memcpy(blob, header, header_len);
-  blob[header_len] = '\0';
-  memcpy(blob + header_len + 1, file_contents, file_size);
-  free(file_contents);
-
 
-  // Compute the SHA-1 hash of the blob
-  unsigned char hash[SHA_DIGEST_LENGTH];
-  SHA1((unsigned char *)blob, blob_size, hash);
-  
-  // Convert hash to hex string
-  char hash_str[SHA_LEN * 2 + 1];
-  for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-    snprintf(hash_str + i * 2, 3, "%02x", hash[i]);
-  }
-  hash_str[SHA_LEN * 2] = '\0';
+  char hash_str[41];
+  sha1_to_hex(&sha, hash_str);
   printf("%s\n", hash_str);
+  return 0;
+}
 
-  // Write the blob to the object store
-  if (write_flag) {
-    // Compress the blob data
-    unsigned char compressed_blob[CHUNK];
-    z_stream stream = {0};
-    deflateInit(&stream, Z_BEST_COMPRESSION);
-
-    stream.avail_in = blob_size;
-    stream.next_in = blob;
-    stream.next_out = compressed_blob;
-    stream.avail_out = sizeof(compressed_blob);
-
-    int status = deflate(&stream, Z_FINISH);
-    if (status != Z_STREAM_END) {
-      fprintf(stderr, "Failed to compress blob data\n");
-      free(blob);
-      return -1;
-    }
-
-    // Write the compressed blob data to the object store .git/objects<dir>/<file>
-    char object_dir[256];
-    snprintf(object_dir, sizeof(object_dir), "%s/%.2s", OBJ_DIR, hash_str);
-    mkdir(object_dir, 0755);
-
-    char object_path[256];
-    snprintf(object_path, sizeof(object_path), "%s/%s", object_dir, hash_str + 2);
-    FILE *object_file = fopen(object_path, "wb");
-    if (!object_file) {
-      fprintf(stderr, "Failed to open object file %s\n", object_path);
-      free(blob);
-      return -1;
-    }
-    fwrite(compressed_blob, 1, stream.total_out, object_file);
-    fclose(object_file);
+/* Function to hash several files at once, printing one id per file in order */
+int hash_objects(char *const *filenames, int count, int write_flag) {
+  sha1_t *shas = malloc(count * sizeof(*shas));
+  if (!shas) {
+    perror("malloc");
+    return -1;
+  }
+  if (write_blob_files(filenames, count, write_flag, shas) != 0) {
+    free(shas);
+    return -1;
   }
+  for (int i = 0; i < count; i++) {
+    char hash_str[41];
+    sha1_to_hex(&shas[i], hash_str);
+    printf("%s\n", hash_str);
+  }
+  free(shas);
+  return 0;
 }
 
-/* Function to list the contents of a tree object using the ls-tree command
-* with --name-only option
-* The output is alphabetically sorted
-*/
-
 void die(const char *msg) {
   perror(msg);
   exit(1);
 }
 
-// Read and decompress the tree object
+// Read and decompress a loose object
+// The compressed file is mapped instead of read into a heap copy. Only the
+// header is inflated first; its declared size decides the single output
+// allocation, which holds "<type> <size>\0" followed by the content.
 
-void read_git_object(const char *hash, unsigned char **data, size_t *size) {
+int read_loose_object(const char *hash, unsigned char **data, size_t *size, size_t *header_len) {
   char path[256];
   snprintf(path, sizeof(path), "%s/%.2s/%s", OBJ_DIR, hash, hash + 2);
-  
+
   int fd = open(path, O_RDONLY);
   if (fd < 0) {
-    die("open");
+    // A missing file is not an error yet: the object may be packed.
+    if (errno != ENOENT) {
+      fprintf(stderr, "Failed to open object %s: %s\n", hash, strerror(errno));
+    }
+    return -1;
   }
-  
   struct stat st;
-  if (fstat(fd, &st) < 0) {
-    die("fstat");
-  }
-  
-  unsigned char *compressed = malloc(st.st_size);
-  if (!compressed) {
-    die("malloc");
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    fprintf(stderr, "Failed to stat object %s\n", hash);
+    close(fd);
+    return -1;
   }
-
-  if (read(fd, compressed, st.st_size) != st.st_size);
+  unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
   close(fd);
-
-  *data = malloc(BUFFER_SIZE);
-  if (!*data) {
-    die("malloc");
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map object %s: %s\n", hash, strerror(errno));
+    return -1;
   }
 
   z_stream stream = {0};
-  stream.avail_in = st.st_size;
-  stream.next_in = compressed;
-  stream.avail_out = BUFFER_SIZE;
-  stream.next_out = *data;
+  unsigned char head[MAX_HEADER_LEN];
+  unsigned char *out = NULL;
+  int ret = -1;
 
   if (inflateInit(&stream) != Z_OK) {
-    die("inflateInit");
+    munmap(map, st.st_size);
+    return -1;
+  }
+  size_t used, have;
+  int status = inflate_sized(&stream, map, st.st_size, head, sizeof(head), Z_SYNC_FLUSH, &used, &have);
+  if (status != Z_OK && status != Z_STREAM_END) {
+    fprintf(stderr, "Failed to inflate object %s\n", hash);
+    goto out;
   }
 
-  if (inflate(&stream, Z_FINISH) != Z_STREAM_END) {
-    die("inflate");
+  unsigned char *nul = memchr(head, '\0', have);
+  char type[16];
+  size_t content_size;
+  if (nul == NULL || parse_object_header((char *)head, type, sizeof(type), &content_size) != 0) {
+    fprintf(stderr, "Invalid header in object %s\n", hash);
+    goto out;
+  }
+  size_t hlen = nul - head + 1;
+  // A corrupt header must not wrap the allocation size around.
+  if (content_size > SIZE_MAX - hlen - 1) {
+    fprintf(stderr, "Object %s is too large\n", hash);
+    goto out;
+  }
+  size_t total = hlen + content_size;
+  if (have > total) {
+    fprintf(stderr, "Object %s is longer than its header says\n", hash);
+    goto out;
   }
 
-  *size = stream.total_out;
-  inflateEnd(&stream);
-  free(compressed);
+  // One extra byte keeps text objects null-terminated for callers.
+  out = malloc(total + 1);
+  if (!out) {
+    fprintf(stderr, "Failed to allocate %zu bytes for object %s\n", total, hash);
+    goto out;
+  }
+  memcpy(out, head, have);
+  if (status != Z_STREAM_END) {
+    size_t produced;
+    status = inflate_sized(&stream, map + used, st.st_size - used, out + have, total - have, Z_FINISH, NULL,
+                           &produced);
+    have += produced;
+  }
+  if (status != Z_STREAM_END || have != total) {
+    fprintf(stderr, "Failed to inflate object %s\n", hash);
+    free(out);
+    out = NULL;
+    goto out;
+  }
+  out[total] = '\0';
 
-}
+  *data = out;
+  *size = total;
+  *header_len = hlen;
+  ret = 0;
 
-// Parse the tree object format
+out:
+  inflateEnd(&stream);
+  munmap(map, st.st_size);
+  return ret;
+}
 
-void parse_tree(const unsigned char *data, size_t size, int name_only){
-  // Skip the header
+/* Function to read an object from the packs or, failing that, the loose store
+* buffer receives the allocation to free; span describes the content in it.
+* With quiet set, a missing object is not reported.
+*/
+static int read_object(const char *hash, const sha1_t *sha, unsigned char **buffer, object_span *span, int quiet) {
+  unsigned char *data;
+  size_t size, header_len;
+  // Packs first, as git looks: in a packed repository, trying the loose
+  // file first costs a failed open() for every object read.
+  int type;
+  if (read_packed_object(sha, 0, &type, &data, &size) == 0) {
+    snprintf(span->type, sizeof(span->type), "%s", type_name(type));
+    span->data = data;
+    span->size = size;
+    *buffer = data;
+    return 0;
+  }
 
-  const unsigned char *ptr = memchr(data, '\0', size);
-  if (!ptr) {
-    fprintf(stderr, "Invalid tree object format\n");
-    return;
+  if (read_loose_object(hash, &data, &size, &header_len) == 0) {
+    parse_object_header((char *)data, span->type, sizeof(span->type), &span->size);
+    span->data = data + header_len;
+    *buffer = data;
+    return 0;
   }
-  while (ptr < data + size) {
-    char mode[8] = {0};
-    char name[256] = {0};
-    unsigned char hash[20];
+  if (errno == ENOENT && !quiet) {
+    fprintf(stderr, "Not a valid object name %s\n", hash);
+  }
+  return -1;
+}
 
-    int i = 0;
-    while (ptr < data + size && *ptr != ' ') {
-      if (i < sizeof(mode) - 1) mode[i++] = *ptr;
-      ptr++;
+/* Function to convert a 40 character hex object id into a sha1_t */
+int hex_to_sha1(const char *hex, sha1_t *out) {
+  for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+    unsigned int byte;
+    if (!isxdigit((unsigned char)hex[2 * i]) || !isxdigit((unsigned char)hex[2 * i + 1]) ||
+        sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+      return -1;
     }
-    mode[i] = '\0';
-    if (*ptr == ' ') ptr++;
+    out->hash[i] = (unsigned char)byte;
+  }
+  return 0;
+}
 
-    i = 0;
-    while (ptr < data + size && *ptr != '\0') {
-      if (i < sizeof(name) - 1) name[i++] = *ptr;
-      ptr++;
+/* Function to convert a sha1_t into a null-terminated 40 character hex string */
+void sha1_to_hex(const sha1_t *sha, char *out) {
+  static const char digits[] = "0123456789abcdef";
+  for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+    out[2 * i] = digits[sha->hash[i] >> 4];
+    out[2 * i + 1] = digits[sha->hash[i] & 0xf];
+  }
+  out[SHA_DIGEST_LENGTH * 2] = '\0';
+}
+
+/* Function to undo C-style quoting in place, as git writes paths with
+* unusual characters. Unquoted strings are left alone; returns -1 if the
+* quoting is malformed.
+*/
+int unquote_c_path(char *s) {
+  size_t len = strlen(s);
+  if (len < 2 || s[0] != '"' || s[len - 1] != '"') {
+    return 0;
+  }
+  char *out = s;
+  for (size_t i = 1; i < len - 1; i++) {
+    if (s[i] != '\\') {
+      *out++ = s[i];
+      continue;
     }
-    name[i] = '\0';
-    if (*ptr == '\0') ptr++;
+    if (++i >= len - 1) {
+      return -1;
+    }
+    switch (s[i]) {
+    case 'a': *out++ = '\a'; break;
+    case 'b': *out++ = '\b'; break;
+    case 'f': *out++ = '\f'; break;
+    case 'n': *out++ = '\n'; break;
+    case 'r': *out++ = '\r'; break;
+    case 't': *out++ = '\t'; break;
+    case 'v': *out++ = '\v'; break;
+    case '\\': case '"': *out++ = s[i]; break;
+    default:
+      if (s[i] < '0' || s[i] > '3' || i + 2 >= len - 1) {
+        return -1;
+      }
+      *out++ = (char)((s[i] - '0') << 6 | (s[i + 1] - '0') << 3 | (s[i + 2] - '0'));
+      i += 2;
+    }
+  }
+  *out = '\0';
+  return 0;
+}
 
-    if (ptr + 20 > data + size) {
-      fprintf(stderr, "Invalid tree object format\n");
-      return;
+/* Function to write a path the way git shows it: in double quotes with C
+* escapes if it has control characters, quotes, backslashes or bytes
+* outside ASCII, as is
+*/
+void write_c_path(FILE *out, const char *s, size_t len) {
+  size_t i = 0;
+  while (i < len && (unsigned char)s[i] >= 0x20 && (unsigned char)s[i] < 0x7f && s[i] != '"' && s[i] != '\\') {
+    i++;
+  }
+  if (i == len) {
+    fwrite(s, 1, len, out);
+    return;
+  }
+  putc('"', out);
+  for (i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    const char *esc = NULL;
+    switch (c) {
+    case '\a': esc = "\\a"; break;
+    case '\b': esc = "\\b"; break;
+    case '\f': esc = "\\f"; break;
+    case '\n': esc = "\\n"; break;
+    case '\r': esc = "\\r"; break;
+    case '\t': esc = "\\t"; break;
+    case '\v': esc = "\\v"; break;
+    case '\\': esc = "\\\\"; break;
+    case '"': esc = "\\\""; break;
     }
+    if (esc) {
+      fputs(esc, out);
+    } else if (c < 0x20 || c >= 0x7f) {
+      fprintf(out, "\\%03o", c);
+    } else {
+      putc(c, out);
+    }
+  }
+  putc('"', out);
+}
 
-    memcpy(hash, ptr, 20);
-    ptr += 20;
-    printf("%s\n", name);
+/* Function to hand the content of an object to a callback without copying it
+* Inflated objects are kept in the object cache, so visiting the same id
+* again costs a hash lookup. The span stays valid only for the duration of
+* the callback.
+*/
+int visit_git_object(const char *hash, object_visit_fn fn, void *ctx) {
+  sha1_t sha;
+  if (hex_to_sha1(hash, &sha) != 0) {
+    fprintf(stderr, "Not a valid object name %s\n", hash);
+    return -1;
+  }
 
-    // if (name_only) {
-    //   printf("%s\n", name);
-    // } else {
-    //   // printf("%s %s\n", mode, (mode[0] == '4' ? "tree" : "blob"), name);
-    //   printf("%s %s %s\n", mode, (mode[0] == '4' ? "tree" : "blob"), name);
-    // }
+  cached_object *obj = object_cache_get(&sha);
+  if (!obj) {
+    unsigned char *buffer;
+    object_span span;
+    if (read_object(hash, &sha, &buffer, &span, 0) != 0) {
+      return -1;
+    }
+    obj = object_cache_put(&sha, buffer, &span);
+    if (!obj) {
+      free(buffer);
+      fprintf(stderr, "Failed to cache object %s\n", hash);
+      return -1;
+    }
   }
+
+  int ret = fn(&obj->span, ctx);
+  object_cache_release(obj);
+  return ret;
 }
 
-void ls_tree(const char *tree_file, int name_only) {
-  unsigned char *data;
-  size_t size;
-  read_git_object(tree_file, &data, &size);
-  parse_tree(data, size, name_only);
-  free(data);
+/* Function to inflate an object into the object cache ahead of its use
+* Safe to call from worker threads. A missing object is left for the
+* reader to report.
+*/
+void prefetch_git_object(const sha1_t *sha) {
+  cached_object *obj = object_cache_get(sha);
+  if (!obj) {
+    char hex[41];
+    unsigned char *buffer;
+    object_span span;
+    sha1_to_hex(sha, hex);
+    if (read_object(hex, sha, &buffer, &span, 1) != 0) {
+      return;
+    }
+    obj = object_cache_put(sha, buffer, &span);
+    if (!obj) {
+      free(buffer);
+      return;
+    }
+  }
+  object_cache_release(obj);
 }
 
 /** Function to write a tree object to the .git/objects
@@ -359,272 +698,497 @@ void ls_tree(const char *tree_file, int name_only) {
 * Once all the entries are processed, it creates a tree object and writes it to the object store
 */
 
-int compare_entries(const void *a, const void *b) {
-    return strcmp(((tree_entry *)a)->name, ((tree_entry *)b)->name);
-}
-
-// Function to compute the SHA-1 hash of a file
+// Function to compute the SHA-1 hash of a buffer
 void compute_sha1(const unsigned char *data, size_t len, sha1_t *out) {
-  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
-  if (!ctx) {
-    perror("EVP_MD_CTX_new");
-    exit(1);
-  }
-  EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
-  EVP_DigestUpdate(ctx, data, len);
-
-  unsigned int sha_len;
-  EVP_DigestFinal_ex(ctx, (unsigned char *)out, &sha_len);
-  EVP_MD_CTX_free(ctx);
+  sha1_buffer(data, len, out);
 }
 
-void write_compressed(const char *path, const unsigned char *data, size_t size) {
-    FILE *file = fopen(path, "wb");
-    if (!file) {
+// Function to write a blob object
+sha1_t write_blob(const char *filepath) {
+    FILE *fp = fopen(filepath, "rb");
+    if (!fp) {
         perror("fopen");
         exit(1);
     }
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0) {
+        perror("fstat");
+        exit(1);
+    }
 
-    z_stream stream = {0};
-    if (deflateInit(&stream, Z_BEST_COMPRESSION) != Z_OK) {
-        perror("deflateInit");
+    sha1_t sha;
+    if (write_blob_stream(fp, st.st_size, 1, &sha) != 0) {
+        fprintf(stderr, "Failed to write blob for %s\n", filepath);
         exit(1);
     }
+    fclose(fp);
+    return sha;
+}
 
-    unsigned char compressed[4096];
-    stream.next_in = (unsigned char *)data;
-    stream.avail_in = size;
-    stream.next_out = compressed;
-    stream.avail_out = sizeof(compressed);
+static int skip_dir_entry(const char *name) {
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, ".git") == 0;
+}
 
-    int ret = deflate(&stream, Z_FINISH);
-    if (ret != Z_STREAM_END) {
-        fprintf(stderr, "deflate failed: %d\n", ret);
-        exit(1);
+/* A directory being listed into a tree builder */
+typedef struct {
+    tree_builder *tb;
+    int fd;
+} tree_scan;
+
+// Function to add a directory entry to the tree
+// Directories are known from d_type alone; everything else is looked at
+// with fstatat, without following symlinks, for its mode and stat data.
+static int add_tree_entry(void *ctx, const char *name, unsigned char d_type) {
+    tree_scan *scan = ctx;
+    if (skip_dir_entry(name)) {
+        return 0;
     }
-    size_t written = fwrite(compressed, 1, sizeof(compressed) - stream.avail_out, file);
-    if (written != sizeof(compressed) - stream.avail_out) {
-        fprintf(stderr, "failed to write to file: %s\n", path);
-        exit(1);
+    struct stat st;
+    if (d_type == DT_DIR) {
+        st.st_mode = S_IFDIR;
+    } else if (fstatat(scan->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        perror(name);
+        return 0;
+    }
+    const char *mode;
+    if (S_ISDIR(st.st_mode)) {
+        mode = "40000";
+    } else if (S_ISLNK(st.st_mode)) {
+        mode = "120000";
+    } else if (S_ISREG(st.st_mode)) {
+        mode = (st.st_mode & S_IXUSR) ? "100755" : "100644";
+    } else {
+        // Sockets, fifos and devices have no place in a tree.
+        return 0;
+    }
+    tree_entry *e = tree_builder_add(scan->tb, name, strlen(name));
+    strcpy(e->mode, mode);
+    if (!S_ISDIR(st.st_mode)) {
+        fill_stat_data(&e->st, &st);
     }
-    fclose(file);
-    deflateEnd(&stream);
+    return 0;
 }
 
-
-// Function to write a blob object
-sha1_t write_blob(const char *filepath) {
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
-        perror("fopen");
+// Function to list the directory open on fd into tb
+static void scan_tree_dir(tree_builder *tb, int fd, const char *dirpath) {
+    tree_scan scan = { tb, fd };
+    if (dir_scan(fd, add_tree_entry, &scan) != 0) {
+        fprintf(stderr, "Failed to read directory %s\n", dirpath);
         exit(1);
     }
-    
-    fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    
-    unsigned char *buffer = malloc(size);
-    if (!buffer) {
-        perror("malloc");
+}
+
+static int open_tree_dir(int parent_fd, const char *name) {
+    int fd = dir_scan_open(parent_fd, name);
+    if (fd < 0) {
+        perror(name);
         exit(1);
     }
+    return fd;
+}
 
-    fread(buffer, 1, size, fp);
-    fclose(fp);
-
-    char header[64];
-    int header_len = snprintf(header, sizeof(header), "blob %zu", size);
-
-    size_t total_len = header_len + 1 + size;
-    unsigned char *full_data = malloc(total_len);
-    memcpy(full_data, header, header_len);
-    full_data[header_len] = '\0';
-    memcpy(full_data + header_len + 1, buffer, size);
-
-    sha1_t sha;
-    compute_sha1(full_data, total_len, &sha);
-    free(buffer);
-
-    char hex_hash[41];
-    for (int i = 0; i < 20; i++) {
-        sprintf(hex_hash + 2 * i, "%02x", sha.hash[i]);
+// Function to store a symlink's target as a blob
+static void write_symlink_blob(int dirfd, tree_entry *e) {
+    size_t size = e->st.size + 1;
+    for (;;) {
+        char *target = malloc(size);
+        if (!target) {
+            perror("malloc");
+            exit(1);
+        }
+        ssize_t len = readlinkat(dirfd, e->name, target, size);
+        if (len < 0) {
+            perror(e->name);
+            exit(1);
+        }
+        // The link may have been replaced by a longer one meanwhile.
+        if ((size_t)len < size) {
+            if (write_object("blob", target, len, &e->sha) != 0) {
+                exit(1);
+            }
+            free(target);
+            return;
+        }
+        free(target);
+        size *= 2;
     }
+}
 
-    char object_dir[256], object_path[256];
-    snprintf(object_dir, sizeof(object_dir), "%s/%02x", OBJ_DIR, sha.hash[0]);
-    snprintf(object_path, sizeof(object_path), "%s/%s", object_dir, hex_hash + 2);
-    // snprintf(object_dir, sizeof(object_dir), "%s/%02x%02x", OBJ_DIR, sha.hash[0], sha.hash[1]);
-    // snprintf(object_path, sizeof(object_path), "%s/%s", object_dir, hex_hash + 2);
 
-    mkdir(object_dir, 0755);
-    write_compressed(object_path, full_data, total_len);
+// Move the files ahead of the directories; returns how many files there are
+static size_t partition_tree_entries(tree_entry *entries, size_t entry_count) {
+    size_t files = 0;
+    for (size_t i = 0; i < entry_count; i++) {
+        if (strcmp(entries[i].mode, "40000") != 0) {
+            tree_entry tmp = entries[files];
+            entries[files++] = entries[i];
+            entries[i] = tmp;
+        }
+    }
+    return files;
+}
 
-    free(full_data);
-    return sha;
-    /**
-    // Compute SHA-1 hash of blob content
-    sha1_t sha;
-    compute_sha1(buffer, size, &sha);
-    free(buffer);
-    
-    return sha;*/
+// Index entries are named relative to the top of the working tree.
+static const char *index_name(const char *path) {
+    if (strcmp(path, ".") == 0) {
+        return "";
+    }
+    return strncmp(path, "./", 2) == 0 ? path + 2 : path;
 }
 
-// Function to write a tree object
-sha1_t write_tree(const char *dirpath) {
-    DIR *dir = opendir(dirpath);
-    if (!dir) {
-        perror("opendir");
+/* What the walk learned about one directory, for its cache tree node */
+typedef struct {
+    cache_tree *cache;          /* this directory's node, NULL without an index */
+    atomic_size_t cached;       /* files here whose id came from the index */
+    atomic_size_t total_files;  /* files in the whole subtree */
+    atomic_int dirty;           /* some subdirectory's tree was rebuilt */
+    atomic_int inexact;         /* the subtree holds something the index lacks */
+} tree_walk_state;
+
+// Function to write the blobs for a run of file entries in one batch
+// Files whose stat data still matches their index entry keep the cached
+// id and are not read at all.
+static void write_tree_blobs(const char *dirpath, int dirfd, tree_entry *entries, size_t count, git_index *index, tree_walk_state *ws) {
+    char **paths = malloc((count ? count : 1) * sizeof(*paths));
+    char **names = malloc((count ? count : 1) * sizeof(*names));
+    size_t *which = malloc((count ? count : 1) * sizeof(*which));
+    sha1_t *shas = malloc((count ? count : 1) * sizeof(*shas));
+    if (!paths || !names || !which || !shas) {
+        perror("malloc");
         exit(1);
     }
-    
-    struct dirent *entry;
-    tree_entry entries[1024];
-    size_t entry_count = 0;
-    
-    while ((entry = readdir(dir))) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".git") == 0) {
-            continue;
+    size_t nr = 0, cached = 0;
+    int inexact = 0;
+    for (size_t i = 0; i < count; i++) {
+        char *path = malloc(strlen(dirpath) + strlen(entries[i].name) + 2);
+        if (!path) {
+            perror("malloc");
+            exit(1);
+        }
+        sprintf(path, "%s/%s", dirpath, entries[i].name);
+        index_entry *ie = index ? index_find(index, index_name(path)) : NULL;
+        uint32_t mode = strtoul(entries[i].mode, NULL, 8);
+        if (!ie || ie->mode != mode) {
+            inexact = 1;
+            ie = NULL;
         }
-        
-        char fullpath[1024];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", dirpath, entry->d_name);
-        
-        struct stat st;
-        if (stat(fullpath, &st) == -1) {
-            perror("stat");
+        if (ie && index_entry_uptodate(index, ie, &entries[i].st)) {
+            entries[i].sha = ie->sha;
+            cached++;
+            free(path);
             continue;
         }
-        if (entry_count >= 1024) {
-            fprintf(stderr, "Too many entries in directory\n");
-            exit(1);
+        if (S_ISLNK(mode)) {
+            write_symlink_blob(dirfd, &entries[i]);
+            if (ie) {
+                index_entry_refresh(index, ie, &entries[i].sha, &entries[i].st);
+            }
+            free(path);
+            continue;
         }
-        
-        // Copy the file/directory name.
-        strncpy(entries[entry_count].name, entry->d_name, sizeof(entries[entry_count].name)-1);
-        entries[entry_count].name[sizeof(entries[entry_count].name)-1] = '\0';
-        
-        // Set the mode and recursively write subtrees or blobs.
-        if (S_ISDIR(st.st_mode)) {
-            strcpy(entries[entry_count].mode, "40000");
-            entries[entry_count].sha = write_tree(fullpath);
-        } else {
-            strcpy(entries[entry_count].mode, "100644");
-            entries[entry_count].sha = write_blob(fullpath);
+        paths[nr] = path;
+        names[nr] = (char *)entries[i].name;
+        which[nr++] = i;
+    }
+    if (write_blob_files_at(dirfd, names, nr, 1, shas) != 0) {
+        exit(1);
+    }
+    for (size_t i = 0; i < nr; i++) {
+        tree_entry *e = &entries[which[i]];
+        e->sha = shas[i];
+        // Tracked files that were only touched get their stat data refreshed.
+        index_entry *ie = index ? index_find(index, index_name(paths[i])) : NULL;
+        if (ie && ie->mode == strtoul(e->mode, NULL, 8)) {
+            index_entry_refresh(index, ie, &e->sha, &e->st);
         }
-        entry_count++;
+        free(paths[i]);
     }
-    closedir(dir);
+    free(paths);
+    free(names);
+    free(which);
+    free(shas);
+    atomic_fetch_add(&ws->cached, cached);
+    if (inexact) {
+        atomic_store(&ws->inexact, 1);
+    }
+}
 
-    // Sort the entries by name (as Git does).
-    qsort(entries, entry_count, sizeof(tree_entry), compare_entries);
-    
-    // Write the sorted entries into tree_buffer.
-    char tree_buffer[8192];
-    size_t offset = 0;
-    for (size_t i = 0; i < entry_count; i++) {
-        // Check for potential buffer overflow.
-        if (offset + 27 >= sizeof(tree_buffer)) {
-            fprintf(stderr, "Tree buffer overflow\n");
+// Look up the cache tree nodes of the subdirectories entries[files..] and
+// forget nodes for directories that are gone.
+static void prepare_subtree_caches(tree_walk_state *ws, tree_entry *entries, size_t files, size_t entry_count, cache_tree **subs) {
+    for (size_t i = files; i < entry_count; i++) {
+        subs[i - files] = ws->cache ? cache_tree_sub(ws->cache, entries[i].name) : NULL;
+    }
+    if (ws->cache) {
+        cache_tree_sweep(ws->cache);
+    }
+}
+
+// Function to produce a directory's tree once all its entries are known
+// When none of the files or subtrees changed since the cache tree node
+// was recorded, its id is used as is. Otherwise the tree is written and
+// the node updated, or left invalid if the index does not describe the
+// directory exactly (untracked files, other modes, empty directories).
+static sha1_t finish_tree_dir(const char *dirpath, tree_builder *tb, size_t files,
+                              git_index *index, tree_walk_state *ws, tree_walk_state *parent) {
+    size_t total = files + atomic_load(&ws->total_files);
+    cache_tree *cache = ws->cache;
+    int inexact = atomic_load(&ws->inexact) || total == 0;
+    sha1_t sha;
+
+    if (cache && cache->entry_count >= 0 && !atomic_load(&ws->dirty) &&
+        atomic_load(&ws->cached) == files && (size_t)cache->entry_count == total) {
+        sha = cache->sha;
+    } else {
+        if (tree_builder_write(tb, &sha) != 0) {
             exit(1);
         }
-        // Write "<mode> <name>" followed by a null byte.
-        offset += snprintf(tree_buffer + offset, sizeof(tree_buffer) - offset,
-                           "%s %s", entries[i].mode, entries[i].name);
-        tree_buffer[offset++] = '\0';
-        // Append the 20-byte SHA1 hash.
-        memcpy(tree_buffer + offset, entries[i].sha.hash, 20);
-        offset += 20;
+        if (cache) {
+            if (!inexact && total == index_count_under(index, index_name(dirpath))) {
+                cache->entry_count = total;
+                cache->sha = sha;
+            } else {
+                cache->entry_count = -1;
+            }
+            atomic_store(&index->changed, 1);
+        }
+        if (parent) {
+            atomic_store(&parent->dirty, 1);
+        }
     }
-    
-    // Build the tree object header
-    char header[64];
-    int header_len = snprintf(header, sizeof(header), "tree %zu", offset);
-    size_t total_len = header_len + 1 + offset;
-
-    // Allocate the full object data (header + null byte + tree_buffer).
-    unsigned char *full_data = malloc(total_len);
-    if (!full_data) {
-        perror("malloc");
-        exit(1);
+    if (parent) {
+        atomic_fetch_add(&parent->total_files, total);
+        if (inexact) {
+            atomic_store(&parent->inexact, 1);
+        }
     }
-    memcpy(full_data, header, header_len);
-    full_data[header_len] = '\0';
-    memcpy(full_data + header_len + 1, tree_buffer, offset);
+    return sha;
+}
 
-    // Compute the SHA-1 hash of the tree object.
-    sha1_t tree_sha;
-    compute_sha1(full_data, total_len, &tree_sha);
+static void init_walk_state(tree_walk_state *ws, cache_tree *cache) {
+    ws->cache = cache;
+    atomic_init(&ws->cached, 0);
+    atomic_init(&ws->total_files, 0);
+    atomic_init(&ws->dirty, 0);
+    atomic_init(&ws->inexact, 0);
+}
 
-    // Build the hex string for the SHA1.
-    char hex_hash[41];
-    for (int i = 0; i < 20; i++) {
-        sprintf(hex_hash + 2 * i, "%02x", tree_sha.hash[i]);
+// The root of the cache tree, created on first use. Without tracked
+// files there is nothing to cache, and no index file is written for it.
+static cache_tree *root_cache_tree(git_index *index) {
+    if (!index || index->nr == 0) {
+        return NULL;
     }
+    if (!index->cache_tree) {
+        index->cache_tree = cache_tree_new("");
+    }
+    return index->cache_tree;
+}
 
-    // Build the object directory and file paths
-    char object_dir[256], object_path[256];
-    snprintf(object_dir, sizeof(object_dir), "%s/%02x", OBJ_DIR, tree_sha.hash[0]);
-    snprintf(object_path, sizeof(object_path), "%s/%s", object_dir, hex_hash + 2);
-    // snprintf(object_dir, sizeof(object_dir), "%s/%02x%02x", OBJ_DIR, tree_sha.hash[0], tree_sha.hash[1]);
-    // snprintf(object_path, sizeof(object_path), "%s/%s", object_dir, hex_hash + 2);
+static sha1_t write_tree_dir(const char *dirpath, int fd, git_index *index, cache_tree *cache, tree_walk_state *parent) {
+    tree_builder tb;
+    tree_builder_init(&tb);
+    scan_tree_dir(&tb, fd, dirpath);
+
+    tree_walk_state ws;
+    init_walk_state(&ws, cache);
+
+    // Hash the whole directory's files as one batch, then recurse.
+    size_t files = partition_tree_entries(tb.entries, tb.nr);
+    cache_tree **subs = arena_alloc(&tb.arena, (tb.nr - files) * sizeof(*subs));
+    prepare_subtree_caches(&ws, tb.entries, files, tb.nr, subs);
+    write_tree_blobs(dirpath, fd, tb.entries, files, index, &ws);
+    for (size_t i = files; i < tb.nr; i++) {
+        char *fullpath = arena_join_path(&tb.arena, dirpath, tb.entries[i].name);
+        int subfd = open_tree_dir(fd, tb.entries[i].name);
+        tb.entries[i].sha = write_tree_dir(fullpath, subfd, index, subs[i - files], &ws);
+        close(subfd);
+    }
 
-    mkdir(object_dir, 0755);
-    write_compressed(object_path, full_data, total_len);
+    sha1_t sha = finish_tree_dir(dirpath, &tb, files, index, &ws, parent);
+    tree_builder_release(&tb);
+    return sha;
+}
 
-    free(full_data);
-    return tree_sha;
+// Function to write a tree object, using index as a stat cache when given
+sha1_t write_tree(const char *dirpath, git_index *index) {
+    int fd = open_tree_dir(AT_FDCWD, dirpath);
+    sha1_t sha = write_tree_dir(dirpath, fd, index, root_cache_tree(index), NULL);
+    close(fd);
+    return sha;
 }
 
 /**
-* Implement the git commit-tree command
-* This program creates a commit object and print its 40-char SHA to stdout
-* The commit object contains the timestamp, tree sha, author, committer, and parent commit sha (if any)
+* Parallel write-tree
+* Every directory becomes a task that lists its entries and submits one
+* task per subdirectory and one per run of up to BLOB_BATCH_OBJECTS files,
+* which are hashed as a batch and then compressed. A
+* directory keeps a count of children that have not resolved yet; the
+* task that brings it to zero builds the tree object and then resolves
+* the entry in the parent, so trees are assembled bottom up as soon as
+* their last child is known. Entries are sorted before the tree is
+* written, so the result is the same as the serial walk.
 */
 
-// Get timestamp
-void get_timestamp(char *buffer, size_t size) {
-    time_t t = time(NULL);
-    struct tm tm_info;
-    localtime_r(&t, &tm_info);
-    strftime(buffer, size, "%Y-%m-%d %H:%M:%S %z", &tm_info);
-}
+typedef struct tree_job {
+    tree_builder tree;         /* holds path as well as the entries */
+    const char *path;
+    int fd;                    /* open from listing until the tree is done */
+    struct tree_job *parent;
+    size_t slot;               /* our entry in the parent */
+    size_t files;              /* entries[0..files) are files */
+    git_index *index;          /* stat cache, may be NULL */
+    tree_walk_state walk;
+    atomic_size_t unresolved;  /* children left, plus one while listing */
+    sha1_t *result;            /* set on the root only */
+} tree_job;
 
-// Compute the SHA-1 hash of a commit content
-void sha1_hash(const char *data, size_t len, char *out) {
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1((unsigned char *)data, len, hash);
-    for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-        sprintf(out + (i * 2), "%02x", hash[i]);
+typedef struct {
+    thread_pool *pool;
+    git_index *index;  /* stat cache, may be NULL */
+    tree_job *job;
+    size_t slot;
+    size_t count;  /* files from slot on, for blob tasks */
+} tree_task;
+
+static void resolve_tree_child(tree_job *job);
+
+static void finish_tree_job(tree_job *job) {
+    tree_job *parent = job->parent;
+    sha1_t sha = finish_tree_dir(job->path, &job->tree, job->files,
+                                 job->index, &job->walk, parent ? &parent->walk : NULL);
+    if (parent) {
+        parent->tree.entries[job->slot].sha = sha;
+    } else {
+        *job->result = sha;
+    }
+    close(job->fd);
+    tree_builder_release(&job->tree);
+    free(job);
+    if (parent) {
+        resolve_tree_child(parent);
     }
 }
 
-// Write the commit object
-void write_commit_object(const char *content, const char *sha) {
-    char dir_path[64], file_path[128];
+static void resolve_tree_child(tree_job *job) {
+    if (atomic_fetch_sub(&job->unresolved, 1) == 1) {
+        finish_tree_job(job);
+    }
+}
 
-    snprintf(dir_path, sizeof(dir_path), "%s/%.2s", OBJ_DIR, sha);
-    snprintf(file_path, sizeof(file_path), "%s/%.2s/%s", OBJ_DIR, sha, sha + 2);
+static void blob_task(void *arg) {
+    tree_task *t = arg;
+    tree_job *job = t->job;
+    write_tree_blobs(job->path, job->fd, job->tree.entries + t->slot, t->count, t->index, &job->walk);
+    free(t);
+    resolve_tree_child(job);
+}
 
-    mkdir(OBJ_DIR, 0755);
-    mkdir(dir_path, 0755);
+static void tree_task_run(void *arg) {
+    tree_task *t = arg;
+    tree_job *job = t->job;
+    // Subdirectories open relative to the parent, whose fd stays open
+    // until all of its children are done.
+    tree_job *parent = job->parent;
+    job->fd = parent ? open_tree_dir(parent->fd, parent->tree.entries[job->slot].name)
+                     : open_tree_dir(AT_FDCWD, job->path);
+
+    // List the directory completely before submitting children, so
+    // the entries never move while they write into them.
+    tree_builder *tb = &job->tree;
+    scan_tree_dir(tb, job->fd, job->path);
+
+    size_t files = partition_tree_entries(tb->entries, tb->nr);
+    job->files = files;
+    cache_tree **subs = arena_alloc(&tb->arena, (tb->nr - files) * sizeof(*subs));
+    prepare_subtree_caches(&job->walk, tb->entries, files, tb->nr, subs);
+    size_t batches = (files + BLOB_BATCH_OBJECTS - 1) / BLOB_BATCH_OBJECTS;
+    atomic_store(&job->unresolved, batches + (tb->nr - files) + 1);
+    for (size_t i = 0; i < tb->nr; ) {
+        tree_task *child = malloc(sizeof(*child));
+        if (!child) {
+            perror("malloc");
+            exit(1);
+        }
+        child->pool = t->pool;
+        child->index = t->index;
+        child->slot = i;
+        if (i < files) {
+            child->job = job;
+            child->count = files - i < BLOB_BATCH_OBJECTS ? files - i : BLOB_BATCH_OBJECTS;
+            i += child->count;
+            thread_pool_submit(t->pool, blob_task, child);
+        } else {
+            tree_job *sub = calloc(1, sizeof(*sub));
+            if (!sub) {
+                perror("malloc");
+                exit(1);
+            }
+            tree_builder_init(&sub->tree);
+            sub->path = arena_join_path(&sub->tree.arena, job->path, tb->entries[i].name);
+            sub->parent = job;
+            sub->slot = i;
+            sub->index = job->index;
+            init_walk_state(&sub->walk, subs[i - files]);
+            child->job = sub;
+            child->count = 0;
+            i++;
+            thread_pool_submit(t->pool, tree_task_run, child);
+        }
+    }
+    free(t);
+    resolve_tree_child(job);
+}
 
-    size_t content_len = strlen(content);
-    size_t formatted_size = content_len + 20; // "commit " + size digits + null terminator
-    char *formatted_content = malloc(formatted_size);
-    if (!formatted_content) {
+/* Function to write a tree object on a pool of worker threads
+* threads <= 0 uses one worker per CPU. The result is the same object
+* write_tree would produce.
+*/
+sha1_t write_tree_parallel(const char *dirpath, int threads, git_index *index) {
+    thread_pool *pool = thread_pool_new(threads);
+    if (!pool) {
+        return write_tree(dirpath, index);
+    }
+    sha1_t sha;
+    tree_job *root = calloc(1, sizeof(*root));
+    tree_task *t = malloc(sizeof(*t));
+    if (!root || !t) {
         perror("malloc");
         exit(1);
     }
+    tree_builder_init(&root->tree);
+    root->path = arena_strndup(&root->tree.arena, dirpath, strlen(dirpath));
+    root->result = &sha;
+    root->index = index;
+    init_walk_state(&root->walk, root_cache_tree(index));
+    t->pool = pool;
+    t->index = index;
+    t->job = root;
+    thread_pool_submit(pool, tree_task_run, t);
+    thread_pool_wait(pool);
+    thread_pool_free(pool);
+    return sha;
+}
 
-    int total_len = snprintf(formatted_content, formatted_size, "commit %zu%c%s", content_len, '\0', content);
-    // memcpy(formatted_content + header_len, content, content_len + 1);
+/**
+* Implement the git commit-tree command
+* This program creates a commit object and print its 40-char SHA to stdout
+* The commit object contains the timestamp, tree sha, author, committer, and parent commit sha (if any)
+*/
 
-    // write_compressed_commit(file_path, (unsigned char *)content, strlen(content));
-    write_compressed(file_path, (unsigned char *)formatted_content, total_len);
+// Get timestamp
+void get_timestamp(char *buffer, size_t size) {
+    time_t t = time(NULL);
+    struct tm tm_info;
+    localtime_r(&t, &tm_info);
+    strftime(buffer, size, "%s %z", &tm_info);
+}
 
-    free(formatted_content);
+// Write the commit object and return its id
+void write_commit_object(const char *content, sha1_t *out) {
+    if (write_object("commit", content, strlen(content), out) != 0) {
+        exit(1);
+    }
 }
 
 // Commit the tree object
@@ -645,10 +1209,10 @@ int commit_tree(const char *tree_sha, const char *parent_sha, const char *messag
                  COMMITTER_NAME, COMMITTER_EMAIL, timestamp, message);
     }
 
-    char sha[SHA_DIGEST_LENGTH * 2 + 1] = {0};
-    sha1_hash(commit_content, strlen(commit_content), sha);
-
-    write_commit_object(commit_content, sha);
+    sha1_t commit_sha;
+    char sha[SHA_DIGEST_LENGTH * 2 + 1];
+    write_commit_object(commit_content, &commit_sha);
+    sha1_to_hex(&commit_sha, sha);
     printf("%s\n", sha);
 
     return 0;
@@ -824,13 +1388,13 @@ char *extract_head_sha(const char *refs) {
     char *sha = NULL;
     
     while (token != NULL) {
-        if (strstr(token, "HEAD") != NULL) {
-            // Packet-line: first 4 bytes are length.
-            // We assume the SHA is the next 40 characters.
-            if (strlen(token) >= 44) {
-                sha = strndup(token + 4, 40);
-                break;
-            }
+        // The id is the 40 characters in front of " HEAD". The first
+        // advertised ref may be preceded by a flush packet as well as its
+        // own length, so counting from the start of the line is not enough.
+        char *head = strstr(token, " HEAD");
+        if (head != NULL && head - token >= 40) {
+            sha = strndup(head - 40, 40);
+            break;
         }
         token = strtok_r(NULL, "\n", &saveptr);
     }
@@ -841,10 +1405,12 @@ char *extract_head_sha(const char *refs) {
 // --- Build Upload-pack Request ---
 // Build a minimal upload-pack request body using the HEAD SHA.
 // Build a request body with a "want" line including common capabilities.
+// side-band-64k lets progress and errors travel next to the pack data, and
+// "done" ends the negotiation since we have nothing to offer.
 char *build_upload_pack_request(const char *head_sha) {
     char line[256];
     snprintf(line, sizeof(line),
-             "want %s multi_ack_detailed ofs-delta agent=git/2.34.1\n",
+             "want %s multi_ack_detailed side-band-64k ofs-delta agent=git/2.34.1\n",
              head_sha);
     unsigned int line_len = (unsigned int)(strlen(line) + 4); // 4 bytes for the length header
     char header[5];
@@ -854,19 +1420,170 @@ char *build_upload_pack_request(const char *head_sha) {
         perror("malloc");
         exit(EXIT_FAILURE);
     }
-    snprintf(request, 512, "%s%s0000", header, line);
+    snprintf(request, 512, "%s%s00000009done\n", header, line);
     return request;
 }
 
+// --- Receive the packfile ---
+// The upload-pack response is parsed as it arrives: pkt-lines are split
+// out of the curl buffers, sideband 1 is appended to the .pack file and fed
+// to the running SHA-1 and to index-pack's sequential pass, band 2 goes to
+// stderr and band 3 aborts. The last 20 pack bytes are held back, since
+// they are the checksum the running hash must match once the stream ends.
+
+typedef struct {
+    FILE *pack;
+    EVP_MD_CTX *ctx;
+    pack_indexer *indexer;
+    char len_buf[4];
+    size_t len_have;
+    size_t payload_left;
+    int at_payload_start;
+    int band;
+    char line[LARGE_PKT_MAX];
+    size_t line_len;
+    unsigned char trailer[20];
+    size_t trailer_len;
+    size_t pack_bytes;
+    int failed;
+} pack_receiver;
+
+// Append pack bytes, hashing everything but the last 20 seen so far.
+static int receive_pack_bytes(pack_receiver *rx, const unsigned char *data, size_t len) {
+    if (fwrite(data, 1, len, rx->pack) != len) {
+        perror("fwrite packfile");
+        return -1;
+    }
+    rx->pack_bytes += len;
+    if (rx->indexer && pack_indexer_feed(rx->indexer, data, len) != 0) {
+        return -1;
+    }
+
+    size_t total = rx->trailer_len + len;
+    if (total <= sizeof(rx->trailer)) {
+        memcpy(rx->trailer + rx->trailer_len, data, len);
+        rx->trailer_len = total;
+        return 0;
+    }
+    size_t flush = total - sizeof(rx->trailer);
+    size_t from_trailer = flush < rx->trailer_len ? flush : rx->trailer_len;
+    EVP_DigestUpdate(rx->ctx, rx->trailer, from_trailer);
+    EVP_DigestUpdate(rx->ctx, data, flush - from_trailer);
+
+    unsigned char keep[20];
+    size_t keep_old = rx->trailer_len - from_trailer;
+    memcpy(keep, rx->trailer + from_trailer, keep_old);
+    memcpy(keep + keep_old, data + (flush - from_trailer), len - (flush - from_trailer));
+    memcpy(rx->trailer, keep, sizeof(rx->trailer));
+    rx->trailer_len = sizeof(rx->trailer);
+    return 0;
+}
+
+// Handle payload bytes of the current pkt-line.
+static int receive_payload(pack_receiver *rx, const unsigned char *data, size_t len, int last) {
+    // The band byte may arrive in a later buffer than the length.
+    if (rx->at_payload_start && len > 0) {
+        rx->at_payload_start = 0;
+        rx->band = data[0];
+        // Before the sideband starts the server sends NAK/ACK lines.
+        if (rx->band != 1 && rx->band != 2 && rx->band != 3) {
+            rx->band = 0;
+        } else {
+            data++;
+            len--;
+        }
+    }
+
+    if (rx->band == 1) {
+        return receive_pack_bytes(rx, data, len);
+    }
+
+    // Text lines are collected whole before being reported.
+    size_t room = sizeof(rx->line) - 1 - rx->line_len;
+    size_t take = len < room ? len : room;
+    memcpy(rx->line + rx->line_len, data, take);
+    rx->line_len += take;
+    if (!last) {
+        return 0;
+    }
+    rx->line[rx->line_len] = '\0';
+    rx->line_len = 0;
+    if (rx->band == 2) {
+        fputs(rx->line, stderr);
+    } else if (rx->band == 3) {
+        fprintf(stderr, "remote error: %s\n", rx->line);
+        return -1;
+    } else if (strncmp(rx->line, "ERR ", 4) == 0) {
+        fprintf(stderr, "remote error: %s\n", rx->line + 4);
+        return -1;
+    }
+    return 0;
+}
+
+static size_t ReceivePackCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    pack_receiver *rx = (pack_receiver *)userp;
+    const unsigned char *p = contents, *end = p + realsize;
+
+    while (p < end) {
+        if (rx->payload_left == 0) {
+            // Gather the 4 hex digit length, which may straddle buffers.
+            while (rx->len_have < 4 && p < end) {
+                rx->len_buf[rx->len_have++] = *p++;
+            }
+            if (rx->len_have < 4) {
+                break;
+            }
+            rx->len_have = 0;
+            char hex[5] = {0};
+            memcpy(hex, rx->len_buf, 4);
+            char *hex_end;
+            unsigned long pkt_len = strtoul(hex, &hex_end, 16);
+            if (hex_end != hex + 4 || (pkt_len != 0 && pkt_len < 4) || pkt_len > LARGE_PKT_MAX) {
+                fprintf(stderr, "Bad pkt-line length in upload-pack response\n");
+                rx->failed = 1;
+                return 0;
+            }
+            if (pkt_len <= 4) {
+                continue; // flush or empty packet
+            }
+            rx->payload_left = pkt_len - 4;
+            rx->at_payload_start = 1;
+            if (p == end) {
+                break;
+            }
+        }
+
+        size_t avail = (size_t)(end - p);
+        size_t take = avail < rx->payload_left ? avail : rx->payload_left;
+        rx->payload_left -= take;
+        if (receive_payload(rx, p, take, rx->payload_left == 0) != 0) {
+            rx->failed = 1;
+            return 0;
+        }
+        p += take;
+    }
+    return realsize;
+}
+
 // --- Post Upload-pack ---
-// Returns the real packfile size via out_size.
-// Sends the request and returns the packfile data and its size.
-char *post_upload_pack(const char *remote_url, const char *request_body, size_t *out_size) {
+// Streams the packfile in the response to pack_path and returns its
+// verified trailing checksum via pack_sha. The pack is also fed to
+// indexer, if not NULL, as it arrives.
+int post_upload_pack(const char *remote_url, const char *request_body, const char *pack_path, pack_indexer *indexer,
+                     sha1_t *pack_sha) {
     CURL *curl_handle;
     CURLcode res;
-    struct MemoryStruct chunk;
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+    pack_receiver rx = {0};
+    rx.indexer = indexer;
+
+    rx.pack = fopen(pack_path, "wb");
+    if (!rx.pack) {
+        perror("fopen packfile");
+        return -1;
+    }
+    rx.ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(rx.ctx, EVP_sha1(), NULL);
     
     curl_global_init(CURL_GLOBAL_ALL);
     curl_handle = curl_easy_init();
@@ -885,51 +1602,37 @@ char *post_upload_pack(const char *remote_url, const char *request_body, size_t
     curl_easy_setopt(curl_handle, CURLOPT_POST, 1L);
     curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, request_body);
     curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDSIZE, (long)strlen(request_body));
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, ReceivePackCallback);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&rx);
     
     res = curl_easy_perform(curl_handle);
-    if (res != CURLE_OK) {
-        fprintf(stderr, "POST failed: %s\n", curl_easy_strerror(res));
-        exit(1);
-    }
     curl_slist_free_all(headers);
     curl_easy_cleanup(curl_handle);
     curl_global_cleanup();
-    
-    *out_size = chunk.size;
-    return chunk.memory;
-}
-
-// --- Save the packfile to disk and unpack it ---
-int save_and_unpack_packfile(const char *packfile_data, size_t packfile_size) {
-    system("mkdir -p .git/objects/pack");
 
-    FILE *packfile = fopen(".git/objects/pack/temp.pack", "wb");
-    if (!packfile) {
-        perror("fopen packfile");
-        return -1;
+    int ret = 0;
+    if (fclose(rx.pack) != 0) {
+        perror("fclose packfile");
+        ret = -1;
     }
+    unsigned char checksum[20];
+    EVP_DigestFinal_ex(rx.ctx, checksum, NULL);
+    EVP_MD_CTX_free(rx.ctx);
 
-    if (fwrite(packfile_data, 1, packfile_size, packfile) != packfile_size) {
-        perror("fwrite packfile");
-        fclose(packfile);
-        return -1;
+    if (res != CURLE_OK) {
+        if (!rx.failed) {
+            fprintf(stderr, "POST failed: %s\n", curl_easy_strerror(res));
+        }
+        ret = -1;
+    } else if (rx.pack_bytes < 12 + 20 || rx.trailer_len != 20 || memcmp(checksum, rx.trailer, 20) != 0) {
+        fprintf(stderr, "Received packfile is truncated or corrupt\n");
+        ret = -1;
     }
-    fclose(packfile);
-
-    FILE *git_unpack = popen("git unpack-objects < .git/objects/pack/temp.pack", "r");
-    if (!git_unpack) {
-        perror("popen git unpack-objects");
+    if (ret != 0) {
+        remove(pack_path);
         return -1;
     }
-
-    char output[256];
-    while (fgets(output, sizeof(output), git_unpack)) {
-        printf("%s", output);
-    }
-    pclose(git_unpack);
-    remove(".git/objects/pack/temp.pack");
+    memcpy(pack_sha->hash, checksum, 20);
     return 0;
 }
 
@@ -991,23 +1694,32 @@ int clone_repo(const char *remote_url, const char *target_dir) {
     printf("Default branch: %s\n", default_branch);
 
     char *request = build_upload_pack_request(head_sha);
-    size_t packfile_size;
-    char *packfile = post_upload_pack(remote_url, request, &packfile_size);
+    const char *tmp_pack = PACK_DIR "/tmp_pack.pack";
+    const char *tmp_idx = PACK_DIR "/tmp_pack.idx";
+    sha1_t pack_sha;
+    mkdir(PACK_DIR, 0755);
+    // Indexing starts on the bytes as they arrive; only resolving the
+    // deltas waits for the whole pack.
+    pack_indexer *indexer = pack_indexer_new();
+    int fetched = indexer ? post_upload_pack(remote_url, request, tmp_pack, indexer, &pack_sha) : -1;
     free(request);
-    if (!packfile) {
+    if (fetched != 0) {
         fprintf(stderr, "Failed to fetch packfile\n");
+        pack_indexer_free(indexer);
         free(default_branch);
         return -1;
     }
 
-    if (save_and_unpack_packfile(packfile, packfile_size) == -1) {
-        fprintf(stderr, "Failed to save and unpack packfile\n");
-        free(packfile);
+    // The checksum was verified while receiving.
+    if (pack_indexer_finish(indexer, tmp_pack, tmp_idx, 0, &pack_sha) != 0 ||
+        finalize_pack(tmp_pack, tmp_idx, &pack_sha) != 0) {
+        fprintf(stderr, "Failed to index packfile\n");
+        remove(tmp_pack);
+        remove(tmp_idx);
         free(default_branch);
         return -1;
     }
 
-    free(packfile);
     if (update_refs(default_branch, head_sha) == -1) {
         fprintf(stderr, "Failed to update refs\n");
         free(default_branch);
@@ -2,6 +2,7 @@
 #define BLOB_H
 
 /* Includes */
+#include <stdio.h>
 #include <openssl/sha.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -12,10 +13,14 @@
 #include <errno.h>
 #include <curl/curl.h>
 #include <ctype.h>
+#include <zlib.h>
+#include <stdint.h>
 
 #define SHA_LEN 100
 #define CHUNK 16384
 #define BUFFER_SIZE 4096
+#define MAX_HEADER_LEN 64
+#define LARGE_PKT_MAX 65520
 #define OBJ_DIR ".git/objects"
 #define COMMITTER_NAME "Dorine Tipo"
 #define COMMITTER_EMAIL "dorine.a.tipo@gmail.com"
@@ -24,28 +29,82 @@ typedef struct {
   unsigned char hash[20];
 } sha1_t;
 
+/* The parts of struct stat the index compares to spot changed files */
+typedef struct {
+    uint32_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t dev;
+    uint32_t ino;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t size;
+} stat_data;
+
 typedef struct {
     char mode[7];
-    char name[256];
+    const char *name;  /* owned by the tree builder's arena */
+    size_t name_len;
     sha1_t sha;
+    stat_data st;  /* as seen by the working tree walk */
 } tree_entry;
 
+struct git_index;
+
+/* Reusable inflate state for streaming loose objects */
+typedef struct {
+    z_stream stream;
+    FILE *file;
+    unsigned char in[CHUNK];
+    unsigned char out[CHUNK];
+    unsigned char *pending;
+    size_t pending_len;
+    size_t expected;
+    size_t written;
+    int finished;
+} object_stream;
+
+/* Borrowed view of an inflated object's content */
+typedef struct {
+    char type[16];
+    const unsigned char *data;
+    size_t size;
+} object_span;
+
+typedef int (*object_visit_fn)(const object_span *obj, void *ctx);
+
 
 /* Function prototypes */
 void get_file_path(char *file_path, char *object_hash);
-int decompress_blob(FILE *file, unsigned char **blob_data, size_t *blob_size);
-int cat_file(char *fp, char *path);
+int parse_object_header(const char *header, char *type, size_t type_size, size_t *size);
+object_stream *object_stream_new(void);
+void object_stream_free(object_stream *os);
+int object_stream_begin(object_stream *os, FILE *in, char *type, size_t type_size, size_t *size);
+int object_stream_copy(object_stream *os, FILE *out);
+int stream_object_content(object_stream *os, FILE *in, FILE *out);
+int cat_file(const char *hash);
+int cat_file_batch(int header_only, int buffer_output);
 int hash_object(char  *filename, int write_flag);
+int hash_objects(char *const *filenames, int count, int write_flag);
 void die(const char *msg);
-void read_git_object(const char *hash, unsigned char **data, size_t *size);
-void parse_tree(const unsigned char *data, size_t size, int name_only);
-void ls_tree(const char *tree_file, int name_only);
+int read_loose_object(const char *hash, unsigned char **data, size_t *size, size_t *header_len);
+int hex_to_sha1(const char *hex, sha1_t *out);
+void sha1_to_hex(const sha1_t *sha, char *out);
+int unquote_c_path(char *s);
+void write_c_path(FILE *out, const char *s, size_t len);
+int has_loose_object(const sha1_t *sha);
+int object_exists(const sha1_t *sha);
+int prepare_loose_subdir(const sha1_t *sha);
+void loose_cache_add(const sha1_t *sha);
+int visit_git_object(const char *hash, object_visit_fn fn, void *ctx);
+void prefetch_git_object(const sha1_t *sha);
 void compute_sha1(const unsigned char *data, size_t len, sha1_t *out);
-sha1_t write_tree(const char *dirpath);
+sha1_t write_tree(const char *dirpath, struct git_index *index);
+sha1_t write_tree_parallel(const char *dirpath, int threads, struct git_index *index);
 sha1_t write_blob(const char *filepath);
 void get_timestamp(char *buffer, size_t size);
-void sha1_hash(const char *data, size_t len, char *out);
-void write_commit_object(const char *content, const char *sha);
+void write_commit_object(const char *content, sha1_t *out);
 int commit_tree(const char *tree_sha, const char *parent_sha, const char *message);
 int clone_repo(const char *remote_url, const char *target_dir);
 
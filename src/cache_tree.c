@@ -0,0 +1,250 @@
+/**
+* cache_tree.c - Tree ids cached per directory
+* Each node remembers the tree object last written for one directory and
+* how many index entries it covers. Changing an entry invalidates only the
+* nodes on its path, so write-tree can take every other directory's tree
+* id as is and rebuild just the trees between the change and the root.
+* Nodes are stored in the index's TREE extension, in git's format:
+* "<name>\0<entry count> <subtree count>\n", the 20-byte id when the
+* entry count is not -1, then the subtrees, depth first.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache_tree.h"
+
+/* Deepest subtree accepted from disk; bounds the recursion in read_one */
+#define MAX_CACHE_TREE_DEPTH 4096
+
+cache_tree *cache_tree_new(const char *name) {
+  cache_tree *ct = calloc(1, sizeof(*ct));
+  if (!ct || !(ct->name = strdup(name))) {
+    free(ct);
+    return NULL;
+  }
+  ct->entry_count = -1;
+  return ct;
+}
+
+void cache_tree_free(cache_tree *ct) {
+  if (!ct) {
+    return;
+  }
+  for (size_t i = 0; i < ct->down_nr; i++) {
+    cache_tree_free(ct->down[i]);
+  }
+  free(ct->down);
+  free(ct->name);
+  free(ct);
+}
+
+// Subtrees are ordered by name length first, then bytes, as git keeps them.
+static int subtree_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+  if (alen != blen) {
+    return alen < blen ? -1 : 1;
+  }
+  return memcmp(a, b, alen);
+}
+
+// Binary search; returns the position, or -(insert position + 1).
+static long subtree_pos(const cache_tree *ct, const char *name, size_t len) {
+  size_t lo = 0, hi = ct->down_nr;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const char *other = ct->down[mid]->name;
+    int cmp = subtree_cmp(name, len, other, strlen(other));
+    if (cmp == 0) {
+      return mid;
+    }
+    if (cmp < 0) hi = mid;
+    else lo = mid + 1;
+  }
+  return -(long)lo - 1;
+}
+
+cache_tree *cache_tree_find(const cache_tree *ct, const char *name) {
+  long pos = subtree_pos(ct, name, strlen(name));
+  return pos >= 0 ? ct->down[pos] : NULL;
+}
+
+/* Function to find the subtree for name, creating an invalid one if needed */
+cache_tree *cache_tree_sub(cache_tree *ct, const char *name) {
+  long pos = subtree_pos(ct, name, strlen(name));
+  if (pos >= 0) {
+    ct->down[pos]->used = 1;
+    return ct->down[pos];
+  }
+  if (ct->down_nr == ct->down_alloc) {
+    size_t alloc = ct->down_alloc ? ct->down_alloc * 2 : 4;
+    cache_tree **down = realloc(ct->down, alloc * sizeof(*down));
+    if (!down) {
+      return NULL;
+    }
+    ct->down = down;
+    ct->down_alloc = alloc;
+  }
+  cache_tree *sub = cache_tree_new(name);
+  if (!sub) {
+    return NULL;
+  }
+  pos = -pos - 1;
+  memmove(&ct->down[pos + 1], &ct->down[pos], (ct->down_nr - pos) * sizeof(*ct->down));
+  ct->down[pos] = sub;
+  ct->down_nr++;
+  sub->used = 1;
+  return sub;
+}
+
+/* Function to drop subtrees not looked up through cache_tree_sub since the last sweep */
+void cache_tree_sweep(cache_tree *ct) {
+  size_t kept = 0;
+  for (size_t i = 0; i < ct->down_nr; i++) {
+    if (ct->down[i]->used) {
+      ct->down[i]->used = 0;
+      ct->down[kept++] = ct->down[i];
+    } else {
+      cache_tree_free(ct->down[i]);
+    }
+  }
+  ct->down_nr = kept;
+}
+
+/* Function to invalidate the nodes from the root down to the directory holding path */
+void cache_tree_invalidate_path(cache_tree *ct, const char *path) {
+  while (ct) {
+    ct->entry_count = -1;
+    const char *slash = strchr(path, '/');
+    if (!slash) {
+      return;
+    }
+    long pos = subtree_pos(ct, path, slash - path);
+    ct = pos >= 0 ? ct->down[pos] : NULL;
+    path = slash + 1;
+  }
+}
+
+static cache_tree *read_one(const unsigned char **data, const unsigned char *end, int depth) {
+  const unsigned char *p = *data;
+  const unsigned char *nul = memchr(p, '\0', end - p);
+  if (!nul || depth > MAX_CACHE_TREE_DEPTH) {
+    return NULL;
+  }
+  cache_tree *ct = cache_tree_new((const char *)p);
+  if (!ct) {
+    return NULL;
+  }
+  p = nul + 1;
+  char line[32];
+  const unsigned char *nl = memchr(p, '\n', end - p);
+  int subtrees;
+  if (!nl || (size_t)(nl - p) >= sizeof(line)) {
+    goto fail;
+  }
+  memcpy(line, p, nl - p);
+  line[nl - p] = '\0';
+  if (sscanf(line, "%d %d", &ct->entry_count, &subtrees) != 2 || subtrees < 0) {
+    goto fail;
+  }
+  p = nl + 1;
+  if (ct->entry_count >= 0) {
+    if (end - p < 20) {
+      goto fail;
+    }
+    memcpy(ct->sha.hash, p, 20);
+    p += 20;
+  }
+  for (int i = 0; i < subtrees; i++) {
+    cache_tree *sub = read_one(&p, end, depth + 1);
+    if (!sub) {
+      goto fail;
+    }
+    // A repeated name would replace, and leak, the first one's children.
+    if (cache_tree_find(ct, sub->name)) {
+      cache_tree_free(sub);
+      goto fail;
+    }
+    // Insert through the sorted lookup, whatever order they came in.
+    cache_tree *slot = cache_tree_sub(ct, sub->name);
+    if (!slot) {
+      cache_tree_free(sub);
+      goto fail;
+    }
+    slot->entry_count = sub->entry_count;
+    slot->sha = sub->sha;
+    slot->down = sub->down;
+    slot->down_nr = sub->down_nr;
+    slot->down_alloc = sub->down_alloc;
+    slot->used = 0;
+    sub->down = NULL;
+    sub->down_nr = 0;
+    cache_tree_free(sub);
+  }
+  *data = p;
+  return ct;
+
+fail:
+  cache_tree_free(ct);
+  return NULL;
+}
+
+/* Function to parse a TREE extension payload */
+cache_tree *cache_tree_read(const unsigned char *data, size_t size) {
+  const unsigned char *p = data;
+  cache_tree *ct = read_one(&p, data + size, 0);
+  if (ct && p != data + size) {
+    cache_tree_free(ct);
+    return NULL;
+  }
+  return ct;
+}
+
+typedef struct {
+    unsigned char *buf;
+    size_t len;
+    size_t alloc;
+} byte_buffer;
+
+static int buffer_add(byte_buffer *b, const void *data, size_t len) {
+  if (b->len + len > b->alloc) {
+    size_t alloc = b->alloc ? b->alloc : 256;
+    while (alloc < b->len + len) alloc *= 2;
+    unsigned char *buf = realloc(b->buf, alloc);
+    if (!buf) {
+      return -1;
+    }
+    b->buf = buf;
+    b->alloc = alloc;
+  }
+  memcpy(b->buf + b->len, data, len);
+  b->len += len;
+  return 0;
+}
+
+static int write_one(byte_buffer *b, const cache_tree *ct) {
+  char line[64];
+  int n = snprintf(line, sizeof(line), "%d %zu\n", ct->entry_count, ct->down_nr);
+  if (buffer_add(b, ct->name, strlen(ct->name) + 1) != 0 || buffer_add(b, line, n) != 0) {
+    return -1;
+  }
+  if (ct->entry_count >= 0 && buffer_add(b, ct->sha.hash, 20) != 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < ct->down_nr; i++) {
+    if (write_one(b, ct->down[i]) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Function to serialize ct as a TREE extension payload; the caller frees it */
+unsigned char *cache_tree_write(const cache_tree *ct, size_t *size) {
+  byte_buffer b = {0};
+  if (write_one(&b, ct) != 0) {
+    free(b.buf);
+    return NULL;
+  }
+  *size = b.len;
+  return b.buf;
+}
@@ -0,0 +1,27 @@
+#ifndef CACHE_TREE_H
+#define CACHE_TREE_H
+
+#include "blob.h"
+
+/* A directory's tree as last written, kept in the index's TREE extension */
+typedef struct cache_tree {
+    char *name;                 /* path component, "" for the root */
+    int entry_count;            /* index entries below, -1 when invalid */
+    sha1_t sha;                 /* meaningful only when valid */
+    struct cache_tree **down;   /* subdirectories, see cache_tree_sub */
+    size_t down_nr;
+    size_t down_alloc;
+    int used;                   /* mark for cache_tree_sweep */
+} cache_tree;
+
+/* Function prototypes */
+cache_tree *cache_tree_new(const char *name);
+void cache_tree_free(cache_tree *ct);
+cache_tree *cache_tree_find(const cache_tree *ct, const char *name);
+cache_tree *cache_tree_sub(cache_tree *ct, const char *name);
+void cache_tree_sweep(cache_tree *ct);
+void cache_tree_invalidate_path(cache_tree *ct, const char *path);
+cache_tree *cache_tree_read(const unsigned char *data, size_t size);
+unsigned char *cache_tree_write(const cache_tree *ct, size_t *size);
+
+#endif
@@ -0,0 +1,382 @@
+/**
+* commit_graph.c - Commit-graph file
+* .git/objects/info/commit-graph holds, for every commit reachable from
+* the refs, its root tree, the positions of its parents, its generation
+* number and its commit date, in git's version 1 layout: a chunk table
+* with OIDF, OIDL, CDAT and, for octopus merges, EDGE chunks. The file is
+* mapped, so walking history through it reads a fixed-size row per commit
+* and never inflates a commit object.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "commit_graph.h"
+#include "hash_io.h"
+#include "revision.h"
+#include "refs.h"
+
+#define GRAPH_SIGNATURE 0x43475048 /* "CGPH" */
+#define GRAPH_VERSION 1
+#define GRAPH_HASH_VERSION 1
+#define GRAPH_HEADER_SIZE 8
+#define GRAPH_CHUNK_ENTRY_SIZE 12
+#define GRAPH_DATA_WIDTH (20 + 16)
+
+#define CHUNK_OIDF 0x4f494446
+#define CHUNK_OIDL 0x4f49444c
+#define CHUNK_CDAT 0x43444154
+#define CHUNK_EDGE 0x45444745
+
+static commit_graph *graph;
+static int graph_prepared;
+
+void close_commit_graph(void) {
+  if (graph) {
+    munmap(graph->map, graph->size);
+    free(graph);
+    graph = NULL;
+  }
+  graph_prepared = 0;
+}
+
+// Map the file and find its chunks; NULL if it is missing or corrupt.
+static commit_graph *load_commit_graph(void) {
+  int fd = open(COMMIT_GRAPH_PATH, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < GRAPH_HEADER_SIZE + GRAPH_CHUNK_ENTRY_SIZE + 20) {
+    close(fd);
+    return NULL;
+  }
+  unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  commit_graph *g = calloc(1, sizeof(*g));
+  g->map = map;
+  g->size = st.st_size;
+  if (get_be32(map) != GRAPH_SIGNATURE || map[4] != GRAPH_VERSION || map[5] != GRAPH_HASH_VERSION) {
+    goto bad;
+  }
+  int num_chunks = map[6];
+  if (GRAPH_HEADER_SIZE + (size_t)(num_chunks + 1) * GRAPH_CHUNK_ENTRY_SIZE > g->size - 20) {
+    goto bad;
+  }
+
+  uint64_t oidl_size = 0, cdat_size = 0, edge_size = 0, oidf_size = 0;
+  for (int i = 0; i < num_chunks; i++) {
+    const unsigned char *e = map + GRAPH_HEADER_SIZE + (size_t)i * GRAPH_CHUNK_ENTRY_SIZE;
+    uint32_t id = get_be32(e);
+    uint64_t off = get_be64(e + 4);
+    uint64_t next = get_be64(e + GRAPH_CHUNK_ENTRY_SIZE + 4);
+    if (off > next || next > g->size - 20) {
+      goto bad;
+    }
+    switch (id) {
+      case CHUNK_OIDF: g->fanout = map + off; oidf_size = next - off; break;
+      case CHUNK_OIDL: g->oids = map + off; oidl_size = next - off; break;
+      case CHUNK_CDAT: g->data = map + off; cdat_size = next - off; break;
+      case CHUNK_EDGE: g->edges = map + off; edge_size = next - off; break;
+    }
+  }
+  if (!g->fanout || !g->oids || !g->data || oidf_size < 256 * 4) {
+    goto bad;
+  }
+  // Any fanout slot bounds a search, so each must stay within the last.
+  for (int i = 0; i < 255; i++) {
+    if (get_be32(g->fanout + i * 4) > get_be32(g->fanout + (i + 1) * 4)) {
+      goto bad;
+    }
+  }
+  g->num_commits = get_be32(g->fanout + 255 * 4);
+  g->num_edges = edge_size / 4;
+  if (oidl_size < (uint64_t)g->num_commits * 20 || cdat_size < (uint64_t)g->num_commits * GRAPH_DATA_WIDTH) {
+    goto bad;
+  }
+  return g;
+
+bad:
+  fprintf(stderr, "warning: ignoring corrupt %s\n", COMMIT_GRAPH_PATH);
+  munmap(map, st.st_size);
+  free(g);
+  return NULL;
+}
+
+/* Function to return the mapped commit graph, or NULL if there is none */
+commit_graph *get_commit_graph(void) {
+  if (!graph_prepared) {
+    graph_prepared = 1;
+    graph = load_commit_graph();
+  }
+  return graph;
+}
+
+/* Function to find a commit's row; pos is left alone if it is missing */
+int commit_graph_find(const commit_graph *g, const sha1_t *sha, uint32_t *pos) {
+  uint32_t lo = sha->hash[0] ? get_be32(g->fanout + (sha->hash[0] - 1) * 4) : 0;
+  uint32_t hi = get_be32(g->fanout + sha->hash[0] * 4);
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int cmp = memcmp(sha->hash, g->oids + (size_t)mid * 20, 20);
+    if (cmp < 0) {
+      hi = mid;
+    } else if (cmp > 0) {
+      lo = mid + 1;
+    } else {
+      *pos = mid;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void commit_graph_oid(const commit_graph *g, uint32_t pos, sha1_t *out) {
+  memcpy(out->hash, g->oids + (size_t)pos * 20, 20);
+}
+
+void commit_graph_data_at(const commit_graph *g, uint32_t pos, commit_graph_data *out) {
+  const unsigned char *row = g->data + (size_t)pos * GRAPH_DATA_WIDTH;
+  memcpy(out->tree.hash, row, 20);
+  out->parent1 = get_be32(row + 20);
+  out->parent2 = get_be32(row + 24);
+  // The top 30 bits hold the generation, the low 2 the date's bits 32-33.
+  uint32_t word = get_be32(row + 28);
+  out->generation = word >> 2;
+  out->date = ((uint64_t)(word & 3) << 32) | get_be32(row + 32);
+}
+
+/* Function to count the parents listed in the EDGE chunk from start on
+* Returns -1 if the list runs past the end of the chunk.
+*/
+int commit_graph_edge_count(const commit_graph *g, uint32_t start) {
+  for (uint32_t i = start; i < g->num_edges; i++) {
+    if (get_be32(g->edges + (size_t)i * 4) & GRAPH_LAST_EDGE) {
+      return i - start + 1;
+    }
+  }
+  return -1;
+}
+
+uint32_t commit_graph_edge(const commit_graph *g, uint32_t index) {
+  return get_be32(g->edges + (size_t)index * 4) & ~GRAPH_LAST_EDGE;
+}
+
+/* The commits going into a new graph */
+typedef struct {
+  commit_node **list;
+  size_t nr;
+  size_t alloc;
+  int error;
+} graph_commits;
+
+static void push_commit(graph_commits *gc, commit_node *c) {
+  if (gc->nr == gc->alloc) {
+    gc->alloc = gc->alloc ? gc->alloc * 2 : 1024;
+    gc->list = realloc(gc->list, gc->alloc * sizeof(*gc->list));
+    if (!gc->list) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  gc->list[gc->nr++] = c;
+}
+
+// Refs to trees and blobs are skipped; tags are peeled.
+static int add_ref_tip(const char *ref, const sha1_t *sha, void *ctx) {
+  (void)ref;
+  graph_commits *gc = ctx;
+  commit_node *c = lookup_commit_reference(sha, 1);
+  if (c && !(c->flags & COMMIT_SEEN)) {
+    c->flags |= COMMIT_SEEN;
+    push_commit(gc, c);
+  }
+  return 0;
+}
+
+// Add every ancestor of the tips, which are already in the list.
+static int collect_ancestors(graph_commits *gc) {
+  for (size_t i = 0; i < gc->nr; i++) {
+    commit_node *c = gc->list[i];
+    for (uint32_t j = 0; j < c->nr_parents; j++) {
+      commit_node *p = c->parents[j];
+      if (p->flags & COMMIT_SEEN) {
+        continue;
+      }
+      if (parse_commit_node(p) != 0) {
+        return -1;
+      }
+      p->flags |= COMMIT_SEEN;
+      push_commit(gc, p);
+    }
+  }
+  return 0;
+}
+
+static int cmp_commit_sha(const void *a, const void *b) {
+  return memcmp((*(commit_node *const *)a)->sha.hash, (*(commit_node *const *)b)->sha.hash, 20);
+}
+
+static uint32_t graph_position(const graph_commits *gc, commit_node *c) {
+  commit_node **found = bsearch(&c, gc->list, gc->nr, sizeof(*gc->list), cmp_commit_sha);
+  return (uint32_t)(found - gc->list);
+}
+
+// Generation of a root is 1, else one more than the highest parent's.
+static uint32_t *compute_generations(const graph_commits *gc) {
+  uint32_t *gen = calloc(gc->nr ? gc->nr : 1, sizeof(*gen));
+  size_t alloc = 1024, nr = 0;
+  uint32_t *stack = malloc(alloc * sizeof(*stack));
+  if (!gen || !stack) {
+    perror("calloc");
+    exit(1);
+  }
+  for (size_t i = 0; i < gc->nr; i++) {
+    if (gen[i]) {
+      continue;
+    }
+    stack[nr++] = i;
+    while (nr) {
+      uint32_t top = stack[nr - 1];
+      commit_node *c = gc->list[top];
+      uint32_t max = 0;
+      int ready = 1;
+      for (uint32_t j = 0; j < c->nr_parents; j++) {
+        uint32_t pos = graph_position(gc, c->parents[j]);
+        if (gen[pos]) {
+          max = gen[pos] > max ? gen[pos] : max;
+          continue;
+        }
+        ready = 0;
+        if (nr == alloc) {
+          alloc *= 2;
+          stack = realloc(stack, alloc * sizeof(*stack));
+          if (!stack) {
+            perror("realloc");
+            exit(1);
+          }
+        }
+        stack[nr++] = pos;
+      }
+      if (ready) {
+        gen[top] = max < GENERATION_NUMBER_V1_MAX ? max + 1 : GENERATION_NUMBER_V1_MAX;
+        nr--;
+      }
+    }
+  }
+  free(stack);
+  return gen;
+}
+
+/* Function to write .git/objects/info/commit-graph for every commit
+* reachable from HEAD and the refs. Commits already in the old graph are
+* read from it.
+*/
+int write_commit_graph(void) {
+  graph_commits gc = {0};
+  sha1_t head;
+  if (read_ref("HEAD", &head) == 0) {
+    add_ref_tip("HEAD", &head, &gc);
+  }
+  if (for_each_ref("refs/", add_ref_tip, &gc) != 0 || collect_ancestors(&gc) != 0) {
+    free(gc.list);
+    return -1;
+  }
+  qsort(gc.list, gc.nr, sizeof(*gc.list), cmp_commit_sha);
+  uint32_t *gen = compute_generations(&gc);
+
+  uint32_t num_edges = 0;
+  for (size_t i = 0; i < gc.nr; i++) {
+    if (gc.list[i]->nr_parents > 2) {
+      num_edges += gc.list[i]->nr_parents - 1;
+    }
+  }
+  uint32_t chunk_ids[4] = { CHUNK_OIDF, CHUNK_OIDL, CHUNK_CDAT, CHUNK_EDGE };
+  uint64_t chunk_sizes[4] = { 256 * 4, gc.nr * 20, gc.nr * GRAPH_DATA_WIDTH, (uint64_t)num_edges * 4 };
+  int num_chunks = num_edges ? 4 : 3;
+
+  mkdir(OBJ_DIR "/info", 0755);
+  char tmp_path[512];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.lock", COMMIT_GRAPH_PATH);
+  FILE *f = fopen(tmp_path, "wb");
+  if (!f) {
+    perror("fopen commit-graph");
+    free(gc.list);
+    free(gen);
+    return -1;
+  }
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+  int err = 0;
+
+  unsigned char buf[GRAPH_DATA_WIDTH];
+  put_be32(buf, GRAPH_SIGNATURE);
+  buf[4] = GRAPH_VERSION;
+  buf[5] = GRAPH_HASH_VERSION;
+  buf[6] = (unsigned char)num_chunks;
+  buf[7] = 0; /* no base graphs */
+  err |= write_hashed(f, ctx, buf, GRAPH_HEADER_SIZE);
+
+  uint64_t offset = GRAPH_HEADER_SIZE + (uint64_t)(num_chunks + 1) * GRAPH_CHUNK_ENTRY_SIZE;
+  for (int i = 0; i <= num_chunks; i++) {
+    put_be32(buf, i < num_chunks ? chunk_ids[i] : 0);
+    put_be64(buf + 4, offset);
+    err |= write_hashed(f, ctx, buf, GRAPH_CHUNK_ENTRY_SIZE);
+    if (i < num_chunks) offset += chunk_sizes[i];
+  }
+
+  size_t count = 0;
+  for (int b = 0; b < 256; b++) {
+    while (count < gc.nr && gc.list[count]->sha.hash[0] == b) count++;
+    put_be32(buf, (uint32_t)count);
+    err |= write_hashed(f, ctx, buf, 4);
+  }
+  for (size_t i = 0; i < gc.nr; i++) {
+    err |= write_hashed(f, ctx, gc.list[i]->sha.hash, 20);
+  }
+  uint32_t edge = 0;
+  for (size_t i = 0; i < gc.nr; i++) {
+    commit_node *c = gc.list[i];
+    memcpy(buf, c->tree.hash, 20);
+    put_be32(buf + 20, c->nr_parents > 0 ? graph_position(&gc, c->parents[0]) : GRAPH_PARENT_NONE);
+    if (c->nr_parents > 2) {
+      put_be32(buf + 24, GRAPH_EXTRA_EDGES_NEEDED | edge);
+      edge += c->nr_parents - 1;
+    } else {
+      put_be32(buf + 24, c->nr_parents > 1 ? graph_position(&gc, c->parents[1]) : GRAPH_PARENT_NONE);
+    }
+    uint64_t date = c->date < (1ULL << 34) ? c->date : (1ULL << 34) - 1;
+    put_be32(buf + 28, gen[i] << 2 | (uint32_t)(date >> 32));
+    put_be32(buf + 32, (uint32_t)date);
+    err |= write_hashed(f, ctx, buf, GRAPH_DATA_WIDTH);
+  }
+  for (size_t i = 0; i < gc.nr; i++) {
+    commit_node *c = gc.list[i];
+    for (uint32_t j = 1; c->nr_parents > 2 && j < c->nr_parents; j++) {
+      uint32_t pos = graph_position(&gc, c->parents[j]);
+      put_be32(buf, j + 1 == c->nr_parents ? pos | GRAPH_LAST_EDGE : pos);
+      err |= write_hashed(f, ctx, buf, 4);
+    }
+  }
+
+  unsigned char checksum[20];
+  EVP_DigestFinal_ex(ctx, checksum, NULL);
+  EVP_MD_CTX_free(ctx);
+  err |= fwrite(checksum, 1, 20, f) != 20;
+  if (fclose(f) != 0) err = 1;
+  free(gc.list);
+  free(gen);
+
+  if (err || chmod(tmp_path, 0444) != 0 || rename(tmp_path, COMMIT_GRAPH_PATH) != 0) {
+    fprintf(stderr, "Failed to write %s\n", COMMIT_GRAPH_PATH);
+    remove(tmp_path);
+    return -1;
+  }
+  close_commit_graph();
+  return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+#include <stdint.h>
+#include "blob.h"
+
+#define COMMIT_GRAPH_PATH OBJ_DIR "/info/commit-graph"
+
+/* Parent fields of a CDAT row */
+#define GRAPH_PARENT_NONE 0x70000000
+#define GRAPH_EXTRA_EDGES_NEEDED 0x80000000
+#define GRAPH_LAST_EDGE 0x80000000
+
+/* Generations are stored in 30 bits */
+#define GENERATION_NUMBER_V1_MAX 0x3fffffff
+
+/* A mapped commit-graph file */
+typedef struct {
+  unsigned char *map;
+  size_t size;
+  uint32_t num_commits;
+  const unsigned char *fanout;
+  const unsigned char *oids;
+  const unsigned char *data;
+  const unsigned char *edges;
+  uint32_t num_edges;
+} commit_graph;
+
+/* One commit's row, decoded */
+typedef struct {
+  sha1_t tree;
+  uint32_t parent1;
+  uint32_t parent2;
+  uint32_t generation;
+  uint64_t date;
+} commit_graph_data;
+
+/* Function prototypes */
+commit_graph *get_commit_graph(void);
+void close_commit_graph(void);
+int commit_graph_find(const commit_graph *g, const sha1_t *sha, uint32_t *pos);
+void commit_graph_oid(const commit_graph *g, uint32_t pos, sha1_t *out);
+void commit_graph_data_at(const commit_graph *g, uint32_t pos, commit_graph_data *out);
+int commit_graph_edge_count(const commit_graph *g, uint32_t start);
+uint32_t commit_graph_edge(const commit_graph *g, uint32_t index);
+int write_commit_graph(void);
+
+#endif
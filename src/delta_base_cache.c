@@ -0,0 +1,196 @@
+/**
+* delta_base_cache.c - Cache of reconstructed delta bases
+* Siblings in a delta chain share their bases, so rebuilding them one by
+* one would inflate the same base objects again and again. Bases are kept
+* here keyed by (pack, offset) under a byte budget with LRU eviction.
+* Entries are pinned while a delta is applied against them; one whose
+* pack is closed meanwhile is detached and freed on its last release.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pack.h"
+
+#define DELTA_CACHE_BUCKETS 4096
+
+static delta_base_entry *buckets[DELTA_CACHE_BUCKETS];
+static delta_base_entry *lru_head; /* most recently used */
+static delta_base_entry *lru_tail; /* least recently used */
+static delta_base_cache_stats stats = { .limit = DELTA_BASE_CACHE_LIMIT };
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t bucket_of(const packed_git *p, uint64_t offset) {
+  uint64_t h = offset * 0x9e3779b97f4a7c15ULL ^ (uintptr_t)p;
+  return (h >> 20) % DELTA_CACHE_BUCKETS;
+}
+
+static void lru_unlink(delta_base_entry *e) {
+  if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+  else lru_head = e->lru_next;
+  if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+  else lru_tail = e->lru_prev;
+  e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(delta_base_entry *e) {
+  e->lru_prev = NULL;
+  e->lru_next = lru_head;
+  if (lru_head) lru_head->lru_prev = e;
+  lru_head = e;
+  if (!lru_tail) lru_tail = e;
+}
+
+// Take an entry out of the table and the LRU list, without freeing it.
+static void unlink_entry(delta_base_entry *e) {
+  delta_base_entry **pp = &buckets[bucket_of(e->pack, e->offset)];
+  while (*pp && *pp != e) {
+    pp = &(*pp)->hash_next;
+  }
+  if (*pp) *pp = e->hash_next;
+  lru_unlink(e);
+  stats.bytes -= e->size;
+  stats.entries--;
+}
+
+static void free_entry(delta_base_entry *e) {
+  free(e->data);
+  free(e);
+}
+
+static void remove_entry(delta_base_entry *e) {
+  unlink_entry(e);
+  free_entry(e);
+}
+
+static void evict_to_limit(void) {
+  delta_base_entry *e = lru_tail;
+  while (e && stats.bytes > stats.limit) {
+    delta_base_entry *prev = e->lru_prev;
+    if (e->refs == 0) {
+      remove_entry(e);
+      stats.evictions++;
+    }
+    e = prev;
+  }
+}
+
+void delta_base_cache_set_limit(size_t limit) {
+  pthread_mutex_lock(&lock);
+  stats.limit = limit;
+  evict_to_limit();
+  pthread_mutex_unlock(&lock);
+}
+
+/* Function to look up and pin the object at offset in pack p */
+delta_base_entry *delta_base_cache_get(const packed_git *p, uint64_t offset) {
+  pthread_mutex_lock(&lock);
+  delta_base_entry *e = buckets[bucket_of(p, offset)];
+  for (; e; e = e->hash_next) {
+    if (e->pack == p && e->offset == offset) {
+      stats.hits++;
+      e->refs++;
+      lru_unlink(e);
+      lru_push_front(e);
+      break;
+    }
+  }
+  if (!e) {
+    stats.misses++;
+  }
+  pthread_mutex_unlock(&lock);
+  return e;
+}
+
+/* Function to hand a reconstructed base to the cache
+* The cache takes ownership of data and returns the entry pinned. Objects
+* bigger than the whole budget are refused with NULL and stay with the
+* caller.
+*/
+delta_base_entry *delta_base_cache_put(const packed_git *p, uint64_t offset, int type, unsigned char *data, size_t size) {
+  delta_base_entry *e = calloc(1, sizeof(*e));
+  if (!e) {
+    return NULL;
+  }
+  e->pack = p;
+  e->offset = offset;
+  e->type = type;
+  e->data = data;
+  e->size = size;
+  e->refs = 1;
+
+  pthread_mutex_lock(&lock);
+  if (size > stats.limit) {
+    pthread_mutex_unlock(&lock);
+    free(e);
+    return NULL;
+  }
+  // Another reader may have rebuilt the same base meanwhile.
+  size_t b = bucket_of(p, offset);
+  for (delta_base_entry *old = buckets[b]; old; old = old->hash_next) {
+    if (old->pack == p && old->offset == offset && old->refs == 0) {
+      remove_entry(old);
+      break;
+    }
+  }
+  e->hash_next = buckets[b];
+  buckets[b] = e;
+  lru_push_front(e);
+  stats.entries++;
+  stats.bytes += size;
+  evict_to_limit();
+  pthread_mutex_unlock(&lock);
+  return e;
+}
+
+void delta_base_cache_release(delta_base_entry *e) {
+  if (!e) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  e->refs--;
+  if (e->refs == 0 && !e->pack) {
+    free_entry(e);
+  } else if (e->refs == 0 && stats.bytes > stats.limit) {
+    evict_to_limit();
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/* Function to drop every entry belonging to pack p, which is being closed
+* Pinned entries are detached rather than left keyed by a pointer that a
+* new pack may reuse; their last release frees them.
+*/
+void delta_base_cache_drop_pack(const packed_git *p) {
+  pthread_mutex_lock(&lock);
+  delta_base_entry *e = lru_head;
+  while (e) {
+    delta_base_entry *next = e->lru_next;
+    if (e->pack == p) {
+      unlink_entry(e);
+      if (e->refs == 0) {
+        free_entry(e);
+      } else {
+        e->pack = NULL;
+      }
+    }
+    e = next;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+delta_base_cache_stats delta_base_cache_get_stats(void) {
+  pthread_mutex_lock(&lock);
+  delta_base_cache_stats s = stats;
+  pthread_mutex_unlock(&lock);
+  return s;
+}
+
+void delta_base_cache_report(FILE *out) {
+  delta_base_cache_stats s = delta_base_cache_get_stats();
+  size_t lookups = s.hits + s.misses;
+  fprintf(out, "delta base cache: %zu hits, %zu misses (%.1f%% hit rate), %zu evictions, %zu entries, %zu/%zu bytes\n",
+          s.hits, s.misses, lookups ? 100.0 * s.hits / lookups : 0.0,
+          s.evictions, s.entries, s.bytes, s.limit);
+}
@@ -0,0 +1,63 @@
+/**
+* dir_scan.c - List directories relative to directory fds
+* Directories are opened with openat relative to their parent's fd, so the
+* kernel never resolves a full path again, and listed with getdents64
+* into one large buffer instead of readdir's entry at a time. Callers get
+* each entry's d_type, which lets them skip stat calls for directories.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include "dir_scan.h"
+
+/* The kernel's record layout for getdents64 */
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Function to open the directory path below dirfd (AT_FDCWD for the cwd)
+* Symlinks are not followed. Returns the fd, or -1 with errno set.
+*/
+int dir_scan_open(int dirfd, const char *path) {
+    return openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+/* Function to call fn for every entry of the directory open on fd
+* Stops at the first nonzero return of fn and passes it on; -1 if reading
+* the directory fails.
+*/
+int dir_scan(int fd, dir_scan_fn fn, void *ctx) {
+    char buf[DIR_SCAN_BUF] __attribute__((aligned(8)));
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("getdents64");
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        for (long pos = 0; pos < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+            pos += d->d_reclen;
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+                continue;
+            }
+            int ret = fn(ctx, d->d_name, d->d_type);
+            if (ret) {
+                return ret;
+            }
+        }
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef DIR_SCAN_H
+#define DIR_SCAN_H
+
+#include <stddef.h>
+
+/* Bytes of directory entries fetched per getdents64 call */
+#define DIR_SCAN_BUF (32 * 1024)
+
+/* Called for each entry but "." and ".."; d_type may be DT_UNKNOWN */
+typedef int (*dir_scan_fn)(void *ctx, const char *name, unsigned char d_type);
+
+/* Function prototypes */
+int dir_scan_open(int dirfd, const char *path);
+int dir_scan(int fd, dir_scan_fn fn, void *ctx);
+
+#endif
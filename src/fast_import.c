@@ -0,0 +1,1077 @@
+/**
+* fast_import.c - Load history from a fast-import stream
+* Reads the blob, commit, tag and reset commands of git's fast-import text
+* format and writes every new object into one pack, so importing a long
+* history costs neither a process nor a loose file per object. Branch
+* trees stay in memory between commits: a commit only rewrites the
+* directories its file changes touch, and directories that are not yet
+* in memory are loaded on demand, if need be from the pack being
+* written. Refs and the marks file are updated once the pack is
+* installed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include "fast_import.h"
+#include "pack.h"
+#include "object_writer.h"
+#include "tree_builder.h"
+
+typedef struct fi_tree fi_tree;
+
+/* One entry of a branch tree; directories get their contents when needed */
+typedef struct {
+    char *name;
+    uint32_t mode;
+    sha1_t sha;      /* stale while dirty */
+    int dirty;
+    fi_tree *tree;   /* NULL until the directory is loaded */
+} fi_entry;
+
+struct fi_tree {
+    fi_entry *entries;  /* sorted by name */
+    size_t nr;
+    size_t alloc;
+};
+
+typedef struct fi_branch {
+    char *ref;
+    sha1_t tip;
+    int has_tip;
+    fi_entry root;
+    struct fi_branch *next;
+} fi_branch;
+
+typedef struct {
+    uint64_t mark;  /* 0 = empty slot */
+    sha1_t sha;
+    int type;       /* OBJ_NONE if it came from a marks file */
+} fi_mark;
+
+typedef struct {
+    FILE *in;
+    char *line;
+    size_t line_alloc;
+    int pending;  /* line holds a command that was read ahead */
+    fi_mark *marks;
+    size_t marks_nr;
+    size_t marks_size;
+    fi_branch *branches;
+    pack_writer *pack;
+    char *export_marks;
+    int require_done;
+    size_t blobs;
+    size_t trees;
+    size_t commits;
+    size_t tags;
+} fi_state;
+
+static int fi_error(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "fatal: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    return -1;
+}
+
+static int is_null_sha(const sha1_t *sha) {
+    static const sha1_t null_sha;
+    return memcmp(sha->hash, null_sha.hash, 20) == 0;
+}
+
+// Read the next line of the stream without its LF; 0 at the end.
+static int read_line(fi_state *s) {
+    if (s->pending) {
+        s->pending = 0;
+        return 1;
+    }
+    ssize_t n = getline(&s->line, &s->line_alloc, s->in);
+    if (n < 0) {
+        return 0;
+    }
+    if (n && s->line[n - 1] == '\n') {
+        s->line[n - 1] = '\0';
+    }
+    return 1;
+}
+
+// Return the argument of an optional "<prefix>..." line, or NULL and
+// leave the line for the next reader.
+static char *optional_line(fi_state *s, const char *prefix) {
+    if (!read_line(s)) {
+        return NULL;
+    }
+    size_t len = strlen(prefix);
+    if (strncmp(s->line, prefix, len) == 0) {
+        return s->line + len;
+    }
+    s->pending = 1;
+    return NULL;
+}
+
+// Read a "data <count>" or "data <<<delim>" command and its payload.
+static int parse_data(fi_state *s, unsigned char **out, size_t *out_len) {
+    if (!read_line(s) || strncmp(s->line, "data ", 5) != 0) {
+        return fi_error("Expected 'data n' command, found: %s", s->line ? s->line : "");
+    }
+    const char *arg = s->line + 5;
+    if (strncmp(arg, "<<", 2) == 0) {
+        char *delim = strdup(arg + 2);
+        size_t len = 0, alloc = 0;
+        unsigned char *buf = NULL;
+        for (;;) {
+            if (!read_line(s)) {
+                free(delim);
+                free(buf);
+                return fi_error("EOF in data (terminator '%s' not found)", arg + 2);
+            }
+            if (strcmp(s->line, delim) == 0) {
+                break;
+            }
+            size_t n = strlen(s->line);
+            if (len + n + 2 > alloc) {
+                alloc = (len + n + 2) * 2;
+                buf = realloc(buf, alloc);
+                if (!buf) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            memcpy(buf + len, s->line, n);
+            len += n;
+            buf[len++] = '\n';
+        }
+        free(delim);
+        *out = buf ? buf : calloc(1, 1);
+        *out_len = len;
+        return 0;
+    }
+
+    char *end;
+    unsigned long long len = strtoull(arg, &end, 10);
+    if (*end || end == arg) {
+        return fi_error("Invalid data length: %s", arg);
+    }
+    unsigned char *buf = malloc(len + 1);
+    if (!buf) {
+        perror("malloc");
+        return -1;
+    }
+    if (fread(buf, 1, len, s->in) != len) {
+        free(buf);
+        return fi_error("EOF in data (%llu bytes remaining)", len);
+    }
+    // The payload may be followed by an optional LF.
+    int c = getc(s->in);
+    if (c != '\n' && c != EOF) {
+        ungetc(c, s->in);
+    }
+    *out = buf;
+    *out_len = len;
+    return 0;
+}
+
+static size_t mark_slot(const fi_state *s, uint64_t mark) {
+    return (mark * 0x9e3779b97f4a7c15ULL) >> 32 & (s->marks_size - 1);
+}
+
+static fi_mark *find_mark(const fi_state *s, uint64_t mark) {
+    if (!s->marks_size) {
+        return NULL;
+    }
+    for (size_t i = mark_slot(s, mark); s->marks[i].mark; i = (i + 1) & (s->marks_size - 1)) {
+        if (s->marks[i].mark == mark) {
+            return &s->marks[i];
+        }
+    }
+    return NULL;
+}
+
+static void set_mark(fi_state *s, uint64_t mark, const sha1_t *sha, int type) {
+    fi_mark *m = find_mark(s, mark);
+    if (!m) {
+        if ((s->marks_nr + 1) * 2 > s->marks_size) {
+            fi_mark *old = s->marks;
+            size_t old_size = s->marks_size;
+            s->marks_size = old_size ? old_size * 2 : 1024;
+            s->marks = calloc(s->marks_size, sizeof(*s->marks));
+            if (!s->marks) {
+                perror("calloc");
+                exit(1);
+            }
+            for (size_t i = 0; i < old_size; i++) {
+                if (old[i].mark) {
+                    size_t slot = mark_slot(s, old[i].mark);
+                    while (s->marks[slot].mark) slot = (slot + 1) & (s->marks_size - 1);
+                    s->marks[slot] = old[i];
+                }
+            }
+            free(old);
+        }
+        size_t slot = mark_slot(s, mark);
+        while (s->marks[slot].mark) slot = (slot + 1) & (s->marks_size - 1);
+        m = &s->marks[slot];
+        m->mark = mark;
+        s->marks_nr++;
+    }
+    m->sha = *sha;
+    m->type = type;
+}
+
+static int parse_mark(fi_state *s, uint64_t *mark) {
+    *mark = 0;
+    const char *arg = optional_line(s, "mark :");
+    if (arg) {
+        char *end;
+        *mark = strtoull(arg, &end, 10);
+        if (*end || end == arg || !*mark) {
+            return fi_error("Invalid mark: :%s", arg);
+        }
+    }
+    return 0;
+}
+
+static fi_branch *lookup_branch(fi_state *s, const char *ref) {
+    for (fi_branch *b = s->branches; b; b = b->next) {
+        if (strcmp(b->ref, ref) == 0) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static fi_branch *get_branch(fi_state *s, const char *ref) {
+    fi_branch *b = lookup_branch(s, ref);
+    if (!b) {
+        b = calloc(1, sizeof(*b));
+        if (!b || !(b->ref = strdup(ref))) {
+            perror("calloc");
+            exit(1);
+        }
+        b->root.mode = S_IFDIR;
+        b->next = s->branches;
+        s->branches = b;
+    }
+    return b;
+}
+
+static int copy_object(const object_span *obj, void *ctx) {
+    object_span *copy = ctx;
+    unsigned char *data = malloc(obj->size + 1);
+    if (!data) {
+        perror("malloc");
+        return -1;
+    }
+    memcpy(data, obj->data, obj->size);
+    data[obj->size] = '\0';
+    memcpy(copy->type, obj->type, sizeof(copy->type));
+    copy->data = data;
+    copy->size = obj->size;
+    return 0;
+}
+
+// Read an object from the pack being written, or else the repository.
+static int read_object_copy(fi_state *s, const sha1_t *sha, int *type, unsigned char **data, size_t *size) {
+    int ret = s->pack ? pack_writer_read(s->pack, sha, type, data, size) : 1;
+    if (ret != 1) {
+        return ret;
+    }
+    char hex[41];
+    sha1_to_hex(sha, hex);
+    object_span copy = {0};
+    if (visit_git_object(hex, copy_object, &copy) != 0) {
+        return -1;
+    }
+    *type = type_from_name(copy.type);
+    *data = (unsigned char *)copy.data;
+    *size = copy.size;
+    return 0;
+}
+
+// Resolve ":<mark>", a full object id, or a ref for from and merge lines.
+static int resolve_object(fi_state *s, const char *arg, sha1_t *out, int *type) {
+    if (arg[0] == ':') {
+        char *end;
+        fi_mark *m = find_mark(s, strtoull(arg + 1, &end, 10));
+        if (*end || !m) {
+            return fi_error("mark %s not declared", arg);
+        }
+        *out = m->sha;
+        *type = m->type;
+        return 0;
+    }
+    *type = OBJ_NONE;
+    if (strlen(arg) == 40 && hex_to_sha1(arg, out) == 0) {
+        return 0;
+    }
+    fi_branch *b = lookup_branch(s, arg);
+    if (b && b->has_tip) {
+        *out = b->tip;
+        return 0;
+    }
+    // A ref of the repository that the stream has not touched.
+    char path[PATH_MAX], hex[64];
+    snprintf(path, sizeof(path), ".git/%s", arg);
+    FILE *f = strncmp(arg, "refs/", 5) == 0 ? fopen(path, "r") : NULL;
+    int found = f && fgets(hex, sizeof(hex), f) && hex_to_sha1(hex, out) == 0;
+    if (f) {
+        fclose(f);
+    }
+    return found ? 0 : fi_error("Invalid ref name or SHA1 expression: %s", arg);
+}
+
+static void free_tree(fi_tree *t) {
+    if (!t) {
+        return;
+    }
+    for (size_t i = 0; i < t->nr; i++) {
+        free(t->entries[i].name);
+        free_tree(t->entries[i].tree);
+    }
+    free(t->entries);
+    free(t);
+}
+
+static int compare_fi_entries(const void *a, const void *b) {
+    return strcmp(((const fi_entry *)a)->name, ((const fi_entry *)b)->name);
+}
+
+static fi_entry *tree_append(fi_tree *t) {
+    if (t->nr == t->alloc) {
+        size_t alloc = t->alloc ? t->alloc * 2 : 8;
+        fi_entry *entries = realloc(t->entries, alloc * sizeof(*entries));
+        if (!entries) {
+            perror("realloc");
+            exit(1);
+        }
+        t->entries = entries;
+        t->alloc = alloc;
+    }
+    fi_entry *e = &t->entries[t->nr++];
+    memset(e, 0, sizeof(*e));
+    return e;
+}
+
+// Give dir its entries, read from its tree object unless it is new.
+static int load_tree(fi_state *s, fi_entry *dir) {
+    if (dir->tree) {
+        return 0;
+    }
+    fi_tree *t = calloc(1, sizeof(*t));
+    if (!t) {
+        perror("calloc");
+        return -1;
+    }
+    dir->tree = t;
+    if (is_null_sha(&dir->sha)) {
+        return 0;
+    }
+    int type;
+    unsigned char *data;
+    size_t size;
+    if (read_object_copy(s, &dir->sha, &type, &data, &size) != 0) {
+        return -1;
+    }
+    char hex[41];
+    sha1_to_hex(&dir->sha, hex);
+    const unsigned char *p = data, *end = data + size;
+    while (type == OBJ_TREE && p < end) {
+        char *name;
+        uint32_t mode = strtoul((const char *)p, &name, 8);
+        const unsigned char *nul = *name == ' ' ? memchr(name, '\0', end - (unsigned char *)name) : NULL;
+        if (!nul || nul + 21 > end) {
+            break;
+        }
+        fi_entry *e = tree_append(t);
+        e->name = strdup(name + 1);
+        e->mode = mode;
+        memcpy(e->sha.hash, nul + 1, 20);
+        p = nul + 21;
+    }
+    free(data);
+    if (type != OBJ_TREE || p != end) {
+        return fi_error("Not a valid tree: %s", hex);
+    }
+    // Lookups go by plain name; git's own order differs for directories.
+    qsort(t->entries, t->nr, sizeof(*t->entries), compare_fi_entries);
+    return 0;
+}
+
+// Find name[0..len) in t; *pos is where it is or would be inserted.
+static fi_entry *tree_lookup(fi_tree *t, const char *name, size_t len, size_t *pos) {
+    size_t lo = 0, hi = t->nr;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const char *other = t->entries[mid].name;
+        int cmp = strncmp(other, name, len);
+        if (cmp == 0 && other[len]) {
+            cmp = 1;
+        }
+        if (cmp == 0) {
+            *pos = mid;
+            return &t->entries[mid];
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *pos = lo;
+    return NULL;
+}
+
+// Put mode and sha at path below dir, creating directories on the way.
+static int tree_set(fi_state *s, fi_entry *dir, const char *path, uint32_t mode, const sha1_t *sha) {
+    if (load_tree(s, dir) != 0) {
+        return -1;
+    }
+    const char *slash = strchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : strlen(path);
+    if (len == 0) {
+        return fi_error("Empty path component found in input");
+    }
+    fi_tree *t = dir->tree;
+    size_t pos;
+    fi_entry *e = tree_lookup(t, path, len, &pos);
+    if (!e) {
+        tree_append(t);
+        memmove(&t->entries[pos + 1], &t->entries[pos], (t->nr - 1 - pos) * sizeof(*e));
+        e = &t->entries[pos];
+        memset(e, 0, sizeof(*e));
+        if (!(e->name = strndup(path, len))) {
+            perror("strndup");
+            return -1;
+        }
+    }
+    dir->dirty = 1;
+    if (slash) {
+        // A file in the way becomes a directory.
+        if (!S_ISDIR(e->mode)) {
+            e->mode = S_IFDIR;
+            memset(&e->sha, 0, sizeof(e->sha));
+        }
+        return tree_set(s, e, slash + 1, mode, sha);
+    }
+    free_tree(e->tree);
+    e->tree = NULL;
+    e->mode = mode;
+    e->sha = *sha;
+    e->dirty = 0;
+    return 0;
+}
+
+static int tree_delete(fi_state *s, fi_entry *dir, const char *path) {
+    if (load_tree(s, dir) != 0) {
+        return -1;
+    }
+    const char *slash = strchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : strlen(path);
+    fi_tree *t = dir->tree;
+    size_t pos;
+    fi_entry *e = tree_lookup(t, path, len, &pos);
+    if (!e || (slash && !S_ISDIR(e->mode))) {
+        return 0;
+    }
+    if (slash) {
+        int ret = tree_delete(s, e, slash + 1);
+        if (ret > 0) {
+            dir->dirty = 1;
+        }
+        return ret;
+    }
+    free(e->name);
+    free_tree(e->tree);
+    memmove(e, e + 1, (t->nr - 1 - pos) * sizeof(*e));
+    t->nr--;
+    dir->dirty = 1;
+    return 1;
+}
+
+// Write the trees of every changed directory below dir, deepest first.
+// Directories left empty disappear from their parent, as in git.
+static int store_tree(fi_state *s, fi_entry *dir, int keep_empty, int *empty) {
+    *empty = 0;
+    if (!dir->dirty && !is_null_sha(&dir->sha)) {
+        return 0;
+    }
+    if (load_tree(s, dir) != 0) {
+        return -1;
+    }
+    tree_builder tb;
+    tree_builder_init(&tb);
+    fi_tree *t = dir->tree;
+    for (size_t i = 0; i < t->nr; i++) {
+        fi_entry *e = &t->entries[i];
+        if (S_ISDIR(e->mode)) {
+            int sub_empty;
+            if (store_tree(s, e, 0, &sub_empty) != 0) {
+                tree_builder_release(&tb);
+                return -1;
+            }
+            if (sub_empty) {
+                continue;
+            }
+        }
+        tree_entry *te = tree_builder_add(&tb, e->name, strlen(e->name));
+        snprintf(te->mode, sizeof(te->mode), "%o", e->mode);
+        te->sha = e->sha;
+    }
+    int ret = 0;
+    if (tb.nr == 0 && !keep_empty) {
+        memset(&dir->sha, 0, sizeof(dir->sha));
+        *empty = 1;
+    } else {
+        ret = tree_builder_write(&tb, &dir->sha);
+        s->trees++;
+    }
+    tree_builder_release(&tb);
+    dir->dirty = 0;
+    return ret;
+}
+
+// Start b over from the tree of commit, or from an empty tree.
+static int reset_branch_tree(fi_state *s, fi_branch *b, const sha1_t *commit) {
+    free_tree(b->root.tree);
+    b->root.tree = NULL;
+    b->root.dirty = 0;
+    memset(&b->root.sha, 0, sizeof(b->root.sha));
+    if (!commit) {
+        return 0;
+    }
+    // Other branches know the trees of their own tips.
+    for (fi_branch *o = s->branches; o; o = o->next) {
+        if (o->has_tip && !o->root.dirty && !is_null_sha(&o->root.sha) &&
+            memcmp(o->tip.hash, commit->hash, 20) == 0) {
+            b->root.sha = o->root.sha;
+            return 0;
+        }
+    }
+    int type;
+    unsigned char *data;
+    size_t size;
+    if (read_object_copy(s, commit, &type, &data, &size) != 0) {
+        return -1;
+    }
+    int ok = type == OBJ_COMMIT && size > 45 && strncmp((char *)data, "tree ", 5) == 0 &&
+             hex_to_sha1((char *)data + 5, &b->root.sha) == 0;
+    free(data);
+    if (!ok) {
+        char hex[41];
+        sha1_to_hex(commit, hex);
+        return fi_error("Not a commit: %s", hex);
+    }
+    return 0;
+}
+
+static int parse_blob(fi_state *s) {
+    uint64_t mark;
+    unsigned char *data;
+    size_t len;
+    if (parse_mark(s, &mark) != 0) {
+        return -1;
+    }
+    optional_line(s, "original-oid ");
+    if (parse_data(s, &data, &len) != 0) {
+        return -1;
+    }
+    sha1_t sha;
+    int ret = write_object("blob", data, len, &sha);
+    free(data);
+    if (ret != 0) {
+        return -1;
+    }
+    if (mark) {
+        set_mark(s, mark, &sha, OBJ_BLOB);
+    }
+    s->blobs++;
+    return 0;
+}
+
+static uint32_t parse_mode(const char *arg, char **end) {
+    uint32_t mode = strtoul(arg, end, 8);
+    switch (mode) {
+    case 0644: case 0100644: return 0100644;
+    case 0755: case 0100755: return 0100755;
+    case 0120000: case 040000: case 0160000: return mode;
+    default: return 0;
+    }
+}
+
+// "M <mode> <dataref> <path>", where dataref may be "inline".
+static int file_modify(fi_state *s, fi_branch *b, char *arg) {
+    char *p;
+    uint32_t mode = parse_mode(arg, &p);
+    if (!mode || *p != ' ') {
+        return fi_error("Corrupt mode: M %s", arg);
+    }
+    char *ref = p + 1, *path = strchr(ref, ' ');
+    if (!path) {
+        return fi_error("Missing space after SHA1: M %s", arg);
+    }
+    *path++ = '\0';
+    path = strdup(path);
+    if (!path || unquote_c_path(path) != 0) {
+        free(path);
+        return fi_error("Invalid path: M %s", arg);
+    }
+    sha1_t sha;
+    int ret = 0;
+    if (strcmp(ref, "inline") == 0) {
+        unsigned char *data;
+        size_t len;
+        if (S_ISDIR(mode) || mode == 0160000) {
+            ret = fi_error("Tree and submodule entries can not be inline: %s", path);
+        } else if ((ret = parse_data(s, &data, &len)) == 0) {
+            ret = write_object("blob", data, len, &sha);
+            free(data);
+            s->blobs++;
+        }
+    } else {
+        // Marks know their type; plain ids are taken on trust.
+        int type, want = S_ISDIR(mode) ? OBJ_TREE : OBJ_BLOB;
+        ret = resolve_object(s, ref, &sha, &type);
+        if (ret == 0 && mode != 0160000 && type != OBJ_NONE && type != want) {
+            ret = fi_error("Not a %s (actually a %s): M %s", type_name(want), type_name(type), arg);
+        }
+    }
+    if (ret == 0) {
+        // An id for a directory replaces whatever the branch had there.
+        ret = tree_set(s, &b->root, path, mode, &sha);
+    }
+    free(path);
+    return ret;
+}
+
+static int parse_commit(fi_state *s, const char *ref) {
+    fi_branch *b = get_branch(s, ref);
+    uint64_t mark;
+    if (parse_mark(s, &mark) != 0) {
+        return -1;
+    }
+    optional_line(s, "original-oid ");
+    char *author = optional_line(s, "author ");
+    author = author ? strdup(author) : NULL;
+    char *committer = optional_line(s, "committer ");
+    if (!committer) {
+        free(author);
+        return fi_error("Expected committer but didn't get one");
+    }
+    committer = strdup(committer);
+    char *encoding = optional_line(s, "encoding ");
+    encoding = encoding ? strdup(encoding) : NULL;
+
+    unsigned char *msg = NULL;
+    size_t msg_len = 0, nr_parents = 0, alloc_parents = 0;
+    sha1_t *parents = NULL;
+    int ret = parse_data(s, &msg, &msg_len);
+    if (ret == 0 && b->has_tip) {
+        parents = malloc(sizeof(*parents));
+        alloc_parents = 1;
+        parents[nr_parents++] = b->tip;
+    }
+
+    char *arg;
+    if (ret == 0 && (arg = optional_line(s, "from "))) {
+        sha1_t from;
+        int type;
+        nr_parents = 0;
+        ret = resolve_object(s, arg, &from, &type);
+        // Continuing from the current tip keeps the tree in memory.
+        if (ret == 0 && (!b->has_tip || memcmp(from.hash, b->tip.hash, 20) != 0)) {
+            ret = reset_branch_tree(s, b, &from);
+        }
+        if (ret == 0) {
+            if (!parents) {
+                parents = malloc(sizeof(*parents));
+                alloc_parents = 1;
+            }
+            parents[nr_parents++] = from;
+        }
+    }
+    while (ret == 0 && (arg = optional_line(s, "merge "))) {
+        int type;
+        if (nr_parents == alloc_parents) {
+            alloc_parents = alloc_parents ? alloc_parents * 2 : 2;
+            parents = realloc(parents, alloc_parents * sizeof(*parents));
+            if (!parents) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        ret = resolve_object(s, arg, &parents[nr_parents++], &type);
+    }
+
+    // File changes run to the first line that is not one.
+    while (ret == 0 && read_line(s)) {
+        if (strncmp(s->line, "M ", 2) == 0) {
+            ret = file_modify(s, b, s->line + 2);
+        } else if (strncmp(s->line, "D ", 2) == 0) {
+            char *path = s->line + 2;
+            if (unquote_c_path(path) != 0) {
+                ret = fi_error("Invalid path: D %s", path);
+            } else {
+                ret = tree_delete(s, &b->root, path) < 0 ? -1 : 0;
+            }
+        } else if (strcmp(s->line, "deleteall") == 0) {
+            free_tree(b->root.tree);
+            b->root.tree = NULL;
+            memset(&b->root.sha, 0, sizeof(b->root.sha));
+            b->root.dirty = 1;
+        } else if (s->line[0] == '#') {
+            continue;
+        } else if (strncmp(s->line, "C ", 2) == 0 || strncmp(s->line, "R ", 2) == 0 ||
+                   strncmp(s->line, "N ", 2) == 0 || strncmp(s->line, "ls ", 3) == 0) {
+            ret = fi_error("Unsupported file command: %s", s->line);
+        } else {
+            s->pending = s->line[0] != '\0';
+            break;
+        }
+    }
+
+    int empty;
+    if (ret == 0) {
+        ret = store_tree(s, &b->root, 1, &empty);
+    }
+    if (ret == 0) {
+        size_t size = 128 + 48 * nr_parents + (author ? strlen(author) : strlen(committer)) +
+                      strlen(committer) + (encoding ? strlen(encoding) : 0) + msg_len;
+        char *buf = malloc(size);
+        if (!buf) {
+            perror("malloc");
+            exit(1);
+        }
+        char hex[41];
+        sha1_to_hex(&b->root.sha, hex);
+        int len = sprintf(buf, "tree %s\n", hex);
+        for (size_t i = 0; i < nr_parents; i++) {
+            sha1_to_hex(&parents[i], hex);
+            len += sprintf(buf + len, "parent %s\n", hex);
+        }
+        len += sprintf(buf + len, "author %s\ncommitter %s\n", author ? author : committer, committer);
+        if (encoding) {
+            len += sprintf(buf + len, "encoding %s\n", encoding);
+        }
+        buf[len++] = '\n';
+        memcpy(buf + len, msg, msg_len);
+        ret = write_object("commit", buf, len + msg_len, &b->tip);
+        free(buf);
+    }
+    if (ret == 0) {
+        b->has_tip = 1;
+        if (mark) {
+            set_mark(s, mark, &b->tip, OBJ_COMMIT);
+        }
+        s->commits++;
+    }
+    free(author);
+    free(committer);
+    free(encoding);
+    free(parents);
+    free(msg);
+    return ret;
+}
+
+static int parse_tag(fi_state *s, const char *name) {
+    char ref[PATH_MAX];
+    snprintf(ref, sizeof(ref), "refs/tags/%s", name);
+    char *tag_name = strdup(name);
+    uint64_t mark;
+    sha1_t object;
+    int type = OBJ_NONE, ret = parse_mark(s, &mark);
+    char *arg = ret == 0 ? optional_line(s, "from ") : NULL;
+    if (ret == 0 && !arg) {
+        ret = fi_error("Expected from command, got %s", s->line ? s->line : "");
+    }
+    if (ret == 0) {
+        ret = resolve_object(s, arg, &object, &type);
+    }
+    if (ret == 0 && type == OBJ_NONE) {
+        unsigned char *data;
+        size_t size;
+        if ((ret = read_object_copy(s, &object, &type, &data, &size)) == 0) {
+            free(data);
+        }
+    }
+    char *tagger = NULL;
+    unsigned char *msg = NULL;
+    size_t msg_len = 0;
+    if (ret == 0) {
+        optional_line(s, "original-oid ");
+        tagger = optional_line(s, "tagger ");
+        tagger = tagger ? strdup(tagger) : NULL;
+        ret = parse_data(s, &msg, &msg_len);
+    }
+    sha1_t sha;
+    if (ret == 0) {
+        size_t size = 128 + strlen(tag_name) + (tagger ? strlen(tagger) : 0) + msg_len;
+        char *buf = malloc(size);
+        if (!buf) {
+            perror("malloc");
+            exit(1);
+        }
+        char hex[41];
+        sha1_to_hex(&object, hex);
+        int len = sprintf(buf, "object %s\ntype %s\ntag %s\n", hex, type_name(type), tag_name);
+        if (tagger) {
+            len += sprintf(buf + len, "tagger %s\n", tagger);
+        }
+        buf[len++] = '\n';
+        memcpy(buf + len, msg, msg_len);
+        ret = write_object("tag", buf, len + msg_len, &sha);
+        free(buf);
+    }
+    if (ret == 0) {
+        fi_branch *b = get_branch(s, ref);
+        b->tip = sha;
+        b->has_tip = 1;
+        if (mark) {
+            set_mark(s, mark, &sha, OBJ_TAG);
+        }
+        s->tags++;
+    }
+    free(tag_name);
+    free(tagger);
+    free(msg);
+    return ret;
+}
+
+static int parse_reset(fi_state *s, const char *ref) {
+    fi_branch *b = get_branch(s, ref);
+    const char *arg = optional_line(s, "from ");
+    if (!arg) {
+        b->has_tip = 0;
+        return reset_branch_tree(s, b, NULL);
+    }
+    int type;
+    sha1_t from;
+    if (resolve_object(s, arg, &from, &type) != 0) {
+        return -1;
+    }
+    if (b->has_tip && memcmp(from.hash, b->tip.hash, 20) == 0) {
+        return 0;
+    }
+    b->tip = from;
+    b->has_tip = 1;
+    return type == OBJ_COMMIT || type == OBJ_NONE ? reset_branch_tree(s, b, &from) : 0;
+}
+
+static int import_marks(fi_state *s, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return fi_error("cannot read '%s': %s", path, strerror(errno));
+    }
+    char line[128];
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f)) {
+        char *end;
+        uint64_t mark = strtoull(line + 1, &end, 10);
+        sha1_t sha;
+        if (line[0] != ':' || !mark || *end != ' ' || hex_to_sha1(end + 1, &sha) != 0) {
+            ret = fi_error("corrupt mark line: %s", line);
+        } else {
+            set_mark(s, mark, &sha, OBJ_NONE);
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+static int compare_marks(const void *a, const void *b) {
+    uint64_t x = ((const fi_mark *)a)->mark, y = ((const fi_mark *)b)->mark;
+    return x < y ? -1 : x > y;
+}
+
+static int export_marks(fi_state *s, const char *path) {
+    char lock[PATH_MAX];
+    snprintf(lock, sizeof(lock), "%s.lock", path);
+    FILE *f = fopen(lock, "w");
+    if (!f) {
+        return fi_error("cannot write '%s': %s", lock, strerror(errno));
+    }
+    fi_mark *sorted = malloc((s->marks_nr ? s->marks_nr : 1) * sizeof(*sorted));
+    if (!sorted) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < s->marks_size; i++) {
+        if (s->marks[i].mark) {
+            sorted[n++] = s->marks[i];
+        }
+    }
+    qsort(sorted, n, sizeof(*sorted), compare_marks);
+    for (size_t i = 0; i < n; i++) {
+        char hex[41];
+        sha1_to_hex(&sorted[i].sha, hex);
+        fprintf(f, ":%llu %s\n", (unsigned long long)sorted[i].mark, hex);
+    }
+    free(sorted);
+    if (fclose(f) != 0 || rename(lock, path) != 0) {
+        unlink(lock);
+        return fi_error("cannot write '%s': %s", path, strerror(errno));
+    }
+    return 0;
+}
+
+// Point ref at sha through a lock file, creating directories on the way.
+static int write_ref(const char *ref, const sha1_t *sha) {
+    char path[PATH_MAX], lock[PATH_MAX + 8];
+    snprintf(path, sizeof(path), ".git/%s", ref);
+    for (char *p = strchr(path + 5, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            perror(path);
+            return -1;
+        }
+        *p = '/';
+    }
+    snprintf(lock, sizeof(lock), "%s.lock", path);
+    FILE *f = fopen(lock, "w");
+    if (!f) {
+        perror(lock);
+        return -1;
+    }
+    char hex[41];
+    sha1_to_hex(sha, hex);
+    fprintf(f, "%s\n", hex);
+    if (fclose(f) != 0 || rename(lock, path) != 0) {
+        perror(path);
+        unlink(lock);
+        return -1;
+    }
+    return 0;
+}
+
+// Install the pack, then let refs and marks point into it.
+static int finish_pack(fi_state *s) {
+    object_writer_set_pack(NULL);
+    sha1_t pack_sha;
+    int ret = pack_writer_finish(s->pack, object_writer_fsync_enabled(), &pack_sha);
+    s->pack = NULL;
+    if (ret < 0) {
+        return -1;
+    }
+    reprepare_packed_git();
+    for (fi_branch *b = s->branches; b; b = b->next) {
+        if (b->has_tip && write_ref(b->ref, &b->tip) != 0) {
+            return -1;
+        }
+    }
+    return s->export_marks ? export_marks(s, s->export_marks) : 0;
+}
+
+static int start_pack(fi_state *s) {
+    if (!(s->pack = pack_writer_begin())) {
+        return -1;
+    }
+    object_writer_set_pack(s->pack);
+    return 0;
+}
+
+static int parse_feature(fi_state *s, const char *feature, const fast_import_options *opts) {
+    if (strcmp(feature, "done") == 0) {
+        s->require_done = 1;
+    } else if (strncmp(feature, "import-marks=", 13) == 0) {
+        // Marks named on the command line take precedence.
+        return opts->import_marks ? 0 : import_marks(s, feature + 13);
+    } else if (strncmp(feature, "export-marks=", 13) == 0) {
+        if (!opts->export_marks) {
+            free(s->export_marks);
+            s->export_marks = strdup(feature + 13);
+        }
+    } else if (strcmp(feature, "date-format=raw") != 0 && strcmp(feature, "force") != 0) {
+        return fi_error("This version of fast-import does not support feature %s.", feature);
+    }
+    return 0;
+}
+
+static int run_commands(fi_state *s, const fast_import_options *opts) {
+    int ret = 0, done = 0;
+    while (ret == 0 && !done && read_line(s)) {
+        char *line = s->line;
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        char *arg = NULL;
+        if (strcmp(line, "blob") == 0) {
+            ret = parse_blob(s);
+        } else if (strncmp(line, "commit ", 7) == 0) {
+            arg = strdup(line + 7);
+            ret = parse_commit(s, arg);
+        } else if (strncmp(line, "tag ", 4) == 0) {
+            arg = strdup(line + 4);
+            ret = parse_tag(s, arg);
+        } else if (strncmp(line, "reset ", 6) == 0) {
+            arg = strdup(line + 6);
+            ret = parse_reset(s, arg);
+        } else if (strncmp(line, "progress ", 9) == 0) {
+            printf("%s\n", line);
+        } else if (strcmp(line, "checkpoint") == 0) {
+            ret = finish_pack(s) == 0 && start_pack(s) == 0 ? 0 : -1;
+        } else if (strncmp(line, "feature ", 8) == 0) {
+            ret = parse_feature(s, line + 8, opts);
+        } else if (strncmp(line, "option ", 7) == 0) {
+            // Importer options do not change what is stored.
+        } else if (strcmp(line, "done") == 0) {
+            done = 1;
+        } else {
+            ret = fi_error("Unsupported command: %s", line);
+        }
+        free(arg);
+    }
+    if (ret == 0 && s->require_done && !done) {
+        ret = fi_error("stream ends early");
+    }
+    return ret;
+}
+
+/* Function to import the stream in and store its objects in one pack
+* Branches, tags and marks are written after the pack is in place.
+* Returns 0 on success, -1 if the stream or a write failed; no refs are
+* changed then.
+*/
+int fast_import(FILE *in, const fast_import_options *opts) {
+    fi_state s = {.in = in};
+    if (opts->export_marks) {
+        s.export_marks = strdup(opts->export_marks);
+    }
+    int ret = opts->import_marks ? import_marks(&s, opts->import_marks) : 0;
+    if (ret == 0) {
+        ret = start_pack(&s);
+    }
+    if (ret == 0) {
+        ret = run_commands(&s, opts);
+    }
+    if (ret == 0) {
+        ret = finish_pack(&s);
+    }
+    if (s.pack) {
+        object_writer_set_pack(NULL);
+        pack_writer_abort(s.pack);
+    }
+    if (ret == 0 && !opts->quiet) {
+        object_writer_stats stats = object_writer_get_stats();
+        fprintf(stderr, "fast-import: %zu blobs, %zu trees, %zu commits, %zu tags\n",
+                s.blobs, s.trees, s.commits, s.tags);
+        fprintf(stderr, "fast-import: %zu objects packed, %zu already present\n",
+                stats.objects_written, stats.objects_skipped);
+    }
+
+    while (s.branches) {
+        fi_branch *b = s.branches;
+        s.branches = b->next;
+        free_tree(b->root.tree);
+        free(b->ref);
+        free(b);
+    }
+    free(s.marks);
+    free(s.export_marks);
+    free(s.line);
+    return ret;
+}
@@ -0,0 +1,15 @@
+#ifndef FAST_IMPORT_H
+#define FAST_IMPORT_H
+
+#include <stdio.h>
+
+typedef struct {
+    const char *import_marks;  /* ":<mark> <sha>" lines read before the stream */
+    const char *export_marks;  /* written once the pack is installed */
+    int quiet;                 /* no statistics on stderr */
+} fast_import_options;
+
+/* Function prototypes */
+int fast_import(FILE *in, const fast_import_options *opts);
+
+#endif
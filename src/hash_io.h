@@ -0,0 +1,33 @@
+#ifndef HASH_IO_H
+#define HASH_IO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+/* Big-endian fields of the on-disk formats, read and written bytewise so
+ * that mapped tables need no particular alignment */
+static inline uint32_t get_be32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint64_t get_be64(const unsigned char *p) {
+  return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static inline void put_be32(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static inline void put_be64(unsigned char *p, uint64_t v) {
+  put_be32(p, (uint32_t)(v >> 32));
+  put_be32(p + 4, (uint32_t)v);
+}
+
+/* Write data to a file whose trailing checksum covers it; returns -1 on a short write */
+static inline int write_hashed(FILE *f, EVP_MD_CTX *ctx, const void *data, size_t len) {
+  EVP_DigestUpdate(ctx, data, len);
+  return fwrite(data, 1, len, f) == len ? 0 : -1;
+}
+
+#endif
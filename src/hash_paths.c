@@ -0,0 +1,387 @@
+/**
+* hash_paths.c - hash-object --stdin-paths
+* Paths arrive on stdin, one per line or NUL terminated, and one id is
+* printed per path, in order. The work runs as a pipeline of three stages
+* passing batches of files along: a reader thread takes paths and reads
+* small files into the batch's buffer, the calling thread hashes a whole
+* batch at once with sha1_object_batch, and a writer thread compresses and
+* stores the new objects and then prints the ids, so no id is out before
+* its object is on disk. Large files are streamed by the hashing stage
+* instead. A fixed set of batches circulates between
+* the stages, so buffers are reused and memory stays bounded. On a single
+* CPU the stages simply run one after another on the calling thread.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include "hash_paths.h"
+#include "sha1_engine.h"
+
+/* One file of a batch */
+typedef struct {
+    char *path;
+    int streamed;       /* too large to read whole; hashed from the file */
+    size_t offset;      /* of the content in the batch buffer */
+    size_t len;
+    sha1_t sha;
+} hash_item;
+
+typedef struct {
+    hash_item items[BLOB_BATCH_OBJECTS];
+    size_t nr;
+    unsigned char *buf;  /* contents of the files read whole */
+    size_t used;
+    size_t hashed;       /* items with an id, up to any error */
+    int failed;          /* the reader stopped at an error after these items */
+} hash_batch;
+
+/* A blocking queue of batches; NULL marks the end of input */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    hash_batch *slots[HASH_PATHS_BATCHES + 1];
+    size_t head;
+    size_t nr;
+} batch_queue;
+
+static void queue_init(batch_queue *q) {
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->head = q->nr = 0;
+}
+
+static void queue_destroy(batch_queue *q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+}
+
+static void queue_push(batch_queue *q, hash_batch *b) {
+    pthread_mutex_lock(&q->lock);
+    q->slots[(q->head + q->nr++) % (HASH_PATHS_BATCHES + 1)] = b;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static hash_batch *queue_pop(batch_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->nr == 0) {
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+    hash_batch *b = q->slots[q->head];
+    q->head = (q->head + 1) % (HASH_PATHS_BATCHES + 1);
+    q->nr--;
+    pthread_mutex_unlock(&q->lock);
+    return b;
+}
+
+/* Paths read from a file descriptor through one reused buffer */
+typedef struct {
+    int fd;
+    char term;
+    char buf[CHUNK];
+    size_t pos;
+    size_t len;
+    int eof;
+    char *line;
+    size_t line_len;
+    size_t line_alloc;
+} path_reader;
+
+// Move buffered input into line up to the terminator; returns 1 when a
+// whole path is there.
+static int take_path(path_reader *r) {
+    char *end = memchr(r->buf + r->pos, r->term, r->len - r->pos);
+    size_t n = (end ? (size_t)(end - r->buf) : r->len) - r->pos;
+    if (r->line_len + n + 1 > r->line_alloc) {
+        r->line_alloc = (r->line_len + n + 1) * 2;
+        r->line = realloc(r->line, r->line_alloc);
+        if (!r->line) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(r->line + r->line_len, r->buf + r->pos, n);
+    r->line_len += n;
+    r->line[r->line_len] = '\0';
+    r->pos += n + (end != NULL);
+    return end != NULL;
+}
+
+static int refill(path_reader *r) {
+    ssize_t n;
+    do {
+        n = read(r->fd, r->buf, sizeof(r->buf));
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        perror("read");
+        return -1;
+    }
+    r->pos = 0;
+    r->len = n;
+    r->eof = n == 0;
+    return 0;
+}
+
+typedef struct {
+    int write_flag;
+    path_reader reader;
+    batch_queue free_batches;
+    batch_queue to_hash;
+    batch_queue to_write;
+    hash_batch batches[HASH_PATHS_BATCHES];
+    atomic_int stop;       /* a stage failed; the others wind down */
+} hash_pipeline;
+
+// Add one file to the batch; returns -1 when it cannot be read.
+static int read_item(hash_batch *b, char *path) {
+    hash_item *it = &b->items[b->nr];
+    FILE *f = fopen(path, "rb");
+    struct stat st;
+    if (!f || fstat(fileno(f), &st) != 0) {
+        fprintf(stderr, "fatal: could not open '%s' for reading: %s\n", path, strerror(errno));
+        if (f) fclose(f);
+        return -1;
+    }
+    it->path = path;
+    it->len = st.st_size;
+    it->offset = b->used;
+    it->streamed = it->len > BLOB_BATCH_MAX_SIZE;
+    if (!it->streamed) {
+        if (fread(b->buf + b->used, 1, it->len, f) != it->len) {
+            fprintf(stderr, "Failed to read %s\n", path);
+            fclose(f);
+            return -1;
+        }
+        b->used += it->len;
+    }
+    fclose(f);
+    b->nr++;
+    return 0;
+}
+
+static int input_ready(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/* Function to fill a batch; returns NULL once input is exhausted
+* A batch is handed on early rather than blocking for more input, so a
+* caller feeding one path at a time gets each answer right away.
+*/
+static hash_batch *read_batch(hash_pipeline *p, hash_batch *b) {
+    path_reader *r = &p->reader;
+    b->nr = b->used = 0;
+    b->failed = 0;
+    while (!atomic_load(&p->stop) && b->nr < BLOB_BATCH_OBJECTS && b->used < BLOB_BATCH_BYTES) {
+        if (!take_path(r)) {
+            if (!r->eof) {
+                if (b->nr > 0 && !input_ready(r->fd)) {
+                    break;
+                }
+                if (refill(r) != 0) {
+                    b->failed = 1;
+                    break;
+                }
+                continue;
+            }
+            // A last path may lack its terminator.
+            if (r->line_len == 0) {
+                break;
+            }
+        }
+        char *path = strdup(r->line);
+        r->line_len = 0;
+        if (!path || (r->term == '\n' && unquote_c_path(path) != 0)) {
+            fprintf(stderr, "fatal: line is badly quoted: %s\n", r->line);
+            free(path);
+            b->failed = 1;
+            break;
+        }
+        if (read_item(b, path) != 0) {
+            free(path);
+            b->failed = 1;
+            break;
+        }
+    }
+    return b->nr || b->failed ? b : NULL;
+}
+
+// Hash the batch; streamed files are stored as well.
+static int hash_batch_items(hash_pipeline *p, hash_batch *b) {
+    sha1_batch_item items[BLOB_BATCH_OBJECTS];
+    size_t which[BLOB_BATCH_OBJECTS], n = 0;
+    for (size_t i = 0; i < b->nr; i++) {
+        hash_item *it = &b->items[i];
+        if (!it->streamed) {
+            items[n].type = "blob";
+            items[n].data = b->buf + it->offset;
+            items[n].len = it->len;
+            which[n++] = i;
+        }
+    }
+    sha1_object_batch(items, n);
+    for (size_t i = 0; i < n; i++) {
+        b->items[which[i]].sha = items[i].sha;
+    }
+
+    for (b->hashed = 0; b->hashed < b->nr; b->hashed++) {
+        hash_item *it = &b->items[b->hashed];
+        if (it->streamed) {
+            FILE *f = fopen(it->path, "rb");
+            if (!f || write_blob_stream(f, it->len, p->write_flag, &it->sha) != 0) {
+                fprintf(stderr, "fatal: could not hash '%s'\n", it->path);
+                if (f) fclose(f);
+                return -1;
+            }
+            fclose(f);
+        }
+    }
+    return b->failed ? -1 : 0;
+}
+
+// Store the batch's new objects if asked and print the ids of those
+// that made it, then empty the batch for reuse.
+static int finish_batch(hash_batch *b, int store) {
+    int ret = 0;
+    for (size_t i = 0; i < b->nr; i++) {
+        hash_item *it = &b->items[i];
+        if (i < b->hashed && ret == 0) {
+            if (store && !it->streamed) {
+                ret = write_object_hashed("blob", b->buf + it->offset, it->len, &it->sha);
+            }
+            if (ret == 0) {
+                char hex[41];
+                sha1_to_hex(&it->sha, hex);
+                printf("%s\n", hex);
+            }
+        }
+        free(it->path);
+    }
+    fflush(stdout);
+    b->nr = b->hashed = 0;
+    return ret;
+}
+
+static void *reader_thread(void *arg) {
+    hash_pipeline *p = arg;
+    hash_batch *b;
+    while ((b = read_batch(p, queue_pop(&p->free_batches)))) {
+        queue_push(&p->to_hash, b);
+        if (b->failed) {
+            break;
+        }
+    }
+    queue_push(&p->to_hash, NULL);
+    return NULL;
+}
+
+static void *writer_thread(void *arg) {
+    hash_pipeline *p = arg;
+    hash_batch *b;
+    int failed = 0;
+    while ((b = queue_pop(&p->to_write))) {
+        // Nothing is printed past an object that could not be stored.
+        if (failed) {
+            b->hashed = 0;
+        }
+        if (finish_batch(b, 1) != 0) {
+            failed = 1;
+            atomic_store(&p->stop, 1);
+        }
+        queue_push(&p->free_batches, b);
+    }
+    return NULL;
+}
+
+// The calling thread hashes while the reader and writer threads run.
+static int run_pipelined(hash_pipeline *p) {
+    pthread_t reader, writer;
+    if (p->write_flag && pthread_create(&writer, NULL, writer_thread, p) != 0) {
+        return -1;
+    }
+    if (pthread_create(&reader, NULL, reader_thread, p) != 0) {
+        if (p->write_flag) {
+            queue_push(&p->to_write, NULL);
+            pthread_join(writer, NULL);
+        }
+        return -1;
+    }
+    hash_batch *b;
+    while ((b = queue_pop(&p->to_hash))) {
+        // After a failure, batches already read are only drained.
+        b->hashed = 0;
+        if (!atomic_load(&p->stop) && hash_batch_items(p, b) != 0) {
+            atomic_store(&p->stop, 1);
+        }
+        if (p->write_flag) {
+            queue_push(&p->to_write, b);
+        } else {
+            finish_batch(b, 0);
+            queue_push(&p->free_batches, b);
+        }
+    }
+    pthread_join(reader, NULL);
+    if (p->write_flag) {
+        queue_push(&p->to_write, NULL);
+        pthread_join(writer, NULL);
+    }
+    return atomic_load(&p->stop) ? -1 : 0;
+}
+
+static int run_serial(hash_pipeline *p) {
+    hash_batch *b;
+    while ((b = read_batch(p, queue_pop(&p->free_batches)))) {
+        int failed = hash_batch_items(p, b) != 0;
+        failed |= finish_batch(b, p->write_flag) != 0;
+        queue_push(&p->free_batches, b);
+        if (failed) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Function to hash, and optionally store, every path named on stdin */
+int hash_stdin_paths(int write_flag, int nul_terminated) {
+    hash_pipeline *p = calloc(1, sizeof(*p));
+    if (!p) {
+        perror("calloc");
+        return -1;
+    }
+    p->write_flag = write_flag;
+    p->reader.fd = STDIN_FILENO;
+    p->reader.term = nul_terminated ? '\0' : '\n';
+    atomic_init(&p->stop, 0);
+    queue_init(&p->free_batches);
+    queue_init(&p->to_hash);
+    queue_init(&p->to_write);
+    int ret = 0;
+    for (int i = 0; i < HASH_PATHS_BATCHES; i++) {
+        // A batch closes once past BLOB_BATCH_BYTES, so one more small
+        // file always fits.
+        p->batches[i].buf = malloc(BLOB_BATCH_BYTES + BLOB_BATCH_MAX_SIZE);
+        if (!p->batches[i].buf) {
+            perror("malloc");
+            ret = -1;
+        }
+        queue_push(&p->free_batches, &p->batches[i]);
+    }
+
+    if (ret == 0) {
+        ret = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? run_pipelined(p) : run_serial(p);
+    }
+
+    for (int i = 0; i < HASH_PATHS_BATCHES; i++) {
+        free(p->batches[i].buf);
+    }
+    free(p->reader.line);
+    queue_destroy(&p->free_batches);
+    queue_destroy(&p->to_hash);
+    queue_destroy(&p->to_write);
+    free(p);
+    return ret;
+}
@@ -0,0 +1,12 @@
+#ifndef HASH_PATHS_H
+#define HASH_PATHS_H
+
+#include "object_writer.h"
+
+/* Batches in flight between the pipeline stages */
+#define HASH_PATHS_BATCHES 4
+
+/* Function prototypes */
+int hash_stdin_paths(int write_flag, int nul_terminated);
+
+#endif
@@ -0,0 +1,648 @@
+/**
+* index_file.c - The .git/index staging file
+* The index lists every staged path in sorted order together with its
+* mode, object id and the stat data the file had when it was hashed. A
+* path whose size, times and inode still match can reuse its id without
+* reading the file, so refreshing a mostly unchanged tree costs one
+* lstat per file. The file uses git's version 2 layout: a "DIRC" header,
+* the entries padded to 8 bytes, and a trailing SHA-1 of everything
+* before it. An entry modified in the same instant the index was written
+* is "racily clean" and is always hashed again. The TREE extension (see
+* cache_tree.c) is kept; other optional extensions are dropped.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "index_file.h"
+#include "hash_io.h"
+#include "object_writer.h"
+#include "sha1_engine.h"
+
+#define INDEX_SIGNATURE 0x44495243 /* "DIRC" */
+#define INDEX_HEADER_SIZE 12
+#define ENTRY_FIXED_SIZE 62      /* stat data, mode, id and flags */
+#define ENTRY_NAME_MASK 0x0fff
+#define ENTRY_EXTENDED 0x4000
+#define EXT_TREE 0x54524545 /* "TREE" */
+
+void fill_stat_data(stat_data *sd, const struct stat *st) {
+  sd->ctime_sec = st->st_ctim.tv_sec;
+  sd->ctime_nsec = st->st_ctim.tv_nsec;
+  sd->mtime_sec = st->st_mtim.tv_sec;
+  sd->mtime_nsec = st->st_mtim.tv_nsec;
+  sd->dev = st->st_dev;
+  sd->ino = st->st_ino;
+  sd->uid = st->st_uid;
+  sd->gid = st->st_gid;
+  sd->size = st->st_size;
+}
+
+/* Function to map a file's st_mode to the mode git records for it */
+uint32_t index_mode(mode_t mode) {
+  if (S_ISLNK(mode)) {
+    return 0120000;
+  }
+  return (mode & S_IXUSR) ? 0100755 : 0100644;
+}
+
+// Entries on disk are padded with 1 to 8 NULs to a multiple of 8 bytes.
+static size_t entry_disk_size(size_t name_len) {
+  return (ENTRY_FIXED_SIZE + name_len + 8) & ~(size_t)7;
+}
+
+static int index_grow(git_index *index) {
+  if (index->nr < index->alloc) {
+    return 0;
+  }
+  size_t alloc = index->alloc ? index->alloc * 2 : 64;
+  index_entry *entries = realloc(index->entries, alloc * sizeof(*entries));
+  if (!entries) {
+    perror("realloc");
+    return -1;
+  }
+  index->entries = entries;
+  index->alloc = alloc;
+  return 0;
+}
+
+/* Function to load .git/index; a missing file reads as an empty index */
+int read_index(git_index *index) {
+  memset(index, 0, sizeof(*index));
+  int fd = open(INDEX_PATH, O_RDONLY);
+  if (fd < 0) {
+    return errno == ENOENT ? 0 : -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < INDEX_HEADER_SIZE + 20) {
+    fprintf(stderr, "fatal: index file smaller than expected\n");
+    close(fd);
+    return -1;
+  }
+  size_t size = st.st_size;
+  unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  index->mtime = st.st_mtim;
+
+  sha1_t checksum;
+  sha1_buffer(map, size - 20, &checksum);
+  uint32_t version = get_be32(map + 4);
+  if (get_be32(map) != INDEX_SIGNATURE || (version != 2 && version != 3) ||
+      memcmp(checksum.hash, map + size - 20, 20) != 0) {
+    fprintf(stderr, "fatal: bad index file %s\n", INDEX_PATH);
+    munmap(map, size);
+    return -1;
+  }
+
+  uint32_t count = get_be32(map + 8);
+  size_t pos = INDEX_HEADER_SIZE;
+  for (uint32_t i = 0; i < count; i++) {
+    const unsigned char *p = map + pos;
+    if (pos + ENTRY_FIXED_SIZE > size - 20 || index_grow(index) != 0) {
+      goto corrupt;
+    }
+    index_entry *ie = &index->entries[index->nr];
+    ie->st.ctime_sec = get_be32(p);
+    ie->st.ctime_nsec = get_be32(p + 4);
+    ie->st.mtime_sec = get_be32(p + 8);
+    ie->st.mtime_nsec = get_be32(p + 12);
+    ie->st.dev = get_be32(p + 16);
+    ie->st.ino = get_be32(p + 20);
+    ie->mode = get_be32(p + 24);
+    ie->st.uid = get_be32(p + 28);
+    ie->st.gid = get_be32(p + 32);
+    ie->st.size = get_be32(p + 36);
+    memcpy(ie->sha.hash, p + 40, 20);
+    ie->flags = (p[60] << 8) | p[61];
+
+    // Version 3 entries with the extended bit carry 16 more flag bits.
+    size_t fixed = ENTRY_FIXED_SIZE + ((ie->flags & ENTRY_EXTENDED) ? 2 : 0);
+    const unsigned char *name = p + fixed;
+    const unsigned char *end = memchr(name, '\0', size - 20 - (pos + fixed));
+    if (!end) {
+      goto corrupt;
+    }
+    size_t name_len = end - name;
+    ie->name = malloc(name_len + 1);
+    if (!ie->name) {
+      goto corrupt;
+    }
+    memcpy(ie->name, name, name_len + 1);
+    index->nr++;
+    pos += (fixed + name_len + 8) & ~(size_t)7;
+  }
+
+  while (pos + 8 <= size - 20) {
+    uint32_t sig = get_be32(map + pos);
+    uint32_t len = get_be32(map + pos + 4);
+    if (len > size - 20 - pos - 8) {
+      goto corrupt;
+    }
+    if (sig == EXT_TREE) {
+      cache_tree_free(index->cache_tree);
+      index->cache_tree = cache_tree_read(map + pos + 8, len);
+    } else if (map[pos] < 'A' || map[pos] > 'Z') {
+      // Extensions starting with a capital letter are optional.
+      fprintf(stderr, "fatal: index uses %.4s extension, which we do not understand\n", map + pos);
+      munmap(map, size);
+      discard_index(index);
+      return -1;
+    }
+    pos += 8 + len;
+  }
+  munmap(map, size);
+  return 0;
+
+corrupt:
+  fprintf(stderr, "fatal: corrupt index file %s\n", INDEX_PATH);
+  munmap(map, size);
+  discard_index(index);
+  return -1;
+}
+
+void discard_index(git_index *index) {
+  for (size_t i = 0; i < index->nr; i++) {
+    free(index->entries[i].name);
+  }
+  free(index->entries);
+  index->entries = NULL;
+  index->nr = index->alloc = 0;
+  cache_tree_free(index->cache_tree);
+  index->cache_tree = NULL;
+}
+
+/* Function to write the index through .git/index.lock and rename it into place */
+int write_index(git_index *index) {
+  int fd = open(INDEX_LOCK_PATH, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "fatal: Unable to create '%s': %s\n", INDEX_LOCK_PATH, strerror(errno));
+    return -1;
+  }
+  FILE *f = fdopen(fd, "wb");
+  if (!f) {
+    perror("fdopen");
+    close(fd);
+    unlink(INDEX_LOCK_PATH);
+    return -1;
+  }
+  EVP_MD_CTX *ctx = sha1_thread_ctx();
+  int err = 0;
+
+  unsigned char buf[ENTRY_FIXED_SIZE];
+  put_be32(buf, INDEX_SIGNATURE);
+  put_be32(buf + 4, 2);
+  put_be32(buf + 8, index->nr);
+  err |= write_hashed(f, ctx, buf, INDEX_HEADER_SIZE);
+
+  static const unsigned char zeros[8];
+  for (size_t i = 0; i < index->nr; i++) {
+    const index_entry *ie = &index->entries[i];
+    size_t name_len = strlen(ie->name);
+    put_be32(buf, ie->st.ctime_sec);
+    put_be32(buf + 4, ie->st.ctime_nsec);
+    put_be32(buf + 8, ie->st.mtime_sec);
+    put_be32(buf + 12, ie->st.mtime_nsec);
+    put_be32(buf + 16, ie->st.dev);
+    put_be32(buf + 20, ie->st.ino);
+    put_be32(buf + 24, ie->mode);
+    put_be32(buf + 28, ie->st.uid);
+    put_be32(buf + 32, ie->st.gid);
+    put_be32(buf + 36, ie->st.size);
+    memcpy(buf + 40, ie->sha.hash, 20);
+    uint16_t flags = name_len < ENTRY_NAME_MASK ? name_len : ENTRY_NAME_MASK;
+    buf[60] = flags >> 8;
+    buf[61] = flags & 0xff;
+    err |= write_hashed(f, ctx, buf, ENTRY_FIXED_SIZE);
+    err |= write_hashed(f, ctx, ie->name, name_len);
+    err |= write_hashed(f, ctx, zeros, entry_disk_size(name_len) - ENTRY_FIXED_SIZE - name_len);
+  }
+
+  if (index->cache_tree) {
+    size_t len;
+    unsigned char *ext = cache_tree_write(index->cache_tree, &len);
+    if (ext) {
+      put_be32(buf, EXT_TREE);
+      put_be32(buf + 4, len);
+      err |= write_hashed(f, ctx, buf, 8);
+      err |= write_hashed(f, ctx, ext, len);
+      free(ext);
+    }
+  }
+
+  unsigned char checksum[20];
+  EVP_DigestFinal_ex(ctx, checksum, NULL);
+  err |= fwrite(checksum, 1, 20, f) != 20;
+  if (fclose(f) != 0) err = 1;
+  if (err || rename(INDEX_LOCK_PATH, INDEX_PATH) != 0) {
+    fprintf(stderr, "Failed to write %s\n", INDEX_PATH);
+    unlink(INDEX_LOCK_PATH);
+    return -1;
+  }
+  atomic_store(&index->changed, 0);
+  return 0;
+}
+
+// Binary search; returns the position, or -(insert position + 1).
+static long index_pos(const git_index *index, const char *name) {
+  size_t lo = 0, hi = index->nr;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(name, index->entries[mid].name);
+    if (cmp == 0) {
+      return mid;
+    }
+    if (cmp < 0) hi = mid;
+    else lo = mid + 1;
+  }
+  return -(long)lo - 1;
+}
+
+index_entry *index_find(const git_index *index, const char *name) {
+  long pos = index_pos(index, name);
+  return pos >= 0 ? &index->entries[pos] : NULL;
+}
+
+/* Function to count the entries inside directory dir, "" being the top */
+size_t index_count_under(const git_index *index, const char *dir) {
+  size_t len = strlen(dir);
+  if (len == 0) {
+    return index->nr;
+  }
+  // Everything under "dir/" sorts between "dir/" and "dir0".
+  char *lo_key = malloc(len + 2);
+  if (!lo_key) {
+    return 0;
+  }
+  memcpy(lo_key, dir, len);
+  lo_key[len] = '/';
+  lo_key[len + 1] = '\0';
+  long lo = index_pos(index, lo_key);
+  lo_key[len] = '/' + 1;
+  long hi = index_pos(index, lo_key);
+  free(lo_key);
+  lo = lo < 0 ? -lo - 1 : lo;
+  hi = hi < 0 ? -hi - 1 : hi;
+  return hi - lo;
+}
+
+/* Function to add or replace the entry for name */
+index_entry *index_add_entry(git_index *index, const char *name, uint32_t mode, const sha1_t *sha, const stat_data *sd) {
+  long pos = index_pos(index, name);
+  index_entry *ie;
+  if (pos >= 0) {
+    ie = &index->entries[pos];
+    if (ie->mode != mode || memcmp(&ie->sha, sha, sizeof(*sha)) != 0) {
+      cache_tree_invalidate_path(index->cache_tree, name);
+    }
+  } else {
+    char *copy = strdup(name);
+    if (!copy || index_grow(index) != 0) {
+      free(copy);
+      return NULL;
+    }
+    pos = -pos - 1;
+    memmove(&index->entries[pos + 1], &index->entries[pos], (index->nr - pos) * sizeof(index_entry));
+    index->nr++;
+    ie = &index->entries[pos];
+    ie->name = copy;
+    ie->flags = 0;
+    cache_tree_invalidate_path(index->cache_tree, name);
+  }
+  ie->mode = mode;
+  ie->sha = *sha;
+  ie->st = *sd;
+  atomic_store(&index->changed, 1);
+  return ie;
+}
+
+/* Function to remove path, or everything under it if it is a directory; returns how many entries went */
+int index_remove_path(git_index *index, const char *path) {
+  size_t len = strlen(path);
+  size_t kept = 0;
+  int removed = 0;
+  for (size_t i = 0; i < index->nr; i++) {
+    const char *name = index->entries[i].name;
+    int under = len == 0 || (strncmp(name, path, len) == 0 && (name[len] == '\0' || name[len] == '/'));
+    if (under) {
+      cache_tree_invalidate_path(index->cache_tree, name);
+      free(index->entries[i].name);
+      removed++;
+    } else {
+      index->entries[kept++] = index->entries[i];
+    }
+  }
+  index->nr = kept;
+  if (removed) {
+    atomic_store(&index->changed, 1);
+  }
+  return removed;
+}
+
+/* Function to decide whether a cached id is still good for a file with stat data sd */
+int index_entry_uptodate(const git_index *index, const index_entry *ie, const stat_data *sd) {
+  if (ie->st.mtime_sec != sd->mtime_sec || ie->st.mtime_nsec != sd->mtime_nsec ||
+      ie->st.ctime_sec != sd->ctime_sec || ie->st.ctime_nsec != sd->ctime_nsec ||
+      ie->st.ino != sd->ino || ie->st.uid != sd->uid || ie->st.gid != sd->gid ||
+      ie->st.size != sd->size) {
+    return 0;
+  }
+  // The file may have changed again within the timestamp granularity
+  // after it was hashed, without its stat data showing it.
+  if (sd->mtime_sec > (uint32_t)index->mtime.tv_sec ||
+      (sd->mtime_sec == (uint32_t)index->mtime.tv_sec && sd->mtime_nsec >= (uint32_t)index->mtime.tv_nsec)) {
+    return 0;
+  }
+  return 1;
+}
+
+/* Function to store a freshly computed id and stat data in an existing entry
+* Only ie is written, so walkers on several threads can refresh different
+* entries at the same time. The cache tree is left to the caller, which
+* is rebuilding the trees on ie's path anyway.
+*/
+void index_entry_refresh(git_index *index, index_entry *ie, const sha1_t *sha, const stat_data *sd) {
+  if (memcmp(&ie->st, sd, sizeof(*sd)) == 0 && memcmp(&ie->sha, sha, sizeof(*sha)) == 0) {
+    return;
+  }
+  ie->sha = *sha;
+  ie->st = *sd;
+  atomic_store(&index->changed, 1);
+}
+
+/* A working tree file waiting to be staged */
+typedef struct {
+    char *path;
+    stat_data st;
+    uint32_t mode;
+} pending_file;
+
+typedef struct {
+    pending_file *items;
+    size_t nr;
+    size_t alloc;
+} pending_list;
+
+static int pending_add(pending_list *list, const char *path, const struct stat *st) {
+  if (list->nr == list->alloc) {
+    size_t alloc = list->alloc ? list->alloc * 2 : 64;
+    pending_file *items = realloc(list->items, alloc * sizeof(*items));
+    if (!items) {
+      perror("realloc");
+      return -1;
+    }
+    list->items = items;
+    list->alloc = alloc;
+  }
+  pending_file *pf = &list->items[list->nr];
+  pf->path = strdup(path);
+  if (!pf->path) {
+    perror("strdup");
+    return -1;
+  }
+  fill_stat_data(&pf->st, st);
+  pf->mode = index_mode(st->st_mode);
+  list->nr++;
+  return 0;
+}
+
+static void pending_clear(pending_list *list) {
+  for (size_t i = 0; i < list->nr; i++) {
+    free(list->items[i].path);
+  }
+  free(list->items);
+}
+
+// Queue every file under dir, skipping .git.
+static int collect_dir(pending_list *list, const char *dir) {
+  DIR *d = opendir(*dir ? dir : ".");
+  if (!d) {
+    perror(dir);
+    return -1;
+  }
+  struct dirent *entry;
+  int ret = 0;
+  while (ret == 0 && (entry = readdir(d))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".git") == 0) {
+      continue;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s%s", dir, *dir ? "/" : "", entry->d_name);
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+      perror(path);
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      ret = collect_dir(list, path);
+    } else if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+      ret = pending_add(list, path, &st);
+    }
+  }
+  closedir(d);
+  return ret;
+}
+
+// Hash and store whatever is queued whose stat data no longer matches the index.
+static int stage_pending(git_index *index, pending_list *list) {
+  char **paths = malloc((list->nr ? list->nr : 1) * sizeof(*paths));
+  size_t *which = malloc((list->nr ? list->nr : 1) * sizeof(*which));
+  sha1_t *shas = malloc((list->nr ? list->nr : 1) * sizeof(*shas));
+  int ret = paths && which && shas ? 0 : -1;
+  size_t nr = 0;
+
+  for (size_t i = 0; ret == 0 && i < list->nr; i++) {
+    pending_file *pf = &list->items[i];
+    index_entry *ie = index_find(index, pf->path);
+    if (ie && ie->mode == pf->mode && index_entry_uptodate(index, ie, &pf->st)) {
+      continue;
+    }
+    if (pf->mode == 0120000) {
+      // A symlink's blob is its target, not what it points to.
+      char target[4096];
+      ssize_t len = readlink(pf->path, target, sizeof(target));
+      sha1_t sha;
+      if (len < 0 || write_object("blob", target, len, &sha) != 0) {
+        perror(pf->path);
+        ret = -1;
+      } else if (!index_add_entry(index, pf->path, pf->mode, &sha, &pf->st)) {
+        ret = -1;
+      }
+      continue;
+    }
+    paths[nr] = pf->path;
+    which[nr++] = i;
+  }
+  if (ret == 0 && nr) {
+    ret = write_blob_files(paths, nr, 1, shas);
+  }
+  for (size_t i = 0; ret == 0 && i < nr; i++) {
+    pending_file *pf = &list->items[which[i]];
+    if (!index_add_entry(index, pf->path, pf->mode, &shas[i], &pf->st)) {
+      ret = -1;
+    }
+  }
+  free(paths);
+  free(which);
+  free(shas);
+  return ret;
+}
+
+// Turn "./a/b/" into "a/b" and "." into "".
+static void normalize_path(char *path) {
+  while (path[0] == '.' && path[1] == '/') {
+    memmove(path, path + 2, strlen(path + 2) + 1);
+  }
+  if (strcmp(path, ".") == 0) {
+    path[0] = '\0';
+  }
+  size_t len = strlen(path);
+  while (len > 0 && path[len - 1] == '/') {
+    path[--len] = '\0';
+  }
+}
+
+// Drop entries under prefix whose files have gone from the working tree.
+static void remove_deleted(git_index *index, const char *prefix) {
+  size_t len = strlen(prefix);
+  for (size_t i = 0; i < index->nr; ) {
+    index_entry *ie = &index->entries[i];
+    struct stat st;
+    if ((len == 0 || (strncmp(ie->name, prefix, len) == 0 && ie->name[len] == '/')) &&
+        lstat(ie->name, &st) != 0 && errno == ENOENT) {
+      cache_tree_invalidate_path(index->cache_tree, ie->name);
+      free(ie->name);
+      memmove(ie, ie + 1, (index->nr - i - 1) * sizeof(*ie));
+      index->nr--;
+      atomic_store(&index->changed, 1);
+      continue;
+    }
+    i++;
+  }
+}
+
+/* Function to implement git add <path>...
+* Files are staged, directories are staged recursively, and tracked files
+* that no longer exist under the given paths are removed from the index.
+*/
+int add_paths(char *const *paths, int count) {
+  git_index index;
+  if (read_index(&index) != 0) {
+    return -1;
+  }
+  pending_list list = {0};
+  int ret = 0;
+  for (int i = 0; ret == 0 && i < count; i++) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s", paths[i]);
+    normalize_path(path);
+    struct stat st;
+    if (lstat(*path ? path : ".", &st) != 0) {
+      if (!index_remove_path(&index, path)) {
+        fprintf(stderr, "fatal: pathspec '%s' did not match any files\n", paths[i]);
+        ret = -1;
+      }
+    } else if (S_ISDIR(st.st_mode)) {
+      ret = collect_dir(&list, path);
+      remove_deleted(&index, path);
+    } else {
+      ret = pending_add(&list, path, &st);
+    }
+  }
+  if (ret == 0) {
+    ret = stage_pending(&index, &list);
+  }
+  if (ret == 0 && atomic_load(&index.changed)) {
+    ret = write_index(&index);
+  }
+  pending_clear(&list);
+  discard_index(&index);
+  return ret;
+}
+
+// Re-stat every entry; hash those whose stat data changed and keep the
+// new stat data where the content turned out to be the same.
+static int refresh_index(git_index *index) {
+  int ret = 0;
+  for (size_t i = 0; i < index->nr; i++) {
+    index_entry *ie = &index->entries[i];
+    struct stat st;
+    if (lstat(ie->name, &st) != 0) {
+      printf("%s: needs update\n", ie->name);
+      ret = 1;
+      continue;
+    }
+    stat_data sd;
+    fill_stat_data(&sd, &st);
+    if (index_entry_uptodate(index, ie, &sd)) {
+      continue;
+    }
+    sha1_t sha;
+    int hashed;
+    if (S_ISLNK(st.st_mode)) {
+      char target[4096];
+      ssize_t len = readlink(ie->name, target, sizeof(target));
+      hashed = len >= 0;
+      if (hashed) sha1_object("blob", target, len, &sha);
+    } else {
+      FILE *f = fopen(ie->name, "rb");
+      hashed = f && write_blob_stream(f, st.st_size, 0, &sha) == 0;
+      if (f) fclose(f);
+    }
+    if (hashed && memcmp(&sha, &ie->sha, sizeof(sha)) == 0 && index_mode(st.st_mode) == ie->mode) {
+      index_entry_refresh(index, ie, &sha, &sd);
+    } else {
+      printf("%s: needs update\n", ie->name);
+      ret = 1;
+    }
+  }
+  return ret;
+}
+
+/* Function to implement git update-index [--add] [--remove] [--refresh] <file>...
+* Only tracked files are updated unless allow_add is set, and missing files
+* are only dropped when allow_remove is set.
+*/
+int update_index(char *const *paths, int count, int allow_add, int allow_remove, int refresh) {
+  git_index index;
+  if (read_index(&index) != 0) {
+    return -1;
+  }
+  int ret = refresh ? refresh_index(&index) : 0;
+  pending_list list = {0};
+  for (int i = 0; ret >= 0 && i < count; i++) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s", paths[i]);
+    normalize_path(path);
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+      if (!allow_remove) {
+        fprintf(stderr, "error: %s: does not exist and --remove not passed\n", path);
+        ret = -1;
+      } else {
+        index_remove_path(&index, path);
+      }
+    } else if (S_ISDIR(st.st_mode)) {
+      fprintf(stderr, "error: %s: is a directory - add files inside instead\n", path);
+      ret = -1;
+    } else if (!allow_add && !index_find(&index, path)) {
+      fprintf(stderr, "error: %s: cannot add to the index - missing --add option?\n", path);
+      ret = -1;
+    } else if (pending_add(&list, path, &st) != 0) {
+      ret = -1;
+    }
+  }
+  if (ret >= 0 && stage_pending(&index, &list) != 0) {
+    ret = -1;
+  }
+  if (ret >= 0 && atomic_load(&index.changed) && write_index(&index) != 0) {
+    ret = -1;
+  }
+  pending_clear(&list);
+  discard_index(&index);
+  return ret;
+}
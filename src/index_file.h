@@ -0,0 +1,47 @@
+#ifndef INDEX_FILE_H
+#define INDEX_FILE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "blob.h"
+#include "cache_tree.h"
+
+#define INDEX_PATH ".git/index"
+#define INDEX_LOCK_PATH ".git/index.lock"
+
+/* One staged path, as stored in a version 2 index entry */
+typedef struct {
+    stat_data st;
+    uint32_t mode;
+    sha1_t sha;
+    uint16_t flags;
+    char *name;
+} index_entry;
+
+/* The index loaded in memory, entries sorted by name */
+typedef struct git_index {
+    index_entry *entries;
+    size_t nr;
+    size_t alloc;
+    struct timespec mtime;  /* of the index file when it was read */
+    cache_tree *cache_tree; /* from the TREE extension, may be NULL */
+    atomic_int changed;
+} git_index;
+
+/* Function prototypes */
+void fill_stat_data(stat_data *sd, const struct stat *st);
+uint32_t index_mode(mode_t mode);
+int read_index(git_index *index);
+int write_index(git_index *index);
+void discard_index(git_index *index);
+index_entry *index_find(const git_index *index, const char *name);
+size_t index_count_under(const git_index *index, const char *dir);
+index_entry *index_add_entry(git_index *index, const char *name, uint32_t mode, const sha1_t *sha, const stat_data *sd);
+int index_remove_path(git_index *index, const char *path);
+int index_entry_uptodate(const git_index *index, const index_entry *ie, const stat_data *sd);
+void index_entry_refresh(git_index *index, index_entry *ie, const sha1_t *sha, const stat_data *sd);
+int add_paths(char *const *paths, int count);
+int update_index(char *const *paths, int count, int allow_add, int allow_remove, int refresh);
+
+#endif
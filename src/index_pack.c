@@ -0,0 +1,691 @@
+/**
+* index_pack.c - Build a v2 .idx for a received packfile
+* A single sequential pass walks the pack to find every entry's offset,
+* CRC32 and, for non-delta objects, its SHA-1; it has to inflate every
+* entry to find where the next one starts. The pass takes the pack in
+* pieces, so a clone runs it on the bytes as they arrive and only the
+* rest is left once the download ends. Delta chains are then resolved
+* in parallel: worker threads take base objects off a shared counter and
+* rebuild all of their descendants depth first, inflating each base and
+* delta a second time. No locking is needed on the results.
+*/
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "pack.h"
+#include "hash_io.h"
+
+typedef struct {
+    uint64_t offset;    /* start of the entry header */
+    uint64_t data_pos;  /* start of the zlib stream */
+    size_t size;        /* inflated size from the entry header */
+    int type;           /* type as stored, possibly a delta */
+    int real_type;      /* type after delta resolution */
+    uint32_t crc;
+    sha1_t sha;
+} pack_obj;
+
+/* A delta entry keyed by what it is based on */
+typedef struct {
+    uint64_t base_offset;
+    sha1_t base_sha;
+    uint32_t obj;
+} delta_ref;
+
+typedef struct {
+    const unsigned char *map;
+    size_t map_size;
+    pack_obj *objs;
+    uint32_t nr_objects;
+    delta_ref *ofs_deltas;
+    uint32_t nr_ofs_deltas;
+    delta_ref *ref_deltas;
+    uint32_t nr_ref_deltas;
+    uint32_t *bases;
+    uint32_t nr_bases;
+    atomic_uint next_base;
+    atomic_uint nr_resolved;
+    atomic_int failed;
+} index_state;
+
+static void hash_object_buffer(int type, const unsigned char *data, size_t size, sha1_t *out) {
+  char header[MAX_HEADER_LEN];
+  int len = snprintf(header, sizeof(header), "%s %zu", type_name(type), size) + 1;
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  if (!ctx) {
+    perror("EVP_MD_CTX_new");
+    exit(1);
+  }
+  EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+  EVP_DigestUpdate(ctx, header, len);
+  EVP_DigestUpdate(ctx, data, size);
+  EVP_DigestFinal_ex(ctx, out->hash, NULL);
+  EVP_MD_CTX_free(ctx);
+}
+
+// Inflate a whole entry's zlib stream into a new buffer of the given size.
+static unsigned char *inflate_entry(const index_state *st, const pack_obj *obj) {
+  unsigned char *buf = malloc(obj->size + 1);
+  if (!buf) {
+    return NULL;
+  }
+  z_stream stream = {0};
+  if (inflateInit(&stream) != Z_OK) {
+    free(buf);
+    return NULL;
+  }
+  size_t produced;
+  int ret = inflate_sized(&stream, st->map + obj->data_pos, st->map_size - 20 - obj->data_pos, buf, obj->size + 1,
+                          Z_FINISH, NULL, &produced);
+  inflateEnd(&stream);
+  if (ret != Z_STREAM_END || produced != obj->size) {
+    free(buf);
+    return NULL;
+  }
+  buf[obj->size] = '\0';
+  return buf;
+}
+
+/* Where the sequential pass is in the pack bytes fed to it */
+enum {
+  SCAN_PACK_HEADER,
+  SCAN_ENTRY_HEADER,
+  SCAN_ENTRY_DATA,
+  SCAN_TRAILER,
+  SCAN_FAILED
+};
+
+/* Longest entry header: a 10 byte size, then a 10 byte offset or an id */
+#define ENTRY_HEADER_MAX 32
+
+struct pack_indexer {
+  index_state st;
+  int phase;
+  uint64_t pos;                  /* pack bytes taken so far */
+  uint32_t cur;                  /* the entry being scanned */
+  unsigned char buf[ENTRY_HEADER_MAX];  /* a header or the trailer, gathered */
+  size_t buf_len;
+  z_stream stream;
+  int hashing;                   /* the entry is no delta, so it is hashed */
+  EVP_MD_CTX *ctx;
+};
+
+/* Function to start the sequential pass over a pack that is fed in
+* pieces with pack_indexer_feed, as it arrives or from a mapped file
+*/
+pack_indexer *pack_indexer_new(void) {
+  pack_indexer *ix = calloc(1, sizeof(*ix));
+  if (!ix) {
+    perror("calloc");
+    return NULL;
+  }
+  ix->ctx = EVP_MD_CTX_new();
+  if (!ix->ctx || inflateInit(&ix->stream) != Z_OK) {
+    fprintf(stderr, "Failed to set up pack indexing\n");
+    EVP_MD_CTX_free(ix->ctx);
+    free(ix);
+    return NULL;
+  }
+  return ix;
+}
+
+void pack_indexer_free(pack_indexer *ix) {
+  if (!ix) {
+    return;
+  }
+  inflateEnd(&ix->stream);
+  EVP_MD_CTX_free(ix->ctx);
+  free(ix->st.bases);
+  free(ix->st.ref_deltas);
+  free(ix->st.ofs_deltas);
+  free(ix->st.objs);
+  free(ix);
+}
+
+static int scan_pack_header(pack_indexer *ix) {
+  index_state *st = &ix->st;
+  uint32_t version = get_be32(ix->buf + 4);
+  if (memcmp(ix->buf, "PACK", 4) != 0 || (version != 2 && version != 3)) {
+    fprintf(stderr, "Not a version 2 pack\n");
+    return -1;
+  }
+  st->nr_objects = get_be32(ix->buf + 8);
+  size_t n = st->nr_objects ? st->nr_objects : 1;
+  st->objs = calloc(n, sizeof(*st->objs));
+  st->ofs_deltas = malloc(n * sizeof(delta_ref));
+  st->ref_deltas = malloc(n * sizeof(delta_ref));
+  st->bases = malloc(n * sizeof(uint32_t));
+  if (!st->objs || !st->ofs_deltas || !st->ref_deltas || !st->bases) {
+    fprintf(stderr, "Failed to allocate index for %u objects\n", st->nr_objects);
+    return -1;
+  }
+  ix->phase = st->nr_objects ? SCAN_ENTRY_HEADER : SCAN_TRAILER;
+  return 0;
+}
+
+// Parse the entry header gathered so far; returns 1 once it is whole,
+// 0 if it needs more bytes and -1 if it is corrupt.
+static int scan_entry_header(pack_indexer *ix) {
+  index_state *st = &ix->st;
+  pack_obj *obj = &st->objs[ix->cur];
+  const unsigned char *b = ix->buf, *end = ix->buf + ix->buf_len;
+
+  int type = (ix->buf[0] >> 4) & 7;
+  unsigned char c = *b++;
+  size_t size = c & 15;
+  int shift = 4;
+  while (c & 0x80) {
+    if (b == end) return 0;
+    if (shift > 60) return -1;
+    c = *b++;
+    size |= (size_t)(c & 0x7f) << shift;
+    shift += 7;
+  }
+
+  uint64_t rel = 0;
+  if (type == OBJ_OFS_DELTA) {
+    if (b == end) return 0;
+    c = *b++;
+    rel = c & 0x7f;
+    while (c & 0x80) {
+      if (b == end) return 0;
+      if (rel >> 56) return -1;
+      c = *b++;
+      rel = ((rel + 1) << 7) | (c & 0x7f);
+    }
+    if (rel == 0 || rel > ix->pos) return -1;
+  } else if (type == OBJ_REF_DELTA) {
+    if (end - b < 20) return 0;
+    b += 20;
+  } else if (!type_name(type)) {
+    return -1;
+  }
+
+  obj->offset = ix->pos;
+  obj->type = type;
+  obj->size = size;
+  obj->data_pos = ix->pos + (b - ix->buf);
+  if (type == OBJ_OFS_DELTA) {
+    delta_ref *d = &st->ofs_deltas[st->nr_ofs_deltas++];
+    d->base_offset = obj->offset - rel;
+    d->obj = ix->cur;
+  } else if (type == OBJ_REF_DELTA) {
+    delta_ref *d = &st->ref_deltas[st->nr_ref_deltas++];
+    memcpy(d->base_sha.hash, b - 20, 20);
+    d->obj = ix->cur;
+  } else {
+    obj->real_type = type;
+    st->bases[st->nr_bases++] = ix->cur;
+  }
+
+  ix->hashing = obj->real_type != OBJ_NONE;
+  if (ix->hashing) {
+    char header[MAX_HEADER_LEN];
+    int len = snprintf(header, sizeof(header), "%s %zu", type_name(type), size) + 1;
+    EVP_DigestInit_ex(ix->ctx, EVP_sha1(), NULL);
+    EVP_DigestUpdate(ix->ctx, header, len);
+  }
+  obj->crc = crc32(crc32(0L, Z_NULL, 0), ix->buf, b - ix->buf);
+  ix->pos = obj->data_pos;
+  inflateReset(&ix->stream);
+  return 1;
+}
+
+// Inflate the current entry's zlib stream from data, hashing non-delta
+// content and dropping it, so memory stays at one CHUNK buffer. Returns
+// how much of data belongs to the entry, or -1 if it is corrupt.
+static int64_t scan_entry_data(pack_indexer *ix, const unsigned char *data, size_t len) {
+  pack_obj *obj = &ix->st.objs[ix->cur];
+  z_stream *zs = &ix->stream;
+  unsigned char out[CHUNK];
+  size_t used = 0;
+  int ret = Z_OK;
+  zs->next_in = (unsigned char *)data;
+  while (ret != Z_STREAM_END && used < len) {
+    // zlib takes at most a uInt of input at a time.
+    uInt chunk = len - used > UINT_MAX ? UINT_MAX : (uInt)(len - used);
+    zs->avail_in = chunk;
+    do {
+      zs->next_out = out;
+      zs->avail_out = sizeof(out);
+      ret = inflate(zs, Z_NO_FLUSH);
+      if (ret == Z_BUF_ERROR) {
+        break;  /* the rest of the entry is still to come */
+      }
+      if ((ret != Z_OK && ret != Z_STREAM_END) || zs->total_out > obj->size) {
+        return -1;
+      }
+      if (ix->hashing) {
+        EVP_DigestUpdate(ix->ctx, out, sizeof(out) - zs->avail_out);
+      }
+    } while (ret != Z_STREAM_END && (zs->avail_in > 0 || zs->avail_out == 0));
+    used += chunk - zs->avail_in;
+  }
+  obj->crc = crc32(obj->crc, data, used);
+  ix->pos += used;
+  if (ret != Z_STREAM_END) {
+    return used;
+  }
+
+  if (zs->total_out != obj->size) {
+    return -1;
+  }
+  if (ix->hashing) {
+    EVP_DigestFinal_ex(ix->ctx, obj->sha.hash, NULL);
+  }
+  ix->cur++;
+  ix->phase = ix->cur < ix->st.nr_objects ? SCAN_ENTRY_HEADER : SCAN_TRAILER;
+  return used;
+}
+
+/* Function to run the sequential pass over the next len pack bytes
+* It finds every entry's offset and CRC32 and, for non-delta objects, its
+* SHA-1, inflating each entry to find where the next one starts. Entries
+* and headers may be split anywhere between calls. Returns -1 once the
+* pack is found to be corrupt.
+*/
+int pack_indexer_feed(pack_indexer *ix, const unsigned char *data, size_t len) {
+  while (len > 0) {
+    switch (ix->phase) {
+      case SCAN_PACK_HEADER:
+        ix->buf[ix->buf_len++] = *data++;
+        len--;
+        ix->pos++;
+        if (ix->buf_len == 12) {
+          ix->buf_len = 0;
+          if (scan_pack_header(ix) != 0) {
+            ix->phase = SCAN_FAILED;
+          }
+        }
+        break;
+      case SCAN_ENTRY_HEADER: {
+        ix->buf[ix->buf_len++] = *data++;
+        len--;
+        int r = scan_entry_header(ix);
+        if (r < 0 || (r == 0 && ix->buf_len == sizeof(ix->buf))) {
+          fprintf(stderr, "Corrupt pack entry %u at offset %llu\n", ix->cur, (unsigned long long)ix->pos);
+          ix->phase = SCAN_FAILED;
+        } else if (r == 1) {
+          ix->buf_len = 0;
+          ix->phase = SCAN_ENTRY_DATA;
+        }
+        break;
+      }
+      case SCAN_ENTRY_DATA: {
+        int64_t used = scan_entry_data(ix, data, len);
+        if (used < 0) {
+          fprintf(stderr, "Corrupt pack entry %u at offset %llu\n", ix->cur,
+                  (unsigned long long)ix->st.objs[ix->cur].offset);
+          ix->phase = SCAN_FAILED;
+          break;
+        }
+        data += used;
+        len -= used;
+        break;
+      }
+      case SCAN_TRAILER:
+        if (ix->buf_len == 20) {
+          fprintf(stderr, "Garbage at end of pack\n");
+          ix->phase = SCAN_FAILED;
+          break;
+        }
+        ix->buf[ix->buf_len++] = *data++;
+        len--;
+        ix->pos++;
+        break;
+      case SCAN_FAILED:
+        return -1;
+    }
+  }
+  return ix->phase == SCAN_FAILED ? -1 : 0;
+}
+
+static int cmp_base_offset(const void *a, const void *b) {
+  uint64_t x = ((const delta_ref *)a)->base_offset, y = ((const delta_ref *)b)->base_offset;
+  return x < y ? -1 : x > y;
+}
+
+static int cmp_base_sha(const void *a, const void *b) {
+  return memcmp(((const delta_ref *)a)->base_sha.hash, ((const delta_ref *)b)->base_sha.hash, 20);
+}
+
+// Find the run of deltas whose key matches; returns its length.
+static uint32_t find_children(const delta_ref *list, uint32_t n, const delta_ref *key,
+                              int (*cmp)(const void *, const void *), uint32_t *first) {
+  uint32_t lo = 0, hi = n;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (cmp(&list[mid], key) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  *first = lo;
+  uint32_t end = lo;
+  while (end < n && cmp(&list[end], key) == 0) end++;
+  return end - lo;
+}
+
+static void resolve_delta_list(index_state *st, const pack_obj *base, const unsigned char *data,
+                               const delta_ref *list, uint32_t first, uint32_t count);
+
+// Rebuild every delta based on obj, then their descendants.
+static void resolve_children(index_state *st, const pack_obj *base, const unsigned char *data) {
+  delta_ref key;
+  uint32_t first, count;
+
+  key.base_offset = base->offset;
+  count = find_children(st->ofs_deltas, st->nr_ofs_deltas, &key, cmp_base_offset, &first);
+  resolve_delta_list(st, base, data, st->ofs_deltas, first, count);
+
+  key.base_sha = base->sha;
+  count = find_children(st->ref_deltas, st->nr_ref_deltas, &key, cmp_base_sha, &first);
+  resolve_delta_list(st, base, data, st->ref_deltas, first, count);
+}
+
+static void resolve_delta_list(index_state *st, const pack_obj *base, const unsigned char *data,
+                               const delta_ref *list, uint32_t first, uint32_t count) {
+  for (uint32_t i = first; i < first + count && !atomic_load(&st->failed); i++) {
+    pack_obj *child = &st->objs[list[i].obj];
+    unsigned char *delta = inflate_entry(st, child);
+    unsigned char *result;
+    size_t result_size;
+    if (!delta || apply_delta(data, base->size, delta, child->size, 0, &result, &result_size) != 0) {
+      fprintf(stderr, "Failed to resolve delta at offset %llu\n", (unsigned long long)child->offset);
+      free(delta);
+      atomic_store(&st->failed, 1);
+      return;
+    }
+    free(delta);
+
+    // From here on the child stands for its reconstructed object.
+    child->real_type = base->real_type;
+    child->size = result_size;
+    hash_object_buffer(child->real_type, result, result_size, &child->sha);
+    atomic_fetch_add(&st->nr_resolved, 1);
+    resolve_children(st, child, result);
+    free(result);
+  }
+}
+
+static void *resolve_worker(void *arg) {
+  index_state *st = arg;
+  for (;;) {
+    unsigned int n = atomic_fetch_add(&st->next_base, 1);
+    if (n >= st->nr_bases || atomic_load(&st->failed)) {
+      break;
+    }
+    pack_obj *base = &st->objs[st->bases[n]];
+    delta_ref key = { .base_offset = base->offset, .base_sha = base->sha };
+    uint32_t first;
+    if (!find_children(st->ofs_deltas, st->nr_ofs_deltas, &key, cmp_base_offset, &first) &&
+        !find_children(st->ref_deltas, st->nr_ref_deltas, &key, cmp_base_sha, &first)) {
+      continue;
+    }
+    unsigned char *data = inflate_entry(st, base);
+    if (!data) {
+      fprintf(stderr, "Failed to inflate base at offset %llu\n", (unsigned long long)base->offset);
+      atomic_store(&st->failed, 1);
+      break;
+    }
+    resolve_children(st, base, data);
+    free(data);
+  }
+  return NULL;
+}
+
+static int cmp_entry_sha(const void *a, const void *b) {
+  return memcmp(((const pack_idx_entry *)a)->sha.hash, ((const pack_idx_entry *)b)->sha.hash, 20);
+}
+
+/* Function to sort index entries by object id, as write_pack_idx expects */
+void sort_pack_idx_entries(pack_idx_entry *entries, uint32_t n) {
+  qsort(entries, n, sizeof(*entries), cmp_entry_sha);
+}
+
+static int write_be32(FILE *f, EVP_MD_CTX *ctx, uint32_t v) {
+  unsigned char be[4];
+  put_be32(be, v);
+  return write_hashed(f, ctx, be, 4);
+}
+
+/* Function to write a version 2 pack index for entries sorted by object id
+* The index goes to a temporary file that is fsynced and then renamed to
+* idx_path, so a crash never leaves a truncated index next to a pack.
+*/
+int write_pack_idx(const char *idx_path, const pack_idx_entry *sorted, uint32_t n, const sha1_t *pack_sha) {
+  char tmp_path[PATH_MAX];
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s_XXXXXX", idx_path) >= (int)sizeof(tmp_path)) {
+    fprintf(stderr, "Index path too long: %s\n", idx_path);
+    return -1;
+  }
+  int fd = mkstemp(tmp_path);
+  FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!f) {
+    perror("create idx");
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmp_path);
+    }
+    return -1;
+  }
+  fchmod(fd, 0444);
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+  int err = 0;
+
+  err |= write_be32(f, ctx, 0xff744f63);
+  err |= write_be32(f, ctx, 2);
+  uint32_t count = 0;
+  for (int b = 0; b < 256; b++) {
+    while (count < n && sorted[count].sha.hash[0] == b) count++;
+    err |= write_be32(f, ctx, count);
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    err |= write_hashed(f, ctx, sorted[i].sha.hash, 20);
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    err |= write_be32(f, ctx, sorted[i].crc);
+  }
+  // Offsets past 2 GiB go to the 64-bit table, referenced by index.
+  uint32_t nr_large = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t off = sorted[i].offset;
+    err |= write_be32(f, ctx, off < 0x80000000ULL ? (uint32_t)off : (0x80000000u | nr_large++));
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t off = sorted[i].offset;
+    if (off >= 0x80000000ULL) {
+      err |= write_be32(f, ctx, (uint32_t)(off >> 32));
+      err |= write_be32(f, ctx, (uint32_t)off);
+    }
+  }
+  err |= write_hashed(f, ctx, pack_sha->hash, 20);
+
+  unsigned char idx_sha[20];
+  EVP_DigestFinal_ex(ctx, idx_sha, NULL);
+  EVP_MD_CTX_free(ctx);
+  err |= fwrite(idx_sha, 1, 20, f) != 20;
+  err |= fflush(f) != 0 || fsync(fd) != 0;
+  if (fclose(f) != 0) err = 1;
+  if (err || rename(tmp_path, idx_path) != 0) {
+    fprintf(stderr, "Failed to write %s\n", idx_path);
+    unlink(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+/* Function to move a freshly written pack and index to their final
+* pack-<checksum> names, the index last so readers never see a pack
+* without one. On failure both are left at their temporary names.
+*/
+int finalize_pack(const char *tmp_pack, const char *tmp_idx, const sha1_t *pack_sha) {
+  char hex[41], pack_path[512], idx_path[512];
+  sha1_to_hex(pack_sha, hex);
+  snprintf(pack_path, sizeof(pack_path), "%s/pack-%s.pack", PACK_DIR, hex);
+  snprintf(idx_path, sizeof(idx_path), "%s/pack-%s.idx", PACK_DIR, hex);
+  // The same pack may be installed already, with its own index.
+  struct stat st;
+  int had_pack = stat(pack_path, &st) == 0;
+  if (rename(tmp_pack, pack_path) != 0) {
+    perror("rename pack");
+    return -1;
+  }
+  if (rename(tmp_idx, idx_path) != 0) {
+    perror("rename pack index");
+    if (!had_pack && rename(pack_path, tmp_pack) != 0) {
+      perror("restore pack");
+    }
+    return -1;
+  }
+  reprepare_packed_git();
+  return 0;
+}
+
+static int default_threads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+static unsigned char *map_pack(const char *pack_path, size_t *size) {
+  int fd = open(pack_path, O_RDONLY);
+  if (fd < 0) {
+    perror("open pack");
+    return NULL;
+  }
+  struct stat st_buf;
+  if (fstat(fd, &st_buf) < 0 || st_buf.st_size < 12 + 20) {
+    fprintf(stderr, "%s is too short to be a pack\n", pack_path);
+    close(fd);
+    return NULL;
+  }
+  *size = st_buf.st_size;
+  unsigned char *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap pack");
+    return NULL;
+  }
+  return map;
+}
+
+// Resolve the deltas the sequential pass found, against the whole pack
+// now mapped, and write the index.
+static int resolve_and_write(pack_indexer *ix, const unsigned char *map, size_t map_size, const char *idx_path,
+                             int threads, sha1_t *pack_sha) {
+  index_state *st = &ix->st;
+  if (ix->phase != SCAN_TRAILER || ix->buf_len != 20) {
+    fprintf(stderr, "Pack is truncated\n");
+    return -1;
+  }
+  if (map_size != ix->pos) {
+    fprintf(stderr, "Pack changed while being indexed\n");
+    return -1;
+  }
+  st->map = map;
+  st->map_size = map_size;
+  memcpy(pack_sha->hash, ix->buf, 20);
+
+  qsort(st->ofs_deltas, st->nr_ofs_deltas, sizeof(delta_ref), cmp_base_offset);
+  qsort(st->ref_deltas, st->nr_ref_deltas, sizeof(delta_ref), cmp_base_sha);
+
+  if (threads <= 0) {
+    threads = default_threads();
+  }
+  pthread_t *workers = malloc(threads * sizeof(*workers));
+  int started = 0;
+  for (int t = 0; workers && t < threads; t++) {
+    if (pthread_create(&workers[t], NULL, resolve_worker, st) != 0) {
+      break;
+    }
+    started++;
+  }
+  if (started == 0) {
+    // Fall back to resolving on this thread.
+    resolve_worker(st);
+  }
+  for (int t = 0; t < started; t++) {
+    pthread_join(workers[t], NULL);
+  }
+  free(workers);
+
+  uint32_t nr_deltas = st->nr_ofs_deltas + st->nr_ref_deltas;
+  if (atomic_load(&st->failed) || atomic_load(&st->nr_resolved) != nr_deltas) {
+    fprintf(stderr, "Pack has %u unresolved deltas\n", nr_deltas - atomic_load(&st->nr_resolved));
+    return -1;
+  }
+
+  pack_idx_entry *sorted = malloc((st->nr_objects ? st->nr_objects : 1) * sizeof(*sorted));
+  if (!sorted) {
+    fprintf(stderr, "Failed to allocate index for %u objects\n", st->nr_objects);
+    return -1;
+  }
+  for (uint32_t i = 0; i < st->nr_objects; i++) {
+    sorted[i].sha = st->objs[i].sha;
+    sorted[i].crc = st->objs[i].crc;
+    sorted[i].offset = st->objs[i].offset;
+  }
+  sort_pack_idx_entries(sorted, st->nr_objects);
+  int ret = write_pack_idx(idx_path, sorted, st->nr_objects, pack_sha);
+  free(sorted);
+  return ret;
+}
+
+/* Function to finish indexing a pack that was fed whole to ix
+* The pack, now complete at pack_path, is mapped to resolve the deltas,
+* and the index is written to idx_path. pack_sha receives the pack's
+* trailing checksum, which the caller verified while receiving. threads
+* is as for index_pack. ix is freed.
+*/
+int pack_indexer_finish(pack_indexer *ix, const char *pack_path, const char *idx_path, int threads,
+                        sha1_t *pack_sha) {
+  size_t map_size;
+  unsigned char *map = map_pack(pack_path, &map_size);
+  int ret = map ? resolve_and_write(ix, map, map_size, idx_path, threads, pack_sha) : -1;
+  if (map) {
+    munmap(map, map_size);
+  }
+  pack_indexer_free(ix);
+  return ret;
+}
+
+/* Function to index a packfile
+* Writes a v2 index for pack_path to idx_path and returns the pack's
+* trailing checksum in pack_sha. threads <= 0 uses one worker per CPU.
+* verify can be cleared when the checksum was already checked.
+*/
+int index_pack(const char *pack_path, const char *idx_path, int threads, int verify, sha1_t *pack_sha) {
+  size_t map_size;
+  unsigned char *map = map_pack(pack_path, &map_size);
+  if (!map) {
+    return -1;
+  }
+
+  // The trailer must be the SHA-1 of everything before it.
+  if (verify) {
+    unsigned char checksum[20];
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+    EVP_DigestUpdate(ctx, map, map_size - 20);
+    EVP_DigestFinal_ex(ctx, checksum, NULL);
+    EVP_MD_CTX_free(ctx);
+    if (memcmp(checksum, map + map_size - 20, 20) != 0) {
+      fprintf(stderr, "Pack checksum mismatch in %s\n", pack_path);
+      munmap(map, map_size);
+      return -1;
+    }
+  }
+
+  pack_indexer *ix = pack_indexer_new();
+  int ret = -1;
+  if (ix && pack_indexer_feed(ix, map, map_size) == 0) {
+    ret = resolve_and_write(ix, map, map_size, idx_path, threads, pack_sha);
+  }
+  pack_indexer_free(ix);
+  munmap(map, map_size);
+  return ret;
+}
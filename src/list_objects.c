@@ -0,0 +1,200 @@
+/**
+* list_objects.c - Every object reachable from a walk's commits
+* This is what rev-list --objects prints, and what packing and
+* connectivity checks need: the commits of a rev_walk, then the tags,
+* trees and blobs they reach, each once. Objects reachable from excluded
+* commits are put in the seen set before anything is listed, so they are
+* never listed; only the trees on the edge of the excluded history are
+* opened for that, not all of it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "list_objects.h"
+#include "oidset.h"
+#include "pack.h"
+#include "tree_walk.h"
+
+typedef struct {
+    oidset seen;
+    int show;                   /* list objects, or only mark them seen */
+    show_object_fn show_object;
+    void *show_data;
+    char *path;                 /* directory of the tree being read, with '/' */
+    size_t path_len;
+    size_t path_alloc;
+} traversal;
+
+typedef struct {
+    traversal *t;
+    const sha1_t *sha;
+} tree_visit;
+
+static int process_tree(traversal *t, const sha1_t *sha, const char *name, size_t namelen);
+
+static void path_append(traversal *t, const char *s, size_t len) {
+    if (t->path_len + len + 2 > t->path_alloc) {
+        t->path_alloc = (t->path_len + len + 2) * 2;
+        t->path = realloc(t->path, t->path_alloc);
+        if (!t->path) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(t->path + t->path_len, s, len);
+    t->path_len += len;
+    t->path[t->path_len] = '\0';
+}
+
+static void path_truncate(traversal *t, size_t len) {
+    t->path_len = len;
+    if (t->path) {
+        t->path[len] = '\0';
+    }
+}
+
+// Go through the entries of one tree; subtrees are read while the
+// cache keeps this one pinned, so entries can point into its content.
+static int process_tree_entries(const object_span *obj, void *ctx) {
+    tree_visit *v = ctx;
+    traversal *t = v->t;
+    char hex[41];
+    if (strcmp(obj->type, "tree") != 0) {
+        sha1_to_hex(v->sha, hex);
+        fprintf(stderr, "fatal: object %s is a %s, not a tree\n", hex, obj->type);
+        return -1;
+    }
+    tree_desc desc;
+    name_entry e;
+    int r;
+    tree_desc_init(&desc, obj->data, obj->size);
+    while ((r = tree_entry_next(&desc, &e)) == 1) {
+        sha1_t id;
+        memcpy(id.hash, e.oid, 20);
+        if (S_ISDIR(e.mode)) {
+            if (process_tree(t, &id, e.path, e.pathlen) != 0) {
+                return -1;
+            }
+        } else if (!S_ISGITLINK(e.mode) && !oidset_insert(&t->seen, &id) && t->show) {
+            size_t base = t->path_len;
+            path_append(t, e.path, e.pathlen);
+            t->show_object(&id, t->path, t->show_data);
+            path_truncate(t, base);
+        }
+    }
+    if (r < 0) {
+        sha1_to_hex(v->sha, hex);
+        fprintf(stderr, "fatal: corrupt tree %s\n", hex);
+        return -1;
+    }
+    return 0;
+}
+
+// List (or mark) a tree and what it contains, depth first in tree
+// order, unless it was seen before.
+static int process_tree(traversal *t, const sha1_t *sha, const char *name, size_t namelen) {
+    if (oidset_insert(&t->seen, sha)) {
+        return 0;
+    }
+    size_t base = t->path_len;
+    if (t->show) {
+        path_append(t, name, namelen);
+        t->show_object(sha, t->path ? t->path : "", t->show_data);
+        if (t->path_len) {
+            path_append(t, "/", 1);
+        }
+    }
+    char hex[41];
+    sha1_to_hex(sha, hex);
+    tree_visit v = {t, sha};
+    int ret = visit_git_object(hex, process_tree_entries, &v);
+    path_truncate(t, base);
+    return ret;
+}
+
+static int process_pending(traversal *t, const rev_pending *p) {
+    if (p->type == OBJ_TREE) {
+        return process_tree(t, &p->sha, p->name, strlen(p->name));
+    }
+    if (!oidset_insert(&t->seen, &p->sha) && t->show) {
+        t->show_object(&p->sha, p->name, t->show_data);
+    }
+    return 0;
+}
+
+// What the excluded commits next to listed ones reach must not be
+// listed; their trees are the only ones that need opening, as git's
+// mark_edges_uninteresting does.
+static int mark_edges_uninteresting(traversal *t, rev_walk *w) {
+    for (size_t i = 0; i < w->list_nr; i++) {
+        commit_node *c = w->list[i];
+        if (c->flags & COMMIT_UNINTERESTING) {
+            if (process_tree(t, &c->tree, "", 0) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        for (uint32_t j = 0; j < c->nr_parents; j++) {
+            commit_node *p = c->parents[j];
+            if ((p->flags & COMMIT_UNINTERESTING) && process_tree(t, &p->tree, "", 0) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Function to show the commits of w, at most max_count of them (no
+* limit if < 0), and then every object they and the non-commit starting
+* points reach, as git's traverse_commit_list does
+* Returns -1 on error.
+*/
+int traverse_commit_list(rev_walk *w, long max_count, show_commit_fn show_commit, show_object_fn show_object,
+                         void *ctx) {
+    traversal t = {.show_object = show_object, .show_data = ctx};
+    sha1_t *trees = NULL;
+    size_t trees_nr = 0, trees_alloc = 0;
+    int ret = rev_walk_prepare(w);
+
+    for (size_t i = 0; ret == 0 && i < w->pending_nr; i++) {
+        if (w->pending[i].uninteresting) {
+            ret = process_pending(&t, &w->pending[i]);
+        }
+    }
+    if (ret == 0 && w->limited) {
+        ret = mark_edges_uninteresting(&t, w);
+    }
+    t.show = 1;
+
+    // Trees wait until all commits are out; they share most of their
+    // content, which is listed under the newest commit that has it.
+    commit_node *c;
+    while (ret == 0 && max_count-- != 0 && (c = rev_walk_next(w))) {
+        show_commit(c, ctx);
+        if (trees_nr == trees_alloc) {
+            trees_alloc = trees_alloc ? trees_alloc * 2 : 256;
+            trees = realloc(trees, trees_alloc * sizeof(*trees));
+            if (!trees) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        trees[trees_nr++] = c->tree;
+    }
+    if (w->error) {
+        ret = -1;
+    }
+    for (size_t i = 0; ret == 0 && i < w->pending_nr; i++) {
+        if (!w->pending[i].uninteresting) {
+            ret = process_pending(&t, &w->pending[i]);
+        }
+    }
+    for (size_t i = 0; ret == 0 && i < trees_nr; i++) {
+        ret = process_tree(&t, &trees[i], "", 0);
+    }
+    free(trees);
+    free(t.path);
+    oidset_clear(&t.seen);
+    return ret;
+}
@@ -0,0 +1,15 @@
+#ifndef LIST_OBJECTS_H
+#define LIST_OBJECTS_H
+
+#include "revision.h"
+
+/* Called for each commit of the walk, then for each tag, tree and blob
+* with the path it was reached by */
+typedef void (*show_commit_fn)(const commit_node *c, void *ctx);
+typedef void (*show_object_fn)(const sha1_t *sha, const char *path, void *ctx);
+
+/* Function prototypes */
+int traverse_commit_list(rev_walk *w, long max_count, show_commit_fn show_commit, show_object_fn show_object,
+                         void *ctx);
+
+#endif
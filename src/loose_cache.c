@@ -0,0 +1,133 @@
+/**
+* loose_cache.c - Which loose objects exist
+* Each of the 256 fanout directories is read with readdir at most once per
+* process, the first time an id starting with its byte is asked about, and
+* kept as a sorted array of sha1_t. Lookups are then a binary search, and
+* writers use object_exists to skip compressing and writing objects that
+* are already stored.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "blob.h"
+#include "pack.h"
+
+typedef struct {
+    int loaded;
+    int dir_exists;
+    sha1_t *items;
+    size_t nr;
+    size_t alloc;
+} loose_subdir;
+
+static loose_subdir subdirs[256];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int cmp_sha(const void *a, const void *b) {
+  return memcmp(a, b, sizeof(sha1_t));
+}
+
+static int push_sha(loose_subdir *d, const sha1_t *sha) {
+  if (d->nr == d->alloc) {
+    size_t alloc = d->alloc ? d->alloc * 2 : 16;
+    sha1_t *items = realloc(d->items, alloc * sizeof(*items));
+    if (!items) {
+      return -1;
+    }
+    d->items = items;
+    d->alloc = alloc;
+  }
+  d->items[d->nr++] = *sha;
+  return 0;
+}
+
+// Read one fanout directory into its sorted array.
+static void load_subdir(int first_byte) {
+  loose_subdir *d = &subdirs[first_byte];
+  d->loaded = 1;
+
+  char path[64];
+  snprintf(path, sizeof(path), "%s/%02x", OBJ_DIR, first_byte);
+  DIR *dir = opendir(path);
+  if (!dir) {
+    return;
+  }
+  d->dir_exists = 1;
+
+  char hex[41];
+  snprintf(hex, sizeof(hex), "%02x", first_byte);
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (strlen(entry->d_name) != 38) {
+      continue;
+    }
+    memcpy(hex + 2, entry->d_name, 39);
+    sha1_t sha;
+    if (hex_to_sha1(hex, &sha) == 0 && push_sha(d, &sha) != 0) {
+      break;
+    }
+  }
+  closedir(dir);
+  qsort(d->items, d->nr, sizeof(sha1_t), cmp_sha);
+}
+
+static loose_subdir *get_subdir(const sha1_t *sha) {
+  loose_subdir *d = &subdirs[sha->hash[0]];
+  if (!d->loaded) {
+    load_subdir(sha->hash[0]);
+  }
+  return d;
+}
+
+int has_loose_object(const sha1_t *sha) {
+  pthread_mutex_lock(&lock);
+  loose_subdir *d = get_subdir(sha);
+  int found = bsearch(sha, d->items, d->nr, sizeof(sha1_t), cmp_sha) != NULL;
+  pthread_mutex_unlock(&lock);
+  return found;
+}
+
+/* Function to check whether an object is stored, loose or packed */
+int object_exists(const sha1_t *sha) {
+  return has_loose_object(sha) || has_packed_object(sha);
+}
+
+/* Function to make sure the fanout directory for sha exists
+* The answer is cached with the directory listing, so only the first
+* object written into a new directory pays for mkdir.
+*/
+int prepare_loose_subdir(const sha1_t *sha) {
+  pthread_mutex_lock(&lock);
+  loose_subdir *d = get_subdir(sha);
+  int ret = 0;
+  if (!d->dir_exists) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s/%02x", OBJ_DIR, sha->hash[0]);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+      perror("mkdir");
+      ret = -1;
+    } else {
+      d->dir_exists = 1;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
+
+/* Function to record a loose object this process has just written */
+void loose_cache_add(const sha1_t *sha) {
+  pthread_mutex_lock(&lock);
+  loose_subdir *d = get_subdir(sha);
+  if (!bsearch(sha, d->items, d->nr, sizeof(sha1_t), cmp_sha) && push_sha(d, sha) == 0) {
+    // Insertion sort step: the new id bubbles down to its place.
+    size_t i = d->nr - 1;
+    while (i > 0 && cmp_sha(&d->items[i - 1], sha) > 0) {
+      d->items[i] = d->items[i - 1];
+      i--;
+    }
+    d->items[i] = *sha;
+  }
+  pthread_mutex_unlock(&lock);
+}
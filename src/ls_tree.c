@@ -0,0 +1,259 @@
+/**
+* ls_tree.c - The ls-tree command
+* Lists a tree as "<mode> <type> <id>\t<path>", recursively with -r. Paths
+* given on the command line prune the walk: a subtree is only read if it
+* lies on the way to one of them or inside one, so listing one directory
+* of a huge tree reads just the trees along its path. While a tree's
+* entries are printed, worker threads inflate the subtrees the walk will
+* descend into next, so the reading that is left overlaps with output.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ls_tree.h"
+#include "blob.h"
+#include "pack.h"
+#include "refs.h"
+#include "thread_pool.h"
+#include "tree_walk.h"
+
+/* How an entry relates to the paths asked for */
+enum {
+    MATCH_NONE,
+    MATCH_LEADING,  /* a directory on the way to one of them */
+    MATCH_ALL       /* one of them, or inside one */
+};
+
+typedef struct {
+    const ls_tree_options *opts;
+    char *const *paths;
+    int nr;
+    thread_pool *pool;          /* NULL when nothing is prefetched */
+    char *path;                 /* of the entry at hand */
+    size_t path_len;
+    size_t path_alloc;
+} ls_walk;
+
+typedef struct {
+    ls_walk *w;
+    int match_all;              /* the tree is inside a path asked for */
+} ls_visit;
+
+static int list_tree(ls_walk *w, const sha1_t *sha, int match_all);
+
+static void path_append(ls_walk *w, const char *s, size_t len) {
+    if (w->path_len + len + 2 > w->path_alloc) {
+        w->path_alloc = (w->path_len + len + 2) * 2;
+        w->path = realloc(w->path, w->path_alloc);
+        if (!w->path) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(w->path + w->path_len, s, len);
+    w->path_len += len;
+    w->path[w->path_len] = '\0';
+}
+
+// Compare the entry at w->path against the paths asked for. A path with
+// a trailing slash only names a directory.
+static int match_paths(const ls_walk *w, int is_dir) {
+    int match = MATCH_NONE;
+    for (int i = 0; i < w->nr; i++) {
+        const char *spec = w->paths[i];
+        size_t len = strlen(spec);
+        int dir_only = len && spec[len - 1] == '/';
+        len -= dir_only;
+        if (len == 0) {
+            return MATCH_ALL;
+        }
+        if (len == w->path_len && memcmp(spec, w->path, len) == 0) {
+            if (!dir_only || is_dir) {
+                return MATCH_ALL;
+            }
+        } else if (is_dir && len > w->path_len && spec[w->path_len] == '/' &&
+                   memcmp(spec, w->path, w->path_len) == 0) {
+            match = MATCH_LEADING;
+        }
+    }
+    return match;
+}
+
+// Without -r, a subtree is only entered if a path asked for goes on
+// below it, as in git's show_recursive.
+static int goes_below(const ls_walk *w) {
+    for (int i = 0; i < w->nr; i++) {
+        const char *spec = w->paths[i];
+        if (strlen(spec) > w->path_len && spec[w->path_len] == '/' && memcmp(spec, w->path, w->path_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Decide about the entry whose path was just appended to w->path.
+static int classify(const ls_walk *w, const name_entry *e, int match_all, int *recurse) {
+    int is_dir = S_ISDIR(e->mode);
+    int match = match_all || !w->nr ? MATCH_ALL : match_paths(w, is_dir);
+    *recurse = match != MATCH_NONE && is_dir && (w->opts->recursive || goes_below(w));
+    return match;
+}
+
+static void prefetch_task(void *arg) {
+    prefetch_git_object(arg);
+    free(arg);
+}
+
+// Hand the subtrees the walk is going to read to the workers.
+static void prefetch_subtrees(ls_walk *w, const object_span *obj, int match_all) {
+    size_t base = w->path_len;
+    tree_desc desc;
+    name_entry e;
+    int recurse;
+    tree_desc_init(&desc, obj->data, obj->size);
+    while (tree_entry_next(&desc, &e) == 1) {
+        if (!S_ISDIR(e.mode)) {
+            continue;
+        }
+        path_append(w, e.path, e.pathlen);
+        classify(w, &e, match_all, &recurse);
+        w->path_len = base;
+        if (recurse) {
+            sha1_t *sha = malloc(sizeof(*sha));
+            if (!sha) {
+                return;
+            }
+            memcpy(sha->hash, e.oid, 20);
+            thread_pool_submit(w->pool, prefetch_task, sha);
+        }
+    }
+}
+
+static void show_entry(const ls_walk *w, const name_entry *e) {
+    if (!w->opts->name_only) {
+        char hex[41];
+        sha1_t sha;
+        memcpy(sha.hash, e->oid, 20);
+        sha1_to_hex(&sha, hex);
+        const char *type = S_ISDIR(e->mode) ? "tree" : S_ISGITLINK(e->mode) ? "commit" : "blob";
+        printf("%06o %s %s\t", (unsigned)e->mode, type, hex);
+    }
+    write_c_path(stdout, w->path, w->path_len);
+    putchar('\n');
+}
+
+static int list_tree_entries(const object_span *obj, void *ctx) {
+    ls_visit *v = ctx;
+    ls_walk *w = v->w;
+    if (strcmp(obj->type, "tree") != 0) {
+        fprintf(stderr, "fatal: not a tree object\n");
+        return -1;
+    }
+    if (w->pool) {
+        prefetch_subtrees(w, obj, v->match_all);
+    }
+    size_t base = w->path_len;
+    tree_desc desc;
+    name_entry e;
+    int r, recurse;
+    tree_desc_init(&desc, obj->data, obj->size);
+    while ((r = tree_entry_next(&desc, &e)) == 1) {
+        path_append(w, e.path, e.pathlen);
+        int match = classify(w, &e, v->match_all, &recurse);
+        if (match != MATCH_NONE && (!recurse || w->opts->show_trees)) {
+            show_entry(w, &e);
+        }
+        if (recurse) {
+            sha1_t sha;
+            memcpy(sha.hash, e.oid, 20);
+            path_append(w, "/", 1);
+            if (list_tree(w, &sha, match == MATCH_ALL) != 0) {
+                return -1;
+            }
+        }
+        w->path_len = base;
+    }
+    if (r < 0) {
+        fprintf(stderr, "fatal: corrupt tree object\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int list_tree(ls_walk *w, const sha1_t *sha, int match_all) {
+    char hex[41];
+    sha1_to_hex(sha, hex);
+    ls_visit v = {w, match_all};
+    return visit_git_object(hex, list_tree_entries, &v);
+}
+
+typedef struct {
+    int type;
+    sha1_t next;   /* a commit's tree or a tag's object */
+} peel_state;
+
+static int peel_object(const object_span *obj, void *ctx) {
+    peel_state *peel = ctx;
+    peel->type = type_from_name(obj->type);
+    const char *key = peel->type == OBJ_COMMIT ? "tree " : peel->type == OBJ_TAG ? "object " : NULL;
+    if (key) {
+        size_t n = strlen(key);
+        if (obj->size < n + 40 || strncmp((const char *)obj->data, key, n) != 0 ||
+            hex_to_sha1((const char *)obj->data + n, &peel->next) != 0) {
+            fprintf(stderr, "fatal: corrupt %s object\n", obj->type);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Follow tags and commits down to a tree.
+static int peel_to_tree(sha1_t *sha) {
+    for (int depth = 0; depth < 100; depth++) {
+        peel_state peel = {0};
+        char hex[41];
+        sha1_to_hex(sha, hex);
+        if (visit_git_object(hex, peel_object, &peel) != 0) {
+            return -1;
+        }
+        if (peel.type == OBJ_TREE) {
+            return 0;
+        }
+        if (peel.type != OBJ_COMMIT && peel.type != OBJ_TAG) {
+            break;
+        }
+        *sha = peel.next;
+    }
+    fprintf(stderr, "fatal: not a tree object\n");
+    return -1;
+}
+
+/* Function to list the tree tree_ish names, or the tree of a commit or
+* tag, limited to paths if nr > 0; returns -1 on error
+*/
+int ls_tree(const char *tree_ish, char *const *paths, int nr, const ls_tree_options *opts) {
+    sha1_t sha;
+    if (resolve_rev(tree_ish, &sha) != 0 || peel_to_tree(&sha) != 0) {
+        return -1;
+    }
+    ls_walk w = {.opts = opts, .paths = paths, .nr = nr};
+    // "." is the whole tree, run from the top as ls-tree always is here.
+    for (int i = 0; i < nr; i++) {
+        if (strcmp(paths[i], ".") == 0) {
+            w.nr = 0;
+        }
+    }
+    // A single level needs no help; one CPU gains nothing from it.
+    if ((opts->recursive || w.nr) && sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+        w.pool = thread_pool_new(0);
+    }
+    int ret = list_tree(&w, &sha, 0);
+    if (w.pool) {
+        thread_pool_wait(w.pool);
+        thread_pool_free(w.pool);
+    }
+    free(w.path);
+    return ret;
+}
@@ -0,0 +1,13 @@
+#ifndef LS_TREE_H
+#define LS_TREE_H
+
+typedef struct {
+    int recursive;    /* -r: list the contents of subtrees too */
+    int show_trees;   /* -t: also list the subtrees that are descended into */
+    int name_only;    /* --name-only: paths without mode, type and id */
+} ls_tree_options;
+
+/* Function prototypes */
+int ls_tree(const char *tree_ish, char *const *paths, int nr, const ls_tree_options *opts);
+
+#endif
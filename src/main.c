@@ -4,12 +4,76 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include "blob.h"
+#include "object_cache.h"
+#include "pack.h"
+#include "object_writer.h"
+#include "sha1_engine.h"
+#include "index_file.h"
+#include "hash_paths.h"
+#include "fast_import.h"
+#include "revision.h"
+#include "commit_graph.h"
+#include "refs.h"
+#include "ls_tree.h"
+
+static void report_object_cache(void) {
+    object_cache_report(stderr);
+}
+
+static void report_delta_cache(void) {
+    delta_base_cache_report(stderr);
+}
+
+static void report_object_writes(void) {
+    object_writer_report(stderr);
+}
+
+// Commands writing many loose objects can leave the file work to
+// background I/O, which pays off on slow or network storage:
+// GIT_OBJECT_IO=uring (I/O threads when io_uring is unavailable) or
+// GIT_OBJECT_IO=threads. Writes are synchronous by default.
+static void start_object_io(void) {
+    const char *name = getenv("GIT_OBJECT_IO");
+    if (!name) {
+        return;
+    }
+    async_io_kind kind = strcmp(name, "uring") == 0 ? ASYNC_IO_URING
+                       : strcmp(name, "threads") == 0 ? ASYNC_IO_THREADS : ASYNC_IO_NONE;
+    object_writer_start_async(kind);
+}
 
 int main(int argc, char *argv[]) {
     // Disable output buffering
     setbuf(stdout, NULL);
     setbuf(stderr, NULL);
 
+    if (getenv("GIT_TRACE_OBJECT_CACHE")) {
+        atexit(report_object_cache);
+    }
+    if (getenv("GIT_TRACE_DELTA_CACHE")) {
+        atexit(report_delta_cache);
+    }
+    if (getenv("GIT_TRACE_OBJECT_WRITES")) {
+        atexit(report_object_writes);
+    }
+    if (getenv("GIT_SHA1_ENGINE")) {
+        const char *name = getenv("GIT_SHA1_ENGINE");
+        sha1_engine_kind kind = strcmp(name, "avx2") == 0 ? SHA1_ENGINE_AVX2
+                              : strcmp(name, "evp") == 0 ? SHA1_ENGINE_EVP : SHA1_ENGINE_AUTO;
+        if (sha1_engine_set(kind) != 0) {
+            fprintf(stderr, "SHA-1 engine %s is not supported on this CPU\n", name);
+        }
+    }
+    if (getenv("GIT_FSYNC_OBJECTS")) {
+        object_writer_set_fsync(atoi(getenv("GIT_FSYNC_OBJECTS")));
+    }
+    if (getenv("GIT_DELTA_BASE_CACHE_LIMIT")) {
+        delta_base_cache_set_limit(strtoull(getenv("GIT_DELTA_BASE_CACHE_LIMIT"), NULL, 10));
+    }
+    if (getenv("GIT_OBJECT_CACHE_BUDGET")) {
+        object_cache_set_budget(strtoull(getenv("GIT_OBJECT_CACHE_BUDGET"), NULL, 10));
+    }
+
     if (argc < 2) {
         fprintf(stderr, "Usage: ./your_program.sh <command> [<args>]\n");
         return 1;
@@ -41,49 +105,159 @@ int main(int argc, char *argv[]) {
         printf("Initialized git directory\n");
 
     }else if (strcmp(command, "cat-file") == 0) {
+        if (argc >= 3 && (strcmp(argv[2], "--batch") == 0 || strcmp(argv[2], "--batch-check") == 0)) {
+            int buffer_output = argc == 4 && strcmp(argv[3], "--buffer") == 0;
+            if (argc > 4 || (argc == 4 && !buffer_output)) {
+                fprintf(stderr, "Usage: ./your_program.sh cat-file (--batch | --batch-check) [--buffer]\n");
+                return 1;
+            }
+            // Records are small and many, so let stdio batch the writes.
+            setvbuf(stdout, NULL, _IOFBF, CHUNK);
+            return cat_file_batch(strcmp(argv[2], "--batch-check") == 0, buffer_output);
+        }
         if (argc < 4 || strcmp(argv[2], "-p") != 0) {
             fprintf(stderr, "Usage: ./your_program.sh cat-file -p <object_hash>\n");
             return 1; 
         }
         
-        char *path = malloc(sizeof(char) * (SHA_LEN + 2 + strlen(OBJ_DIR)));
-        FILE *blob_file = NULL;
-        
-        get_file_path(path, argv[3]);
-        blob_file = fopen(path, "rb");
-        if (blob_file == NULL) {
-            fprintf(stderr, "Failed to open file %s: %s\n", path, strerror(errno));
-            return 1;
-        }
-        cat_file(path, path);
-        
-        free(path);
-        fclose(blob_file);
+        return cat_file(argv[3]) == 0 ? 0 : 1;
     } else if (strcmp(command, "hash-object") == 0) {
-        if (argc < 4 || strcmp(argv[2], "-w") != 0) {
-            fprintf(stderr, "Usage: ./your_program.sh hash-object <filename>\n");
+        int write_flag = 0, stdin_paths = 0, nul_terminated = 0;
+        int first = 2;
+        for (; first < argc && argv[first][0] == '-'; first++) {
+            if (strcmp(argv[first], "-w") == 0) {
+                write_flag = 1;
+            } else if (strcmp(argv[first], "--stdin-paths") == 0) {
+                stdin_paths = 1;
+            } else if (strcmp(argv[first], "-z") == 0) {
+                nul_terminated = 1;
+            } else {
+                break;
+            }
+        }
+        if (stdin_paths ? first != argc : argc <= first || nul_terminated) {
+            fprintf(stderr, "Usage: ./your_program.sh hash-object [-w] <filename>...\n"
+                            "   or: ./your_program.sh hash-object [-w] --stdin-paths [-z]\n");
             return 1;
         }
-        
-        return hash_object(argv[3], 1);
+
+        // Paths on stdin go through one process-wide pipeline.
+        if (stdin_paths) {
+            if (write_flag) {
+                start_object_io();
+            }
+            int ret = hash_stdin_paths(write_flag, nul_terminated);
+            return ret == 0 && object_writer_finish_async() == 0 ? 0 : 128;
+        }
+
+        // Several files are hashed as a batch.
+        if (argc == first + 1) {
+            return hash_object(argv[first], write_flag) == 0 ? 0 : 1;
+        }
+        if (write_flag) {
+            start_object_io();
+        }
+        int ret = hash_objects(argv + first, argc - first, write_flag);
+        return ret == 0 && object_writer_finish_async() == 0 ? 0 : 1;
 
     } else if (strcmp(command, "ls-tree") == 0) {
-        if (argc < 4 || strcmp(argv[2], "--name-only") != 0) {
-            fprintf(stderr, "Usage: ./your_program.sh ls-tree --name-only <object_hash>\n");
+        ls_tree_options opts = {0};
+        int i = 2;
+        for (; i < argc && argv[i][0] == '-'; i++) {
+            if (strcmp(argv[i], "-r") == 0) {
+                opts.recursive = 1;
+            } else if (strcmp(argv[i], "-t") == 0) {
+                opts.show_trees = 1;
+            } else if (strcmp(argv[i], "--name-only") == 0) {
+                opts.name_only = 1;
+            } else {
+                break;
+            }
+        }
+        if (i >= argc || argv[i][0] == '-') {
+            fprintf(stderr, "Usage: ./your_program.sh ls-tree [-r] [-t] [--name-only] <tree-ish> [<path>...]\n");
             return 1;
         }
+        setvbuf(stdout, NULL, _IOFBF, CHUNK);
+        return ls_tree(argv[i], argv + i + 1, argc - i - 1, &opts) == 0 ? 0 : 128;
 
-        ls_tree(argv[3], 1);
-        // ls_tree(tree_file, strcmp(argv[2], "--name-only") == 0);
-        // free(path);
-        // fclose(tree_file);
     } else if (strcmp(command, "write-tree") == 0) {
-        sha1_t sha = write_tree(".");
+        int threads = -1, to_pack = 0;
+        for (int i = 2; i < argc; i++) {
+            if (strncmp(argv[i], "--threads=", 10) == 0) {
+                threads = atoi(argv[i] + 10);
+            } else if (strcmp(argv[i], "--to-pack") == 0) {
+                to_pack = 1;
+            } else {
+                fprintf(stderr, "Usage: ./your_program.sh write-tree [--threads=<n>] [--to-pack]\n");
+                return 1;
+            }
+        }
+        // The index, when there is one, saves hashing unchanged files.
+        git_index index;
+        if (read_index(&index) != 0) {
+            return 1;
+        }
+        // New objects can all go into one pack instead of loose files.
+        pack_writer *pack = NULL;
+        if (to_pack) {
+            if (!(pack = pack_writer_begin())) {
+                return 1;
+            }
+            object_writer_set_pack(pack);
+        } else {
+            start_object_io();
+        }
+        sha1_t sha = threads >= 0 ? write_tree_parallel(".", threads, &index)
+                                  : write_tree(".", &index);
+        // The index may only name objects that made it to disk.
+        if (object_writer_finish_async() != 0) {
+            return 1;
+        }
+        if (pack) {
+            sha1_t pack_sha;
+            object_writer_set_pack(NULL);
+            if (pack_writer_finish(pack, object_writer_fsync_enabled(), &pack_sha) < 0) {
+                return 1;
+            }
+        }
+        if (atomic_load(&index.changed) && write_index(&index) != 0) {
+            return 1;
+        }
+        discard_index(&index);
         for (int i = 0; i < 20; i++) {
             printf("%02x", sha.hash[i]);
         }
         printf("\n");
 
+    } else if (strcmp(command, "add") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: ./your_program.sh add <path>...\n");
+            return 1;
+        }
+        return add_paths(argv + 2, argc - 2) == 0 ? 0 : 128;
+
+    } else if (strcmp(command, "update-index") == 0) {
+        int allow_add = 0, allow_remove = 0, refresh = 0;
+        int argi = 2;
+        for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+            if (strcmp(argv[argi], "--add") == 0) {
+                allow_add = 1;
+            } else if (strcmp(argv[argi], "--remove") == 0) {
+                allow_remove = 1;
+            } else if (strcmp(argv[argi], "--refresh") == 0) {
+                refresh = 1;
+            } else if (strcmp(argv[argi], "--") == 0) {
+                argi++;
+                break;
+            } else {
+                fprintf(stderr, "Usage: ./your_program.sh update-index [--add] [--remove] [--refresh] [--] <file>...\n");
+                return 1;
+            }
+        }
+        int ret = update_index(argv + argi, argc - argi, allow_add, allow_remove, refresh);
+        return ret < 0 ? 128 : ret;
+
     } else if (strcmp(command, "commit-tree") == 0) {
         if (argc != 7 || strcmp(argv[3], "-p") != 0 || strcmp(argv[5], "-m") != 0) {
             fprintf(stderr, "Usage: ./your_program.sh commit-tree <tree_sha> -p <commit_sha> -m <message>\n");
@@ -98,6 +272,119 @@ int main(int argc, char *argv[]) {
         }
         return clone_repo(argv[2], argv[3]);
 
+    } else if (strcmp(command, "index-pack") == 0) {
+        int threads = 0;
+        int argi = 2;
+        if (argc > argi && strncmp(argv[argi], "--threads=", 10) == 0) {
+            threads = atoi(argv[argi] + 10);
+            argi++;
+        }
+        size_t len = argc == argi + 1 ? strlen(argv[argi]) : 0;
+        if (len < 6 || strcmp(argv[argi] + len - 5, ".pack") != 0) {
+            fprintf(stderr, "Usage: ./your_program.sh index-pack [--threads=<n>] <pack-file>.pack\n");
+            return 1;
+        }
+        char *idx_path = strdup(argv[argi]);
+        strcpy(idx_path + len - 5, ".idx");
+        sha1_t pack_sha;
+        int ret = index_pack(argv[argi], idx_path, threads, 1, &pack_sha);
+        free(idx_path);
+        if (ret != 0) {
+            return 1;
+        }
+        char hex[41];
+        sha1_to_hex(&pack_sha, hex);
+        printf("%s\n", hex);
+
+    } else if (strcmp(command, "fast-import") == 0) {
+        fast_import_options opts = {0};
+        for (int i = 2; i < argc; i++) {
+            if (strncmp(argv[i], "--import-marks=", 15) == 0) {
+                opts.import_marks = argv[i] + 15;
+            } else if (strncmp(argv[i], "--export-marks=", 15) == 0) {
+                opts.export_marks = argv[i] + 15;
+            } else if (strcmp(argv[i], "--quiet") == 0) {
+                opts.quiet = 1;
+            } else if (strcmp(argv[i], "--force") != 0) {
+                fprintf(stderr, "Usage: ./your_program.sh fast-import [--quiet] [--force] "
+                                "[--import-marks=<file>] [--export-marks=<file>] < <stream>\n");
+                return 1;
+            }
+        }
+        return fast_import(stdin, &opts) == 0 ? 0 : 128;
+
+    } else if (strcmp(command, "commit-graph") == 0) {
+        if (argc != 3 || strcmp(argv[2], "write") != 0) {
+            fprintf(stderr, "Usage: ./your_program.sh commit-graph write\n");
+            return 1;
+        }
+        return write_commit_graph() == 0 ? 0 : 1;
+
+    } else if (strcmp(command, "rev-list") == 0 || strcmp(command, "log") == 0) {
+        // log only knows the format rev-list prints anyway.
+        int is_log = strcmp(command, "log") == 0, format_ok = !is_log;
+        rev_list_options opts = {.max_count = -1};
+        char **revs = malloc(argc * sizeof(*revs));
+        int nr = 0;
+        for (int i = 2; i < argc; i++) {
+            if (strncmp(argv[i], "--max-count=", 12) == 0) {
+                opts.max_count = atol(argv[i] + 12);
+            } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+                opts.max_count = atol(argv[++i]);
+            } else if (strcmp(argv[i], "--all") == 0) {
+                opts.all = 1;
+            } else if (strcmp(argv[i], "--branches") == 0) {
+                opts.branches = 1;
+            } else if (!is_log && strcmp(argv[i], "--objects") == 0) {
+                opts.objects = 1;
+            } else if (is_log && (strcmp(argv[i], "--format=%H") == 0 ||
+                                  strcmp(argv[i], "--pretty=format:%H") == 0)) {
+                format_ok = 1;
+            } else if (argv[i][0] == '-') {
+                format_ok = 0;
+                break;
+            } else {
+                revs[nr++] = argv[i];
+            }
+        }
+        int have_revs = nr || opts.all || opts.branches;
+        if (is_log && !have_revs) {
+            revs[nr++] = "HEAD";
+            have_revs = 1;
+        }
+        if (!format_ok || !have_revs) {
+            fprintf(stderr, is_log ? "Usage: ./your_program.sh log --format=%%H [-n <n>] [--all|--branches] [<rev>...]\n"
+                                   : "Usage: ./your_program.sh rev-list [--objects] [-n <n>] [--all|--branches] "
+                                     "<rev>... [^<rev>...]\n");
+            free(revs);
+            return 1;
+        }
+        setvbuf(stdout, NULL, _IOFBF, CHUNK);
+        int ret = rev_list(revs, nr, &opts);
+        free(revs);
+        return ret == 0 ? 0 : 128;
+
+    } else if (strcmp(command, "merge-base") == 0) {
+        if (argc != 5 || strcmp(argv[2], "--is-ancestor") != 0) {
+            fprintf(stderr, "Usage: ./your_program.sh merge-base --is-ancestor <commit> <commit>\n");
+            return 1;
+        }
+        sha1_t a, b;
+        commit_node *ca, *cb;
+        if (resolve_rev(argv[3], &a) != 0 || resolve_rev(argv[4], &b) != 0 ||
+            !(ca = lookup_commit_reference(&a, 0)) || !(cb = lookup_commit_reference(&b, 0))) {
+            return 128;
+        }
+        int ret = is_ancestor(ca, cb);
+        return ret < 0 ? 128 : !ret;
+
+    } else if (strcmp(command, "multi-pack-index") == 0) {
+        if (argc != 3 || strcmp(argv[2], "write") != 0) {
+            fprintf(stderr, "Usage: ./your_program.sh multi-pack-index write\n");
+            return 1;
+        }
+        return write_multi_pack_index() == 0 ? 0 : 1;
+
     } else {
         fprintf(stderr, "Unknown command %s\n", command);
         return 1;
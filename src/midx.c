@@ -0,0 +1,370 @@
+/**
+* midx.c - Multi-pack index
+* The multi-pack-index file under .git/objects/pack maps every packed
+* object id to (pack, offset) through one fanout table and one sorted id
+* table, so a lookup is a single binary search however many packs have
+* piled up. The file follows git's MIDX version 1 layout: a chunk table
+* with PNAM, OIDF, OIDL, OOFF and, when needed, LOFF chunks.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "pack.h"
+#include "hash_io.h"
+
+#define MIDX_SIGNATURE 0x4d494458 /* "MIDX" */
+#define MIDX_VERSION 1
+#define MIDX_HASH_VERSION 1
+#define MIDX_HEADER_SIZE 12
+#define MIDX_CHUNK_ENTRY_SIZE 12
+#define MIDX_LARGE_OFFSET 0x80000000u
+
+#define CHUNK_PNAM 0x504e414d
+#define CHUNK_OIDF 0x4f494446
+#define CHUNK_OIDL 0x4f49444c
+#define CHUNK_OOFF 0x4f4f4646
+#define CHUNK_LOFF 0x4c4f4646
+
+static multi_pack_index *midx;
+
+static const char *pack_basename(const packed_git *p) {
+  const char *slash = strrchr(p->pack_path, '/');
+  return slash ? slash + 1 : p->pack_path;
+}
+
+// Compare a .idx name from the midx with a pack's .pack path.
+static int same_pack_name(const char *idx_name, const packed_git *p) {
+  const char *base = pack_basename(p);
+  size_t len = strlen(base);
+  return len > 5 && strncmp(idx_name, base, len - 5) == 0 && strcmp(idx_name + len - 5, ".idx") == 0;
+}
+
+void close_multi_pack_index(void) {
+  if (!midx) {
+    return;
+  }
+  munmap(midx->map, midx->size);
+  free(midx->pack_names);
+  free(midx->packs);
+  free(midx);
+  midx = NULL;
+}
+
+/* Function to map the multi-pack-index and bind its pack names to the
+* already mapped packs, which are then flagged so plain idx probing skips
+* them. A missing or unreadable file simply leaves every pack unflagged.
+*/
+void load_multi_pack_index(packed_git *packs) {
+  close_multi_pack_index();
+
+  int fd = open(MIDX_PATH, O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < MIDX_HEADER_SIZE + 20) {
+    close(fd);
+    return;
+  }
+  unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return;
+  }
+
+  multi_pack_index *m = calloc(1, sizeof(*m));
+  m->map = map;
+  m->size = st.st_size;
+  if (get_be32(map) != MIDX_SIGNATURE || map[4] != MIDX_VERSION || map[5] != MIDX_HASH_VERSION) {
+    goto bad;
+  }
+  int num_chunks = map[6];
+  m->num_packs = get_be32(map + 8);
+  if (MIDX_HEADER_SIZE + (size_t)(num_chunks + 1) * MIDX_CHUNK_ENTRY_SIZE > m->size - 20) {
+    goto bad;
+  }
+
+  const unsigned char *pnam = NULL;
+  uint64_t pnam_size = 0, loff_size = 0, oidf_size = 0, oidl_size = 0, ooff_size = 0;
+  for (int i = 0; i < num_chunks; i++) {
+    const unsigned char *e = map + MIDX_HEADER_SIZE + (size_t)i * MIDX_CHUNK_ENTRY_SIZE;
+    uint32_t id = get_be32(e);
+    uint64_t off = get_be64(e + 4);
+    uint64_t next = get_be64(e + MIDX_CHUNK_ENTRY_SIZE + 4);
+    if (off > next || next > m->size - 20) {
+      goto bad;
+    }
+    switch (id) {
+      case CHUNK_PNAM: pnam = map + off; pnam_size = next - off; break;
+      case CHUNK_OIDF: m->fanout = map + off; oidf_size = next - off; break;
+      case CHUNK_OIDL: m->oids = map + off; oidl_size = next - off; break;
+      case CHUNK_OOFF: m->offsets = map + off; ooff_size = next - off; break;
+      case CHUNK_LOFF: m->large_offsets = map + off; loff_size = next - off; break;
+    }
+  }
+  if (!pnam || !m->fanout || !m->oids || !m->offsets || oidf_size < 256 * 4) {
+    goto bad;
+  }
+  // Any fanout slot bounds a search, so each must stay within the last.
+  for (int i = 0; i < 255; i++) {
+    if (get_be32(m->fanout + i * 4) > get_be32(m->fanout + (i + 1) * 4)) {
+      goto bad;
+    }
+  }
+  m->num_objects = get_be32(m->fanout + 255 * 4);
+  m->nr_large_offsets = loff_size / 8;
+  // Lookups index these by object, so they must cover every one.
+  if (oidl_size < (uint64_t)m->num_objects * 20 || ooff_size < (uint64_t)m->num_objects * 8) {
+    goto bad;
+  }
+
+  m->pack_names = calloc(m->num_packs ? m->num_packs : 1, sizeof(*m->pack_names));
+  m->packs = calloc(m->num_packs ? m->num_packs : 1, sizeof(*m->packs));
+  const char *name = (const char *)pnam, *end = (const char *)pnam + pnam_size;
+  for (uint32_t i = 0; i < m->num_packs; i++) {
+    const char *nul = memchr(name, '\0', end - name);
+    if (!nul) {
+      goto bad;
+    }
+    m->pack_names[i] = name;
+    name = nul + 1;
+    for (packed_git *p = packs; p; p = p->next) {
+      if (same_pack_name(m->pack_names[i], p)) {
+        m->packs[i] = p;
+        p->in_midx = 1;
+      }
+    }
+  }
+  midx = m;
+  return;
+
+bad:
+  fprintf(stderr, "warning: ignoring corrupt %s\n", MIDX_PATH);
+  for (packed_git *p = packs; p; p = p->next) {
+    p->in_midx = 0;
+  }
+  munmap(map, st.st_size);
+  free(m->pack_names);
+  free(m->packs);
+  free(m);
+}
+
+/* Function to look an object up through the multi-pack-index */
+int midx_find_entry(const sha1_t *sha, packed_git **pack, uint64_t *offset) {
+  if (!midx) {
+    return -1;
+  }
+  uint32_t lo = sha->hash[0] ? get_be32(midx->fanout + (sha->hash[0] - 1) * 4) : 0;
+  uint32_t hi = get_be32(midx->fanout + sha->hash[0] * 4);
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int cmp = memcmp(sha->hash, midx->oids + (size_t)mid * 20, 20);
+    if (cmp < 0) {
+      hi = mid;
+    } else if (cmp > 0) {
+      lo = mid + 1;
+    } else {
+      const unsigned char *e = midx->offsets + (size_t)mid * 8;
+      uint32_t pack_id = get_be32(e);
+      uint32_t off = get_be32(e + 4);
+      if (pack_id >= midx->num_packs || !midx->packs[pack_id]) {
+        return -1;
+      }
+      if ((off & MIDX_LARGE_OFFSET) && midx->large_offsets) {
+        uint32_t idx = off & ~MIDX_LARGE_OFFSET;
+        if (idx >= midx->nr_large_offsets) {
+          return -1;
+        }
+        *offset = get_be64(midx->large_offsets + (size_t)idx * 8);
+      } else {
+        *offset = off;
+      }
+      *pack = midx->packs[pack_id];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* One object as collected for writing */
+typedef struct {
+  sha1_t sha;
+  uint32_t pack_id;
+  uint64_t offset;
+  time_t mtime;
+} midx_entry;
+
+static int cmp_midx_entry(const void *a, const void *b) {
+  const midx_entry *x = a, *y = b;
+  int cmp = memcmp(x->sha.hash, y->sha.hash, 20);
+  if (cmp) return cmp;
+  // For duplicates, prefer the newest pack, then the lowest id.
+  if (x->mtime != y->mtime) return x->mtime > y->mtime ? -1 : 1;
+  return x->pack_id < y->pack_id ? -1 : x->pack_id > y->pack_id;
+}
+
+static int cmp_pack_name(const void *a, const void *b) {
+  return strcmp(pack_basename(*(packed_git *const *)a), pack_basename(*(packed_git *const *)b));
+}
+
+/* Function to write .git/objects/pack/multi-pack-index covering every pack */
+int write_multi_pack_index(void) {
+  reprepare_packed_git();
+  uint32_t num_packs = 0;
+  size_t total = 0;
+  for (packed_git *p = get_packed_git(); p; p = p->next) {
+    num_packs++;
+    total += p->num_objects;
+  }
+  if (num_packs == 0) {
+    fprintf(stderr, "No packs to index\n");
+    return -1;
+  }
+
+  packed_git **list = malloc(num_packs * sizeof(*list));
+  midx_entry *entries = malloc((total ? total : 1) * sizeof(*entries));
+  if (!list || !entries) {
+    fprintf(stderr, "Failed to allocate multi-pack-index for %zu objects\n", total);
+    free(list);
+    free(entries);
+    return -1;
+  }
+  uint32_t n = 0;
+  for (packed_git *p = get_packed_git(); p; p = p->next) {
+    list[n++] = p;
+  }
+  qsort(list, num_packs, sizeof(*list), cmp_pack_name);
+
+  size_t nr = 0;
+  for (uint32_t id = 0; id < num_packs; id++) {
+    packed_git *p = list[id];
+    struct stat st;
+    time_t mtime = stat(p->pack_path, &st) == 0 ? st.st_mtime : 0;
+    for (uint32_t i = 0; i < p->num_objects; i++) {
+      midx_entry *e = &entries[nr++];
+      memcpy(e->sha.hash, p->sha_table + (size_t)i * 20, 20);
+      e->pack_id = id;
+      e->mtime = mtime;
+      if (pack_nth_offset(p, i, &e->offset) != 0) {
+        free(list);
+        free(entries);
+        return -1;
+      }
+    }
+  }
+  qsort(entries, nr, sizeof(*entries), cmp_midx_entry);
+  size_t unique = 0;
+  for (size_t i = 0; i < nr; i++) {
+    if (unique == 0 || memcmp(entries[unique - 1].sha.hash, entries[i].sha.hash, 20) != 0) {
+      entries[unique++] = entries[i];
+    }
+  }
+  nr = unique;
+
+  // Offsets only move to LOFF once some offset no longer fits in 32 bits.
+  int large_needed = 0;
+  uint32_t nr_large = 0;
+  for (size_t i = 0; i < nr; i++) {
+    if (entries[i].offset > 0xffffffffULL) large_needed = 1;
+  }
+  if (large_needed) {
+    for (size_t i = 0; i < nr; i++) {
+      if (entries[i].offset >> 31) nr_large++;
+    }
+  }
+
+  size_t pnam_size = 0;
+  for (uint32_t id = 0; id < num_packs; id++) {
+    pnam_size += strlen(pack_basename(list[id])) - 5 + 4 + 1; /* .pack -> .idx */
+  }
+  size_t pnam_pad = (4 - pnam_size % 4) % 4;
+
+  uint32_t chunk_ids[5] = { CHUNK_PNAM, CHUNK_OIDF, CHUNK_OIDL, CHUNK_OOFF, CHUNK_LOFF };
+  uint64_t chunk_sizes[5] = { pnam_size + pnam_pad, 256 * 4, nr * 20, nr * 8, (uint64_t)nr_large * 8 };
+  int num_chunks = nr_large ? 5 : 4;
+
+  char tmp_path[512];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.lock", MIDX_PATH);
+  FILE *f = fopen(tmp_path, "wb");
+  if (!f) {
+    perror("fopen multi-pack-index");
+    free(list);
+    free(entries);
+    return -1;
+  }
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+  int err = 0;
+
+  unsigned char buf[MIDX_CHUNK_ENTRY_SIZE];
+  put_be32(buf, MIDX_SIGNATURE);
+  buf[4] = MIDX_VERSION;
+  buf[5] = MIDX_HASH_VERSION;
+  buf[6] = (unsigned char)num_chunks;
+  buf[7] = 0; /* no base files */
+  put_be32(buf + 8, num_packs);
+  err |= write_hashed(f, ctx, buf, MIDX_HEADER_SIZE);
+
+  uint64_t offset = MIDX_HEADER_SIZE + (uint64_t)(num_chunks + 1) * MIDX_CHUNK_ENTRY_SIZE;
+  for (int i = 0; i <= num_chunks; i++) {
+    put_be32(buf, i < num_chunks ? chunk_ids[i] : 0);
+    put_be64(buf + 4, offset);
+    err |= write_hashed(f, ctx, buf, MIDX_CHUNK_ENTRY_SIZE);
+    if (i < num_chunks) offset += chunk_sizes[i];
+  }
+
+  for (uint32_t id = 0; id < num_packs; id++) {
+    const char *base = pack_basename(list[id]);
+    size_t len = strlen(base) - 5;
+    err |= write_hashed(f, ctx, base, len);
+    err |= write_hashed(f, ctx, ".idx", 5);
+  }
+  static const unsigned char zeros[4];
+  err |= write_hashed(f, ctx, zeros, pnam_pad);
+
+  size_t count = 0;
+  for (int b = 0; b < 256; b++) {
+    while (count < nr && entries[count].sha.hash[0] == b) count++;
+    put_be32(buf, (uint32_t)count);
+    err |= write_hashed(f, ctx, buf, 4);
+  }
+  for (size_t i = 0; i < nr; i++) {
+    err |= write_hashed(f, ctx, entries[i].sha.hash, 20);
+  }
+  uint32_t large_idx = 0;
+  for (size_t i = 0; i < nr; i++) {
+    put_be32(buf, entries[i].pack_id);
+    if (large_needed && (entries[i].offset >> 31)) {
+      put_be32(buf + 4, MIDX_LARGE_OFFSET | large_idx++);
+    } else {
+      put_be32(buf + 4, (uint32_t)entries[i].offset);
+    }
+    err |= write_hashed(f, ctx, buf, 8);
+  }
+  if (nr_large) {
+    for (size_t i = 0; i < nr; i++) {
+      if (entries[i].offset >> 31) {
+        put_be64(buf, entries[i].offset);
+        err |= write_hashed(f, ctx, buf, 8);
+      }
+    }
+  }
+
+  unsigned char checksum[20];
+  EVP_DigestFinal_ex(ctx, checksum, NULL);
+  EVP_MD_CTX_free(ctx);
+  err |= fwrite(checksum, 1, 20, f) != 20;
+  if (fclose(f) != 0) err = 1;
+  free(list);
+  free(entries);
+
+  if (err || rename(tmp_path, MIDX_PATH) != 0) {
+    fprintf(stderr, "Failed to write %s\n", MIDX_PATH);
+    remove(tmp_path);
+    return -1;
+  }
+  reprepare_packed_git();
+  return 0;
+}
@@ -0,0 +1,209 @@
+/**
+* object_cache.c - In-process LRU cache of inflated objects
+* Objects are keyed by their binary sha1_t and kept until the memory budget
+* is exceeded, at which point the least recently used unpinned entries are
+* evicted. Callers pin an entry while they read its span and release it
+* afterwards, so recursive readers never see their parent evicted.
+* A mutex guards the cache, so worker threads can fill it ahead of use.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "object_cache.h"
+
+#define INITIAL_BUCKETS 1024
+
+static cached_object **buckets;
+static size_t bucket_count;
+static cached_object *lru_head; /* most recently used */
+static cached_object *lru_tail; /* least recently used */
+static object_cache_stats stats = { .budget = OBJECT_CACHE_BUDGET };
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t sha_bucket(const sha1_t *sha, size_t count) {
+  // The object id is already uniformly distributed.
+  size_t h;
+  memcpy(&h, sha->hash, sizeof(h));
+  return h & (count - 1);
+}
+
+static void lru_unlink(cached_object *obj) {
+  if (obj->lru_prev) obj->lru_prev->lru_next = obj->lru_next;
+  else lru_head = obj->lru_next;
+  if (obj->lru_next) obj->lru_next->lru_prev = obj->lru_prev;
+  else lru_tail = obj->lru_prev;
+  obj->lru_prev = obj->lru_next = NULL;
+}
+
+static void lru_push_front(cached_object *obj) {
+  obj->lru_prev = NULL;
+  obj->lru_next = lru_head;
+  if (lru_head) lru_head->lru_prev = obj;
+  lru_head = obj;
+  if (!lru_tail) lru_tail = obj;
+}
+
+static void hash_unlink(cached_object *obj) {
+  cached_object **pp = &buckets[sha_bucket(&obj->sha, bucket_count)];
+  while (*pp && *pp != obj) {
+    pp = &(*pp)->hash_next;
+  }
+  if (*pp) *pp = obj->hash_next;
+}
+
+static void grow_buckets(void) {
+  size_t new_count = bucket_count ? bucket_count * 2 : INITIAL_BUCKETS;
+  cached_object **new_buckets = calloc(new_count, sizeof(*new_buckets));
+  if (!new_buckets) {
+    // Longer chains are still correct, just slower.
+    return;
+  }
+  for (size_t i = 0; i < bucket_count; i++) {
+    cached_object *obj = buckets[i];
+    while (obj) {
+      cached_object *next = obj->hash_next;
+      size_t b = sha_bucket(&obj->sha, new_count);
+      obj->hash_next = new_buckets[b];
+      new_buckets[b] = obj;
+      obj = next;
+    }
+  }
+  free(buckets);
+  buckets = new_buckets;
+  bucket_count = new_count;
+}
+
+static void free_entry(cached_object *obj) {
+  stats.bytes -= obj->cost;
+  stats.entries--;
+  free(obj->buffer);
+  free(obj);
+}
+
+// Evict least recently used unpinned entries until the budget is met.
+static void evict_to_budget(void) {
+  cached_object *obj = lru_tail;
+  while (obj && stats.bytes > stats.budget) {
+    cached_object *prev = obj->lru_prev;
+    if (obj->refs == 0) {
+      lru_unlink(obj);
+      hash_unlink(obj);
+      free_entry(obj);
+      stats.evictions++;
+    }
+    obj = prev;
+  }
+}
+
+void object_cache_set_budget(size_t budget) {
+  pthread_mutex_lock(&lock);
+  stats.budget = budget;
+  evict_to_budget();
+  pthread_mutex_unlock(&lock);
+}
+
+static cached_object *find_entry(const sha1_t *sha) {
+  if (bucket_count) {
+    cached_object *obj = buckets[sha_bucket(sha, bucket_count)];
+    for (; obj; obj = obj->hash_next) {
+      if (memcmp(obj->sha.hash, sha->hash, sizeof(sha->hash)) == 0) {
+        return obj;
+      }
+    }
+  }
+  return NULL;
+}
+
+static void pin(cached_object *obj) {
+  obj->refs++;
+  lru_unlink(obj);
+  lru_push_front(obj);
+}
+
+/* Function to look up and pin an object, or return NULL on a miss */
+cached_object *object_cache_get(const sha1_t *sha) {
+  pthread_mutex_lock(&lock);
+  cached_object *obj = find_entry(sha);
+  if (obj) {
+    stats.hits++;
+    pin(obj);
+  } else {
+    stats.misses++;
+  }
+  pthread_mutex_unlock(&lock);
+  return obj;
+}
+
+/* Function to add an inflated object to the cache
+* The cache takes ownership of buffer, the allocation span points into.
+* The returned entry is pinned for the caller. If another thread cached
+* the object meanwhile, buffer is freed and that entry is returned.
+*/
+cached_object *object_cache_put(const sha1_t *sha, unsigned char *buffer, const object_span *span) {
+  pthread_mutex_lock(&lock);
+  cached_object *obj = find_entry(sha);
+  if (obj) {
+    pin(obj);
+    pthread_mutex_unlock(&lock);
+    free(buffer);
+    return obj;
+  }
+  obj = calloc(1, sizeof(*obj));
+  if (!obj) {
+    pthread_mutex_unlock(&lock);
+    return NULL;
+  }
+  obj->sha = *sha;
+  obj->buffer = buffer;
+  obj->span = *span;
+  obj->cost = sizeof(*obj) + (span->data - buffer) + span->size;
+  obj->refs = 1;
+
+  if (stats.entries >= bucket_count) {
+    grow_buckets();
+  }
+  if (!bucket_count) {
+    pthread_mutex_unlock(&lock);
+    free(obj);
+    return NULL;
+  }
+  size_t b = sha_bucket(sha, bucket_count);
+  obj->hash_next = buckets[b];
+  buckets[b] = obj;
+  lru_push_front(obj);
+  stats.entries++;
+  stats.bytes += obj->cost;
+  evict_to_budget();
+  pthread_mutex_unlock(&lock);
+  return obj;
+}
+
+/* Function to unpin an entry; it stays cached until evicted */
+void object_cache_release(cached_object *obj) {
+  if (!obj) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  obj->refs--;
+  if (obj->refs == 0 && stats.bytes > stats.budget) {
+    evict_to_budget();
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+object_cache_stats object_cache_get_stats(void) {
+  pthread_mutex_lock(&lock);
+  object_cache_stats copy = stats;
+  pthread_mutex_unlock(&lock);
+  return copy;
+}
+
+void object_cache_report(FILE *out) {
+  object_cache_stats snap = object_cache_get_stats();
+  size_t lookups = snap.hits + snap.misses;
+  fprintf(out, "object cache: %zu hits, %zu misses (%.1f%% hit rate), %zu evictions, %zu entries, %zu/%zu bytes\n",
+          snap.hits, snap.misses, lookups ? 100.0 * snap.hits / lookups : 0.0,
+          snap.evictions, snap.entries, snap.bytes, snap.budget);
+}
@@ -0,0 +1,38 @@
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+#include "blob.h"
+
+/* Default memory budget for inflated objects kept in the cache */
+#define OBJECT_CACHE_BUDGET (64 * 1024 * 1024)
+
+/* An inflated object owned by the cache */
+typedef struct cached_object {
+    sha1_t sha;
+    object_span span;
+    unsigned char *buffer;
+    size_t cost;
+    int refs;
+    struct cached_object *hash_next;
+    struct cached_object *lru_prev;
+    struct cached_object *lru_next;
+} cached_object;
+
+typedef struct {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+} object_cache_stats;
+
+/* Function prototypes */
+void object_cache_set_budget(size_t budget);
+cached_object *object_cache_get(const sha1_t *sha);
+cached_object *object_cache_put(const sha1_t *sha, unsigned char *buffer, const object_span *span);
+void object_cache_release(cached_object *obj);
+object_cache_stats object_cache_get_stats(void);
+void object_cache_report(FILE *out);
+
+#endif
@@ -0,0 +1,466 @@
+/**
+* object_writer.c - Store loose objects
+* Every object write goes through here. The object id is computed first;
+* if the object is already stored, nothing else happens. Otherwise the
+* compressed object is written to a temporary file under .git/objects,
+* optionally fsynced, and renamed to its final path, so a crash can never
+* leave a torn object behind. While a pack is set with
+* object_writer_set_pack, new objects are appended to it instead. Between
+* object_writer_start_async and object_writer_finish_async, objects are
+* compressed in memory and the file work is left to async_io.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "object_writer.h"
+#include "sha1_engine.h"
+#include "pack.h"
+#include "async_io.h"
+
+static int fsync_objects;
+static pack_writer *target_pack;
+static atomic_size_t objects_written;
+static atomic_size_t objects_skipped;
+static atomic_uint_fast64_t bytes_written;
+static atomic_uint_fast64_t bytes_skipped;
+static pthread_key_t stream_key;
+static pthread_once_t stream_once = PTHREAD_ONCE_INIT;
+
+void object_writer_set_fsync(int enabled) {
+  fsync_objects = enabled;
+}
+
+int object_writer_fsync_enabled(void) {
+  return fsync_objects;
+}
+
+/* Function to send new objects to pw rather than loose files; NULL undoes it */
+void object_writer_set_pack(struct pack_writer *pw) {
+  target_pack = pw;
+}
+
+static void free_stream(void *p) {
+  deflateEnd(p);
+  free(p);
+}
+
+static void make_stream_key(void) {
+  pthread_key_create(&stream_key, free_stream);
+}
+
+/* Function to get this thread's deflate stream, reset for a new object
+* Setting up deflate allocates its window and hash tables; reusing one
+* stream per thread saves that for every object after the first.
+*/
+z_stream *deflate_thread_stream(void) {
+  pthread_once(&stream_once, make_stream_key);
+  z_stream *zs = pthread_getspecific(stream_key);
+  if (!zs) {
+    zs = calloc(1, sizeof(*zs));
+    if (!zs || deflateInit(zs, Z_BEST_COMPRESSION) != Z_OK) {
+      fprintf(stderr, "Failed to set up compression\n");
+      exit(1);
+    }
+    pthread_setspecific(stream_key, zs);
+  } else {
+    deflateReset(zs);
+  }
+  return zs;
+}
+
+/* Function to deflate in_len bytes into out, like inflate_sized
+* Input and output go to zlib at most UINT_MAX bytes at a time; flush is
+* only used once the last piece of input is in. *out_used receives the
+* bytes produced. Returns zlib's result from the last call.
+*/
+int deflate_sized(z_stream *stream, const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len,
+                  int flush, size_t *out_used) {
+  size_t in_left = in_len, out_left = out_len;
+  int ret;
+  stream->next_in = (unsigned char *)in;
+  stream->next_out = out;
+  for (;;) {
+    uInt in_chunk = in_left > UINT_MAX ? UINT_MAX : (uInt)in_left;
+    uInt out_chunk = out_left > UINT_MAX ? UINT_MAX : (uInt)out_left;
+    stream->avail_in = in_chunk;
+    stream->avail_out = out_chunk;
+    ret = deflate(stream, in_left > in_chunk ? Z_NO_FLUSH : flush);
+    in_left -= in_chunk - stream->avail_in;
+    out_left -= out_chunk - stream->avail_out;
+    // Go on only if a chunk limit, not the buffers, stopped it.
+    int clamped = (stream->avail_in == 0 && in_left > 0) || (stream->avail_out == 0 && out_left > 0);
+    if ((ret != Z_OK && ret != Z_BUF_ERROR) || !clamped) {
+      break;
+    }
+  }
+  *out_used = out_len - out_left;
+  return ret;
+}
+
+// Feed len bytes through the deflate stream, writing every output chunk.
+// avail_in is only a uInt, so larger input goes in pieces, and flush is
+// only asked for with the last one.
+static int deflate_to_file(z_stream *stream, const unsigned char *data, size_t len, int flush, FILE *out) {
+  unsigned char buf[CHUNK];
+  stream->next_in = (unsigned char *)data;
+  do {
+    // Each piece is used up before the next, so next_in is already there.
+    uInt piece = len > UINT_MAX ? UINT_MAX : (uInt)len;
+    int piece_flush = len > piece ? Z_NO_FLUSH : flush;
+    stream->avail_in = piece;
+    len -= piece;
+    do {
+      stream->next_out = buf;
+      stream->avail_out = sizeof(buf);
+      int ret = deflate(stream, piece_flush);
+      if (ret == Z_STREAM_ERROR) {
+        return -1;
+      }
+      size_t have = sizeof(buf) - stream->avail_out;
+      if (have && fwrite(buf, 1, have, out) != have) {
+        return -1;
+      }
+    } while (stream->avail_out == 0);
+  } while (len > 0);
+  return 0;
+}
+
+/* A loose object being written to its temporary file */
+typedef struct {
+  char tmp_path[64];
+  FILE *file;
+  z_stream *stream;  /* the thread's, see deflate_thread_stream */
+} object_file;
+
+static int object_file_open(object_file *of, const char *header, size_t header_len) {
+  memset(of, 0, sizeof(*of));
+  snprintf(of->tmp_path, sizeof(of->tmp_path), "%s/tmp_obj_XXXXXX", OBJ_DIR);
+  int fd = mkstemp(of->tmp_path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return -1;
+  }
+  // Objects are immutable; the open descriptor can still write.
+  fchmod(fd, 0444);
+  of->file = fdopen(fd, "wb");
+  if (!of->file) {
+    perror("fdopen");
+    close(fd);
+    unlink(of->tmp_path);
+    return -1;
+  }
+  of->stream = deflate_thread_stream();
+  if (deflate_to_file(of->stream, (const unsigned char *)header, header_len, Z_NO_FLUSH, of->file) != 0) {
+    fprintf(stderr, "Failed to compress object\n");
+    fclose(of->file);
+    unlink(of->tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+static int object_file_write(object_file *of, const void *data, size_t len) {
+  if (deflate_to_file(of->stream, data, len, Z_NO_FLUSH, of->file) != 0) {
+    fprintf(stderr, "Failed to compress object\n");
+    return -1;
+  }
+  return 0;
+}
+
+static void object_file_abort(object_file *of) {
+  fclose(of->file);
+  unlink(of->tmp_path);
+}
+
+// Finish the stream and move the file to its final name, unless an
+// identical object showed up meanwhile.
+static int object_file_commit(object_file *of, const sha1_t *sha) {
+  if (deflate_to_file(of->stream, NULL, 0, Z_FINISH, of->file) != 0) {
+    fprintf(stderr, "Failed to compress object\n");
+    object_file_abort(of);
+    return -1;
+  }
+  uint64_t compressed = of->stream->total_out;
+  int failed = fflush(of->file) != 0 || (fsync_objects && fsync(fileno(of->file)) != 0);
+  failed |= fclose(of->file) != 0;
+  if (failed) {
+    perror("write object");
+    unlink(of->tmp_path);
+    return -1;
+  }
+
+  if (object_exists(sha)) {
+    unlink(of->tmp_path);
+    return 0;
+  }
+  char hex[41], path[256];
+  sha1_to_hex(sha, hex);
+  snprintf(path, sizeof(path), "%s/%.2s/%s", OBJ_DIR, hex, hex + 2);
+  if (prepare_loose_subdir(sha) != 0 || rename(of->tmp_path, path) != 0) {
+    perror("rename object");
+    unlink(of->tmp_path);
+    return -1;
+  }
+  loose_cache_add(sha);
+  atomic_fetch_add(&objects_written, 1);
+  atomic_fetch_add(&bytes_written, compressed);
+  return 0;
+}
+
+// async_io's report on a queued object.
+static void async_object_done(const sha1_t *sha, size_t compressed, int ok) {
+  (void)sha;
+  if (ok) {
+    atomic_fetch_add(&objects_written, 1);
+    atomic_fetch_add(&bytes_written, compressed);
+  }
+}
+
+/* Function to hand loose object writes to background I/O of the given kind
+* Objects count as present as soon as they are queued, so nothing may read
+* them back before object_writer_finish_async.
+*/
+async_io_kind object_writer_start_async(async_io_kind kind) {
+  return async_io_start(kind, fsync_objects, async_object_done);
+}
+
+/* Function to wait for queued objects; -1 if any failed to be written */
+int object_writer_finish_async(void) {
+  return async_io_finish();
+}
+
+// Compress header and data in one go and queue the result.
+static int queue_object(const char *header, size_t header_len, const void *data, size_t len, const sha1_t *sha) {
+  z_stream *zs = deflate_thread_stream();
+  uLong bound = deflateBound(zs, header_len + len);
+  unsigned char *out = malloc(bound);
+  if (!out) {
+    perror("malloc");
+    return -1;
+  }
+  size_t head_out, data_out;
+  int ret = deflate_sized(zs, (const unsigned char *)header, header_len, out, bound, Z_NO_FLUSH, &head_out);
+  if (ret != Z_OK ||
+      deflate_sized(zs, data, len, out + head_out, bound - head_out, Z_FINISH, &data_out) != Z_STREAM_END) {
+    fprintf(stderr, "Failed to compress object\n");
+    free(out);
+    return -1;
+  }
+  if (async_io_submit(sha, out, head_out + data_out) != 0) {
+    return -1;
+  }
+  loose_cache_add(sha);
+  return 0;
+}
+
+static void count_skipped(size_t object_len) {
+  atomic_fetch_add(&objects_skipped, 1);
+  atomic_fetch_add(&bytes_skipped, object_len);
+}
+
+// Account for the result of a pack_writer add.
+static int count_packed(int ret, size_t object_len, uint64_t bytes) {
+  if (ret == 1) {
+    count_skipped(object_len);
+  } else if (ret == 0) {
+    atomic_fetch_add(&objects_written, 1);
+    atomic_fetch_add(&bytes_written, bytes);
+  }
+  return ret < 0 ? -1 : 0;
+}
+
+/* Function to store an object whose id the caller has already computed */
+int write_object_hashed(const char *type, const void *data, size_t len, const sha1_t *sha) {
+  char header[MAX_HEADER_LEN];
+  int header_len = snprintf(header, sizeof(header), "%s %zu", type, len) + 1;
+
+  if (object_exists(sha)) {
+    count_skipped(header_len + len);
+    return 0;
+  }
+  if (target_pack) {
+    uint64_t bytes = 0;
+    int ret = pack_writer_add(target_pack, type_from_name(type), data, len, sha, &bytes);
+    return count_packed(ret, header_len + len, bytes);
+  }
+  if (async_io_active() != ASYNC_IO_NONE) {
+    return queue_object(header, header_len, data, len, sha);
+  }
+  object_file of;
+  if (object_file_open(&of, header, header_len) != 0) {
+    return -1;
+  }
+  if (object_file_write(&of, data, len) != 0) {
+    object_file_abort(&of);
+    return -1;
+  }
+  return object_file_commit(&of, sha);
+}
+
+/* Function to store an object of the given type and return its id */
+int write_object(const char *type, const void *data, size_t len, sha1_t *out) {
+  sha1_object(type, data, len, out);
+  return write_object_hashed(type, data, len, out);
+}
+
+/* Function to hash a file as a blob and optionally store it, in one pass
+* The file is read in CHUNK sized pieces and each piece goes to both the
+* SHA-1 context and the deflate stream, so every input byte is touched once
+* and memory use does not depend on the file size.
+*/
+int write_blob_stream(FILE *in, size_t size, int write_flag, sha1_t *out) {
+  char header[MAX_HEADER_LEN];
+  int header_len = snprintf(header, sizeof(header), "blob %zu", size) + 1;
+
+  if (write_flag && target_pack) {
+    uint64_t bytes = 0;
+    int ret = pack_writer_add_stream(target_pack, in, size, out, &bytes);
+    return count_packed(ret, header_len + size, bytes);
+  }
+
+  EVP_MD_CTX *ctx = sha1_thread_ctx();
+  EVP_DigestUpdate(ctx, header, header_len);
+
+  object_file of;
+  if (write_flag && object_file_open(&of, header, header_len) != 0) {
+    return -1;
+  }
+
+  unsigned char buf[CHUNK];
+  size_t total = 0, n;
+  int ret = -1;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+    total += n;
+    EVP_DigestUpdate(ctx, buf, n);
+    if (write_flag && object_file_write(&of, buf, n) != 0) {
+      goto fail;
+    }
+  }
+  if (ferror(in)) {
+    perror("fread");
+    goto fail;
+  }
+  if (total != size) {
+    fprintf(stderr, "File changed size while being hashed\n");
+    goto fail;
+  }
+  EVP_DigestFinal_ex(ctx, out->hash, NULL);
+
+  if (!write_flag) {
+    return 0;
+  }
+  // The compression already happened; dedup can only save the write.
+  if (object_exists(out)) {
+    object_file_abort(&of);
+    count_skipped(header_len + size);
+    return 0;
+  }
+  return object_file_commit(&of, out);
+
+fail:
+  if (write_flag) {
+    object_file_abort(&of);
+  }
+  return ret;
+}
+
+// Hash the files read so far in one batch, then store the new ones.
+static int flush_blob_batch(sha1_batch_item *items, size_t *out_index, size_t nr, int write_flag, sha1_t *out) {
+  sha1_object_batch(items, nr);
+  int ret = 0;
+  for (size_t i = 0; i < nr; i++) {
+    out[out_index[i]] = items[i].sha;
+    if (write_flag && ret == 0) {
+      ret = write_object_hashed("blob", items[i].data, items[i].len, &items[i].sha);
+    }
+    free((void *)items[i].data);
+  }
+  return ret;
+}
+
+static unsigned char *read_small_file(FILE *f, size_t size) {
+  unsigned char *buf = malloc(size ? size : 1);
+  if (buf && fread(buf, 1, size, f) != size) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+/* Function to hash, and optionally store, a list of files as blobs
+* Small files are read whole and hashed together by sha1_object_batch, up
+* to BLOB_BATCH_OBJECTS files or BLOB_BATCH_BYTES bytes at a time; larger
+* ones are streamed one by one. out[i] receives the id of paths[i], which
+* are relative to dirfd (AT_FDCWD for the current directory).
+*/
+int write_blob_files_at(int dirfd, char *const *paths, size_t n, int write_flag, sha1_t *out) {
+  sha1_batch_item items[BLOB_BATCH_OBJECTS];
+  size_t out_index[BLOB_BATCH_OBJECTS];
+  size_t nr = 0, bytes = 0;
+  int ret = 0;
+
+  for (size_t i = 0; i < n && ret == 0; i++) {
+    int fd = openat(dirfd, paths[i], O_RDONLY | O_CLOEXEC);
+    FILE *f = fd >= 0 ? fdopen(fd, "rb") : NULL;
+    struct stat st;
+    if (!f || fstat(fileno(f), &st) != 0) {
+      perror(paths[i]);
+      if (f) fclose(f);
+      else if (fd >= 0) close(fd);
+      ret = -1;
+      break;
+    }
+    if ((size_t)st.st_size > BLOB_BATCH_MAX_SIZE) {
+      ret = write_blob_stream(f, st.st_size, write_flag, &out[i]);
+      fclose(f);
+      continue;
+    }
+    unsigned char *data = read_small_file(f, st.st_size);
+    fclose(f);
+    if (!data) {
+      fprintf(stderr, "Failed to read %s\n", paths[i]);
+      ret = -1;
+      break;
+    }
+    items[nr].type = "blob";
+    items[nr].data = data;
+    items[nr].len = st.st_size;
+    out_index[nr++] = i;
+    bytes += st.st_size;
+    if (nr == BLOB_BATCH_OBJECTS || bytes >= BLOB_BATCH_BYTES) {
+      ret = flush_blob_batch(items, out_index, nr, write_flag, out);
+      nr = bytes = 0;
+    }
+  }
+  if (nr) {
+    int flushed = flush_blob_batch(items, out_index, nr, write_flag, out);
+    if (ret == 0) {
+      ret = flushed;
+    }
+  }
+  return ret;
+}
+
+int write_blob_files(char *const *paths, size_t n, int write_flag, sha1_t *out) {
+  return write_blob_files_at(AT_FDCWD, paths, n, write_flag, out);
+}
+
+object_writer_stats object_writer_get_stats(void) {
+  object_writer_stats s;
+  s.objects_written = atomic_load(&objects_written);
+  s.objects_skipped = atomic_load(&objects_skipped);
+  s.bytes_written = atomic_load(&bytes_written);
+  s.bytes_skipped = atomic_load(&bytes_skipped);
+  return s;
+}
+
+void object_writer_report(FILE *out) {
+  object_writer_stats s = object_writer_get_stats();
+  fprintf(out, "object writer: %zu written (%llu bytes), %zu already present (%llu bytes skipped)\n",
+          s.objects_written, (unsigned long long)s.bytes_written,
+          s.objects_skipped, (unsigned long long)s.bytes_skipped);
+}
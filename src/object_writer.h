@@ -0,0 +1,39 @@
+#ifndef OBJECT_WRITER_H
+#define OBJECT_WRITER_H
+
+#include <stdint.h>
+#include "blob.h"
+#include "async_io.h"
+
+/* Files up to this size are read whole and hashed in batches */
+#define BLOB_BATCH_MAX_SIZE (1024 * 1024)
+#define BLOB_BATCH_OBJECTS 64
+#define BLOB_BATCH_BYTES (8 * 1024 * 1024)
+
+typedef struct {
+    size_t objects_written;
+    size_t objects_skipped;
+    uint64_t bytes_written;  /* compressed bytes that reached the disk */
+    uint64_t bytes_skipped;  /* object bytes not compressed because they existed */
+} object_writer_stats;
+
+struct pack_writer;
+
+/* Function prototypes */
+void object_writer_set_fsync(int enabled);
+int object_writer_fsync_enabled(void);
+z_stream *deflate_thread_stream(void);
+int deflate_sized(z_stream *stream, const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len,
+                  int flush, size_t *out_used);
+void object_writer_set_pack(struct pack_writer *pw);
+async_io_kind object_writer_start_async(async_io_kind kind);
+int object_writer_finish_async(void);
+int write_object(const char *type, const void *data, size_t len, sha1_t *out);
+int write_object_hashed(const char *type, const void *data, size_t len, const sha1_t *sha);
+int write_blob_stream(FILE *in, size_t size, int write_flag, sha1_t *out);
+int write_blob_files(char *const *paths, size_t n, int write_flag, sha1_t *out);
+int write_blob_files_at(int dirfd, char *const *paths, size_t n, int write_flag, sha1_t *out);
+object_writer_stats object_writer_get_stats(void);
+void object_writer_report(FILE *out);
+
+#endif
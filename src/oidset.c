@@ -0,0 +1,98 @@
+/**
+* oidset.c - Set of object ids
+* Walks over millions of objects ask "seen this one?" for every tree
+* entry, so the set is a flat table of 20-byte ids probed linearly from
+* the slot their first bytes pick. Ids are already uniformly distributed,
+* and a miss usually ends at the first empty slot, in the same cache
+* line. The table doubles when it gets half full.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "oidset.h"
+
+#define OIDSET_INITIAL_SIZE 1024
+
+static int is_empty(const sha1_t *slot) {
+    static const sha1_t null_sha;
+    return memcmp(slot->hash, null_sha.hash, 20) == 0;
+}
+
+static size_t oid_slot(const oidset *set, const sha1_t *sha) {
+    uint32_t h;
+    memcpy(&h, sha->hash, 4);
+    return h & (set->size - 1);
+}
+
+static void place(oidset *set, const sha1_t *sha) {
+    size_t i = oid_slot(set, sha);
+    while (!is_empty(&set->slots[i])) {
+        i = (i + 1) & (set->size - 1);
+    }
+    set->slots[i] = *sha;
+}
+
+static void grow(oidset *set) {
+    sha1_t *old = set->slots;
+    size_t old_size = set->size;
+    set->size = old_size ? old_size * 2 : OIDSET_INITIAL_SIZE;
+    set->slots = calloc(set->size, sizeof(*set->slots));
+    if (!set->slots) {
+        perror("calloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < old_size; i++) {
+        if (!is_empty(&old[i])) {
+            place(set, &old[i]);
+        }
+    }
+    free(old);
+}
+
+/* Function to add sha to the set; returns 1 if it was there already */
+int oidset_insert(oidset *set, const sha1_t *sha) {
+    if (is_empty(sha)) {
+        if (set->has_null) {
+            return 1;
+        }
+        set->has_null = 1;
+        set->nr++;
+        return 0;
+    }
+    if ((set->nr + 1) * 2 > set->size) {
+        grow(set);
+    }
+    size_t i = oid_slot(set, sha);
+    for (; !is_empty(&set->slots[i]); i = (i + 1) & (set->size - 1)) {
+        if (memcmp(set->slots[i].hash, sha->hash, 20) == 0) {
+            return 1;
+        }
+    }
+    set->slots[i] = *sha;
+    set->nr++;
+    return 0;
+}
+
+int oidset_contains(const oidset *set, const sha1_t *sha) {
+    if (is_empty(sha)) {
+        return set->has_null;
+    }
+    if (!set->size) {
+        return 0;
+    }
+    for (size_t i = oid_slot(set, sha); !is_empty(&set->slots[i]); i = (i + 1) & (set->size - 1)) {
+        if (memcmp(set->slots[i].hash, sha->hash, 20) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void oidset_clear(oidset *set) {
+    free(set->slots);
+    set->slots = NULL;
+    set->size = 0;
+    set->nr = 0;
+    set->has_null = 0;
+}
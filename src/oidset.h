@@ -0,0 +1,21 @@
+#ifndef OIDSET_H
+#define OIDSET_H
+
+#include <stddef.h>
+#include "blob.h"
+
+/* Open addressing over the ids themselves; the all-zero id marks a free
+* slot, so a null id (which corrupt trees can name) is kept in has_null */
+typedef struct {
+    sha1_t *slots;
+    size_t size;  /* power of two, or 0 before the first insert */
+    size_t nr;
+    int has_null;
+} oidset;
+
+/* Function prototypes */
+int oidset_insert(oidset *set, const sha1_t *sha);
+int oidset_contains(const oidset *set, const sha1_t *sha);
+void oidset_clear(oidset *set);
+
+#endif
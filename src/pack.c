@@ -0,0 +1,671 @@
+/**
+* pack.c - Read objects straight out of packfiles
+* Every .idx under .git/objects/pack is mapped together with its .pack.
+* Objects are located through the multi-pack-index when there is one,
+* otherwise through each idx's 256 entry fanout table plus a binary
+* search of the sorted object ids. OFS_DELTA / REF_DELTA chains are
+* resolved in memory. Only version 2 indexes are supported.
+*/
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "pack.h"
+#include "hash_io.h"
+
+#define IDX_SIGNATURE 0xff744f63
+#define IDX_HEADER_SIZE 8
+#define FANOUT_SIZE (256 * 4)
+/* Longest delta chain followed; pack-objects never writes deeper ones,
+* and a REF_DELTA cycle would otherwise recurse without end */
+#define MAX_DELTA_DEPTH 4095
+
+static packed_git *packs;
+static int packs_prepared;
+// Guards the pack list, which lookups reorder.
+static pthread_mutex_t packs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *type_names[] = {
+  [OBJ_COMMIT] = "commit",
+  [OBJ_TREE] = "tree",
+  [OBJ_BLOB] = "blob",
+  [OBJ_TAG] = "tag",
+};
+
+const char *type_name(int type) {
+  if (type < 0 || type >= (int)(sizeof(type_names) / sizeof(type_names[0])) || !type_names[type]) {
+    return NULL;
+  }
+  return type_names[type];
+}
+
+int type_from_name(const char *name) {
+  for (int i = 0; i < (int)(sizeof(type_names) / sizeof(type_names[0])); i++) {
+    if (type_names[i] && strcmp(type_names[i], name) == 0) {
+      return i;
+    }
+  }
+  return OBJ_BAD;
+}
+
+static void *map_file(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  *size = st.st_size;
+  return map;
+}
+
+static void close_pack(packed_git *p) {
+  if (p->idx_map) munmap(p->idx_map, p->idx_size);
+  if (p->pack_map) munmap(p->pack_map, p->pack_size);
+  free(p);
+}
+
+// Map one .idx/.pack pair and check both headers.
+static packed_git *open_pack(const char *idx_path) {
+  packed_git *p = calloc(1, sizeof(*p));
+  if (!p) {
+    return NULL;
+  }
+  size_t len = strlen(idx_path);
+  if (len + 1 > sizeof(p->pack_path)) {
+    free(p);
+    return NULL;
+  }
+  memcpy(p->pack_path, idx_path, len - 4);
+  strcpy(p->pack_path + len - 4, ".pack");
+
+  p->idx_map = map_file(idx_path, &p->idx_size);
+  p->pack_map = map_file(p->pack_path, &p->pack_size);
+  if (!p->idx_map || !p->pack_map) {
+    close_pack(p);
+    return NULL;
+  }
+
+  if (p->idx_size < IDX_HEADER_SIZE + FANOUT_SIZE + 40 ||
+      get_be32(p->idx_map) != IDX_SIGNATURE || get_be32(p->idx_map + 4) != 2) {
+    fprintf(stderr, "Unsupported pack index %s\n", idx_path);
+    close_pack(p);
+    return NULL;
+  }
+  p->fanout = p->idx_map + IDX_HEADER_SIZE;
+  p->num_objects = get_be32(p->fanout + 255 * 4);
+
+  // As in git's check_packed_git_idx: the fanout only counts up, so the
+  // binary search stays inside the id table, and at most all but one
+  // object can need a large offset.
+  size_t n = p->num_objects;
+  size_t min_size = IDX_HEADER_SIZE + FANOUT_SIZE + n * (20 + 4 + 4) + 40;
+  size_t max_size = min_size + (n ? (n - 1) * 8 : 0);
+  int fanout_ok = 1;
+  for (int i = 0; i < 255; i++) {
+    if (get_be32(p->fanout + i * 4) > get_be32(p->fanout + (i + 1) * 4)) {
+      fanout_ok = 0;
+    }
+  }
+  if (!fanout_ok || p->idx_size < min_size || p->idx_size > max_size || p->pack_size < 12 + 20 ||
+      memcmp(p->pack_map, "PACK", 4) != 0 ||
+      get_be32(p->pack_map + 8) != p->num_objects) {
+    fprintf(stderr, "Corrupt pack %s\n", p->pack_path);
+    close_pack(p);
+    return NULL;
+  }
+  p->sha_table = p->idx_map + IDX_HEADER_SIZE + FANOUT_SIZE;
+  p->crc_table = p->sha_table + n * 20;
+  p->offset_table = p->crc_table + n * 4;
+  p->large_offset_table = p->offset_table + n * 4;
+  p->nr_large_offsets = (p->idx_size - min_size) / 8;
+  return p;
+}
+
+static void prepare_packed_git(void) {
+  if (packs_prepared) {
+    return;
+  }
+  packs_prepared = 1;
+
+  DIR *dir = opendir(PACK_DIR);
+  if (!dir) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    size_t len = strlen(entry->d_name);
+    if (len < 5 || strcmp(entry->d_name + len - 4, ".idx") != 0) {
+      continue;
+    }
+    char idx_path[512];
+    snprintf(idx_path, sizeof(idx_path), "%s/%s", PACK_DIR, entry->d_name);
+    packed_git *p = open_pack(idx_path);
+    if (p) {
+      p->next = packs;
+      packs = p;
+    }
+  }
+  closedir(dir);
+  load_multi_pack_index(packs);
+}
+
+packed_git *get_packed_git(void) {
+  pthread_mutex_lock(&packs_lock);
+  prepare_packed_git();
+  packed_git *p = packs;
+  pthread_mutex_unlock(&packs_lock);
+  return p;
+}
+
+/* Function to forget all mapped packs so the next lookup rescans the directory */
+void reprepare_packed_git(void) {
+  pthread_mutex_lock(&packs_lock);
+  close_multi_pack_index();
+  while (packs) {
+    packed_git *next = packs->next;
+    delta_base_cache_drop_pack(packs);
+    close_pack(packs);
+    packs = next;
+  }
+  packs_prepared = 0;
+  pthread_mutex_unlock(&packs_lock);
+}
+
+/* Function to get the pack offset of the pos'th object in p's idx
+* Returns -1 if its large offset slot lies outside the idx.
+*/
+int pack_nth_offset(const packed_git *p, uint32_t pos, uint64_t *offset) {
+  uint32_t off = get_be32(p->offset_table + (size_t)pos * 4);
+  if (!(off & 0x80000000)) {
+    *offset = off;
+    return 0;
+  }
+  off &= 0x7fffffff;
+  if (off >= p->nr_large_offsets) {
+    fprintf(stderr, "Bad large offset in %s\n", p->pack_path);
+    return -1;
+  }
+  *offset = get_be64(p->large_offset_table + (size_t)off * 8);
+  return 0;
+}
+
+// Binary search one index within the fanout bucket of the first byte.
+static int find_in_pack(const packed_git *p, const sha1_t *sha, uint64_t *offset) {
+  uint32_t lo = sha->hash[0] ? get_be32(p->fanout + (sha->hash[0] - 1) * 4) : 0;
+  uint32_t hi = get_be32(p->fanout + sha->hash[0] * 4);
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int cmp = memcmp(sha->hash, p->sha_table + (size_t)mid * 20, 20);
+    if (cmp == 0) {
+      return pack_nth_offset(p, mid, offset);
+    }
+    if (cmp < 0) hi = mid;
+    else lo = mid + 1;
+  }
+  return -1;
+}
+
+/* Function to find which pack holds an object and at what offset */
+int find_pack_entry(const sha1_t *sha, packed_git **pack, uint64_t *offset) {
+  pthread_mutex_lock(&packs_lock);
+  prepare_packed_git();
+  int ret = -1;
+  // One search covers every pack in the multi-pack-index; only packs
+  // added after it was written need their own idx probed.
+  if (midx_find_entry(sha, pack, offset) == 0) {
+    ret = 0;
+  }
+  packed_git *prev = NULL;
+  for (packed_git *p = packs; ret && p; prev = p, p = p->next) {
+    if (p->in_midx) {
+      continue;
+    }
+    if (find_in_pack(p, sha, offset) == 0) {
+      // Keep the pack that answered last at the front; lookups cluster.
+      if (prev) {
+        prev->next = p->next;
+        p->next = packs;
+        packs = p;
+      }
+      *pack = p;
+      ret = 0;
+    }
+  }
+  pthread_mutex_unlock(&packs_lock);
+  return ret;
+}
+
+int has_packed_object(const sha1_t *sha) {
+  packed_git *p;
+  uint64_t offset;
+  return find_pack_entry(sha, &p, &offset) == 0;
+}
+
+// Parse the variable length type/size header of a pack entry.
+static int unpack_entry_header(const packed_git *p, uint64_t *pos, int *type, size_t *size) {
+  const unsigned char *map = p->pack_map;
+  uint64_t end = p->pack_size - 20;
+  if (*pos >= end) {
+    return -1;
+  }
+  unsigned char c = map[(*pos)++];
+  *type = (c >> 4) & 7;
+  size_t sz = c & 15;
+  int shift = 4;
+  while (c & 0x80) {
+    if (*pos >= end || shift > 60) {
+      return -1;
+    }
+    c = map[(*pos)++];
+    sz |= (size_t)(c & 0x7f) << shift;
+    shift += 7;
+  }
+  *size = sz;
+  return 0;
+}
+
+// Decode the negative base offset that follows an OFS_DELTA header.
+static int read_ofs_delta_base(const packed_git *p, uint64_t *pos, uint64_t entry_offset, uint64_t *base) {
+  const unsigned char *map = p->pack_map;
+  uint64_t end = p->pack_size - 20;
+  if (*pos >= end) {
+    return -1;
+  }
+  unsigned char c = map[(*pos)++];
+  uint64_t rel = c & 0x7f;
+  while (c & 0x80) {
+    if (*pos >= end) {
+      return -1;
+    }
+    c = map[(*pos)++];
+    rel = ((rel + 1) << 7) | (c & 0x7f);
+  }
+  if (rel == 0 || rel > entry_offset) {
+    return -1;
+  }
+  *base = entry_offset - rel;
+  return 0;
+}
+
+/* Function to run inflate over an input and an output buffer of any size
+* zlib counts bytes in a 32-bit uInt, so both are handed over at most
+* UINT_MAX bytes at a time; in a pack over 4 GiB the distance to its end
+* alone does not fit. in_used and out_used, if not NULL, receive what was
+* consumed and produced. Returns the last status inflate gave.
+*/
+int inflate_sized(z_stream *stream, const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len,
+                  int flush, size_t *in_used, size_t *out_used) {
+  size_t in_left = in_len, out_left = out_len;
+  int ret;
+  stream->next_in = (unsigned char *)in;
+  stream->next_out = out;
+  for (;;) {
+    uInt in_chunk = in_left > UINT_MAX ? UINT_MAX : (uInt)in_left;
+    uInt out_chunk = out_left > UINT_MAX ? UINT_MAX : (uInt)out_left;
+    stream->avail_in = in_chunk;
+    stream->avail_out = out_chunk;
+    ret = inflate(stream, flush);
+    in_left -= in_chunk - stream->avail_in;
+    out_left -= out_chunk - stream->avail_out;
+    // Go on only if a chunk limit, not the buffers, stopped it.
+    int clamped = (stream->avail_in == 0 && in_left > 0) || (stream->avail_out == 0 && out_left > 0);
+    if ((ret != Z_OK && ret != Z_BUF_ERROR) || !clamped) {
+      break;
+    }
+  }
+  if (in_used) {
+    *in_used = in_len - in_left;
+  }
+  if (out_used) {
+    *out_used = out_len - out_left;
+  }
+  return ret;
+}
+
+// Inflate size bytes of zlib data starting at pos into out.
+static int inflate_packed(const packed_git *p, uint64_t pos, unsigned char *out, size_t size) {
+  z_stream stream = {0};
+  if (inflateInit(&stream) != Z_OK) {
+    return -1;
+  }
+  // zlib needs a non-null output pointer even for empty objects.
+  unsigned char dummy;
+  size_t produced;
+  int ret = inflate_sized(&stream, p->pack_map + pos, p->pack_size - 20 - pos, size ? out : &dummy, size ? size : 1,
+                          Z_FINISH, NULL, &produced);
+  inflateEnd(&stream);
+  return ret == Z_STREAM_END && produced == size ? 0 : -1;
+}
+
+static int read_delta_varint(const unsigned char **p, const unsigned char *end, size_t *out) {
+  size_t v = 0;
+  int shift = 0;
+  unsigned char c;
+  do {
+    if (*p >= end || shift > 63) {
+      return -1;
+    }
+    c = *(*p)++;
+    v |= (size_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  *out = v;
+  return 0;
+}
+
+/* Function to rebuild an object from its base and a git delta
+* The result is written reserve bytes into a fresh allocation so callers
+* can put an object header in front without copying.
+*/
+int apply_delta(const unsigned char *base, size_t base_size, const unsigned char *delta, size_t delta_size,
+                size_t reserve, unsigned char **out, size_t *out_size) {
+  const unsigned char *p = delta, *end = delta + delta_size;
+  size_t src_size, dst_size;
+  if (read_delta_varint(&p, end, &src_size) != 0 || read_delta_varint(&p, end, &dst_size) != 0 ||
+      src_size != base_size) {
+    return -1;
+  }
+  unsigned char *buf = malloc(reserve + dst_size + 1);
+  if (!buf) {
+    return -1;
+  }
+  unsigned char *dst = buf + reserve;
+  size_t written = 0;
+
+  while (p < end) {
+    unsigned char op = *p++;
+    if (op & 0x80) {
+      // Copy from the base: bits 0-3 select offset bytes, 4-6 size bytes.
+      size_t off = 0, len = 0;
+      for (int i = 0; i < 4; i++) {
+        if (op & (1 << i)) {
+          if (p >= end) goto bad;
+          off |= (size_t)*p++ << (8 * i);
+        }
+      }
+      for (int i = 0; i < 3; i++) {
+        if (op & (0x10 << i)) {
+          if (p >= end) goto bad;
+          len |= (size_t)*p++ << (8 * i);
+        }
+      }
+      if (len == 0) len = 0x10000;
+      if (off + len < off || off + len > base_size || written + len > dst_size) goto bad;
+      memcpy(dst + written, base + off, len);
+      written += len;
+    } else if (op) {
+      // Insert the next op literal bytes.
+      if ((size_t)(end - p) < op || written + op > dst_size) goto bad;
+      memcpy(dst + written, p, op);
+      p += op;
+      written += op;
+    } else {
+      goto bad;
+    }
+  }
+  if (written != dst_size) goto bad;
+
+  dst[dst_size] = '\0';
+  *out = buf;
+  *out_size = dst_size;
+  return 0;
+
+bad:
+  free(buf);
+  return -1;
+}
+
+// Read a loose object's content, used for REF_DELTA bases outside packs.
+static int read_loose_base(const sha1_t *sha, int *type, unsigned char **data, size_t *size) {
+  char hex[41];
+  sha1_to_hex(sha, hex);
+  unsigned char *buf;
+  size_t total, header_len;
+  if (read_loose_object(hex, &buf, &total, &header_len) != 0) {
+    return -1;
+  }
+  char name[16];
+  size_t content_size;
+  parse_object_header((char *)buf, name, sizeof(name), &content_size);
+  *type = type_from_name(name);
+  memmove(buf, buf + header_len, content_size + 1);
+  *data = buf;
+  *size = content_size;
+  return 0;
+}
+
+/* A delta base either pinned in the delta base cache or owned outright */
+typedef struct {
+  int type;
+  const unsigned char *data;
+  size_t size;
+  delta_base_entry *entry;
+  unsigned char *owned;
+} delta_base;
+
+static int unpack_entry_at(packed_git *p, uint64_t offset, int depth, size_t reserve, int *type, unsigned char **data,
+                           size_t *size);
+
+// Get the packed object at offset to apply a delta against, reusing a
+// cached reconstruction when one exists.
+static int get_packed_base(packed_git *p, uint64_t offset, int depth, delta_base *base) {
+  base->entry = delta_base_cache_get(p, offset);
+  if (!base->entry) {
+    unsigned char *data;
+    if (unpack_entry_at(p, offset, depth, 0, &base->type, &data, &base->size) != 0) {
+      return -1;
+    }
+    base->entry = delta_base_cache_put(p, offset, base->type, data, base->size);
+    if (!base->entry) {
+      base->owned = data;
+      base->data = data;
+      return 0;
+    }
+  }
+  base->type = base->entry->type;
+  base->data = base->entry->data;
+  base->size = base->entry->size;
+  base->owned = NULL;
+  return 0;
+}
+
+static void put_base(delta_base *base) {
+  delta_base_cache_release(base->entry);
+  free(base->owned);
+}
+
+// Read the entry at offset as the base depth deltas down a chain.
+static int unpack_entry_at(packed_git *p, uint64_t offset, int depth, size_t reserve, int *type, unsigned char **data,
+                           size_t *size) {
+  uint64_t pos = offset;
+  int entry_type;
+  size_t entry_size;
+  if (depth > MAX_DELTA_DEPTH) {
+    fprintf(stderr, "Delta chain too deep at %llu in %s\n", (unsigned long long)offset, p->pack_path);
+    return -1;
+  }
+  if (unpack_entry_header(p, &pos, &entry_type, &entry_size) != 0) {
+    fprintf(stderr, "Bad pack entry header at %llu in %s\n", (unsigned long long)offset, p->pack_path);
+    return -1;
+  }
+
+  if (entry_type == OBJ_OFS_DELTA || entry_type == OBJ_REF_DELTA) {
+    delta_base base = {0};
+    if (entry_type == OBJ_OFS_DELTA) {
+      uint64_t base_offset;
+      if (read_ofs_delta_base(p, &pos, offset, &base_offset) != 0 ||
+          get_packed_base(p, base_offset, depth + 1, &base) != 0) {
+        fprintf(stderr, "Failed to read delta base for offset %llu\n", (unsigned long long)offset);
+        return -1;
+      }
+    } else {
+      if (pos + 20 > p->pack_size - 20) {
+        return -1;
+      }
+      sha1_t base_sha;
+      memcpy(base_sha.hash, p->pack_map + pos, 20);
+      pos += 20;
+      packed_git *base_pack;
+      uint64_t base_offset;
+      int ret;
+      if (find_pack_entry(&base_sha, &base_pack, &base_offset) == 0) {
+        ret = get_packed_base(base_pack, base_offset, depth + 1, &base);
+      } else {
+        ret = read_loose_base(&base_sha, &base.type, &base.owned, &base.size);
+        base.data = base.owned;
+      }
+      if (ret != 0) {
+        char hex[41];
+        sha1_to_hex(&base_sha, hex);
+        fprintf(stderr, "Missing delta base %s\n", hex);
+        return -1;
+      }
+    }
+
+    unsigned char *delta = malloc(entry_size + 1);
+    if (!delta || inflate_packed(p, pos, delta, entry_size) != 0) {
+      fprintf(stderr, "Failed to inflate delta at %llu\n", (unsigned long long)offset);
+      free(delta);
+      put_base(&base);
+      return -1;
+    }
+    int ret = apply_delta(base.data, base.size, delta, entry_size, reserve, data, size);
+    free(delta);
+    *type = base.type;
+    put_base(&base);
+    if (ret != 0) {
+      fprintf(stderr, "Corrupt delta at %llu in %s\n", (unsigned long long)offset, p->pack_path);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (!type_name(entry_type)) {
+    fprintf(stderr, "Unknown object type %d at %llu\n", entry_type, (unsigned long long)offset);
+    return -1;
+  }
+  unsigned char *buf = malloc(reserve + entry_size + 1);
+  if (!buf) {
+    return -1;
+  }
+  if (inflate_packed(p, pos, buf + reserve, entry_size) != 0) {
+    fprintf(stderr, "Failed to inflate object at %llu in %s\n", (unsigned long long)offset, p->pack_path);
+    free(buf);
+    return -1;
+  }
+  buf[reserve + entry_size] = '\0';
+  *type = entry_type;
+  *data = buf;
+  *size = entry_size;
+  return 0;
+}
+
+/* Function to read the object stored at offset in a pack, resolving deltas
+* The content lands reserve bytes into the returned allocation and is
+* followed by a null byte.
+*/
+int unpack_entry(packed_git *p, uint64_t offset, size_t reserve, int *type, unsigned char **data, size_t *size) {
+  return unpack_entry_at(p, offset, 0, reserve, type, data, size);
+}
+
+/* Function to read a packed object by id; see unpack_entry for reserve */
+int read_packed_object(const sha1_t *sha, size_t reserve, int *type, unsigned char **data, size_t *size) {
+  packed_git *p;
+  uint64_t offset;
+  if (find_pack_entry(sha, &p, &offset) != 0) {
+    return -1;
+  }
+  return unpack_entry(p, offset, reserve, type, data, size);
+}
+
+/* Function to report the type and size of a packed object without
+* reconstructing it. Only the chain of entry headers is walked, plus the
+* first bytes of the outermost delta for its result size.
+*/
+int packed_object_info(const sha1_t *sha, int *type, size_t *size) {
+  packed_git *p;
+  uint64_t offset;
+  if (find_pack_entry(sha, &p, &offset) != 0) {
+    return -1;
+  }
+
+  int have_size = 0;
+  for (int depth = 0; depth <= MAX_DELTA_DEPTH; depth++) {
+    uint64_t pos = offset;
+    int entry_type;
+    size_t entry_size;
+    if (unpack_entry_header(p, &pos, &entry_type, &entry_size) != 0) {
+      return -1;
+    }
+    if (entry_type != OBJ_OFS_DELTA && entry_type != OBJ_REF_DELTA) {
+      if (!type_name(entry_type)) {
+        return -1;
+      }
+      *type = entry_type;
+      if (!have_size) {
+        *size = entry_size;
+      }
+      return 0;
+    }
+
+    sha1_t base_sha;
+    uint64_t base_offset = 0;
+    if (entry_type == OBJ_OFS_DELTA) {
+      if (read_ofs_delta_base(p, &pos, offset, &base_offset) != 0) {
+        return -1;
+      }
+    } else {
+      if (pos + 20 > p->pack_size - 20) {
+        return -1;
+      }
+      memcpy(base_sha.hash, p->pack_map + pos, 20);
+      pos += 20;
+    }
+
+    if (!have_size) {
+      // Two varints of at most 10 bytes each start the delta.
+      unsigned char head[20];
+      z_stream stream = {0};
+      if (inflateInit(&stream) != Z_OK) {
+        return -1;
+      }
+      size_t have;
+      inflate_sized(&stream, p->pack_map + pos, p->pack_size - 20 - pos, head, sizeof(head), Z_SYNC_FLUSH, NULL, &have);
+      const unsigned char *hp = head, *hend = head + have;
+      inflateEnd(&stream);
+      size_t src_size;
+      if (read_delta_varint(&hp, hend, &src_size) != 0 || read_delta_varint(&hp, hend, size) != 0) {
+        return -1;
+      }
+      have_size = 1;
+    }
+
+    if (entry_type == OBJ_OFS_DELTA) {
+      offset = base_offset;
+    } else if (find_pack_entry(&base_sha, &p, &offset) != 0) {
+      // The base is loose; its header carries the type.
+      int base_type;
+      unsigned char *base;
+      size_t base_size;
+      if (read_loose_base(&base_sha, &base_type, &base, &base_size) != 0) {
+        return -1;
+      }
+      free(base);
+      *type = base_type;
+      return 0;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,136 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+#include "blob.h"
+
+#define PACK_DIR OBJ_DIR "/pack"
+#define MIDX_PATH PACK_DIR "/multi-pack-index"
+
+/* Object types as stored in pack entry headers */
+enum pack_object_type {
+    OBJ_BAD = -1,
+    OBJ_NONE = 0,
+    OBJ_COMMIT = 1,
+    OBJ_TREE = 2,
+    OBJ_BLOB = 3,
+    OBJ_TAG = 4,
+    OBJ_OFS_DELTA = 6,
+    OBJ_REF_DELTA = 7
+};
+
+/* A mapped .pack file together with its v2 .idx */
+typedef struct packed_git {
+    char pack_path[512];
+    unsigned char *idx_map;
+    size_t idx_size;
+    unsigned char *pack_map;
+    size_t pack_size;
+    uint32_t num_objects;
+    const unsigned char *fanout;
+    const unsigned char *sha_table;
+    const unsigned char *crc_table;
+    const unsigned char *offset_table;
+    const unsigned char *large_offset_table;
+    size_t nr_large_offsets;
+    int in_midx;
+    struct packed_git *next;
+} packed_git;
+
+/* A mapped multi-pack-index */
+typedef struct {
+    unsigned char *map;
+    size_t size;
+    uint32_t num_packs;
+    uint32_t num_objects;
+    const unsigned char *fanout;
+    const unsigned char *oids;
+    const unsigned char *offsets;
+    const unsigned char *large_offsets;
+    size_t nr_large_offsets;
+    const char **pack_names;
+    packed_git **packs;
+} multi_pack_index;
+
+/* Default byte budget of the delta base cache */
+#define DELTA_BASE_CACHE_LIMIT (96 * 1024 * 1024)
+
+/* A reconstructed base object kept by the delta base cache */
+typedef struct delta_base_entry {
+    const packed_git *pack;     /* NULL once its pack is closed */
+    uint64_t offset;
+    int type;
+    unsigned char *data;
+    size_t size;
+    int refs;
+    struct delta_base_entry *hash_next;
+    struct delta_base_entry *lru_prev;
+    struct delta_base_entry *lru_next;
+} delta_base_entry;
+
+typedef struct {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+    size_t limit;
+} delta_base_cache_stats;
+
+/* One object's row in a pack index */
+typedef struct {
+    sha1_t sha;
+    uint32_t crc;
+    uint64_t offset;
+} pack_idx_entry;
+
+/* A packfile being written, see pack_writer.c */
+typedef struct pack_writer pack_writer;
+
+/* The sequential pass of index_pack, fed as a pack arrives */
+typedef struct pack_indexer pack_indexer;
+
+/* Function prototypes */
+const char *type_name(int type);
+int type_from_name(const char *name);
+packed_git *get_packed_git(void);
+void reprepare_packed_git(void);
+int find_pack_entry(const sha1_t *sha, packed_git **pack, uint64_t *offset);
+int has_packed_object(const sha1_t *sha);
+int pack_nth_offset(const packed_git *p, uint32_t pos, uint64_t *offset);
+int read_packed_object(const sha1_t *sha, size_t reserve, int *type, unsigned char **data, size_t *size);
+int packed_object_info(const sha1_t *sha, int *type, size_t *size);
+int unpack_entry(packed_git *p, uint64_t offset, size_t reserve, int *type, unsigned char **data, size_t *size);
+int inflate_sized(z_stream *stream, const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len,
+                  int flush, size_t *in_used, size_t *out_used);
+int apply_delta(const unsigned char *base, size_t base_size, const unsigned char *delta, size_t delta_size,
+                size_t reserve, unsigned char **out, size_t *out_size);
+int index_pack(const char *pack_path, const char *idx_path, int threads, int verify, sha1_t *pack_sha);
+pack_indexer *pack_indexer_new(void);
+int pack_indexer_feed(pack_indexer *ix, const unsigned char *data, size_t len);
+int pack_indexer_finish(pack_indexer *ix, const char *pack_path, const char *idx_path, int threads,
+                        sha1_t *pack_sha);
+void pack_indexer_free(pack_indexer *ix);
+int finalize_pack(const char *tmp_pack, const char *tmp_idx, const sha1_t *pack_sha);
+void sort_pack_idx_entries(pack_idx_entry *entries, uint32_t n);
+int write_pack_idx(const char *idx_path, const pack_idx_entry *sorted, uint32_t n, const sha1_t *pack_sha);
+void delta_base_cache_set_limit(size_t limit);
+delta_base_entry *delta_base_cache_get(const packed_git *p, uint64_t offset);
+delta_base_entry *delta_base_cache_put(const packed_git *p, uint64_t offset, int type, unsigned char *data, size_t size);
+void delta_base_cache_release(delta_base_entry *e);
+void delta_base_cache_drop_pack(const packed_git *p);
+delta_base_cache_stats delta_base_cache_get_stats(void);
+void delta_base_cache_report(FILE *out);
+void load_multi_pack_index(packed_git *packs);
+void close_multi_pack_index(void);
+int midx_find_entry(const sha1_t *sha, packed_git **pack, uint64_t *offset);
+int write_multi_pack_index(void);
+pack_writer *pack_writer_begin(void);
+int pack_writer_contains(pack_writer *pw, const sha1_t *sha);
+int pack_writer_add(pack_writer *pw, int type, const void *data, size_t len, const sha1_t *sha, uint64_t *bytes);
+int pack_writer_add_stream(pack_writer *pw, FILE *in, size_t size, sha1_t *out, uint64_t *bytes);
+int pack_writer_read(pack_writer *pw, const sha1_t *sha, int *type, unsigned char **data, size_t *size);
+int pack_writer_finish(pack_writer *pw, int fsync_pack, sha1_t *pack_sha);
+void pack_writer_abort(pack_writer *pw);
+
+#endif
@@ -0,0 +1,474 @@
+/**
+* pack_writer.c - Append new objects to one packfile
+* Instead of a loose file per object, objects are appended as undeltified
+* entries to a single temporary pack under .git/objects/pack. Objects held
+* in memory are compressed by the calling thread with its reusable
+* deflate stream and appended under a lock, so compression still runs in
+* parallel; large files are deflated into a scratch file first, and only
+* the copy into the pack holds the lock. When the pack is finished, the
+* object count in the header is filled in, the trailing checksum
+* computed, the .idx written, and both files renamed to their
+* pack-<checksum> names.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "pack.h"
+#include "sha1_engine.h"
+#include "object_writer.h"
+
+struct pack_writer {
+    pthread_mutex_t lock;
+    char tmp_path[64];
+    FILE *file;
+    uint64_t offset;          /* where the next entry goes */
+    pack_idx_entry *entries;
+    uint32_t nr;
+    uint32_t alloc;
+    uint32_t *table;          /* open addressing over entries, 0 = empty */
+    size_t table_size;
+};
+
+// Encode an entry header: type and size, 4 bits then 7 bits per byte.
+static size_t encode_entry_header(unsigned char *out, int type, size_t size) {
+    size_t n = 0;
+    unsigned char c = (type << 4) | (size & 15);
+    size >>= 4;
+    while (size) {
+        out[n++] = c | 0x80;
+        c = size & 0x7f;
+        size >>= 7;
+    }
+    out[n++] = c;
+    return n;
+}
+
+static uint32_t sha_slot(const pack_writer *pw, const sha1_t *sha) {
+    uint32_t h;
+    memcpy(&h, sha->hash, 4);
+    return h & (pw->table_size - 1);
+}
+
+static const pack_idx_entry *find_entry(const pack_writer *pw, const sha1_t *sha) {
+    for (uint32_t i = sha_slot(pw, sha); pw->table[i]; i = (i + 1) & (pw->table_size - 1)) {
+        if (memcmp(pw->entries[pw->table[i] - 1].sha.hash, sha->hash, 20) == 0) {
+            return &pw->entries[pw->table[i] - 1];
+        }
+    }
+    return NULL;
+}
+
+static int add_entry(pack_writer *pw, const sha1_t *sha, uint32_t crc, uint64_t offset) {
+    if (pw->nr == pw->alloc) {
+        uint32_t alloc = pw->alloc ? pw->alloc * 2 : 1024;
+        pack_idx_entry *entries = realloc(pw->entries, alloc * sizeof(*entries));
+        if (!entries) {
+            perror("realloc");
+            return -1;
+        }
+        pw->entries = entries;
+        uint32_t *table = calloc(alloc * 2, sizeof(*table));
+        if (!table) {
+            perror("calloc");
+            return -1;
+        }
+        pw->alloc = alloc;
+        free(pw->table);
+        pw->table = table;
+        pw->table_size = alloc * 2;
+        for (uint32_t i = 0; i < pw->nr; i++) {
+            uint32_t slot = sha_slot(pw, &pw->entries[i].sha);
+            while (pw->table[slot]) slot = (slot + 1) & (pw->table_size - 1);
+            pw->table[slot] = i + 1;
+        }
+    }
+    pack_idx_entry *e = &pw->entries[pw->nr++];
+    e->sha = *sha;
+    e->crc = crc;
+    e->offset = offset;
+    uint32_t slot = sha_slot(pw, sha);
+    while (pw->table[slot]) slot = (slot + 1) & (pw->table_size - 1);
+    pw->table[slot] = pw->nr;
+    return 0;
+}
+
+static int pack_write(pack_writer *pw, const void *data, size_t len, uint32_t *crc) {
+    if (fwrite(data, 1, len, pw->file) != len) {
+        perror("write pack");
+        return -1;
+    }
+    *crc = crc32(*crc, data, len);
+    pw->offset += len;
+    return 0;
+}
+
+/* Function to start a new pack in PACK_DIR; returns NULL on failure */
+pack_writer *pack_writer_begin(void) {
+    pack_writer *pw = calloc(1, sizeof(*pw));
+    if (!pw) {
+        perror("calloc");
+        return NULL;
+    }
+    pthread_mutex_init(&pw->lock, NULL);
+    mkdir(PACK_DIR, 0755);
+    snprintf(pw->tmp_path, sizeof(pw->tmp_path), "%s/tmp_pack_XXXXXX", PACK_DIR);
+    int fd = mkstemp(pw->tmp_path);
+    if (fd < 0 || !(pw->file = fdopen(fd, "w+b"))) {
+        perror("create pack");
+        if (fd >= 0) {
+            close(fd);
+            unlink(pw->tmp_path);
+        }
+        pthread_mutex_destroy(&pw->lock);
+        free(pw);
+        return NULL;
+    }
+    fchmod(fd, 0444);
+    // The object count is filled in by pack_writer_finish.
+    unsigned char header[12] = {'P', 'A', 'C', 'K', 0, 0, 0, 2, 0, 0, 0, 0};
+    if (fwrite(header, 1, sizeof(header), pw->file) != sizeof(header)) {
+        perror("write pack");
+        pack_writer_abort(pw);
+        return NULL;
+    }
+    pw->offset = sizeof(header);
+    return pw;
+}
+
+int pack_writer_contains(pack_writer *pw, const sha1_t *sha) {
+    pthread_mutex_lock(&pw->lock);
+    int found = pw->nr && find_entry(pw, sha);
+    pthread_mutex_unlock(&pw->lock);
+    return found;
+}
+
+/* Function to append an object whose id is known
+* Returns 0 when it was added, 1 when the pack already has it, -1 on error.
+* *bytes receives the size of the new entry.
+*/
+int pack_writer_add(pack_writer *pw, int type, const void *data, size_t len, const sha1_t *sha, uint64_t *bytes) {
+    if (pack_writer_contains(pw, sha)) {
+        return 1;
+    }
+    z_stream *zs = deflate_thread_stream();
+    uLong bound = deflateBound(zs, len);
+    unsigned char *out = malloc(bound ? bound : 1);
+    if (!out) {
+        perror("malloc");
+        return -1;
+    }
+    size_t compressed;
+    if (deflate_sized(zs, data, len, out, bound, Z_FINISH, &compressed) != Z_STREAM_END) {
+        fprintf(stderr, "Failed to compress object\n");
+        free(out);
+        return -1;
+    }
+
+    unsigned char header[16];
+    size_t header_len = encode_entry_header(header, type, len);
+    int ret = 1;
+    pthread_mutex_lock(&pw->lock);
+    // Another thread may have added it while this one compressed.
+    if (!(pw->nr && find_entry(pw, sha))) {
+        uint64_t offset = pw->offset;
+        uint32_t crc = crc32(0L, Z_NULL, 0);
+        ret = pack_write(pw, header, header_len, &crc) || pack_write(pw, out, compressed, &crc) ||
+              add_entry(pw, sha, crc, offset) ? -1 : 0;
+        *bytes = header_len + compressed;
+    }
+    pthread_mutex_unlock(&pw->lock);
+    free(out);
+    return ret;
+}
+
+// An unlinked scratch file next to the pack, for one entry compressed
+// outside the lock.
+static FILE *scratch_file(void) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s/tmp_entry_XXXXXX", PACK_DIR);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return NULL;
+    }
+    unlink(path);
+    FILE *f = fdopen(fd, "w+b");
+    if (!f) {
+        perror("fdopen");
+        close(fd);
+    }
+    return f;
+}
+
+// Deflate size bytes of in as a blob entry into tmp, hashing them again
+// so a file that changed since it was first hashed is caught.
+static int compress_stream(FILE *in, size_t size, const sha1_t *sha, FILE *tmp) {
+    char obj_header[MAX_HEADER_LEN];
+    int obj_header_len = snprintf(obj_header, sizeof(obj_header), "blob %zu", size) + 1;
+    EVP_MD_CTX *ctx = sha1_thread_ctx();
+    EVP_DigestUpdate(ctx, obj_header, obj_header_len);
+    z_stream *zs = deflate_thread_stream();
+
+    unsigned char header[16];
+    size_t header_len = encode_entry_header(header, OBJ_BLOB, size);
+    if (fwrite(header, 1, header_len, tmp) != header_len) {
+        perror("write pack entry");
+        return -1;
+    }
+    unsigned char buf[CHUNK], zbuf[CHUNK];
+    size_t total = 0, n;
+    int flush = Z_NO_FLUSH;
+    while (flush != Z_FINISH) {
+        n = fread(buf, 1, sizeof(buf), in);
+        if (n == 0) {
+            if (ferror(in)) {
+                perror("fread");
+                return -1;
+            }
+            flush = Z_FINISH;
+        }
+        total += n;
+        EVP_DigestUpdate(ctx, buf, n);
+        zs->next_in = buf;
+        zs->avail_in = n;
+        do {
+            zs->next_out = zbuf;
+            zs->avail_out = sizeof(zbuf);
+            if (deflate(zs, flush) == Z_STREAM_ERROR) {
+                fprintf(stderr, "Failed to compress object\n");
+                return -1;
+            }
+            size_t have = sizeof(zbuf) - zs->avail_out;
+            if (fwrite(zbuf, 1, have, tmp) != have) {
+                perror("write pack entry");
+                return -1;
+            }
+        } while (zs->avail_out == 0);
+    }
+    sha1_t check;
+    EVP_DigestFinal_ex(ctx, check.hash, NULL);
+    if (total != size || memcmp(check.hash, sha->hash, 20) != 0) {
+        fprintf(stderr, "File changed while being hashed\n");
+        return -1;
+    }
+    return fflush(tmp) == 0 && fseeko(tmp, 0, SEEK_SET) == 0 ? 0 : -1;
+}
+
+/* Function to hash a file of the given size as a blob and append it
+* The file is hashed first, so a blob that exists already costs no
+* compression. A new one is then deflated into a scratch file, and only
+* copying that into the pack holds the lock, leaving other threads free
+* to add objects meanwhile. Returns like pack_writer_add, with the id in
+* *out.
+*/
+int pack_writer_add_stream(pack_writer *pw, FILE *in, size_t size, sha1_t *out, uint64_t *bytes) {
+    off_t in_start = ftello(in);
+    if (in_start < 0 || write_blob_stream(in, size, 0, out) != 0) {
+        return -1;
+    }
+    if (pack_writer_contains(pw, out) || object_exists(out)) {
+        return 1;
+    }
+    if (fseeko(in, in_start, SEEK_SET) != 0) {
+        perror("fseeko");
+        return -1;
+    }
+    FILE *tmp = scratch_file();
+    if (!tmp) {
+        return -1;
+    }
+    if (compress_stream(in, size, out, tmp) != 0) {
+        fclose(tmp);
+        return -1;
+    }
+
+    int ret = 1;
+    pthread_mutex_lock(&pw->lock);
+    // Another thread may have added it while this one compressed.
+    if (!(pw->nr && find_entry(pw, out))) {
+        uint64_t start = pw->offset;
+        uint32_t crc = crc32(0L, Z_NULL, 0);
+        unsigned char buf[CHUNK];
+        size_t n;
+        ret = 0;
+        while (ret == 0 && (n = fread(buf, 1, sizeof(buf), tmp)) > 0) {
+            ret = pack_write(pw, buf, n, &crc);
+        }
+        if (ret == 0 && ferror(tmp)) {
+            perror("read pack entry");
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = add_entry(pw, out, crc, start);
+            *bytes = pw->offset - start;
+        }
+        // Drop a partly written entry again.
+        if (ret != 0) {
+            if (fflush(pw->file) != 0 || ftruncate(fileno(pw->file), start) != 0 ||
+                fseeko(pw->file, start, SEEK_SET) != 0) {
+                perror("truncate pack");
+            }
+            pw->offset = start;
+        }
+    }
+    pthread_mutex_unlock(&pw->lock);
+    fclose(tmp);
+    return ret;
+}
+
+// Inflate the entry at offset from the pack file; the caller holds the lock.
+static int read_entry(pack_writer *pw, uint64_t offset, int *type, unsigned char **data, size_t *size) {
+    int fd = fileno(pw->file);
+    unsigned char in[CHUNK];
+    ssize_t n = pread(fd, in, sizeof(in), offset);
+    if (n <= 0) {
+        perror("read pack");
+        return -1;
+    }
+    size_t pos = 0;
+    unsigned char c = in[pos++];
+    *type = (c >> 4) & 7;
+    size_t len = c & 15;
+    for (int shift = 4; c & 0x80; shift += 7) {
+        if (pos == (size_t)n) {
+            fprintf(stderr, "Truncated pack entry\n");
+            return -1;
+        }
+        c = in[pos++];
+        len |= (size_t)(c & 0x7f) << shift;
+    }
+    unsigned char *out = malloc(len + 1);
+    if (!out) {
+        perror("malloc");
+        return -1;
+    }
+    z_stream zs = {0};
+    if (inflateInit(&zs) != Z_OK) {
+        fprintf(stderr, "Failed to initialize inflate stream\n");
+        free(out);
+        return -1;
+    }
+    // One byte of room past the size shows an entry that is too long.
+    size_t produced = 0;
+    int status;
+    for (;;) {
+        size_t in_used, out_used;
+        status = inflate_sized(&zs, in + pos, n - pos, out + produced, len + 1 - produced, Z_NO_FLUSH, &in_used,
+                               &out_used);
+        produced += out_used;
+        // Input left over means the output is full: the entry is too long.
+        if (status != Z_OK || in_used < (size_t)n - pos) {
+            break;
+        }
+        offset += n;
+        if ((n = pread(fd, in, sizeof(in), offset)) <= 0) {
+            break;
+        }
+        pos = 0;
+    }
+    inflateEnd(&zs);
+    if (status != Z_STREAM_END || produced != len) {
+        fprintf(stderr, "Corrupt entry in pack being written\n");
+        free(out);
+        return -1;
+    }
+    out[len] = '\0';
+    *data = out;
+    *size = len;
+    return 0;
+}
+
+/* Function to read back an object added to the unfinished pack
+* Returns 0 with a malloc'ed, NUL-terminated copy of the content in *data,
+* 1 if the pack does not have the object, -1 on error.
+*/
+int pack_writer_read(pack_writer *pw, const sha1_t *sha, int *type, unsigned char **data, size_t *size) {
+    pthread_mutex_lock(&pw->lock);
+    const pack_idx_entry *e = pw->nr ? find_entry(pw, sha) : NULL;
+    int ret = 1;
+    if (e) {
+        // Entries may still sit in the stdio buffer.
+        ret = fflush(pw->file) == 0 ? read_entry(pw, e->offset, type, data, size) : -1;
+    }
+    pthread_mutex_unlock(&pw->lock);
+    return ret;
+}
+
+void pack_writer_abort(pack_writer *pw) {
+    fclose(pw->file);
+    unlink(pw->tmp_path);
+    pthread_mutex_destroy(&pw->lock);
+    free(pw->entries);
+    free(pw->table);
+    free(pw);
+}
+
+// Fill in the object count, then hash the whole pack for its trailer.
+static int write_pack_trailer(pack_writer *pw, sha1_t *pack_sha) {
+    uint32_t count = htonl(pw->nr);
+    if (fflush(pw->file) != 0 || fseeko(pw->file, 8, SEEK_SET) != 0 ||
+        fwrite(&count, 4, 1, pw->file) != 1 || fseeko(pw->file, 0, SEEK_SET) != 0) {
+        return -1;
+    }
+    EVP_MD_CTX *ctx = sha1_thread_ctx();
+    unsigned char buf[CHUNK];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), pw->file)) > 0) {
+        EVP_DigestUpdate(ctx, buf, n);
+    }
+    if (ferror(pw->file)) {
+        return -1;
+    }
+    EVP_DigestFinal_ex(ctx, pack_sha->hash, NULL);
+    if (fseeko(pw->file, 0, SEEK_END) != 0 || fwrite(pack_sha->hash, 1, 20, pw->file) != 20) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Function to complete the pack, write its index and install both
+* Returns 0 with the pack's checksum in pack_sha, 1 if no object was
+* added (nothing is installed then), or -1 on error. pw is freed.
+*/
+int pack_writer_finish(pack_writer *pw, int fsync_pack, sha1_t *pack_sha) {
+    if (pw->nr == 0) {
+        pack_writer_abort(pw);
+        return 1;
+    }
+    if (write_pack_trailer(pw, pack_sha) != 0 || fflush(pw->file) != 0 ||
+        (fsync_pack && fsync(fileno(pw->file)) != 0)) {
+        perror("write pack");
+        pack_writer_abort(pw);
+        return -1;
+    }
+
+    char tmp_idx[64];
+    snprintf(tmp_idx, sizeof(tmp_idx), "%s/tmp_idx_XXXXXX", PACK_DIR);
+    int fd = mkstemp(tmp_idx);
+    if (fd < 0) {
+        perror("mkstemp");
+        pack_writer_abort(pw);
+        return -1;
+    }
+    close(fd);
+    sort_pack_idx_entries(pw->entries, pw->nr);
+    int ret = write_pack_idx(tmp_idx, pw->entries, pw->nr, pack_sha);
+    if (ret == 0) {
+        chmod(tmp_idx, 0444);
+        ret = finalize_pack(pw->tmp_path, tmp_idx, pack_sha);
+    }
+    if (ret != 0) {
+        unlink(tmp_idx);
+        pack_writer_abort(pw);
+        return -1;
+    }
+    fclose(pw->file);
+    pthread_mutex_destroy(&pw->lock);
+    free(pw->entries);
+    free(pw->table);
+    free(pw);
+    return 0;
+}
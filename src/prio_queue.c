@@ -0,0 +1,84 @@
+/**
+* prio_queue.c - Priority queue for history walks
+* An array-backed binary heap. Each entry remembers when it was added, so
+* commits with equal dates come out first in, first out, which keeps
+* walk order stable from run to run.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "prio_queue.h"
+
+static int compare(const prio_queue *queue, size_t i, size_t j) {
+    int cmp = queue->compare(queue->array[i].data, queue->array[j].data);
+    if (cmp) {
+        return cmp;
+    }
+    return queue->array[i].ctr < queue->array[j].ctr ? -1 : 1;
+}
+
+static void swap(prio_queue *queue, size_t i, size_t j) {
+    prio_queue_entry tmp = queue->array[i];
+    queue->array[i] = queue->array[j];
+    queue->array[j] = tmp;
+}
+
+void prio_queue_put(prio_queue *queue, void *thing) {
+    if (queue->nr == queue->alloc) {
+        size_t alloc = queue->alloc ? queue->alloc * 2 : 64;
+        prio_queue_entry *array = realloc(queue->array, alloc * sizeof(*array));
+        if (!array) {
+            perror("realloc");
+            exit(1);
+        }
+        queue->array = array;
+        queue->alloc = alloc;
+    }
+    size_t ix = queue->nr++;
+    queue->array[ix].ctr = queue->insertion_ctr++;
+    queue->array[ix].data = thing;
+    // Sift up
+    while (ix) {
+        size_t parent = (ix - 1) / 2;
+        if (compare(queue, parent, ix) <= 0) {
+            break;
+        }
+        swap(queue, parent, ix);
+        ix = parent;
+    }
+}
+
+/* Function to remove and return the first entry, or NULL when empty */
+void *prio_queue_get(prio_queue *queue) {
+    if (!queue->nr) {
+        return NULL;
+    }
+    void *result = queue->array[0].data;
+    if (!--queue->nr) {
+        return result;
+    }
+    queue->array[0] = queue->array[queue->nr];
+    // Sift down
+    for (size_t ix = 0, child; (child = ix * 2 + 1) < queue->nr; ix = child) {
+        if (child + 1 < queue->nr && compare(queue, child, child + 1) >= 0) {
+            child++;
+        }
+        if (compare(queue, ix, child) <= 0) {
+            break;
+        }
+        swap(queue, child, ix);
+    }
+    return result;
+}
+
+void *prio_queue_peek(prio_queue *queue) {
+    return queue->nr ? queue->array[0].data : NULL;
+}
+
+void prio_queue_clear(prio_queue *queue) {
+    free(queue->array);
+    queue->array = NULL;
+    queue->nr = 0;
+    queue->alloc = 0;
+    queue->insertion_ctr = 0;
+}
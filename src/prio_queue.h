@@ -0,0 +1,29 @@
+#ifndef PRIO_QUEUE_H
+#define PRIO_QUEUE_H
+
+#include <stddef.h>
+
+/* Negative when a should come out before b */
+typedef int (*prio_queue_compare_fn)(const void *a, const void *b);
+
+typedef struct {
+    unsigned long ctr;  /* insertion order, to break ties */
+    void *data;
+} prio_queue_entry;
+
+/* Binary heap; entries that compare equal come out in insertion order */
+typedef struct {
+    prio_queue_compare_fn compare;
+    unsigned long insertion_ctr;
+    prio_queue_entry *array;
+    size_t nr;
+    size_t alloc;
+} prio_queue;
+
+/* Function prototypes */
+void prio_queue_put(prio_queue *queue, void *thing);
+void *prio_queue_get(prio_queue *queue);
+void *prio_queue_peek(prio_queue *queue);
+void prio_queue_clear(prio_queue *queue);
+
+#endif
@@ -0,0 +1,190 @@
+/**
+* refs.c - Resolve and list refs
+* A ref is a loose file below .git/refs, or a line of .git/packed-refs; the
+* loose file wins when both exist. HEAD and other symbolic refs hold
+* "ref: <name>" and are followed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "refs.h"
+#include "dir_scan.h"
+
+typedef struct {
+    char *name;
+    sha1_t sha;
+} ref_entry;
+
+typedef struct {
+    ref_entry *refs;
+    size_t nr;
+    size_t alloc;
+    char path[PATH_MAX];  /* ref name of the directory being scanned */
+    int dirfd;
+} ref_list;
+
+static int read_packed_ref(const char *ref, sha1_t *out) {
+    FILE *f = fopen(PACKED_REFS_PATH, "r");
+    if (!f) {
+        return -1;
+    }
+    char line[PATH_MAX + 64];
+    int ret = -1;
+    while (ret != 0 && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strlen(line) > 41 && line[40] == ' ' && strcmp(line + 41, ref) == 0) {
+            ret = hex_to_sha1(line, out);
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+/* Function to look up a full ref name such as refs/heads/main or HEAD
+* Returns 0 with the id in out, or -1 if the ref does not exist.
+*/
+int read_ref(const char *ref, sha1_t *out) {
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s", ref);
+    for (int depth = 0; depth < MAX_SYMREF_DEPTH; depth++) {
+        char path[PATH_MAX + 8], buf[PATH_MAX];
+        snprintf(path, sizeof(path), ".git/%s", name);
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            return read_packed_ref(name, out);
+        }
+        int ok = fgets(buf, sizeof(buf), f) != NULL;
+        fclose(f);
+        if (!ok) {
+            return -1;
+        }
+        buf[strcspn(buf, "\n")] = '\0';
+        if (strncmp(buf, "ref: ", 5) != 0) {
+            return hex_to_sha1(buf, out);
+        }
+        snprintf(name, sizeof(name), "%s", buf + 5);
+    }
+    fprintf(stderr, "Symbolic ref %s nests too deep\n", ref);
+    return -1;
+}
+
+/* Function to turn a revision argument into an object id
+* Accepts a full hex id, HEAD, and ref names in the order git tries them:
+* as given, then below refs/, refs/tags/, refs/heads/ and refs/remotes/.
+*/
+int resolve_rev(const char *name, sha1_t *out) {
+    if (strlen(name) == 40 && hex_to_sha1(name, out) == 0) {
+        return 0;
+    }
+    static const char *const rules[] = {
+        "%s", "refs/%s", "refs/tags/%s", "refs/heads/%s", "refs/remotes/%s", "refs/remotes/%s/HEAD",
+    };
+    for (size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+        char ref[PATH_MAX];
+        snprintf(ref, sizeof(ref), rules[i], name);
+        if ((i > 0 || strcmp(ref, "HEAD") == 0 || strncmp(ref, "refs/", 5) == 0) && read_ref(ref, out) == 0) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "fatal: bad revision '%s'\n", name);
+    return -1;
+}
+
+static void add_ref(ref_list *list, const char *name, const sha1_t *sha) {
+    if (list->nr == list->alloc) {
+        list->alloc = list->alloc ? list->alloc * 2 : 64;
+        list->refs = realloc(list->refs, list->alloc * sizeof(*list->refs));
+        if (!list->refs) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    ref_entry *e = &list->refs[list->nr++];
+    e->name = strdup(name);
+    e->sha = *sha;
+}
+
+static int scan_loose_ref(void *ctx, const char *name, unsigned char d_type) {
+    ref_list *list = ctx;
+    size_t len = strlen(name);
+    if (len > 5 && strcmp(name + len - 5, ".lock") == 0) {
+        return 0;
+    }
+    size_t base = strlen(list->path);
+    snprintf(list->path + base, sizeof(list->path) - base, "%s", name);
+    struct stat st;
+    if (d_type == DT_UNKNOWN && fstatat(list->dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        d_type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+    }
+    if (d_type == DT_DIR) {
+        int fd = dir_scan_open(list->dirfd, name);
+        if (fd >= 0) {
+            int parent = list->dirfd;
+            strncat(list->path, "/", sizeof(list->path) - strlen(list->path) - 1);
+            list->dirfd = fd;
+            dir_scan(fd, scan_loose_ref, list);
+            list->dirfd = parent;
+            close(fd);
+        }
+    } else {
+        sha1_t sha;
+        if (read_ref(list->path, &sha) == 0) {
+            add_ref(list, list->path, &sha);
+        }
+    }
+    list->path[base] = '\0';
+    return 0;
+}
+
+static int compare_refs(const void *a, const void *b) {
+    return strcmp(((const ref_entry *)a)->name, ((const ref_entry *)b)->name);
+}
+
+/* Function to call fn for every ref whose name starts with prefix
+* prefix names a directory below .git, such as "refs/" or "refs/heads/".
+* Returns the first nonzero value of fn, or 0.
+*/
+int for_each_ref(const char *prefix, each_ref_fn fn, void *ctx) {
+    ref_list list = {0};
+    char dir[PATH_MAX + 8];
+    snprintf(list.path, sizeof(list.path), "%s", prefix);
+    snprintf(dir, sizeof(dir), ".git/%s", prefix);
+    list.dirfd = dir_scan_open(AT_FDCWD, dir);
+    if (list.dirfd >= 0) {
+        dir_scan(list.dirfd, scan_loose_ref, &list);
+        close(list.dirfd);
+    }
+    size_t loose = list.nr;
+    qsort(list.refs, loose, sizeof(*list.refs), compare_refs);
+
+    FILE *f = fopen(PACKED_REFS_PATH, "r");
+    char line[PATH_MAX + 64];
+    while (f && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        // Comments and peeled "^<id>" lines are skipped too.
+        if (strlen(line) <= 41 || line[40] != ' ' || strncmp(line + 41, prefix, strlen(prefix)) != 0) {
+            continue;
+        }
+        ref_entry key = {.name = line + 41};
+        sha1_t sha;
+        if (!bsearch(&key, list.refs, loose, sizeof(*list.refs), compare_refs) && hex_to_sha1(line, &sha) == 0) {
+            add_ref(&list, line + 41, &sha);
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    qsort(list.refs, list.nr, sizeof(*list.refs), compare_refs);
+
+    int ret = 0;
+    for (size_t i = 0; i < list.nr; i++) {
+        if (!ret) {
+            ret = fn(list.refs[i].name, &list.refs[i].sha, ctx);
+        }
+        free(list.refs[i].name);
+    }
+    free(list.refs);
+    return ret;
+}
@@ -0,0 +1,19 @@
+#ifndef REFS_H
+#define REFS_H
+
+#include "blob.h"
+
+#define PACKED_REFS_PATH ".git/packed-refs"
+
+/* Symbolic refs are followed at most this deep */
+#define MAX_SYMREF_DEPTH 5
+
+/* Called in name order; a nonzero return stops the iteration */
+typedef int (*each_ref_fn)(const char *ref, const sha1_t *sha, void *ctx);
+
+/* Function prototypes */
+int read_ref(const char *ref, sha1_t *out);
+int resolve_rev(const char *name, sha1_t *out);
+int for_each_ref(const char *prefix, each_ref_fn fn, void *ctx);
+
+#endif
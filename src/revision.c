@@ -0,0 +1,607 @@
+/**
+* revision.c - Commits and history walks
+* Every commit seen is one commit_node in a table keyed by id, so the
+* parents of different commits link up into one graph. Nodes are parsed
+* from the commit-graph file when it has them, which costs a binary
+* search and no inflating; other commits are read as objects. Walks pop
+* commits newest first from a priority queue, as git's rev-list does.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "revision.h"
+#include "commit_graph.h"
+#include "list_objects.h"
+#include "pack.h"
+#include "refs.h"
+#include "tree_builder.h"
+
+/* All commit nodes and their parent arrays; they live until exit */
+static arena commit_arena;
+static commit_node **commit_table;
+static size_t commit_table_size;
+static size_t commit_table_nr;
+
+static size_t commit_slot(const sha1_t *sha) {
+    uint32_t h;
+    memcpy(&h, sha->hash, 4);
+    return h & (commit_table_size - 1);
+}
+
+static void grow_commit_table(void) {
+    commit_node **old = commit_table;
+    size_t old_size = commit_table_size;
+    commit_table_size = old_size ? old_size * 2 : 4096;
+    commit_table = calloc(commit_table_size, sizeof(*commit_table));
+    if (!commit_table) {
+        perror("calloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i]) {
+            size_t slot = commit_slot(&old[i]->sha);
+            while (commit_table[slot]) slot = (slot + 1) & (commit_table_size - 1);
+            commit_table[slot] = old[i];
+        }
+    }
+    free(old);
+}
+
+/* Function to return the one node for a commit id, creating it unparsed */
+commit_node *lookup_commit(const sha1_t *sha) {
+    if ((commit_table_nr + 1) * 2 > commit_table_size) {
+        grow_commit_table();
+    }
+    size_t slot = commit_slot(sha);
+    for (; commit_table[slot]; slot = (slot + 1) & (commit_table_size - 1)) {
+        if (memcmp(commit_table[slot]->sha.hash, sha->hash, 20) == 0) {
+            return commit_table[slot];
+        }
+    }
+    commit_node *c = arena_alloc(&commit_arena, sizeof(*c));
+    memset(c, 0, sizeof(*c));
+    c->sha = *sha;
+    c->generation = GENERATION_NUMBER_INFINITY;
+    c->graph_pos = COMMIT_GRAPH_POS_NONE;
+    commit_table[slot] = c;
+    commit_table_nr++;
+    return c;
+}
+
+static commit_node *graph_commit_at(commit_graph *g, uint32_t pos) {
+    sha1_t sha;
+    commit_graph_oid(g, pos, &sha);
+    commit_node *c = lookup_commit(&sha);
+    c->graph_pos = pos;
+    return c;
+}
+
+// Fill c from its row in the commit graph; parents are looked up by
+// position, so nothing has to be inflated.
+static int fill_commit_from_graph(commit_graph *g, commit_node *c) {
+    commit_graph_data data;
+    commit_graph_data_at(g, c->graph_pos, &data);
+    c->tree = data.tree;
+    c->date = data.date;
+    c->generation = data.generation;
+
+    // More than two parents continue in the extra edge list.
+    int extra = data.parent2 != GRAPH_PARENT_NONE && (data.parent2 & GRAPH_EXTRA_EDGES_NEEDED);
+    uint32_t edge = data.parent2 & ~GRAPH_EXTRA_EDGES_NEEDED;
+    int nr = data.parent1 != GRAPH_PARENT_NONE;
+    if (extra) {
+        int count = commit_graph_edge_count(g, edge);
+        nr = count < 0 ? -1 : nr + count;
+    } else if (data.parent2 != GRAPH_PARENT_NONE) {
+        nr++;
+    }
+    if (nr < 0) {
+        fprintf(stderr, "fatal: %s is corrupt\n", COMMIT_GRAPH_PATH);
+        return -1;
+    }
+    c->parents = arena_alloc(&commit_arena, (nr ? nr : 1) * sizeof(*c->parents));
+    c->nr_parents = nr;
+    for (int i = 0; i < nr; i++) {
+        uint32_t pos = i == 0 ? data.parent1 : extra ? commit_graph_edge(g, edge + i - 1) : data.parent2;
+        if (pos >= g->num_commits) {
+            fprintf(stderr, "fatal: %s is corrupt\n", COMMIT_GRAPH_PATH);
+            return -1;
+        }
+        c->parents[i] = graph_commit_at(g, pos);
+    }
+    return 0;
+}
+
+// Parse the headers of a commit object's content into c.
+static int parse_commit_buffer(commit_node *c, const char *data, size_t size) {
+    const char *p = data, *end = data + size;
+    char hex[41];
+    if (size < 46 || strncmp(p, "tree ", 5) != 0 || hex_to_sha1(p + 5, &c->tree) != 0) {
+        sha1_to_hex(&c->sha, hex);
+        fprintf(stderr, "fatal: bad tree pointer in commit %s\n", hex);
+        return -1;
+    }
+    p += 46;
+    size_t nr = 0;
+    for (const char *q = p; end - q > 47 && strncmp(q, "parent ", 7) == 0; q += 48) {
+        nr++;
+    }
+    c->parents = arena_alloc(&commit_arena, (nr ? nr : 1) * sizeof(*c->parents));
+    c->nr_parents = 0;
+    for (; c->nr_parents < nr; p += 48) {
+        sha1_t parent;
+        if (hex_to_sha1(p + 7, &parent) != 0) {
+            sha1_to_hex(&c->sha, hex);
+            fprintf(stderr, "fatal: bad parents in commit %s\n", hex);
+            return -1;
+        }
+        c->parents[c->nr_parents++] = lookup_commit(&parent);
+    }
+    // The date follows the '>' that closes the committer's email.
+    c->date = 0;
+    while (p < end && *p != '\n') {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            break;
+        }
+        if (strncmp(p, "committer ", 10) == 0) {
+            const char *gt = eol;
+            while (gt > p && *gt != '>') gt--;
+            c->date = strtoull(gt + 1, NULL, 10);
+            break;
+        }
+        p = eol + 1;
+    }
+    c->flags |= COMMIT_PARSED;
+    return 0;
+}
+
+typedef struct {
+    commit_node *commit;  /* set once a commit was parsed */
+    sha1_t next;          /* what a tag points to */
+    int type;             /* of the object last read */
+    int is_tag;
+    const char *tag_name; /* the tag's own name, kept in commit_arena */
+    int quiet;
+} peel_ctx;
+
+static int parse_commit_object(const object_span *obj, void *ctx) {
+    peel_ctx *peel = ctx;
+    peel->type = type_from_name(obj->type);
+    if (strcmp(obj->type, "commit") == 0) {
+        return parse_commit_buffer(peel->commit, (const char *)obj->data, obj->size);
+    }
+    if (strcmp(obj->type, "tag") == 0 && obj->size > 47 && strncmp((const char *)obj->data, "object ", 7) == 0 &&
+        hex_to_sha1((const char *)obj->data + 7, &peel->next) == 0) {
+        peel->is_tag = 1;
+        peel->tag_name = "";
+        const char *p = (const char *)obj->data, *end = p + obj->size;
+        while (p < end && *p != '\n') {
+            const char *eol = memchr(p, '\n', end - p);
+            if (!eol) {
+                break;
+            }
+            if (strncmp(p, "tag ", 4) == 0) {
+                peel->tag_name = arena_strndup(&commit_arena, p + 4, eol - p - 4);
+                break;
+            }
+            p = eol + 1;
+        }
+        return 0;
+    }
+    if (!peel->quiet) {
+        char hex[41];
+        sha1_to_hex(&peel->commit->sha, hex);
+        fprintf(stderr, "fatal: object %s is a %s, not a commit\n", hex, obj->type);
+    }
+    return -1;
+}
+
+// Parse c from the graph if it has it; otherwise peel is left to the
+// caller: a tag's target comes back in peel->next.
+static int parse_commit_gently(commit_node *c, peel_ctx *peel) {
+    if (c->flags & COMMIT_PARSED) {
+        return 0;
+    }
+    commit_graph *g = get_commit_graph();
+    if (g && (c->graph_pos != COMMIT_GRAPH_POS_NONE || commit_graph_find(g, &c->sha, &c->graph_pos) == 0)) {
+        if (fill_commit_from_graph(g, c) != 0) {
+            return -1;
+        }
+        c->flags |= COMMIT_PARSED;
+        return 0;
+    }
+    char hex[41];
+    sha1_to_hex(&c->sha, hex);
+    peel->commit = c;
+    return visit_git_object(hex, parse_commit_object, peel);
+}
+
+/* Function to fill in a commit's tree, parents and date; -1 on error */
+int parse_commit_node(commit_node *c) {
+    peel_ctx peel = {0};
+    if (parse_commit_gently(c, &peel) != 0) {
+        return -1;
+    }
+    if (peel.is_tag) {
+        char hex[41];
+        sha1_to_hex(&c->sha, hex);
+        fprintf(stderr, "fatal: object %s is a tag, not a commit\n", hex);
+        return -1;
+    }
+    return 0;
+}
+
+/* Function to return the parsed commit sha names, through any tags
+* With quiet set, ids of trees and blobs give NULL without a message.
+*/
+commit_node *lookup_commit_reference(const sha1_t *sha, int quiet) {
+    peel_ctx peel = {.quiet = quiet};
+    sha1_t id = *sha;
+    for (;;) {
+        commit_node *c = lookup_commit(&id);
+        peel.is_tag = 0;
+        if (parse_commit_gently(c, &peel) != 0) {
+            return NULL;
+        }
+        if (!peel.is_tag) {
+            return c;
+        }
+        id = peel.next;
+    }
+}
+
+/* Newest first, as rev-list shows commits */
+int compare_commits_by_date(const void *a, const void *b) {
+    const commit_node *x = a, *y = b;
+    return x->date > y->date ? -1 : x->date < y->date;
+}
+
+/* Highest generation first; commits outside the graph before all others */
+int compare_commits_by_generation(const void *a, const void *b) {
+    const commit_node *x = a, *y = b;
+    if (x->generation != y->generation) {
+        return x->generation > y->generation ? -1 : 1;
+    }
+    return compare_commits_by_date(a, b);
+}
+
+void rev_walk_init(rev_walk *w) {
+    memset(w, 0, sizeof(*w));
+    w->queue.compare = compare_commits_by_date;
+}
+
+int rev_walk_add_commit(rev_walk *w, commit_node *c, int uninteresting) {
+    if (uninteresting) {
+        c->flags |= COMMIT_UNINTERESTING;
+        w->limited = 1;
+    }
+    if (!(c->flags & COMMIT_SEEN)) {
+        c->flags |= COMMIT_SEEN;
+        prio_queue_put(&w->queue, c);
+    }
+    return 0;
+}
+
+static void add_pending(rev_walk *w, const sha1_t *sha, int type, const char *name, int uninteresting) {
+    if (w->pending_nr == w->pending_alloc) {
+        w->pending_alloc = w->pending_alloc ? w->pending_alloc * 2 : 16;
+        w->pending = realloc(w->pending, w->pending_alloc * sizeof(*w->pending));
+        if (!w->pending) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    rev_pending *p = &w->pending[w->pending_nr++];
+    p->sha = *sha;
+    p->type = type;
+    p->uninteresting = uninteresting;
+    p->name = name;
+}
+
+/* Function to start the walk at the object sha
+* Tags are peeled down to what they point at; with w->objects set, the
+* tags, trees and blobs met on the way are kept for listing (or for
+* excluding, with uninteresting set). Without it they are skipped, as
+* git's rev-list skips them.
+*/
+int rev_walk_add_object(rev_walk *w, const sha1_t *sha, int uninteresting) {
+    peel_ctx peel = {.quiet = 1};
+    sha1_t id = *sha;
+    for (;;) {
+        commit_node *c = lookup_commit(&id);
+        peel.type = OBJ_NONE;
+        peel.is_tag = 0;
+        if (parse_commit_gently(c, &peel) == 0 && !peel.is_tag) {
+            return rev_walk_add_commit(w, c, uninteresting);
+        }
+        if (peel.type != OBJ_TAG && peel.type != OBJ_TREE && peel.type != OBJ_BLOB) {
+            return -1;
+        }
+        // git lists a tag under the name in its header, and a tree or
+        // blob started at under an empty path.
+        if (w->objects) {
+            add_pending(w, &id, peel.type, peel.is_tag ? peel.tag_name : "", uninteresting);
+        }
+        if (!peel.is_tag) {
+            return 0;
+        }
+        id = peel.next;
+    }
+}
+
+/* Function to start the walk at a revision; "^<rev>" excludes its history */
+int rev_walk_add(rev_walk *w, const char *arg) {
+    int uninteresting = arg[0] == '^';
+    sha1_t sha;
+    if (resolve_rev(arg + uninteresting, &sha) != 0) {
+        return -1;
+    }
+    return rev_walk_add_object(w, &sha, uninteresting);
+}
+
+static int add_ref_tip(const char *ref, const sha1_t *sha, void *ctx) {
+    (void)ref;
+    return rev_walk_add_object(ctx, sha, 0);
+}
+
+/* Function to start the walk at every ref under prefix, then HEAD if
+* with_head is set, in the order git's --all and --branches use
+*/
+int rev_walk_add_refs(rev_walk *w, const char *prefix, int with_head) {
+    if (for_each_ref(prefix, add_ref_tip, w) != 0) {
+        return -1;
+    }
+    sha1_t head;
+    // An unborn HEAD adds nothing.
+    if (with_head && read_ref("HEAD", &head) == 0) {
+        return rev_walk_add_object(w, &head, 0);
+    }
+    return 0;
+}
+
+// Excluding a commit excludes everything it reaches. Parsed ancestors
+// are marked now; the rest pass the flag on when the walk gets to them.
+static void mark_parents_uninteresting(commit_node *c) {
+    size_t nr = 0, alloc = 64;
+    commit_node **stack = malloc(alloc * sizeof(*stack));
+    if (!stack) {
+        perror("malloc");
+        exit(1);
+    }
+    stack[nr++] = c;
+    while (nr) {
+        commit_node *top = stack[--nr];
+        for (uint32_t i = 0; i < top->nr_parents; i++) {
+            commit_node *p = top->parents[i];
+            if (p->flags & COMMIT_UNINTERESTING) {
+                continue;
+            }
+            p->flags |= COMMIT_UNINTERESTING;
+            if (p->flags & COMMIT_PARSED) {
+                if (nr == alloc) {
+                    alloc *= 2;
+                    stack = realloc(stack, alloc * sizeof(*stack));
+                    if (!stack) {
+                        perror("realloc");
+                        exit(1);
+                    }
+                }
+                stack[nr++] = p;
+            }
+        }
+    }
+    free(stack);
+}
+
+// Queue the parents of c, which has just been taken off the queue.
+static int process_parents(rev_walk *w, commit_node *c) {
+    if (c->flags & COMMIT_UNINTERESTING) {
+        mark_parents_uninteresting(c);
+    }
+    for (uint32_t i = 0; i < c->nr_parents; i++) {
+        commit_node *p = c->parents[i];
+        if (parse_commit_node(p) != 0) {
+            return -1;
+        }
+        if (!(p->flags & COMMIT_SEEN)) {
+            p->flags |= COMMIT_SEEN;
+            prio_queue_put(&w->queue, p);
+        }
+    }
+    return 0;
+}
+
+static int everybody_uninteresting(const rev_walk *w) {
+    for (size_t i = 0; i < w->queue.nr; i++) {
+        const commit_node *c = w->queue.array[i].data;
+        if (!(c->flags & COMMIT_UNINTERESTING)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Whether an excluded commit taken off the queue leaves work to do:
+// interesting commits are still queued, or queued ones are not older
+// than the last commit listed, so they may yet exclude it.
+static int still_interesting(rev_walk *w, uint64_t date, int slop) {
+    const commit_node *next = prio_queue_peek(&w->queue);
+    if (!next) {
+        return 0;
+    }
+    if (date <= next->date || !everybody_uninteresting(w)) {
+        return REV_WALK_SLOP;
+    }
+    return slop - 1;
+}
+
+// With excluded revisions, walk until only excluded history is left in
+// the queue; a commit listed early may still turn out to be excluded.
+static int limit_list(rev_walk *w) {
+    size_t alloc = 0;
+    int slop = REV_WALK_SLOP;
+    uint64_t date = UINT64_MAX;
+    commit_node *c;
+    while ((c = prio_queue_get(&w->queue))) {
+        if (process_parents(w, c) != 0) {
+            return -1;
+        }
+        if (c->flags & COMMIT_UNINTERESTING) {
+            if (!(slop = still_interesting(w, date, slop))) {
+                break;
+            }
+            continue;
+        }
+        date = c->date;
+        if (w->list_nr == alloc) {
+            alloc = alloc ? alloc * 2 : 256;
+            w->list = realloc(w->list, alloc * sizeof(*w->list));
+            if (!w->list) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        w->list[w->list_nr++] = c;
+    }
+    return 0;
+}
+
+/* Function to do the work that must precede the first commit returned
+* For a limited walk this walks everything, leaving w->list holding the
+* listed commits and the excluded ones next to them. Returns -1 on error.
+*/
+int rev_walk_prepare(rev_walk *w) {
+    if (!w->prepared) {
+        w->prepared = 1;
+        if (w->limited && limit_list(w) != 0) {
+            w->error = 1;
+        }
+    }
+    return w->error ? -1 : 0;
+}
+
+/* Function to return the next commit of the walk, newest first
+* Returns NULL at the end, and also on error with w->error set.
+*/
+commit_node *rev_walk_next(rev_walk *w) {
+    if (rev_walk_prepare(w) != 0) {
+        return NULL;
+    }
+    if (w->limited) {
+        while (w->list_pos < w->list_nr) {
+            commit_node *c = w->list[w->list_pos++];
+            if (!(c->flags & COMMIT_UNINTERESTING)) {
+                return c;
+            }
+        }
+        return NULL;
+    }
+    commit_node *c = prio_queue_get(&w->queue);
+    if (c && process_parents(w, c) != 0) {
+        w->error = 1;
+        return NULL;
+    }
+    return c;
+}
+
+void rev_walk_release(rev_walk *w) {
+    prio_queue_clear(&w->queue);
+    free(w->list);
+    w->list = NULL;
+    free(w->pending);
+    w->pending = NULL;
+    w->pending_nr = w->pending_alloc = 0;
+}
+
+/* Function to tell whether a can be reached from b
+* Commits are visited highest generation first, and none below a's
+* generation is expanded: its ancestors cannot include a. Without a
+* commit graph, generations are unknown and the whole history of b may be
+* visited.
+*/
+int is_ancestor(commit_node *a, commit_node *b) {
+    if (parse_commit_node(a) != 0 || parse_commit_node(b) != 0) {
+        return -1;
+    }
+    uint32_t min_generation = a->generation == GENERATION_NUMBER_INFINITY ? 0 : a->generation;
+    prio_queue queue = {.compare = compare_commits_by_generation};
+    b->flags |= COMMIT_SEEN;
+    prio_queue_put(&queue, b);
+    int found = 0;
+    commit_node *c;
+    while (!found && (c = prio_queue_get(&queue))) {
+        if (c == a) {
+            found = 1;
+            break;
+        }
+        // Everything c reaches has a lower generation than c.
+        if (c->generation <= min_generation) {
+            continue;
+        }
+        for (uint32_t i = 0; i < c->nr_parents; i++) {
+            commit_node *p = c->parents[i];
+            if (parse_commit_node(p) != 0) {
+                found = -1;
+                break;
+            }
+            if (!(p->flags & COMMIT_SEEN)) {
+                p->flags |= COMMIT_SEEN;
+                prio_queue_put(&queue, p);
+            }
+        }
+    }
+    prio_queue_clear(&queue);
+    return found;
+}
+
+static void show_commit(const commit_node *c, void *ctx) {
+    (void)ctx;
+    char hex[41];
+    sha1_to_hex(&c->sha, hex);
+    printf("%s\n", hex);
+}
+
+static void show_object(const sha1_t *sha, const char *path, void *ctx) {
+    (void)ctx;
+    char hex[41];
+    sha1_to_hex(sha, hex);
+    printf("%s %s\n", hex, path);
+}
+
+/* Function to print the ids of the commits reachable from revs, newest
+* first, as rev-list does; with opts->objects, the tags, trees and blobs
+* they reach follow as "<id> <path>"
+*/
+int rev_list(char *const *revs, int nr, const rev_list_options *opts) {
+    rev_walk w;
+    rev_walk_init(&w);
+    w.objects = opts->objects;
+    int ret = 0;
+    if (opts->all) {
+        ret = rev_walk_add_refs(&w, "refs/", 1);
+    } else if (opts->branches) {
+        ret = rev_walk_add_refs(&w, "refs/heads/", 0);
+    }
+    for (int i = 0; ret == 0 && i < nr; i++) {
+        ret = rev_walk_add(&w, revs[i]);
+    }
+    if (ret != 0) {
+        rev_walk_release(&w);
+        return -1;
+    }
+    if (opts->objects) {
+        ret = traverse_commit_list(&w, opts->max_count, show_commit, show_object, NULL);
+        rev_walk_release(&w);
+        return ret;
+    }
+    commit_node *c;
+    long max_count = opts->max_count;
+    while (max_count-- != 0 && (c = rev_walk_next(&w))) {
+        show_commit(c, NULL);
+    }
+    ret = w.error ? -1 : 0;
+    rev_walk_release(&w);
+    return ret;
+}
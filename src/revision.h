@@ -0,0 +1,79 @@
+#ifndef REVISION_H
+#define REVISION_H
+
+#include <stdint.h>
+#include "blob.h"
+#include "prio_queue.h"
+
+/* Generation of commits the commit graph does not know */
+#define GENERATION_NUMBER_INFINITY 0xffffffff
+#define COMMIT_GRAPH_POS_NONE 0xffffffff
+
+/* Commits this far past the last interesting one are still examined,
+* in case of committer clocks that were off */
+#define REV_WALK_SLOP 5
+
+/* Flags on commit_node */
+#define COMMIT_PARSED        (1u << 0)
+#define COMMIT_SEEN          (1u << 1)  /* queued by a walk */
+#define COMMIT_UNINTERESTING (1u << 2)  /* reachable from an excluded revision */
+
+typedef struct commit_node {
+    sha1_t sha;
+    sha1_t tree;
+    uint64_t date;        /* committer time */
+    uint32_t generation;
+    uint32_t graph_pos;
+    unsigned flags;
+    uint32_t nr_parents;
+    struct commit_node **parents;
+} commit_node;
+
+/* A tree, blob or tag a walk was started at; commits go on the queue */
+typedef struct {
+    sha1_t sha;
+    int type;
+    int uninteresting;
+    const char *name;     /* shown next to the id */
+} rev_pending;
+
+/* A walk over the commits reachable from some revisions but not others */
+typedef struct {
+    prio_queue queue;
+    int objects;            /* keep the non-commit objects started at */
+    rev_pending *pending;
+    size_t pending_nr;
+    size_t pending_alloc;
+    int limited;            /* there are excluded revisions */
+    int prepared;
+    commit_node **list;     /* result of a limited walk */
+    size_t list_nr;
+    size_t list_pos;
+    int error;
+} rev_walk;
+
+typedef struct {
+    long max_count;   /* < 0 for no limit */
+    int objects;      /* also list the trees and blobs */
+    int all;          /* start at every ref and HEAD */
+    int branches;     /* start at every ref under refs/heads/ */
+} rev_list_options;
+
+/* Function prototypes */
+commit_node *lookup_commit(const sha1_t *sha);
+int parse_commit_node(commit_node *c);
+commit_node *lookup_commit_reference(const sha1_t *sha, int quiet);
+int compare_commits_by_date(const void *a, const void *b);
+int compare_commits_by_generation(const void *a, const void *b);
+void rev_walk_init(rev_walk *w);
+int rev_walk_add(rev_walk *w, const char *arg);
+int rev_walk_add_commit(rev_walk *w, commit_node *c, int uninteresting);
+int rev_walk_add_object(rev_walk *w, const sha1_t *sha, int uninteresting);
+int rev_walk_add_refs(rev_walk *w, const char *prefix, int with_head);
+int rev_walk_prepare(rev_walk *w);
+commit_node *rev_walk_next(rev_walk *w);
+void rev_walk_release(rev_walk *w);
+int is_ancestor(commit_node *a, commit_node *b);
+int rev_list(char *const *revs, int nr, const rev_list_options *opts);
+
+#endif
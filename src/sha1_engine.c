@@ -0,0 +1,297 @@
+/**
+* sha1_engine.c - SHA-1 for object ids
+* Single objects are hashed through one EVP context per thread that is
+* reset and reused instead of allocated per call; OpenSSL picks its SHA-NI
+* code when the CPU has it. Batches of independent objects can also go
+* through an AVX2 multi-buffer implementation that runs eight messages
+* through the compression function side by side, one per 32-bit lane,
+* and refills a lane with the next object as soon as its message ends.
+* By default batches use the AVX2 lanes for every object on CPUs without
+* SHA-NI, and only for objects up to SHA1_SMALL_OBJECT bytes on CPUs with
+* it, where the per-call overhead dominates and SHA-NI loses.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "sha1_engine.h"
+#include "hash_io.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+static pthread_key_t ctx_key;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+static sha1_engine_kind engine = SHA1_ENGINE_AUTO;
+static int have_avx2;
+static int have_sha_ni;
+
+static void free_ctx(void *ctx) {
+  EVP_MD_CTX_free(ctx);
+}
+
+static void make_ctx_key(void) {
+  pthread_key_create(&ctx_key, free_ctx);
+}
+
+/* Function to get this thread's SHA-1 context, initialized and ready for updates */
+EVP_MD_CTX *sha1_thread_ctx(void) {
+  pthread_once(&ctx_once, make_ctx_key);
+  EVP_MD_CTX *ctx = pthread_getspecific(ctx_key);
+  if (!ctx) {
+    ctx = EVP_MD_CTX_new();
+    if (!ctx) {
+      perror("EVP_MD_CTX_new");
+      exit(1);
+    }
+    pthread_setspecific(ctx_key, ctx);
+  }
+  EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+  return ctx;
+}
+
+void sha1_buffer(const void *data, size_t len, sha1_t *out) {
+  EVP_MD_CTX *ctx = sha1_thread_ctx();
+  EVP_DigestUpdate(ctx, data, len);
+  EVP_DigestFinal_ex(ctx, out->hash, NULL);
+}
+
+/* Function to compute an object id: SHA-1 of "<type> <len>\0" and the data */
+void sha1_object(const char *type, const void *data, size_t len, sha1_t *out) {
+  char header[MAX_HEADER_LEN];
+  int header_len = snprintf(header, sizeof(header), "%s %zu", type, len) + 1;
+  EVP_MD_CTX *ctx = sha1_thread_ctx();
+  EVP_DigestUpdate(ctx, header, header_len);
+  EVP_DigestUpdate(ctx, data, len);
+  EVP_DigestFinal_ex(ctx, out->hash, NULL);
+}
+
+static void detect_cpu(void) {
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  have_avx2 = __builtin_cpu_supports("avx2");
+  unsigned int eax, ebx, ecx, edx;
+  have_sha_ni = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29));
+#endif
+}
+
+sha1_engine_kind sha1_engine_get(void) {
+  pthread_once(&detect_once, detect_cpu);
+  return engine;
+}
+
+/* Function to force an engine, fails if the CPU cannot run it */
+int sha1_engine_set(sha1_engine_kind kind) {
+  pthread_once(&detect_once, detect_cpu);
+  if (kind == SHA1_ENGINE_AVX2 && !have_avx2) {
+    return -1;
+  }
+  engine = kind;
+  return 0;
+}
+
+const char *sha1_engine_name(sha1_engine_kind kind) {
+  switch (kind) {
+  case SHA1_ENGINE_AVX2: return "avx2";
+  case SHA1_ENGINE_EVP: return "evp";
+  default: return "auto";
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* The padded message "<header><data>0x80 0... <bit length>" of one lane */
+typedef struct {
+    unsigned char header[MAX_HEADER_LEN];
+    size_t header_len;
+    const unsigned char *data;
+    size_t total;    /* header plus data */
+    size_t nblocks;  /* 64-byte blocks after padding */
+} lane_msg;
+
+static void lane_msg_init(lane_msg *m, const sha1_batch_item *item) {
+  m->header_len = snprintf((char *)m->header, sizeof(m->header), "%s %zu", item->type, item->len) + 1;
+  m->data = item->data;
+  m->total = m->header_len + item->len;
+  m->nblocks = (m->total + 8) / 64 + 1;
+}
+
+// Produce block k of the padded message as 16 big-endian words.
+static void lane_msg_block(const lane_msg *m, size_t k, uint32_t w[16]) {
+  unsigned char blk[64];
+  size_t pos = k * 64;
+  if (pos >= m->header_len && pos + 64 <= m->total) {
+    memcpy(blk, m->data + (pos - m->header_len), 64);
+  } else {
+    memset(blk, 0, sizeof(blk));
+    if (pos < m->header_len) {
+      size_t n = m->header_len - pos < 64 ? m->header_len - pos : 64;
+      memcpy(blk, m->header + pos, n);
+    }
+    size_t start = pos > m->header_len ? pos : m->header_len;
+    size_t end = pos + 64 < m->total ? pos + 64 : m->total;
+    if (start < end) {
+      memcpy(blk + (start - pos), m->data + (start - m->header_len), end - start);
+    }
+    if (m->total >= pos && m->total < pos + 64) {
+      blk[m->total - pos] = 0x80;
+    }
+    if (k == m->nblocks - 1) {
+      uint64_t bits = (uint64_t)m->total * 8;
+      for (int i = 0; i < 8; i++) {
+        blk[63 - i] = bits >> (8 * i);
+      }
+    }
+  }
+  for (int i = 0; i < 16; i++) {
+    w[i] = get_be32(blk + 4 * i);
+  }
+}
+
+#define ROL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+
+// One compression of a 64-byte block in each of the eight lanes.
+__attribute__((target("avx2")))
+static void sha1_compress_x8(uint32_t state[5][SHA1_LANES], uint32_t w[SHA1_LANES][16]) {
+  __m256i W[16];
+  for (int t = 0; t < 16; t++) {
+    W[t] = _mm256_setr_epi32(w[0][t], w[1][t], w[2][t], w[3][t],
+                             w[4][t], w[5][t], w[6][t], w[7][t]);
+  }
+  __m256i a = _mm256_loadu_si256((const __m256i *)state[0]);
+  __m256i b = _mm256_loadu_si256((const __m256i *)state[1]);
+  __m256i c = _mm256_loadu_si256((const __m256i *)state[2]);
+  __m256i d = _mm256_loadu_si256((const __m256i *)state[3]);
+  __m256i e = _mm256_loadu_si256((const __m256i *)state[4]);
+  __m256i a0 = a, b0 = b, c0 = c, d0 = d, e0 = e;
+
+  for (int t = 0; t < 80; t++) {
+    __m256i wt;
+    if (t < 16) {
+      wt = W[t];
+    } else {
+      __m256i x = _mm256_xor_si256(_mm256_xor_si256(W[(t - 3) & 15], W[(t - 8) & 15]),
+                                   _mm256_xor_si256(W[(t - 14) & 15], W[t & 15]));
+      wt = W[t & 15] = ROL(x, 1);
+    }
+    __m256i f, k;
+    if (t < 20) {
+      f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+      k = _mm256_set1_epi32(0x5a827999);
+    } else if (t < 40) {
+      f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+      k = _mm256_set1_epi32(0x6ed9eba1);
+    } else if (t < 60) {
+      f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+      k = _mm256_set1_epi32((int)0x8f1bbcdc);
+    } else {
+      f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+      k = _mm256_set1_epi32((int)0xca62c1d6);
+    }
+    __m256i tmp = _mm256_add_epi32(_mm256_add_epi32(ROL(a, 5), f),
+                                   _mm256_add_epi32(_mm256_add_epi32(e, k), wt));
+    e = d;
+    d = c;
+    c = ROL(b, 30);
+    b = a;
+    a = tmp;
+  }
+
+  _mm256_storeu_si256((__m256i *)state[0], _mm256_add_epi32(a, a0));
+  _mm256_storeu_si256((__m256i *)state[1], _mm256_add_epi32(b, b0));
+  _mm256_storeu_si256((__m256i *)state[2], _mm256_add_epi32(c, c0));
+  _mm256_storeu_si256((__m256i *)state[3], _mm256_add_epi32(d, d0));
+  _mm256_storeu_si256((__m256i *)state[4], _mm256_add_epi32(e, e0));
+}
+
+static const uint32_t sha1_init[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+// Keep all lanes busy: whenever a message finishes, its lane takes the
+// next item no longer than max_len. Longer items are left alone.
+static void sha1_batch_avx2(sha1_batch_item *items, size_t n, size_t max_len) {
+  uint32_t state[5][SHA1_LANES];
+  uint32_t w[SHA1_LANES][16];
+  lane_msg msgs[SHA1_LANES];
+  size_t owner[SHA1_LANES], block[SHA1_LANES];
+  int active[SHA1_LANES] = {0};
+  size_t next = 0;
+
+  for (;;) {
+    int busy = 0;
+    for (int l = 0; l < SHA1_LANES; l++) {
+      while (next < n && items[next].len > max_len) {
+        next++;
+      }
+      if (!active[l] && next < n) {
+        lane_msg_init(&msgs[l], &items[next]);
+        owner[l] = next++;
+        block[l] = 0;
+        for (int i = 0; i < 5; i++) {
+          state[i][l] = sha1_init[i];
+        }
+        active[l] = 1;
+      }
+      busy += active[l];
+    }
+    if (!busy) {
+      break;
+    }
+    for (int l = 0; l < SHA1_LANES; l++) {
+      if (active[l]) {
+        lane_msg_block(&msgs[l], block[l], w[l]);
+      } else {
+        memset(w[l], 0, sizeof(w[l]));
+      }
+    }
+    sha1_compress_x8(state, w);
+    for (int l = 0; l < SHA1_LANES; l++) {
+      if (active[l] && ++block[l] == msgs[l].nblocks) {
+        unsigned char *out = items[owner[l]].sha.hash;
+        for (int i = 0; i < 5; i++) {
+          out[4 * i] = state[i][l] >> 24;
+          out[4 * i + 1] = state[i][l] >> 16;
+          out[4 * i + 2] = state[i][l] >> 8;
+          out[4 * i + 3] = state[i][l];
+        }
+        active[l] = 0;
+      }
+    }
+  }
+}
+
+#endif
+
+/* Function to hash a batch of objects with a given engine */
+void sha1_object_batch_with(sha1_engine_kind kind, sha1_batch_item *items, size_t n) {
+  pthread_once(&detect_once, detect_cpu);
+  size_t max_len = 0;  /* items up to this size went through AVX2 */
+  int used_avx2 = 0;
+#ifdef HAVE_X86_SIMD
+  if (kind == SHA1_ENGINE_AUTO && have_avx2) {
+    max_len = have_sha_ni ? SHA1_SMALL_OBJECT : SIZE_MAX;
+  } else if (kind == SHA1_ENGINE_AVX2 && have_avx2) {
+    max_len = SIZE_MAX;
+  }
+  // With a single object there is nothing to run side by side.
+  if (max_len && n > 1) {
+    sha1_batch_avx2(items, n, max_len);
+    used_avx2 = 1;
+  }
+#endif
+  for (size_t i = 0; i < n; i++) {
+    if (!used_avx2 || items[i].len > max_len) {
+      sha1_object(items[i].type, items[i].data, items[i].len, &items[i].sha);
+    }
+  }
+}
+
+/* Function to hash a batch of independent objects with the configured engine */
+void sha1_object_batch(sha1_batch_item *items, size_t n) {
+  sha1_object_batch_with(sha1_engine_get(), items, n);
+}
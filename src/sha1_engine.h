@@ -0,0 +1,36 @@
+#ifndef SHA1_ENGINE_H
+#define SHA1_ENGINE_H
+
+#include "blob.h"
+
+/* Number of messages the AVX2 path hashes side by side */
+#define SHA1_LANES 8
+
+/* With SHA-NI, only objects up to this size are faster in AVX2 lanes */
+#define SHA1_SMALL_OBJECT 1024
+
+/* One object in a batch; sha is filled in by sha1_object_batch */
+typedef struct {
+    const char *type;
+    const void *data;
+    size_t len;
+    sha1_t sha;
+} sha1_batch_item;
+
+typedef enum {
+    SHA1_ENGINE_AUTO,  /* pick per object from what the CPU has */
+    SHA1_ENGINE_EVP,   /* OpenSSL, which uses SHA-NI when the CPU has it */
+    SHA1_ENGINE_AVX2,  /* our own 8-lane multi-buffer code */
+} sha1_engine_kind;
+
+/* Function prototypes */
+EVP_MD_CTX *sha1_thread_ctx(void);
+void sha1_buffer(const void *data, size_t len, sha1_t *out);
+void sha1_object(const char *type, const void *data, size_t len, sha1_t *out);
+void sha1_object_batch(sha1_batch_item *items, size_t n);
+void sha1_object_batch_with(sha1_engine_kind kind, sha1_batch_item *items, size_t n);
+sha1_engine_kind sha1_engine_get(void);
+int sha1_engine_set(sha1_engine_kind kind);
+const char *sha1_engine_name(sha1_engine_kind kind);
+
+#endif
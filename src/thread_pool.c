@@ -0,0 +1,233 @@
+/**
+* thread_pool.c - A small work-stealing thread pool
+* Every worker owns a deque. Tasks submitted from inside a task go onto
+* the submitting worker's deque and are popped back newest first, which
+* keeps a depth first walk on one thread while it has work. A worker whose
+* deque runs dry steals the oldest task from another worker, so large
+* subtrees spread across the pool without a central queue.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "thread_pool.h"
+
+typedef struct {
+    task_fn fn;
+    void *arg;
+} task;
+
+typedef struct {
+    pthread_mutex_t lock;
+    task *items;      /* ring buffer */
+    size_t head;      /* oldest task, where thieves take from */
+    size_t nr;
+    size_t alloc;
+} task_deque;
+
+struct thread_pool {
+    int nr_workers;
+    pthread_t *threads;
+    task_deque *deques;
+    atomic_size_t queued;   /* tasks sitting in some deque */
+    atomic_size_t pending;  /* tasks submitted and not yet finished */
+    atomic_uint next_deque; /* round robin for submissions from outside */
+    pthread_mutex_t lock;
+    pthread_cond_t work;    /* signalled when a task is queued */
+    pthread_cond_t idle;    /* signalled when pending drops to zero */
+    int shutdown;
+};
+
+typedef struct {
+    thread_pool *pool;
+    int id;
+} worker_arg;
+
+// Which pool and deque the current thread works for, if any.
+static _Thread_local thread_pool *current_pool;
+static _Thread_local int current_worker;
+
+static int deque_push(task_deque *d, task t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->nr == d->alloc) {
+    size_t alloc = d->alloc ? d->alloc * 2 : 64;
+    task *items = malloc(alloc * sizeof(*items));
+    if (!items) {
+      pthread_mutex_unlock(&d->lock);
+      return -1;
+    }
+    for (size_t i = 0; i < d->nr; i++) {
+      items[i] = d->items[(d->head + i) % d->alloc];
+    }
+    free(d->items);
+    d->items = items;
+    d->alloc = alloc;
+    d->head = 0;
+  }
+  d->items[(d->head + d->nr) % d->alloc] = t;
+  d->nr++;
+  pthread_mutex_unlock(&d->lock);
+  return 0;
+}
+
+// The owner takes the newest task, a thief the oldest.
+static int deque_take(task_deque *d, int steal, task *out) {
+  pthread_mutex_lock(&d->lock);
+  if (!d->nr) {
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+  }
+  if (steal) {
+    *out = d->items[d->head];
+    d->head = (d->head + 1) % d->alloc;
+  } else {
+    *out = d->items[(d->head + d->nr - 1) % d->alloc];
+  }
+  d->nr--;
+  pthread_mutex_unlock(&d->lock);
+  return 1;
+}
+
+static int find_task(thread_pool *pool, int id, task *out) {
+  if (deque_take(&pool->deques[id], 0, out)) {
+    return 1;
+  }
+  for (int i = 1; i < pool->nr_workers; i++) {
+    if (deque_take(&pool->deques[(id + i) % pool->nr_workers], 1, out)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void *worker_main(void *arg) {
+  worker_arg *w = arg;
+  thread_pool *pool = w->pool;
+  current_pool = pool;
+  current_worker = w->id;
+  free(w);
+  // Wait for thread_pool_new to finish counting the workers.
+  pthread_mutex_lock(&pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (;;) {
+    task t;
+    if (find_task(pool, current_worker, &t)) {
+      atomic_fetch_sub(&pool->queued, 1);
+      t.fn(t.arg);
+      if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->lock);
+      }
+      continue;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (!atomic_load(&pool->queued) && !pool->shutdown) {
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    int done = pool->shutdown && !atomic_load(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+    if (done) {
+      return NULL;
+    }
+  }
+}
+
+/* Function to start a pool, threads <= 0 uses one worker per CPU */
+thread_pool *thread_pool_new(int threads) {
+  if (threads <= 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = n > 0 ? (int)n : 1;
+  }
+  thread_pool *pool = calloc(1, sizeof(*pool));
+  if (!pool) {
+    return NULL;
+  }
+  pool->deques = calloc(threads, sizeof(*pool->deques));
+  pool->threads = calloc(threads, sizeof(*pool->threads));
+  if (!pool->deques || !pool->threads) {
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  pthread_mutex_lock(&pool->lock);
+  for (int i = 0; i < threads; i++) {
+    worker_arg *w = malloc(sizeof(*w));
+    if (!w) {
+      break;
+    }
+    w->pool = pool;
+    w->id = i;
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+    if (pthread_create(&pool->threads[i], NULL, worker_main, w) != 0) {
+      pthread_mutex_destroy(&pool->deques[i].lock);
+      free(w);
+      break;
+    }
+    pool->nr_workers++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  if (!pool->nr_workers) {
+    thread_pool_free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+/* Function to queue fn(arg) on the pool, callable from inside a task */
+void thread_pool_submit(thread_pool *pool, task_fn fn, void *arg) {
+  task t = { fn, arg };
+  int id = current_pool == pool ? current_worker
+                                : (int)(atomic_fetch_add(&pool->next_deque, 1) % pool->nr_workers);
+  atomic_fetch_add(&pool->pending, 1);
+  if (deque_push(&pool->deques[id], t) != 0) {
+    // Out of memory for the deque: run the task right here instead.
+    fn(arg);
+    atomic_fetch_sub(&pool->pending, 1);
+    return;
+  }
+  atomic_fetch_add(&pool->queued, 1);
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Function to block until every submitted task, including the ones they submitted, has run */
+void thread_pool_wait(thread_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (atomic_load(&pool->pending)) {
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_free(thread_pool *pool) {
+  if (!pool) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->nr_workers; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  for (int i = 0; i < pool->nr_workers; i++) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    free(pool->deques[i].items);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->idle);
+  free(pool->deques);
+  free(pool->threads);
+  free(pool);
+}
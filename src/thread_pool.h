@@ -0,0 +1,16 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+
+typedef void (*task_fn)(void *arg);
+
+typedef struct thread_pool thread_pool;
+
+/* Function prototypes */
+thread_pool *thread_pool_new(int threads);
+void thread_pool_submit(thread_pool *pool, task_fn fn, void *arg);
+void thread_pool_wait(thread_pool *pool);
+void thread_pool_free(thread_pool *pool);
+
+#endif
@@ -0,0 +1,154 @@
+/**
+* tree_builder.c - Tree objects built without fixed limits
+* Names and paths for one directory live in an arena that grows in blocks
+* and is dropped in one go when the tree is done, so a directory costs
+* memory in proportion to its names rather than a fixed slot per entry.
+* Entries hold their name as a slice of the arena. Writing sorts them in
+* git's order, adds up the exact serialized size, and formats the tree
+* straight into a single buffer of that size.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tree_builder.h"
+#include "object_writer.h"
+
+void *arena_alloc(arena *a, size_t size) {
+    // Keep every allocation aligned like malloc's.
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    arena_block *b = a->blocks;
+    if (!b || b->size - b->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(*b) + block_size);
+        if (!b) {
+            perror("malloc");
+            exit(1);
+        }
+        b->used = 0;
+        b->size = block_size;
+        // An oversized block goes behind the current one, which may
+        // still have room for later small requests.
+        if (a->blocks && block_size > ARENA_BLOCK_SIZE) {
+            b->next = a->blocks->next;
+            a->blocks->next = b;
+        } else {
+            b->next = a->blocks;
+            a->blocks = b;
+        }
+    }
+    void *p = (char *)b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+char *arena_strndup(arena *a, const char *s, size_t len) {
+    char *copy = arena_alloc(a, len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char *arena_join_path(arena *a, const char *dir, const char *name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    char *path = arena_alloc(a, dlen + nlen + 2);
+    memcpy(path, dir, dlen);
+    path[dlen] = '/';
+    memcpy(path + dlen + 1, name, nlen + 1);
+    return path;
+}
+
+void arena_clear(arena *a) {
+    arena_block *b = a->blocks;
+    while (b) {
+        arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    a->blocks = NULL;
+}
+
+void tree_builder_init(tree_builder *tb) {
+    tb->arena.blocks = NULL;
+    tb->entries = NULL;
+    tb->nr = 0;
+    tb->alloc = 0;
+}
+
+/* Function to append an entry named name[0..len); mode, sha and stat data
+* are left for the caller. The returned pointer is valid until the next add.
+*/
+tree_entry *tree_builder_add(tree_builder *tb, const char *name, size_t len) {
+    if (tb->nr == tb->alloc) {
+        size_t alloc = tb->alloc ? tb->alloc * 2 : 16;
+        tree_entry *entries = realloc(tb->entries, alloc * sizeof(*entries));
+        if (!entries) {
+            perror("realloc");
+            exit(1);
+        }
+        tb->entries = entries;
+        tb->alloc = alloc;
+    }
+    tree_entry *e = &tb->entries[tb->nr++];
+    memset(e, 0, sizeof(*e));
+    e->name = arena_strndup(&tb->arena, name, len);
+    e->name_len = len;
+    return e;
+}
+
+static int is_tree_mode(const char *mode) {
+    return strcmp(mode, "40000") == 0;
+}
+
+// Git orders names bytewise, with a directory compared as if its name
+// ended in '/'.
+static int compare_entries(const void *a, const void *b) {
+    const tree_entry *x = a, *y = b;
+    size_t len = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int cmp = memcmp(x->name, y->name, len);
+    if (cmp) {
+        return cmp;
+    }
+    unsigned char c1 = x->name_len > len ? x->name[len] : is_tree_mode(x->mode) ? '/' : '\0';
+    unsigned char c2 = y->name_len > len ? y->name[len] : is_tree_mode(y->mode) ? '/' : '\0';
+    return c1 - c2;
+}
+
+/* Function to sort the entries and store them as a tree object */
+int tree_builder_write(tree_builder *tb, sha1_t *out) {
+    qsort(tb->entries, tb->nr, sizeof(*tb->entries), compare_entries);
+
+    // "<mode> <name>\0" and the 20-byte id for each entry.
+    size_t size = 0;
+    for (size_t i = 0; i < tb->nr; i++) {
+        size += strlen(tb->entries[i].mode) + 1 + tb->entries[i].name_len + 1 + 20;
+    }
+    char *buf = malloc(size ? size : 1);
+    if (!buf) {
+        perror("malloc");
+        return -1;
+    }
+    char *p = buf;
+    for (size_t i = 0; i < tb->nr; i++) {
+        const tree_entry *e = &tb->entries[i];
+        size_t mode_len = strlen(e->mode);
+        memcpy(p, e->mode, mode_len);
+        p += mode_len;
+        *p++ = ' ';
+        memcpy(p, e->name, e->name_len);
+        p += e->name_len;
+        *p++ = '\0';
+        memcpy(p, e->sha.hash, 20);
+        p += 20;
+    }
+
+    int ret = write_object("tree", buf, size, out);
+    free(buf);
+    return ret;
+}
+
+void tree_builder_release(tree_builder *tb) {
+    free(tb->entries);
+    arena_clear(&tb->arena);
+    tree_builder_init(tb);
+}
@@ -0,0 +1,40 @@
+#ifndef TREE_BUILDER_H
+#define TREE_BUILDER_H
+
+#include <stddef.h>
+#include "blob.h"
+
+/* Default size of an arena block; larger requests get a block of their own */
+#define ARENA_BLOCK_SIZE 8192
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    max_align_t data[];
+} arena_block;
+
+/* Bump allocator whose memory is all released at once */
+typedef struct {
+    arena_block *blocks;
+} arena;
+
+/* The entries of one tree object while it is being built */
+typedef struct {
+    arena arena;          /* names, and any paths the caller keeps with them */
+    tree_entry *entries;  /* moves as entries are added */
+    size_t nr;
+    size_t alloc;
+} tree_builder;
+
+/* Function prototypes */
+void *arena_alloc(arena *a, size_t size);
+char *arena_strndup(arena *a, const char *s, size_t len);
+char *arena_join_path(arena *a, const char *dir, const char *name);
+void arena_clear(arena *a);
+void tree_builder_init(tree_builder *tb);
+tree_entry *tree_builder_add(tree_builder *tb, const char *name, size_t len);
+int tree_builder_write(tree_builder *tb, sha1_t *out);
+void tree_builder_release(tree_builder *tb);
+
+#endif
@@ -0,0 +1,44 @@
+/**
+* tree_walk.c - Iterate over the entries of a tree object
+* The iterator hands out each "<mode> <name>\0<20-byte id>" entry as
+* pointers into the tree's content, so reading a tree copies and
+* allocates nothing, and a name has no length limit.
+*/
+
+#include <string.h>
+#include "tree_walk.h"
+
+void tree_desc_init(tree_desc *desc, const void *buf, size_t size) {
+    desc->buf = buf;
+    desc->size = size;
+}
+
+/* Function to step to the next entry
+* Returns 1 with the entry filled in, 0 at the end of the tree, or -1 if
+* the tree is malformed.
+*/
+int tree_entry_next(tree_desc *desc, name_entry *entry) {
+    if (desc->size == 0) {
+        return 0;
+    }
+    const unsigned char *p = desc->buf, *end = desc->buf + desc->size;
+    uint32_t mode = 0;
+    while (p < end && *p >= '0' && *p <= '7') {
+        mode = (mode << 3) | (*p++ - '0');
+    }
+    if (p == desc->buf || p == end || *p != ' ') {
+        return -1;
+    }
+    const unsigned char *name = ++p;
+    const unsigned char *nul = memchr(name, '\0', end - name);
+    if (!nul || nul == name || end - nul < 21) {
+        return -1;
+    }
+    entry->path = (const char *)name;
+    entry->pathlen = nul - name;
+    entry->mode = mode;
+    entry->oid = nul + 1;
+    desc->buf = nul + 21;
+    desc->size = end - desc->buf;
+    return 1;
+}
@@ -0,0 +1,29 @@
+#ifndef TREE_WALK_H
+#define TREE_WALK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* Submodule commits are tree entries of their own mode */
+#define S_ISGITLINK(m) (((m) & S_IFMT) == 0160000)
+
+/* Position in the content of a tree object */
+typedef struct {
+    const unsigned char *buf;
+    size_t size;
+} tree_desc;
+
+/* One entry; path and oid point into the tree's content */
+typedef struct {
+    const char *path;
+    size_t pathlen;
+    uint32_t mode;
+    const unsigned char *oid;
+} name_entry;
+
+/* Function prototypes */
+void tree_desc_init(tree_desc *desc, const void *buf, size_t size);
+int tree_entry_next(tree_desc *desc, name_entry *entry);
+
+#endif